@@ -0,0 +1,187 @@
+/**
+ * @brief Enqueue throughput under contention, 1 to 64 producer threads
+ *
+ * Usage: bench-enqueue-contention [emails]
+ *
+ * Each row has the producers enqueue the given number of emails (200000
+ * by default) between them, while one consumer drains in batches of 10:
+ *   - global lock: the old enqueue, which built the queue item, formatted
+ *     its debug line and pushed onto the heap under the lock the consumer
+ *     takes too
+ *   - ingest ring: the item is built outside any lock and handed over on
+ *     the lock-free ring, which the consumer empties under its own lock
+ *   - EmailQueue: the real enqueue() feeding four workers with a no-op sender
+ */
+
+#include "core/logging/logger.hpp"
+#include "core/queue/email_queue.hpp"
+#include "core/queue/ingest_ring.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+using Heap = std::priority_queue<QueueItem, std::vector<QueueItem>,
+                                 std::function<bool(const QueueItem&, const QueueItem&)>>;
+
+bool byPriority(const QueueItem& a, const QueueItem& b) {
+    return a.priority != b.priority ? a.priority < b.priority : a.created_at > b.created_at;
+}
+
+Email makeEmail() {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "Contention";
+    email.body = std::string(512, 'x');
+    return email;
+}
+
+/**
+ * @brief Run producers enqueueing count emails between them; returns emails per second
+ */
+double runProducers(int producers, size_t count, const std::function<void()>& enqueue,
+                    const std::function<bool()>& consumed, const std::function<void()>& consume) {
+    std::atomic<bool> go(false);
+    std::atomic<bool> done(false);
+    std::thread consumer([&] {
+        while (!done || !consumed()) {
+            consume();
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        size_t share = count / producers + (static_cast<size_t>(p) < count % producers ? 1 : 0);
+        threads.emplace_back([&, share] {
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (size_t i = 0; i < share; ++i) {
+                enqueue();
+            }
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    done = true;
+    consumer.join();
+    return count / elapsed;
+}
+
+double globalLock(int producers, size_t count) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    Heap heap(byPriority);
+    std::atomic<size_t> taken(0);
+    Email email = makeEmail();
+
+    auto enqueue = [&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        QueueItem item(email.from, email.to, email.subject, email.body);
+        item.html_body = email.html_body;
+        item.attachments = email.attachments;
+        std::string line = "Email queued from: " + email.from + " with priority: " +
+                           std::to_string(static_cast<int>(item.priority)) +
+                           " (queue size: " + std::to_string(heap.size()) + ")";
+        heap.push(item);
+        cv.notify_all();
+    };
+    auto consume = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (int i = 0; i < 10 && !heap.empty(); ++i) {
+            heap.pop();
+            taken++;
+        }
+    };
+    return runProducers(producers, count, enqueue, [&] { return taken == count; }, consume);
+}
+
+double ingestRing(int producers, size_t count) {
+    std::mutex mutex;
+    IngestRing<QueueItem> ring(1024);
+    Heap heap(byPriority);
+    std::atomic<size_t> taken(0);
+    Email email = makeEmail();
+
+    auto enqueue = [&] {
+        QueueItem item(email.from, email.to, email.subject, email.body);
+        item.html_body = email.html_body;
+        item.attachments = email.attachments;
+        if (!ring.tryPush(std::move(item))) {
+            std::lock_guard<std::mutex> lock(mutex);
+            QueueItem queued;
+            while (ring.tryPop(queued)) {
+                heap.push(std::move(queued));
+            }
+            heap.push(std::move(item));
+        }
+    };
+    auto consume = [&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        QueueItem queued;
+        while (ring.tryPop(queued)) {
+            heap.push(std::move(queued));
+        }
+        for (int i = 0; i < 10 && !heap.empty(); ++i) {
+            heap.pop();
+            taken++;
+        }
+    };
+    return runProducers(producers, count, enqueue, [&] { return taken == count; }, consume);
+}
+
+double emailQueue(int producers, size_t count) {
+    EmailQueue queue;
+    queue.setWorkerCount(4);
+    queue.setMaxQueueSize(count + 1);
+    queue.setMaxQueueBytes(0);
+    queue.setDomainConcurrency(1000);
+    queue.setSendCallback([](const Email*) { return SMTPResult::createSuccess("sent"); });
+    queue.start();
+    Email email = makeEmail();
+
+    // The workers are the consumers here
+    double rate = runProducers(producers, count, [&] { queue.enqueue(&email); },
+                               [] { return true; }, [] {});
+    while (queue.getTotalProcessed() < count) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    queue.stop();
+    return rate;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? static_cast<size_t>(std::atol(argv[1])) : 200000;
+    if (count == 0) {
+        count = 200000;
+    }
+    Logger::getInstance().setLogLevel(LogLevel::ERROR);
+
+    std::printf("%zu emails per row, one consumer draining in batches of 10 (%u hardware threads)\n\n",
+                count, std::thread::hardware_concurrency());
+    std::printf("%9s %16s %16s %16s\n", "producers", "global lock k/s", "ingest ring k/s", "EmailQueue k/s");
+    for (int producers : {1, 2, 4, 8, 16, 32, 64}) {
+        double locked = globalLock(producers, count);
+        double ring = ingestRing(producers, count);
+        double queue = emailQueue(producers, count);
+        std::printf("%9d %16.0f %16.0f %16.0f\n", producers, locked / 1000, ring / 1000, queue / 1000);
+    }
+    return 0;
+}
@@ -0,0 +1,356 @@
+/**
+ * @brief Bytes allocated per message from enqueue to send callback
+ *
+ * Usage: bench-message-copies [emails]
+ *
+ * Counts every operator new while the given number of emails (2000 by
+ * default) pass through, for several body sizes. Each byte of body copied
+ * costs a byte allocated, so the allocation divided by the body size is
+ * about the number of copies made of it:
+ *   - before: the old path, which copied the Email into a QueueItem, that
+ *     into the heap, the heap's top out again and then back into an Email
+ *     for the send callback
+ *   - const Email*: EmailQueue::enqueue(const Email*), which copies the
+ *     email once into the message the queue shares
+ *   - Email&&: EmailQueue::enqueue(Email&&), which moves it in
+ *   - shared: Email&& again, with payload dedup on, as for a fan-out of one
+ *     body; the queue holds one copy between all the emails, reported as
+ *     the bytes held per email, but each send is handed a whole message
+ *
+ * The other queue columns run with payload dedup off, as for emails that
+ * all differ.
+ *
+ * A second table follows the emails on through SMTPEventLoop to an SMTP
+ * sink on the loopback interface, which discards what it is sent, so that
+ * the count covers the whole path to the wire:
+ *   - copy: the queue hands the loop a pointer and submit() copies the Email
+ *   - shared: the queue hands the loop its shared message, which every job
+ *     of the send holds on to instead of a copy
+ * What both spend on encoding the message is the same; the difference
+ * between them is the copy. It runs at most 200 emails per row.
+ */
+
+#include "core/config/config_manager.hpp"
+#include "core/logging/logger.hpp"
+#include "core/queue/email_queue.hpp"
+#include "core/smtp/smtp_event_loop.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<bool> counting(false);
+std::atomic<size_t> allocated(0);
+
+} // anonymous namespace
+
+void* operator new(size_t size) {
+    if (counting.load(std::memory_order_relaxed)) {
+        allocated.fetch_add(size, std::memory_order_relaxed);
+    }
+    void* block = std::malloc(size ? size : 1);
+    if (!block) {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void operator delete(void* block) noexcept {
+    std::free(block);
+}
+
+void operator delete(void* block, size_t) noexcept {
+    std::free(block);
+}
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+Email makeEmail(size_t body_size) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "Copies";
+    email.body = std::string(body_size, 'x');
+    email.html_body = std::string(body_size, 'h');
+    email.attachments = {"report.pdf"};
+    return email;
+}
+
+/**
+ * @brief Bytes allocated per email while run passes count emails through
+ */
+size_t measure(size_t count, const std::function<void()>& run) {
+    allocated = 0;
+    counting = true;
+    run();
+    counting = false;
+    return allocated / count;
+}
+
+size_t before(size_t count, const std::vector<Email>& emails) {
+    using Heap = std::priority_queue<QueueItem, std::vector<QueueItem>,
+                                     std::function<bool(const QueueItem&, const QueueItem&)>>;
+    Heap heap([](const QueueItem& a, const QueueItem& b) { return a.priority < b.priority; });
+    size_t sent = 0;
+    return measure(count, [&] {
+        for (const Email& email : emails) {
+            QueueItem item(email.from, email.to, email.subject, email.body);
+            item.html_body = email.html_body;
+            item.attachments = email.attachments;
+            heap.push(item);
+        }
+        while (!heap.empty()) {
+            QueueItem item = heap.top();
+            heap.pop();
+            Email email;
+            email.from = item.from_address;
+            email.to = item.to_addresses;
+            email.subject = item.subject;
+            email.body = item.body;
+            email.html_body = item.html_body;
+            email.attachments = item.attachments;
+            sent += email.body.size() > 0;
+        }
+    });
+}
+
+size_t throughQueue(size_t count, std::vector<Email>& emails, bool move, bool dedup, size_t* held = nullptr) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setMaxQueueSize(count + 1);
+    queue.setMaxQueueBytes(0);
+    queue.setPayloadDedup(dedup);
+    queue.setSendCallback([](const Email*) { return SMTPResult::createSuccess("sent"); });
+    return measure(count, [&] {
+        for (Email& email : emails) {
+            if (move) {
+                queue.enqueue(std::move(email));
+            } else {
+                queue.enqueue(&email);
+            }
+        }
+        if (held) {
+            *held = queue.getQueuedBytes() / count;
+        }
+        queue.start();
+        while (queue.getTotalProcessed() < count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        queue.stop();
+    });
+}
+
+/**
+ * @brief SMTP server that accepts everything and keeps nothing
+ *
+ * Serves one connection at a time from fixed buffers, so it allocates
+ * nothing while the emails are counted.
+ */
+class Sink {
+public:
+    Sink() : fd_(-1), port_(0) {}
+
+    ~Sink() {
+        stop();
+    }
+
+    bool start() {
+        fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+        int on = 1;
+        setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(addr);
+        if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), length) < 0 || listen(fd_, 16) < 0 ||
+            getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+            return false;
+        }
+        port_ = ntohs(addr.sin_port);
+        thread_ = std::thread([this] {
+            int client;
+            while ((client = accept(fd_, nullptr, nullptr)) >= 0) {
+                serve(client);
+                close(client);
+            }
+        });
+        return true;
+    }
+
+    void stop() {
+        if (fd_ >= 0) {
+            shutdown(fd_, SHUT_RDWR);
+            close(fd_);
+            fd_ = -1;
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    int port() const { return port_; }
+
+private:
+    static void reply(int fd, const char* text) {
+        ssize_t ignored = send(fd, text, std::strlen(text), MSG_NOSIGNAL);
+        (void)ignored;
+    }
+
+    static void serve(int fd) {
+        reply(fd, "220 sink ESMTP\r\n");
+        char buffer[64 * 1024];
+        char command[4];
+        size_t line_length = 0;
+        bool in_data = false;
+        ssize_t received;
+        while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+            for (ssize_t i = 0; i < received; ++i) {
+                char c = buffer[i];
+                if (c != '\n') {
+                    if (line_length < sizeof(command)) {
+                        command[line_length] = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+                    }
+                    line_length++;
+                    continue;
+                }
+                // A complete line; command holds its first characters
+                if (in_data) {
+                    if (line_length == 2 && command[0] == '.') {
+                        in_data = false;
+                        reply(fd, "250 queued\r\n");
+                    }
+                } else if (line_length >= 4 && std::strncmp(command, "DATA", 4) == 0) {
+                    in_data = true;
+                    reply(fd, "354 go ahead\r\n");
+                } else if (line_length >= 4 && std::strncmp(command, "QUIT", 4) == 0) {
+                    reply(fd, "221 bye\r\n");
+                    return;
+                } else {
+                    reply(fd, "250 ok\r\n");
+                }
+                line_length = 0;
+            }
+        }
+    }
+
+    int fd_;
+    int port_;
+    std::thread thread_;
+};
+
+size_t throughTransport(size_t count, std::vector<Email>& emails, SMTPEventLoop& loop, bool shared) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setMaxQueueSize(count + 1);
+    queue.setMaxQueueBytes(0);
+    queue.setPayloadDedup(false);
+    queue.setAsyncSendCallback([&loop, shared](std::shared_ptr<const Email> email,
+                                               EmailQueue::CompletionCallback done) {
+        if (shared) {
+            loop.submit(std::move(email), std::move(done));
+        } else {
+            loop.submit(*email, std::move(done));
+        }
+    });
+    return measure(count, [&] {
+        for (Email& email : emails) {
+            queue.enqueue(std::move(email));
+        }
+        queue.start();
+        while (queue.getTotalProcessed() + queue.getTotalFailed() < count) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        queue.stop();
+    });
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    size_t count = argc > 1 ? static_cast<size_t>(std::atol(argv[1])) : 2000;
+    if (count == 0) {
+        count = 2000;
+    }
+    Logger::getInstance().setLogLevel(LogLevel::ERROR);
+
+    std::printf("%zu emails per row; body and HTML body each of the given size\n", count);
+    std::printf("Bytes allocated per email, and that over the payload size\n\n");
+    std::printf("%10s %18s %18s %18s %18s %15s\n", "body", "before", "const Email*", "Email&&", "shared",
+                "held");
+    for (size_t body_size : {1024, 64 * 1024, 1024 * 1024}) {
+        // Built outside the measurement, as the caller's own copy
+        std::vector<Email> emails(count, makeEmail(body_size));
+        size_t old_bytes = before(count, emails);
+        size_t copied_bytes = throughQueue(count, emails, false, false);
+        size_t moved_bytes = throughQueue(count, emails, true, false);
+        emails.assign(count, makeEmail(body_size));
+        size_t held = 0;
+        size_t shared_bytes = throughQueue(count, emails, true, true, &held);
+        double payload = 2.0 * body_size;
+        std::printf("%10zu %11zu (%4.1fx) %11zu (%4.1fx) %11zu (%4.1fx) %11zu (%4.1fx) %7zu (%4.2fx)\n",
+                    body_size, old_bytes, old_bytes / payload, copied_bytes, copied_bytes / payload,
+                    moved_bytes, moved_bytes / payload, shared_bytes, shared_bytes / payload,
+                    held, held / payload);
+    }
+
+    Sink sink;
+    if (!sink.start()) {
+        std::fprintf(stderr, "Could not start the SMTP sink\n");
+        return 1;
+    }
+    ConfigManager config;
+    DomainConfig domain;
+    domain.name = "example.test";
+    domain.smtp_server = "127.0.0.1";
+    domain.smtp_port = sink.port();
+    domain.auth_method = "NONE";
+    domain.use_ssl = false;
+    domain.use_starttls = false;
+    config.setDomainConfig(domain);
+    SMTPEventLoop loop(config);
+    loop.setMaxSessions(1);
+    if (!loop.start()) {
+        std::fprintf(stderr, "Could not start the SMTP event loop\n");
+        return 1;
+    }
+
+    size_t sent = std::min<size_t>(count, 200);
+    std::printf("\n%zu emails per row through the event loop to an SMTP sink\n\n", sent);
+    std::printf("%10s %18s %18s\n", "body", "copy", "shared");
+    for (size_t body_size : {1024, 64 * 1024, 1024 * 1024}) {
+        // Attachments name files to read, which the sink has no use for
+        Email email = makeEmail(body_size);
+        email.attachments.clear();
+        std::vector<Email> emails(sent, email);
+        size_t copied_bytes = throughTransport(sent, emails, loop, false);
+        emails.assign(sent, email);
+        size_t shared_bytes = throughTransport(sent, emails, loop, true);
+        double payload = 2.0 * body_size;
+        std::printf("%10zu %11zu (%4.1fx) %11zu (%4.1fx)\n", body_size, copied_bytes, copied_bytes / payload,
+                    shared_bytes, shared_bytes / payload);
+    }
+    if (loop.getStats().failed > 0) {
+        std::fprintf(stderr, "%zu sends failed\n", loop.getStats().failed);
+    }
+    loop.stop();
+    return 0;
+}
@@ -0,0 +1,191 @@
+/**
+ * @brief Compression ratio against CPU cost of each payload codec
+ *
+ * Usage: bench-payload-codecs [kilobytes]
+ *
+ * Compresses HTML newsletters of about the given size (128 KiB by
+ * default), built the way marketing mail is: table layout, inline styles,
+ * repeated article blocks of varied text and per-link tracking tokens. For
+ * each codec this build has, at a few levels, reports the compression
+ * ratio, compression and decompression rates in MB/s of HTML, and the
+ * microseconds each costs per email. The ratio is about how much more
+ * backlog the queue holds in the same memory with compression on.
+ */
+
+#include "core/queue/payload_codec.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+const char* const kWords[] = {
+    "offer", "exclusive", "members", "today", "update", "your", "account", "new", "season", "collection",
+    "save", "free", "shipping", "order", "week", "discover", "latest", "stories", "from", "our",
+    "community", "read", "more", "event", "tickets", "limited", "time", "only", "thanks", "for",
+    "being", "customer", "product", "review", "recommended", "based", "on", "recent", "activity", "the",
+    "and", "with", "this", "that", "will", "we", "you", "in", "of", "to"};
+
+std::string words(std::mt19937& rng, int count) {
+    std::uniform_int_distribution<size_t> pick(0, sizeof(kWords) / sizeof(kWords[0]) - 1);
+    std::string text;
+    for (int i = 0; i < count; ++i) {
+        if (i > 0) {
+            text.push_back(' ');
+        }
+        text += kWords[pick(rng)];
+    }
+    return text;
+}
+
+// Per-link tracking tokens compress about as well as random data
+std::string token(std::mt19937& rng, size_t length) {
+    static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    std::uniform_int_distribution<size_t> pick(0, sizeof(kAlphabet) - 2);
+    std::string text;
+    for (size_t i = 0; i < length; ++i) {
+        text.push_back(kAlphabet[pick(rng)]);
+    }
+    return text;
+}
+
+std::string makeNewsletter(size_t size, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> sentence(8, 30);
+    std::string html =
+        "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+        "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">"
+        "<style>body{margin:0;padding:0;background:#f4f4f4;font-family:Helvetica,Arial,sans-serif}"
+        ".button{display:inline-block;padding:12px 24px;border-radius:4px;background:#1a73e8;color:#ffffff}"
+        "@media only screen and (max-width:600px){.column{width:100%!important;display:block}}</style>"
+        "</head>\n<body><table role=\"presentation\" width=\"100%\" cellpadding=\"0\" cellspacing=\"0\" "
+        "border=\"0\" style=\"background-color:#f4f4f4;\">\n";
+    int article = 0;
+    while (html.size() < size) {
+        std::string link = "https://click.example.test/t/" + token(rng, 48) + "?utm_source=newsletter"
+                           "&amp;utm_medium=email&amp;utm_campaign=weekly&amp;utm_content=article" +
+                           std::to_string(article);
+        html += "<tr><td class=\"column\" style=\"padding:24px 32px;background-color:#ffffff;"
+                "border-bottom:1px solid #e0e0e0;\">\n"
+                "<img src=\"https://cdn.example.test/img/" + token(rng, 24) + ".jpg\" width=\"536\" "
+                "alt=\"" + words(rng, 4) + "\" style=\"display:block;width:100%;max-width:536px;height:auto;"
+                "border:0;\">\n"
+                "<h2 style=\"margin:16px 0 8px;font-size:22px;line-height:28px;color:#202124;\">" +
+                words(rng, 6) + "</h2>\n"
+                "<p style=\"margin:0 0 16px;font-size:16px;line-height:24px;color:#5f6368;\">" +
+                words(rng, sentence(rng)) + ". " + words(rng, sentence(rng)) + ".</p>\n"
+                "<a class=\"button\" href=\"" + link + "\" style=\"color:#ffffff;text-decoration:none;"
+                "font-weight:bold;\">" + words(rng, 2) + "</a>\n</td></tr>\n";
+        article++;
+    }
+    html += "<tr><td style=\"padding:24px;font-size:12px;color:#9aa0a6;text-align:center;\">"
+            "<a href=\"https://click.example.test/unsubscribe/" + token(rng, 64) + "\">Unsubscribe</a>"
+            "</td></tr></table>\n<img src=\"https://open.example.test/o/" + token(rng, 64) +
+            ".gif\" width=\"1\" height=\"1\" alt=\"\"></body></html>\n";
+    return html;
+}
+
+struct Result {
+    double ratio;
+    double compress_rate;     // MB/s of input
+    double decompress_rate;   // MB/s of output
+    double compress_us;       // Per email
+    double decompress_us;
+};
+
+bool measure(PayloadCodec codec, int level, const std::vector<std::string>& corpus, Result& result) {
+    std::vector<std::string> packed(corpus.size());
+    size_t in = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < corpus.size(); ++i) {
+        if (!payload_codec::compress(codec, level, corpus[i], packed[i])) {
+            return false;
+        }
+        in += corpus[i].size();
+        out += packed[i].size();
+    }
+    result.ratio = static_cast<double>(in) / static_cast<double>(out);
+
+    // Best of three rounds of each
+    double compress_best = 0;
+    double decompress_best = 0;
+    std::string scratch;
+    for (int round = 0; round < 3; ++round) {
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& html : corpus) {
+            payload_codec::compress(codec, level, html, scratch);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (compress_best == 0 || elapsed.count() < compress_best) {
+            compress_best = elapsed.count();
+        }
+
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < corpus.size(); ++i) {
+            if (!payload_codec::decompress(codec, packed[i], corpus[i].size(), scratch)) {
+                return false;
+            }
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        if (decompress_best == 0 || elapsed.count() < decompress_best) {
+            decompress_best = elapsed.count();
+        }
+    }
+    double megabytes = static_cast<double>(in) / 1e6;
+    result.compress_rate = megabytes / compress_best;
+    result.decompress_rate = megabytes / decompress_best;
+    result.compress_us = compress_best * 1e6 / static_cast<double>(corpus.size());
+    result.decompress_us = decompress_best * 1e6 / static_cast<double>(corpus.size());
+    return true;
+}
+
+} // anonymous namespace
+
+int main(int argc, char* argv[]) {
+    size_t kilobytes = argc > 1 ? static_cast<size_t>(std::atol(argv[1])) : 128;
+    if (kilobytes == 0) {
+        kilobytes = 128;
+    }
+
+    // Enough distinct newsletters for about 32 MB of HTML
+    size_t count = std::max<size_t>(8, 32 * 1024 / kilobytes);
+    std::vector<std::string> corpus;
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        corpus.push_back(makeNewsletter(kilobytes * 1024, static_cast<unsigned>(i + 1)));
+        total += corpus.back().size();
+    }
+    std::printf("%zu newsletters of %zu KiB, %.1f MB of HTML\n\n", corpus.size(), kilobytes,
+                static_cast<double>(total) / 1e6);
+
+    struct Setting {
+        PayloadCodec codec;
+        int level;
+    };
+    const Setting settings[] = {
+        {PayloadCodec::ZLIB, 1}, {PayloadCodec::ZLIB, 6}, {PayloadCodec::ZLIB, 9}};
+
+    std::printf("%-6s %6s %8s %14s %16s %12s %14s\n", "codec", "level", "ratio", "compress MB/s",
+                "decompress MB/s", "compress us", "decompress us");
+    for (const auto& setting : settings) {
+        if (!payload_codec::isAvailable(setting.codec)) {
+            std::printf("%-6s %6d %8s\n", payload_codec::nameOf(setting.codec), setting.level, "not built");
+            continue;
+        }
+        Result result;
+        if (!measure(setting.codec, setting.level, corpus, result)) {
+            std::printf("%-6s %6d %8s\n", payload_codec::nameOf(setting.codec), setting.level, "failed");
+            continue;
+        }
+        std::printf("%-6s %6d %7.2fx %14.0f %16.0f %12.0f %14.0f\n", payload_codec::nameOf(setting.codec),
+                    setting.level, result.ratio, result.compress_rate, result.decompress_rate, result.compress_us,
+                    result.decompress_us);
+    }
+    return 0;
+}
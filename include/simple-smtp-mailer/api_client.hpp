@@ -119,6 +119,20 @@ public:
      */
     virtual std::vector<APIResponse> sendBatch(const std::vector<Email>& emails) = 0;
 
+    /**
+     * @brief Send emails the caller holds, without copying them into a batch
+     * @param emails Emails to send
+     * @return APIResponse per email, in order
+     */
+    virtual std::vector<APIResponse> sendBatch(const std::vector<const Email*>& emails) {
+        std::vector<APIResponse> responses;
+        responses.reserve(emails.size());
+        for (const Email* email : emails) {
+            responses.push_back(sendEmail(*email));
+        }
+        return responses;
+    }
+
     /**
      * @brief Test API connection
      * @return true if successful, false otherwise
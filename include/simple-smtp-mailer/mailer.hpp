@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <vector>
 #include <memory>
@@ -21,6 +22,17 @@ struct Email {
     std::string html_body;
     std::vector<std::string> attachments;
     
+    // Set by callers that may submit the same email more than once; the
+    // queue turns away an email whose key it has seen within its dedup window
+    std::string idempotency_key;
+    
+    // For mail that is worthless late, such as one-time codes: the queue
+    // sends it before others of its priority with a later deadline, and
+    // drops it unsent, without retrying, once the earlier of send_by and
+    // ttl after its send time has passed. Unset (the epoch, zero) for none.
+    std::chrono::system_clock::time_point send_by;
+    std::chrono::seconds ttl = std::chrono::seconds(0);
+    
     /**
      * @brief Default constructor
      */
@@ -198,8 +210,11 @@ struct SMTPResult {
     std::string message_id;
     std::string error_message;
     int error_code;
+    std::vector<std::string> rejected_recipients;  // Envelope addresses refused by RCPT TO
+    std::vector<std::string> delivered_recipients; // On failure, those that took the message all the same
+    bool permanent;                                // No retry can succeed: no such domain, or it takes no mail
     
-    SMTPResult() : success(false), error_code(0) {}
+    SMTPResult() : success(false), error_code(0), permanent(false) {}
     
     /**
      * @brief Create successful result
@@ -294,8 +309,47 @@ public:
      * @brief Add email to queue for processing
      * @param email Email to queue
      * @param priority Priority level for processing
+     * @return ACCEPTED, or why not; waits up to queue_enqueue_timeout_ms for room
+     */
+    EnqueueResult enqueue(const Email& email, EmailPriority priority = EmailPriority::NORMAL);
+    
+    /**
+     * @brief Add email to queue for asynchronous sending, taking over its contents
+     *
+     * Moves the body and attachments into the queue instead of copying them.
+     * @param email Email to send; left in a valid but unspecified state
+     * @param priority Priority level for the email
+     * @return ACCEPTED, or why not; waits up to queue_enqueue_timeout_ms for room
+     */
+    EnqueueResult enqueue(Email&& email, EmailPriority priority = EmailPriority::NORMAL);
+    
+    /**
+     * @brief Queue email to be sent at a later time
+     *
+     * Needs schedule_dir in the configuration: scheduled emails are kept on
+     * disk until shortly before they are due.
+     * @param email Email to send
+     * @param send_at When to send it
+     * @param priority Priority level once it is due
+     * @return Id for cancelScheduledEmail() and rescheduleEmail(), or empty on failure
+     */
+    std::string scheduleEmail(const Email& email, std::chrono::system_clock::time_point send_at,
+                              EmailPriority priority = EmailPriority::NORMAL);
+    
+    /**
+     * @brief Cancel a scheduled email that is not yet due
+     * @param id Id returned by scheduleEmail() or rescheduleEmail()
+     * @return true if it was cancelled
      */
-    void enqueue(const Email& email, EmailPriority priority = EmailPriority::NORMAL);
+    bool cancelScheduledEmail(const std::string& id);
+    
+    /**
+     * @brief Move a scheduled email that is not yet due to another time
+     * @param id Id returned by scheduleEmail() or rescheduleEmail()
+     * @param send_at New send time
+     * @return The email's id from now on, or empty if it was not found
+     */
+    std::string rescheduleEmail(const std::string& id, std::chrono::system_clock::time_point send_at);
     
     /**
      * @brief Start the email processing queue
@@ -321,7 +375,12 @@ public:
     
     /**
      * @brief Get pending emails from queue
-     * @return Vector of pending emails
+     *
+     * Copies every email, bodies included, while holding up the workers;
+     * prefer getQueuePage() for large queues.
+     * @return Vector of pending emails, highest priority first and oldest first
+     *         within a priority, followed by those waiting to retry; this is
+     *         not necessarily the order they are sent in
      */
     std::vector<QueueItem> getPendingEmails() const;
     
@@ -330,6 +389,70 @@ public:
      * @return Vector of failed emails
      */
     std::vector<QueueItem> getFailedEmails() const;
+    
+    /**
+     * @brief Count queued emails by status, without holding up the workers
+     * @return Pending, processing, retrying and recently failed counts
+     */
+    QueueStatusCounts getQueueStatusCounts() const;
+    
+    /**
+     * @brief Page through summaries of the queued emails with one status
+     * @param status PENDING, PROCESSING, RETRY or FAILED
+     * @param cursor Empty for the first page, else the previous page's next_cursor
+     * @param limit Most summaries to return
+     * @return The page; its next_cursor is empty after the last one
+     */
+    QueuePage getQueuePage(EmailStatus status, const std::string& cursor = "", size_t limit = 100) const;
+    
+    /**
+     * @brief Resize the queue's worker pool, also while it is running
+     * @param workers Number of worker threads (at least 1)
+     */
+    void setQueueWorkers(size_t workers);
+    
+    /**
+     * @brief Get per-worker queue statistics
+     * @return One entry per running worker
+     */
+    std::vector<QueueWorkerStats> getQueueWorkerStats() const;
+    
+    /**
+     * @brief Cap how many emails to one recipient domain the queue sends at once
+     * @param domain Recipient domain, e.g. "example.com"
+     * @param limit Emails in flight at once (at least 1)
+     */
+    void setQueueDomainConcurrency(const std::string& domain, size_t limit);
+    
+    /**
+     * @brief Get per-recipient-domain queue depth, in-flight and backoff gauges
+     * @return One entry per domain with mail queued, in flight, deferred or backing off
+     */
+    std::vector<QueueDomainStats> getQueueDomainStats() const;
+    
+    /**
+     * @brief Get idempotency-key deduplication counters
+     * @return Keys checked, duplicates turned away and keys remembered
+     */
+    QueueDedupStats getQueueDedupStats() const;
+    
+    /**
+     * @brief Get payload deduplication counters
+     * @return Emails checked, payloads shared and the dedup ratio
+     */
+    QueuePayloadStats getQueuePayloadStats() const;
+    
+    /**
+     * @brief Get enqueue-to-send latency percentiles for each priority
+     * @return One entry per priority level, LOW first
+     */
+    std::vector<QueueLatencyStats> getQueueLatencyStats() const;
+    
+    /**
+     * @brief Get how many queued emails were dropped unsent past their deadline
+     * @return Emails expired since the queue was created
+     */
+    size_t getQueueExpiredCount() const;
 
 private:
     class Impl;
@@ -3,10 +3,14 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <cstdint>
 #include <memory>
 
 namespace ssmtp_mailer {
 
+struct Email;
+struct PackedPayload;
+
 /**
  * @brief Email priority levels
  */
@@ -29,6 +33,17 @@ enum class EmailStatus {
     CANCELLED = 5
 };
 
+/**
+ * @brief Outcome of offering an email to the queue
+ */
+enum class EnqueueResult {
+    ACCEPTED = 0,      // Queued; on disk too if the queue has a spool
+    QUEUE_FULL = 1,    // No room at this priority and no time left to wait for it
+    TIMED_OUT = 2,     // Waited for room until the deadline
+    UNAVAILABLE = 3,   // No queue to take it, or the queue is shutting down
+    DUPLICATE = 4      // Its idempotency key was already queued within the dedup window
+};
+
 /**
  * @brief Queue item structure
  */
@@ -51,6 +66,26 @@ struct QueueItem {
     int retry_count;
     int max_retries;
     std::string error_message;
+    std::string idempotency_key;   // Caller's key for spotting resubmissions; empty if none
+    std::chrono::system_clock::time_point expires_at;   // Send-by deadline; the epoch if none
+    
+    // The message itself, shared by every copy of this item rather than
+    // duplicated. When set, body, html_body and attachments above are left
+    // empty; read them through the accessors below.
+    std::shared_ptr<const Email> message;
+    
+    // Another queued email with the same body, HTML body and attachments,
+    // whose payload this one shares; message then carries only the
+    // envelope. payload_digest identifies that content, or is 0 if the
+    // queue has not looked it up.
+    std::shared_ptr<const Email> payload;
+    uint64_t payload_digest = 0;
+    
+    // The payload compressed while the email waits, in place of payload or
+    // the message's own; decompressed for each send. packed_shared is set
+    // if it belongs to another queued email with the same content.
+    std::shared_ptr<const PackedPayload> packed;
+    bool packed_shared = false;
     
     QueueItem() = default;
     
@@ -64,6 +99,50 @@ struct QueueItem {
           last_attempt(std::chrono::system_clock::now()),
           retry_delay(std::chrono::seconds(60)),
           retry_count(0), max_retries(3) {}
+    
+    bool hasDeadline() const { return expires_at != std::chrono::system_clock::time_point(); }
+    bool expiredAt(std::chrono::system_clock::time_point now) const { return hasDeadline() && expires_at <= now; }
+    
+    // Empty while the payload is packed
+    const std::string& bodyText() const;
+    const std::string& htmlBodyText() const;
+    const std::vector<std::string>& attachmentList() const;
+    
+    /**
+     * @brief Bytes of body, HTML body and attachment names, uncompressed
+     */
+    size_t payloadSize() const;
+    
+    /**
+     * @brief Bytes of payload this item keeps in memory: none if it shares
+     *        another's, the compressed size if packed
+     */
+    size_t heldSize() const;
+    
+    /**
+     * @brief The message as it is to be sent, with the shared payload filled in
+     *        and a packed one decompressed
+     * @return nullptr if the packed payload is corrupt
+     */
+    std::shared_ptr<const Email> outgoingMessage() const;
+    
+    /**
+     * @brief Move body, html_body and attachments into a shared message, if not there already
+     */
+    void shareMessage();
+    
+    /**
+     * @brief Copy the shared message's payload back into body, html_body and
+     *        attachments, decompressing it if packed
+     * @return false, leaving the item as it was, if the packed payload is corrupt
+     */
+    bool copyMessage();
+    
+    /**
+     * @brief Stop sending to recipients that already have the message, so
+     *        that a retry goes only to the rest
+     */
+    void dropRecipients(const std::vector<std::string>& delivered);
 };
 
 /**
@@ -72,17 +151,160 @@ struct QueueItem {
 struct QueueConfig {
     size_t max_queue_size;
     size_t max_workers;
+    size_t max_domain_concurrency;   // Emails to one recipient domain taken at once
     std::chrono::seconds retry_delay;
     std::chrono::seconds max_retry_delay;
     bool enable_priority_queuing;
     bool enable_scheduled_sending;
+    std::chrono::seconds priority_aging;   // Wait that serves an email one priority higher
+    double urgent_reserve;                 // Share of sending capacity kept free for URGENT mail
     
     QueueConfig()
-        : max_queue_size(10000), max_workers(4),
+        : max_queue_size(10000), max_workers(4), max_domain_concurrency(20),
           retry_delay(std::chrono::seconds(60)),
           max_retry_delay(std::chrono::seconds(3600)),
           enable_priority_queuing(true),
-          enable_scheduled_sending(true) {}
+          enable_scheduled_sending(true),
+          priority_aging(std::chrono::seconds(60)),
+          urgent_reserve(0.0) {}
+};
+
+/**
+ * @brief Idempotency-key deduplication counters
+ */
+struct QueueDedupStats {
+    size_t checked;        // Emails with a key checked since start
+    size_t exact_hits;     // Turned away on a key held exactly
+    size_t filter_hits;    // Turned away on a Bloom filter match, which may be false
+    size_t remembered;     // Keys held exactly now
+    size_t spilled;        // Keys moved from the exact set into the filters
+    size_t expired;        // Keys dropped from the exact set after the window
+    
+    QueueDedupStats()
+        : checked(0), exact_hits(0), filter_hits(0), remembered(0), spilled(0), expired(0) {}
+};
+
+/**
+ * @brief Payload deduplication and compression counters
+ *
+ * The dedup ratio is the payload bytes of the emails checked over the
+ * bytes actually stored for them; 1 when nothing was shared. The
+ * compression ratio is the bytes of the payloads compressed over their
+ * compressed size; 1 when nothing was compressed.
+ */
+struct QueuePayloadStats {
+    size_t checked;         // Emails whose payload was looked up since start
+    size_t shared;          // Of those, found already queued and shared
+    size_t bytes_checked;   // Payload bytes of the emails checked
+    size_t bytes_shared;    // Of those, bytes not stored again
+    size_t payloads;        // Distinct payloads held now
+    size_t stored_bytes;    // Bytes of those payloads, as held
+    double dedup_ratio;
+    size_t compressed;      // Payloads held compressed since start
+    size_t bytes_before;    // Their bytes before compression
+    size_t bytes_after;     // And after
+    double compression_ratio;
+    
+    QueuePayloadStats()
+        : checked(0), shared(0), bytes_checked(0), bytes_shared(0), payloads(0),
+          stored_bytes(0), dedup_ratio(1.0), compressed(0), bytes_before(0), bytes_after(0),
+          compression_ratio(1.0) {}
+};
+
+/**
+ * @brief Enqueue-to-send latency of one priority level
+ *
+ * Measured from enqueue, or the scheduled send time if later, to the
+ * start of the first delivery attempt.
+ */
+struct QueueLatencyStats {
+    EmailPriority priority;
+    size_t samples;
+    std::chrono::microseconds p50;
+    std::chrono::microseconds p90;
+    std::chrono::microseconds p99;
+    std::chrono::microseconds max;
+    
+    QueueLatencyStats()
+        : priority(EmailPriority::NORMAL), samples(0), p50(0), p90(0), p99(0), max(0) {}
+};
+
+/**
+ * @brief Per-worker queue statistics
+ */
+struct QueueWorkerStats {
+    size_t index;
+    size_t processed;      // Emails this worker sent or handed to the asynchronous sender
+    size_t stolen;         // Of those, taken from another worker's deque
+    size_t queued;         // Emails waiting in this worker's deque
+    double utilization;    // Fraction of the time since the worker started spent sending
+    
+    QueueWorkerStats()
+        : index(0), processed(0), stolen(0), queued(0), utilization(0.0) {}
+};
+
+/**
+ * @brief Per-recipient-domain queue gauges
+ */
+struct QueueDomainStats {
+    std::string domain;
+    size_t queued;                 // Ready to send, waiting for the domain's turn
+    size_t in_flight;              // Taken by a worker or the asynchronous sender
+    size_t deferred;               // Waiting out a retry delay
+    size_t concurrency_limit;
+    size_t consecutive_failures;   // Temporary failures since the last success
+    bool backing_off;
+    std::chrono::system_clock::time_point resume_at;   // End of the backoff
+    
+    QueueDomainStats()
+        : queued(0), in_flight(0), deferred(0), concurrency_limit(0),
+          consecutive_failures(0), backing_off(false) {}
+};
+
+/**
+ * @brief What queue inspection reports about one email, without its body
+ */
+struct QueueItemSummary {
+    std::string id;
+    std::string from_address;
+    std::string first_recipient;
+    size_t recipient_count;
+    std::string subject;
+    std::string domain;
+    EmailPriority priority;
+    EmailStatus status;
+    size_t size_bytes;             // Bodies and attachment names
+    int retry_count;
+    std::string error_message;
+    std::chrono::system_clock::time_point created_at;
+    std::chrono::system_clock::time_point last_attempt;
+    
+    QueueItemSummary()
+        : recipient_count(0), priority(EmailPriority::NORMAL), status(EmailStatus::PENDING),
+          size_bytes(0), retry_count(0) {}
+};
+
+/**
+ * @brief Emails in the queue by status
+ */
+struct QueueStatusCounts {
+    size_t pending;      // Ready to send
+    size_t processing;   // Taken by a worker or the asynchronous sender
+    size_t retry;        // Waiting out a retry delay
+    size_t failed;       // Recently failed for good, up to the failure history kept
+    
+    QueueStatusCounts() : pending(0), processing(0), retry(0), failed(0) {}
+};
+
+/**
+ * @brief One page of queue inspection
+ */
+struct QueuePage {
+    std::vector<QueueItemSummary> items;
+    std::string next_cursor;   // Pass back for the next page; empty after the last
+    size_t total;              // Emails with this status when the page was taken
+    
+    QueuePage() : total(0) {}
 };
 
 /**
@@ -13,6 +13,9 @@
 
 namespace ssmtp_mailer {
 
+class ConfigManager;
+class SMTPConnectionPool;
+
 /**
  * @brief Email sending method
  */
@@ -47,8 +50,9 @@ struct UnifiedMailerResult {
     std::string error_message;
     std::string provider_name;
     int retry_count;
+    int error_code;   // SMTP reply code of a failed SMTP send; 0 otherwise
     
-    UnifiedMailerResult() : success(false), method_used(SendMethod::SMTP), retry_count(0) {}
+    UnifiedMailerResult() : success(false), method_used(SendMethod::SMTP), retry_count(0), error_code(0) {}
 };
 
 /**
@@ -106,6 +110,29 @@ public:
     std::vector<UnifiedMailerResult> sendBatch(const std::vector<Email>& emails, 
                                               SendMethod method = SendMethod::AUTO);
     
+    /**
+     * @brief Send multiple emails as one batch
+     *
+     * Over SMTP, emails for the same relay share one pooled session; over
+     * an API, the batch goes to the provider in one sendBatch() call. With
+     * AUTO, only the emails the API failed fall back to SMTP.
+     * @param emails Emails to send; not copied for SMTP
+     * @param method Sending method to use
+     * @return One result per email, in the same order
+     */
+    std::vector<UnifiedMailerResult> sendBatch(const std::vector<const Email*>& emails,
+                                              SendMethod method = SendMethod::AUTO);
+    
+    /**
+     * @brief Send a batch with the default method, reporting as the queue expects
+     *
+     * Suits EmailQueue::setBatchSendCallback(): failed SMTP sends keep
+     * their reply code, so the queue can tell rejections from deferrals.
+     * @param emails Emails to send
+     * @return One SMTPResult per email, in the same order
+     */
+    std::vector<SMTPResult> sendQueuedBatch(const std::vector<const Email*>& emails);
+    
     /**
      * @brief Test connection for specified method
      * @param method Method to test
@@ -154,7 +181,8 @@ public:
 
 private:
     UnifiedMailerConfig config_;
-    std::unique_ptr<class ConfigManager> smtp_config_;
+    std::unique_ptr<ConfigManager> smtp_config_;
+    std::unique_ptr<SMTPConnectionPool> smtp_pool_;
     std::map<std::string, std::shared_ptr<BaseAPIClient>> api_clients_;
     
     // Statistics
@@ -168,6 +196,8 @@ private:
     std::string selectBestProvider(const Email& email);
     bool shouldRetry(const UnifiedMailerResult& result);
     UnifiedMailerResult retryWithFallback(const Email& email, SendMethod original_method);
+    std::vector<UnifiedMailerResult> sendBatchViaSMTP(const std::vector<const Email*>& emails);
+    std::vector<UnifiedMailerResult> sendBatchViaAPI(const std::vector<const Email*>& emails);
 };
 
 } // namespace ssmtp_mailer
@@ -52,6 +52,14 @@ const DomainConfig* ConfigManager::getDomainConfig(const std::string& domain_nam
     return nullptr;
 }
 
+void ConfigManager::setGlobalConfig(const GlobalConfig& config) {
+    global_config_ = config;
+}
+
+void ConfigManager::setDomainConfig(const DomainConfig& config) {
+    domain_configs_[config.name] = config;
+}
+
 const UserConfig* ConfigManager::getUserConfig(const std::string& email) const {
     auto it = user_configs_.find(email);
     if (it != user_configs_.end()) {
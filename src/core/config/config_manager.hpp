@@ -27,8 +27,12 @@ struct DomainConfig {
     std::string ssl_cert_file;
     std::string ssl_key_file;
     std::string ssl_ca_file;
+    bool ssl_verify_peer;
+    std::string smtp_transport;  // "native" (default) or "curl"
+    std::string delivery_mode;   // "relay" (default, via smtp_server) or "mx" (direct to recipient MX hosts)
 
-    DomainConfig() : enabled(true), smtp_port(587), use_ssl(false), use_starttls(true) {}
+    DomainConfig() : enabled(true), smtp_port(587), use_ssl(false), use_starttls(true),
+                     ssl_verify_peer(true), smtp_transport("native"), delivery_mode("relay") {}
 };
 
 /**
@@ -82,12 +86,40 @@ struct GlobalConfig {
     int connection_timeout;
     int read_timeout;
     int write_timeout;
+    int connection_idle_timeout;
     bool enable_rate_limiting;
     int rate_limit_per_minute;
+    int queue_workers;               // Queue worker threads
+    int queue_domain_concurrency;    // Emails to one recipient domain in flight at once
+    int queue_priority_aging_seconds;   // Wait that serves an email one priority higher; 0 for strict
+    int queue_urgent_reserve_percent;   // Workers and in-flight slots kept free for URGENT mail
+    int queue_max_size;              // Emails held before enqueue pushes back
+    int queue_max_mb;                // Payload held before enqueue pushes back; 0 for no limit
+    int queue_enqueue_timeout_ms;    // How long enqueue waits for room in a full queue
+    int queue_dedup_window_seconds;  // How long idempotency keys are remembered
+    int queue_dedup_exact_keys;      // Newest keys held exactly; older ones go to Bloom filters
+    bool queue_batch_send;           // Send each worker's batch over pooled sessions, not the event loop
+    bool queue_payload_dedup;        // Queued emails with the same body keep one copy of it
+    std::string queue_compression;   // none or zlib: codec for large queued payloads
+    int queue_compression_threshold_kb;   // Payloads smaller than this stay uncompressed
+    int queue_compression_level;     // Codec's level; 0 for its default
+    std::string spool_dir;           // Queue write-ahead log; empty keeps the queue in memory only
+    int spool_segment_size_mb;
+    int spool_commit_interval_ms;
+    std::string schedule_dir;        // Scheduled-send store; empty disables scheduled sending
+    int schedule_bucket_seconds;     // Send times sharing one schedule file
 
     GlobalConfig() : max_connections(10), connection_timeout(30),
-                     read_timeout(60), write_timeout(60),
+                     read_timeout(60), write_timeout(60), connection_idle_timeout(60),
                      enable_rate_limiting(true), rate_limit_per_minute(100),
+                     queue_workers(4), queue_domain_concurrency(20),
+                     queue_priority_aging_seconds(60), queue_urgent_reserve_percent(10),
+                     queue_max_size(1000), queue_max_mb(256), queue_enqueue_timeout_ms(0),
+                     queue_dedup_window_seconds(86400), queue_dedup_exact_keys(100000),
+                     queue_batch_send(false), queue_payload_dedup(true),
+                     queue_compression("none"), queue_compression_threshold_kb(16), queue_compression_level(0),
+                     spool_segment_size_mb(16), spool_commit_interval_ms(5),
+                     schedule_bucket_seconds(60),
                      json_logging_enabled(false), json_log_fields("timestamp,level,message,thread"),
                      json_log_pretty_print(false), json_log_timestamp_format("%Y-%m-%dT%H:%M:%S.%fZ") {}
 };
@@ -133,6 +165,18 @@ public:
      */
     const DomainConfig* getDomainConfig(const std::string& domain_name) const;
 
+    /**
+     * @brief Set global configuration
+     * @param config Global configuration to use
+     */
+    void setGlobalConfig(const GlobalConfig& config);
+
+    /**
+     * @brief Add or replace a domain configuration
+     * @param config Domain configuration (keyed by config.name)
+     */
+    void setDomainConfig(const DomainConfig& config);
+
     /**
      * @brief Get user configuration by email
      * @param email User email address
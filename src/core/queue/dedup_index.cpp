@@ -0,0 +1,171 @@
+#include "core/queue/dedup_index.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+uint64_t mix(uint64_t value) {
+    value ^= value >> 30;
+    value *= 0xBF58476D1CE4E5B9ull;
+    value ^= value >> 27;
+    value *= 0x94D049BB133111EBull;
+    value ^= value >> 31;
+    return value;
+}
+
+} // anonymous namespace
+
+DedupIndex::DedupIndex(const DedupIndexOptions& options)
+    : slice_width_(Clock::duration(1)), filter_bits_(64), probes_(1) {
+    configure(options);
+}
+
+void DedupIndex::configure(const DedupIndexOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    options_ = options;
+    if (options_.window <= std::chrono::seconds(0)) {
+        options_.window = std::chrono::seconds(1);
+    }
+    slice_width_ = std::chrono::duration_cast<Clock::duration>(options_.window) / kSlices;
+
+    // Standard Bloom sizing, with the error budget split across the filters probed
+    double keys = static_cast<double>(std::max<size_t>(1, options_.filter_keys / kSlices));
+    double rate = std::min(0.5, std::max(1e-9, options_.false_positive_rate)) / kFilters;
+    double ln2 = std::log(2.0);
+    double bits = std::ceil(-keys * std::log(rate) / (ln2 * ln2));
+    filter_bits_ = (static_cast<size_t>(bits) + 63) / 64 * 64;
+    probes_ = std::max<size_t>(1, static_cast<size_t>(std::lround(bits / keys * ln2)));
+
+    exact_.clear();
+    arrivals_.clear();
+    filters_ = std::array<Filter, kFilters>();
+    stats_ = QueueDedupStats();
+}
+
+bool DedupIndex::admit(const std::string& key, Clock::time_point now) {
+    uint64_t hash = hashOf(key);
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.checked++;
+    trimLocked(now);
+
+    auto it = exact_.find(hash);
+    if (it != exact_.end() && it->second + options_.window > now) {
+        stats_.exact_hits++;
+        return false;
+    }
+    if (filtersContainLocked(hash, now)) {
+        stats_.filter_hits++;
+        return false;
+    }
+    insertLocked(hash, now, now);
+    return true;
+}
+
+void DedupIndex::remember(const std::string& key, Clock::time_point seen) {
+    uint64_t hash = hashOf(key);
+    Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (seen + options_.window > now) {
+        insertLocked(hash, std::min(seen, now), now);
+    }
+}
+
+void DedupIndex::forget(const std::string& key) {
+    uint64_t hash = hashOf(key);
+    std::lock_guard<std::mutex> lock(mutex_);
+    exact_.erase(hash);
+}
+
+QueueDedupStats DedupIndex::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueDedupStats stats = stats_;
+    stats.remembered = exact_.size();
+    return stats;
+}
+
+uint64_t DedupIndex::hashOf(const std::string& key) {
+    // FNV-1a, finished with a mixer so the low bits the filters use are well spread
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (unsigned char c : key) {
+        hash ^= c;
+        hash *= 0x100000001B3ull;
+    }
+    return mix(hash);
+}
+
+int64_t DedupIndex::sliceOf(Clock::time_point time) const {
+    return static_cast<int64_t>(time.time_since_epoch() / slice_width_);
+}
+
+bool DedupIndex::filtersContainLocked(uint64_t hash, Clock::time_point now) const {
+    int64_t oldest = sliceOf(now) - static_cast<int64_t>(kSlices);
+    uint64_t step = mix(hash ^ 0x9E3779B97F4A7C15ull) | 1;
+    for (const Filter& filter : filters_) {
+        if (filter.keys == 0 || filter.slice < oldest) {
+            continue;
+        }
+        bool all = true;
+        for (size_t i = 0; i < probes_ && all; ++i) {
+            size_t bit = static_cast<size_t>((hash + i * step) % filter_bits_);
+            all = (filter.bits[bit / 64] >> (bit % 64)) & 1;
+        }
+        if (all) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DedupIndex::addToFilterLocked(uint64_t hash, Clock::time_point seen, Clock::time_point now) {
+    int64_t current = sliceOf(now);
+    int64_t slice = std::min(sliceOf(seen), current);
+    if (slice < current - static_cast<int64_t>(kSlices)) {
+        return;
+    }
+    Filter& filter = filters_[static_cast<size_t>(slice) % kFilters];
+    if (filter.slice != slice) {
+        // Holds a quarter that has rotated out of the window
+        filter.slice = slice;
+        filter.keys = 0;
+        filter.bits.assign(filter_bits_ / 64, 0);
+    }
+    uint64_t step = mix(hash ^ 0x9E3779B97F4A7C15ull) | 1;
+    for (size_t i = 0; i < probes_; ++i) {
+        size_t bit = static_cast<size_t>((hash + i * step) % filter_bits_);
+        filter.bits[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    filter.keys++;
+}
+
+void DedupIndex::insertLocked(uint64_t hash, Clock::time_point seen, Clock::time_point now) {
+    exact_[hash] = seen;
+    arrivals_.push_back(Arrival{hash, seen});
+    trimLocked(now);
+}
+
+void DedupIndex::trimLocked(Clock::time_point now) {
+    while (!arrivals_.empty()) {
+        const Arrival& oldest = arrivals_.front();
+        auto it = exact_.find(oldest.hash);
+        if (it == exact_.end() || it->second != oldest.seen) {
+            // Forgotten, or admitted again later
+            arrivals_.pop_front();
+            continue;
+        }
+        if (oldest.seen + options_.window <= now) {
+            exact_.erase(it);
+            stats_.expired++;
+        } else if (exact_.size() > options_.exact_keys) {
+            addToFilterLocked(oldest.hash, oldest.seen, now);
+            exact_.erase(it);
+            stats_.spilled++;
+        } else {
+            break;
+        }
+        arrivals_.pop_front();
+    }
+}
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Dedup index settings
+ */
+struct DedupIndexOptions {
+    std::chrono::seconds window;   // How long a key is remembered
+    size_t exact_keys;             // Most recent keys held exactly
+    size_t filter_keys;            // Older keys per window the filters are sized for
+    double false_positive_rate;    // Chance a new key matches a full filter set
+
+    DedupIndexOptions()
+        : window(std::chrono::hours(24)), exact_keys(100000), filter_keys(1000000),
+          false_positive_rate(0.0001) {}
+};
+
+/**
+ * @brief Remembers idempotency keys for a time window to turn away duplicates
+ *
+ * The newest keys are held exactly, as 64-bit hashes in a map with their
+ * arrival time and a FIFO of arrivals to expire and spill them in order.
+ * Once more than exact_keys are held, the oldest spill into Bloom filters,
+ * one per quarter of the window, each sized for a quarter of filter_keys.
+ * Filters rotate out with their quarter, so a key is remembered for between
+ * one and one and a quarter windows. Empty filters are never probed, so the
+ * filters cost nothing, and cannot match falsely, until the exact set has
+ * overflowed within the window.
+ *
+ * A check is one map lookup and at most a fixed number of bit probes.
+ *
+ * Thread-safe.
+ */
+class DedupIndex {
+public:
+    using Clock = std::chrono::system_clock;
+
+    explicit DedupIndex(const DedupIndexOptions& options = DedupIndexOptions());
+
+    DedupIndex(const DedupIndex&) = delete;
+    DedupIndex& operator=(const DedupIndex&) = delete;
+
+    /**
+     * @brief Replace the settings, forgetting every key
+     */
+    void configure(const DedupIndexOptions& options);
+
+    /**
+     * @brief Remember key unless already remembered
+     * @return true if key is new; false for a duplicate
+     */
+    bool admit(const std::string& key, Clock::time_point now = Clock::now());
+
+    /**
+     * @brief Remember key as seen at the given time, without checking it
+     */
+    void remember(const std::string& key, Clock::time_point seen);
+
+    /**
+     * @brief Undo admit() for an email that was not queued after all
+     *
+     * Only keys still held exactly can be forgotten.
+     */
+    void forget(const std::string& key);
+
+    QueueDedupStats getStats() const;
+
+private:
+    // Quarters of the window, each with its own filter, plus the one filling
+    static constexpr size_t kSlices = 4;
+    static constexpr size_t kFilters = kSlices + 1;
+
+    struct Arrival {
+        uint64_t hash;
+        Clock::time_point seen;
+    };
+
+    struct Filter {
+        int64_t slice;          // Which quarter of time it holds keys from
+        size_t keys;
+        std::vector<uint64_t> bits;
+
+        Filter() : slice(-1), keys(0) {}
+    };
+
+    mutable std::mutex mutex_;
+    DedupIndexOptions options_;
+    Clock::duration slice_width_;
+    size_t filter_bits_;
+    size_t probes_;
+    std::unordered_map<uint64_t, Clock::time_point> exact_;
+    std::deque<Arrival> arrivals_;   // Oldest first; entries for forgotten keys are skipped
+    std::array<Filter, kFilters> filters_;
+    QueueDedupStats stats_;
+
+    static uint64_t hashOf(const std::string& key);
+    int64_t sliceOf(Clock::time_point time) const;
+    bool filtersContainLocked(uint64_t hash, Clock::time_point now) const;
+    void addToFilterLocked(uint64_t hash, Clock::time_point seen, Clock::time_point now);
+    void insertLocked(uint64_t hash, Clock::time_point seen, Clock::time_point now);
+    void trimLocked(Clock::time_point now);
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,423 @@
+#include "core/queue/domain_scheduler.hpp"
+#include <algorithm>
+#include <cctype>
+
+namespace ssmtp_mailer {
+
+DomainScheduler::DomainScheduler(size_t quantum)
+    : default_limit_(QueueConfig().max_domain_concurrency),
+      initial_backoff_(std::chrono::seconds(1)), max_backoff_(std::chrono::minutes(5)),
+      aging_step_(0), quantum_(quantum > 0 ? quantum : kDefaultQuantum), size_(0), urgent_(0) {}
+
+void DomainScheduler::push(QueueItem item, Clock::time_point now) {
+    Domain& domain = domainFor(item);
+    int level = levelOf(item);
+    Lane& lane = domain.lanes[level];
+    if (item.hasDeadline()) {
+        Clock::time_point deadline = item.expires_at;
+        lane.timed.emplace(deadline, Waiting{std::move(item), now});
+        retrack(domain, level);
+    } else {
+        lane.fifo.push_back(Waiting{std::move(item), now});
+    }
+    lane.ages.insert(now);
+    reage(domain, level);
+    domain.queued++;
+    size_++;
+    if (level == kPriorities - 1) {
+        urgent_++;
+    }
+    if (!domain.in_ring[level] && eligible(domain)) {
+        enter(domain, level);
+    }
+}
+
+bool DomainScheduler::pop(Clock::time_point now, QueueItem& item, EmailPriority lowest) {
+    resumeDue(now);
+
+    // Serve the highest level, as lifted by how long the oldest email it
+    // could serve has waited; on a tie, the one waiting longer
+    int level = -1;
+    int best_rank = -1;
+    Clock::time_point best_since;
+    int floor = std::min(std::max(static_cast<int>(lowest), 0), kPriorities - 1);
+    for (int candidate = kPriorities - 1; candidate >= floor; --candidate) {
+        if (rings_[candidate].empty()) {
+            continue;
+        }
+        Clock::time_point since = aged_[candidate].begin()->first;
+        int rank = candidate;
+        if (aging_step_.count() > 0 && candidate < kAgedCeiling && now > since) {
+            auto steps = (now - since) / aging_step_;
+            rank = static_cast<int>(std::min<decltype(steps)>(kAgedCeiling, candidate + steps));
+        }
+        if (rank > best_rank || (rank == best_rank && since < best_since)) {
+            level = candidate;
+            best_rank = rank;
+            best_since = since;
+        }
+    }
+    if (level < 0) {
+        return false;
+    }
+
+    if (!due_[level].empty()) {
+        // Earliest deadline first, out of turn
+        Domain& domain = *due_[level].begin()->second;
+        auto& timed = domain.lanes[level].timed;
+        domain.deficit[level] -= std::min(domain.deficit[level], costOf(timed.begin()->second.item));
+        Lane& lane = domain.lanes[level];
+        lane.ages.erase(lane.ages.find(timed.begin()->second.since));
+        item = std::move(timed.begin()->second.item);
+        timed.erase(timed.begin());
+        retrack(domain, level);
+        reage(domain, level);
+        taken(domain, level);
+        return true;
+    }
+
+    // No domain in the ring has deadlines at this level, so each one's next
+    // email is the oldest of its FIFO
+    Ring& ring = rings_[level];
+    while (true) {
+        Domain& domain = *ring.front();
+        auto& queue = domain.lanes[level].fifo;
+        size_t cost = costOf(queue.front().item);
+        if (domain.deficit[level] < cost) {
+            // Not enough credit left this round: top up and pass the turn on
+            domain.deficit[level] += quantum_;
+            ring.splice(ring.end(), ring, ring.begin());
+            continue;
+        }
+
+        domain.deficit[level] -= cost;
+        Lane& lane = domain.lanes[level];
+        lane.ages.erase(lane.ages.find(queue.front().since));
+        item = std::move(queue.front().item);
+        queue.pop_front();
+        reage(domain, level);
+        taken(domain, level);
+        return true;
+    }
+}
+
+size_t DomainScheduler::dropExpired(Clock::time_point now, std::vector<QueueItem>& expired) {
+    size_t dropped = 0;
+    while (!expiries_.empty() && std::get<0>(*expiries_.begin()) <= now) {
+        Domain& domain = *std::get<1>(*expiries_.begin());
+        int level = std::get<2>(*expiries_.begin());
+        Lane& lane = domain.lanes[level];
+        lane.ages.erase(lane.ages.find(lane.timed.begin()->second.since));
+        expired.push_back(std::move(lane.timed.begin()->second.item));
+        lane.timed.erase(lane.timed.begin());
+        retrack(domain, level);
+        reage(domain, level);
+        domain.queued--;
+        size_--;
+        if (level == kPriorities - 1) {
+            urgent_--;
+        }
+        if (lane.empty() && domain.in_ring[level]) {
+            domain.deficit[level] = 0;
+            leave(domain, level);
+        }
+        dropped++;
+        // May forget the domain
+        update(domain);
+    }
+    return dropped;
+}
+
+bool DomainScheduler::nextExpiry(Clock::time_point& deadline) const {
+    if (expiries_.empty()) {
+        return false;
+    }
+    deadline = std::get<0>(*expiries_.begin());
+    return true;
+}
+
+void DomainScheduler::release(const std::string& domain_name, DomainOutcome outcome, Clock::time_point now) {
+    auto it = domains_.find(domain_name);
+    if (it == domains_.end()) {
+        return;
+    }
+    Domain& domain = *it->second;
+    if (domain.in_flight > 0) {
+        domain.in_flight--;
+    }
+
+    switch (outcome) {
+        case DomainOutcome::SENT:
+            domain.failures = 0;
+            break;
+        case DomainOutcome::DEFERRED: {
+            domain.failures++;
+            auto backoff = initial_backoff_;
+            for (int i = 1; i < domain.failures && backoff < max_backoff_; ++i) {
+                backoff *= 2;
+            }
+            backoff = std::min(backoff, max_backoff_);
+            paused_.erase(std::make_pair(domain.paused_until, &domain));
+            domain.paused = true;
+            domain.paused_until = now + backoff;
+            paused_.insert(std::make_pair(domain.paused_until, &domain));
+            break;
+        }
+        case DomainOutcome::REJECTED:
+        case DomainOutcome::NOT_ATTEMPTED:
+            break;
+    }
+
+    update(domain);
+}
+
+void DomainScheduler::giveBack(QueueItem item) {
+    Domain& domain = domainFor(item);
+    if (domain.in_flight > 0) {
+        domain.in_flight--;
+    }
+    int level = levelOf(item);
+    // It was at the head already, so it keeps its turn but not its age
+    Lane& lane = domain.lanes[level];
+    Clock::time_point now = Clock::now();
+    if (item.hasDeadline()) {
+        Clock::time_point deadline = item.expires_at;
+        lane.timed.emplace(deadline, Waiting{std::move(item), now});
+        retrack(domain, level);
+    } else {
+        lane.fifo.push_front(Waiting{std::move(item), now});
+    }
+    lane.ages.insert(now);
+    reage(domain, level);
+    domain.queued++;
+    size_++;
+    if (level == kPriorities - 1) {
+        urgent_++;
+    }
+    update(domain);
+}
+
+bool DomainScheduler::nextDeadline(Clock::time_point& deadline) const {
+    if (paused_.empty()) {
+        return false;
+    }
+    deadline = paused_.begin()->first;
+    return true;
+}
+
+void DomainScheduler::setConcurrency(size_t limit) {
+    default_limit_ = limit > 0 ? limit : 1;
+    std::vector<Domain*> domains;
+    for (auto& entry : domains_) {
+        domains.push_back(entry.second.get());
+    }
+    // update() may forget a domain, so not while iterating domains_
+    for (Domain* domain : domains) {
+        update(*domain);
+    }
+}
+
+void DomainScheduler::setConcurrency(const std::string& domain_name, size_t limit) {
+    std::string name = domainOf("@" + domain_name);
+    limits_[name] = limit > 0 ? limit : 1;
+    auto it = domains_.find(name);
+    if (it != domains_.end()) {
+        update(*it->second);
+    }
+}
+
+void DomainScheduler::setBackoff(std::chrono::milliseconds initial, std::chrono::milliseconds max) {
+    initial_backoff_ = initial;
+    max_backoff_ = std::max(initial, max);
+}
+
+void DomainScheduler::setAging(std::chrono::milliseconds step) {
+    aging_step_ = std::max(step, std::chrono::milliseconds(0));
+}
+
+void DomainScheduler::forEach(const std::function<void(const QueueItem&)>& visit) const {
+    for (const auto& entry : domains_) {
+        for (const auto& lane : entry.second->lanes) {
+            for (const auto& waiting : lane.fifo) {
+                visit(waiting.item);
+            }
+            for (const auto& timed : lane.timed) {
+                visit(timed.second.item);
+            }
+        }
+    }
+}
+
+std::vector<QueueDomainStats> DomainScheduler::getStats(Clock::time_point now) const {
+    std::vector<QueueDomainStats> stats;
+    for (const auto& entry : domains_) {
+        const Domain& domain = *entry.second;
+        QueueDomainStats domain_stats;
+        domain_stats.domain = domain.name;
+        domain_stats.queued = domain.queued;
+        domain_stats.in_flight = domain.in_flight;
+        domain_stats.concurrency_limit = limitFor(domain);
+        domain_stats.consecutive_failures = static_cast<size_t>(domain.failures);
+        domain_stats.backing_off = domain.paused && domain.paused_until > now;
+        domain_stats.resume_at = domain.paused_until;
+        stats.push_back(domain_stats);
+    }
+    std::sort(stats.begin(), stats.end(), [](const QueueDomainStats& a, const QueueDomainStats& b) {
+        return a.domain < b.domain;
+    });
+    return stats;
+}
+
+std::string DomainScheduler::domainOf(const std::string& address) {
+    size_t at = address.rfind('@');
+    if (at == std::string::npos) {
+        return "";
+    }
+    std::string domain = address.substr(at + 1);
+    // Angle-bracketed addresses ("Name <user@host>") end in '>'
+    size_t end = domain.find_first_of("> \t");
+    if (end != std::string::npos) {
+        domain.resize(end);
+    }
+    std::transform(domain.begin(), domain.end(), domain.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return domain;
+}
+
+DomainScheduler::Domain& DomainScheduler::domainFor(QueueItem& item) {
+    if (item.domain.empty() && !item.to_addresses.empty()) {
+        item.domain = domainOf(item.to_addresses.front());
+    }
+    auto& slot = domains_[item.domain];
+    if (!slot) {
+        slot = std::make_unique<Domain>(item.domain);
+    }
+    return *slot;
+}
+
+size_t DomainScheduler::limitFor(const Domain& domain) const {
+    auto it = limits_.find(domain.name);
+    return it != limits_.end() ? it->second : default_limit_;
+}
+
+bool DomainScheduler::eligible(const Domain& domain) const {
+    return domain.in_flight < limitFor(domain) && !domain.paused;
+}
+
+void DomainScheduler::enter(Domain& domain, int level) {
+    domain.ring_pos[level] = rings_[level].insert(rings_[level].end(), &domain);
+    domain.in_ring[level] = true;
+    retrack(domain, level);
+    reage(domain, level);
+}
+
+void DomainScheduler::leave(Domain& domain, int level) {
+    rings_[level].erase(domain.ring_pos[level]);
+    domain.in_ring[level] = false;
+    retrack(domain, level);
+    reage(domain, level);
+}
+
+void DomainScheduler::retrack(Domain& domain, int level) {
+    // Nothing to do for lanes without deadlines, which is most of them
+    const auto& timed = domain.lanes[level].timed;
+    if (!domain.tracked[level] && timed.empty()) {
+        return;
+    }
+    if (domain.tracked[level]) {
+        expiries_.erase(std::make_tuple(domain.earliest[level], &domain, level));
+        domain.tracked[level] = false;
+    }
+    if (domain.in_due[level]) {
+        due_[level].erase(std::make_pair(domain.earliest[level], &domain));
+        domain.in_due[level] = false;
+    }
+    if (timed.empty()) {
+        return;
+    }
+    domain.earliest[level] = timed.begin()->first;
+    expiries_.insert(std::make_tuple(domain.earliest[level], &domain, level));
+    domain.tracked[level] = true;
+    if (domain.in_ring[level]) {
+        due_[level].insert(std::make_pair(domain.earliest[level], &domain));
+        domain.in_due[level] = true;
+    }
+}
+
+void DomainScheduler::reage(Domain& domain, int level) {
+    const auto& ages = domain.lanes[level].ages;
+    if (domain.in_aged[level]) {
+        aged_[level].erase(std::make_pair(domain.oldest[level], &domain));
+        domain.in_aged[level] = false;
+    }
+    if (!domain.in_ring[level] || ages.empty()) {
+        return;
+    }
+    domain.oldest[level] = *ages.begin();
+    aged_[level].insert(std::make_pair(domain.oldest[level], &domain));
+    domain.in_aged[level] = true;
+}
+
+void DomainScheduler::taken(Domain& domain, int level) {
+    domain.queued--;
+    domain.in_flight++;
+    size_--;
+    if (level == kPriorities - 1) {
+        urgent_--;
+    }
+    if (domain.lanes[level].empty()) {
+        // Credit is not banked while a domain has nothing to send
+        domain.deficit[level] = 0;
+        leave(domain, level);
+    }
+    if (!eligible(domain)) {
+        park(domain);
+    }
+}
+
+void DomainScheduler::park(Domain& domain) {
+    for (int level = 0; level < kPriorities; ++level) {
+        if (domain.in_ring[level]) {
+            leave(domain, level);
+        }
+    }
+}
+
+void DomainScheduler::update(Domain& domain) {
+    if (!eligible(domain)) {
+        park(domain);
+        return;
+    }
+    for (int level = 0; level < kPriorities; ++level) {
+        if (!domain.in_ring[level] && !domain.lanes[level].empty()) {
+            enter(domain, level);
+        }
+    }
+    // Forget a domain once it has nothing queued or in flight and its
+    // backoff has run out
+    if (domain.queued == 0 && domain.in_flight == 0) {
+        domains_.erase(domain.name);
+    }
+}
+
+void DomainScheduler::resumeDue(Clock::time_point now) {
+    while (!paused_.empty() && paused_.begin()->first <= now) {
+        Domain* domain = paused_.begin()->second;
+        paused_.erase(paused_.begin());
+        domain->paused = false;
+        update(*domain);
+    }
+}
+
+int DomainScheduler::levelOf(const QueueItem& item) {
+    int level = static_cast<int>(item.priority);
+    return std::min(std::max(level, 0), kPriorities - 1);
+}
+
+size_t DomainScheduler::costOf(const QueueItem& item) const {
+    // Each message costs at least one quantum: below that the SMTP
+    // transaction, not the bytes, is what a destination pays for
+    return std::max(quantum_, item.subject.size() + item.payloadSize());
+}
+
+} // namespace ssmtp_mailer
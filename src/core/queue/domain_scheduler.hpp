@@ -0,0 +1,230 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Outcome of a delivery attempt, as it bears on the destination domain
+ */
+enum class DomainOutcome {
+    SENT,           // Accepted; clears the domain's backoff
+    DEFERRED,       // Temporary or connection failure; backs the domain off
+    REJECTED,       // Permanent failure of this message; the domain itself is healthy
+    NOT_ATTEMPTED   // Handed back unsent
+};
+
+/**
+ * @brief Ready queue partitioned by recipient domain
+ *
+ * Each domain keeps a queue per priority level. Priority levels are served
+ * strictly highest first; within a level the domains with mail waiting
+ * take turns by deficit round robin: each turn a domain earns a quantum
+ * of credit and a message costs its size, but at least one quantum. Small
+ * messages therefore go one per domain per turn, while a domain sending
+ * large ones waits in proportion to their size, however much of the queue
+ * it fills. A domain sits out its turns while it has as many emails taken
+ * as its concurrency cap allows, or while it is backing off after
+ * temporary failures, so a slow or throttling destination is paced without
+ * holding up the others.
+ *
+ * Emails with a send-by deadline are served earliest deadline first within
+ * their level, ahead of the emails without one and ahead of the domains'
+ * turns, though still within each domain's cap and backoff; the credit
+ * they cost is charged as far as the domain has it. Once a deadline passes
+ * the email is only good for dropping, which dropExpired() does in order
+ * of deadline without looking at any other email.
+ *
+ * With aging on, each level below HIGH is served as one level higher for
+ * every aging step the oldest email it could send has waited, whichever
+ * domain that is in, up to HIGH; on a tie the level with the older email
+ * goes first. A flood of HIGH mail then delays LOW and NORMAL mail by a
+ * bounded time instead of indefinitely, while URGENT mail still goes ahead
+ * of everything.
+ *
+ * Not thread-safe; EmailQueue guards it with its queue mutex.
+ */
+class DomainScheduler {
+public:
+    using Clock = std::chrono::system_clock;
+
+    static constexpr size_t kDefaultQuantum = 64 * 1024;
+
+    /**
+     * @brief Constructor
+     * @param quantum Credit, in bytes, a domain earns per turn at a priority level
+     */
+    explicit DomainScheduler(size_t quantum = kDefaultQuantum);
+
+    /**
+     * @brief Queue a ready email under item.domain (set from the first recipient if empty)
+     * @param now When it became ready, which its aging counts from
+     */
+    void push(QueueItem item, Clock::time_point now = Clock::now());
+
+    /**
+     * @brief Take the next email to send and count it against its domain's cap
+     * @param lowest Leave emails below this priority where they are
+     * @return false if nothing can be sent now
+     */
+    bool pop(Clock::time_point now, QueueItem& item, EmailPriority lowest = EmailPriority::LOW);
+
+    /**
+     * @brief Take out every queued email whose deadline is at or before now
+     * @return Number of emails appended to expired
+     */
+    size_t dropExpired(Clock::time_point now, std::vector<QueueItem>& expired);
+
+    /**
+     * @brief Earliest deadline of any queued email
+     * @return false if no queued email has a deadline
+     */
+    bool nextExpiry(Clock::time_point& deadline) const;
+
+    /**
+     * @brief Give back the concurrency slot of an email taken by pop()
+     */
+    void release(const std::string& domain, DomainOutcome outcome, Clock::time_point now);
+
+    /**
+     * @brief Put an email taken by pop() back at the front of its queue, unsent
+     */
+    void giveBack(QueueItem item);
+
+    /**
+     * @brief Time the earliest backoff ends
+     * @return false if no domain is backing off
+     */
+    bool nextDeadline(Clock::time_point& deadline) const;
+
+    // Concurrency cap for every domain, and per-domain overrides of it
+    void setConcurrency(size_t limit);
+    void setConcurrency(const std::string& domain, size_t limit);
+
+    // Backoff after the first temporary failure, doubling with each further one
+    void setBackoff(std::chrono::milliseconds initial, std::chrono::milliseconds max);
+
+    // Wait that lifts a level one higher; zero serves levels strictly
+    void setAging(std::chrono::milliseconds step);
+
+    size_t size() const { return size_; }
+
+    // URGENT emails queued; may be read without the caller's lock, as a hint
+    size_t urgentQueued() const { return urgent_.load(std::memory_order_relaxed); }
+    bool empty() const { return size_ == 0; }
+
+    /**
+     * @brief Visit every queued email, in no particular order
+     */
+    void forEach(const std::function<void(const QueueItem&)>& visit) const;
+
+    /**
+     * @brief Depth, in-flight count and backoff of every domain with mail queued,
+     *        in flight or backing off
+     */
+    std::vector<QueueDomainStats> getStats(Clock::time_point now) const;
+
+    /**
+     * @brief Lower-cased domain of an address, or empty if it has none
+     */
+    static std::string domainOf(const std::string& address);
+
+private:
+    static constexpr int kPriorities = 4;
+    static constexpr int kAgedCeiling = static_cast<int>(EmailPriority::HIGH);
+
+    struct Waiting {
+        QueueItem item;
+        Clock::time_point since;   // When it became ready, for aging
+    };
+
+    // One domain's emails at one priority level
+    struct Lane {
+        std::deque<Waiting> fifo;                          // Without a deadline, oldest first
+        std::multimap<Clock::time_point, Waiting> timed;   // By deadline, earliest first
+        std::multiset<Clock::time_point> ages;             // Since of every email in either
+
+        bool empty() const { return fifo.empty() && timed.empty(); }
+    };
+
+    struct Domain;
+    using Ring = std::list<Domain*>;
+
+    struct Domain {
+        std::string name;
+        std::array<Lane, kPriorities> lanes;
+        std::array<size_t, kPriorities> deficit;
+        std::array<bool, kPriorities> in_ring;
+        std::array<Ring::iterator, kPriorities> ring_pos;
+        std::array<bool, kPriorities> tracked;              // Has an entry in expiries_
+        std::array<bool, kPriorities> in_due;               // Has an entry in due_
+        std::array<Clock::time_point, kPriorities> earliest;   // Deadline those entries are under
+        std::array<bool, kPriorities> in_aged;              // Has an entry in aged_
+        std::array<Clock::time_point, kPriorities> oldest;     // Since that entry is under
+        size_t queued;
+        size_t in_flight;
+        int failures;                    // Temporary failures in a row
+        bool paused;                     // Backing off, with an entry in paused_
+        Clock::time_point paused_until;
+
+        explicit Domain(const std::string& domain_name)
+            : name(domain_name), queued(0), in_flight(0), failures(0), paused(false) {
+            deficit.fill(0);
+            in_ring.fill(false);
+            tracked.fill(false);
+            in_due.fill(false);
+            in_aged.fill(false);
+        }
+    };
+
+    // Domains whose turn it is, one ring per priority level. A domain is in
+    // ring p exactly when it has mail at level p and may send.
+    std::array<Ring, kPriorities> rings_;
+    // Of the domains in each ring, those with deadlines at that level, by
+    // their earliest; and the earliest deadline of every lane that has one
+    std::array<std::set<std::pair<Clock::time_point, Domain*>>, kPriorities> due_;
+    std::set<std::tuple<Clock::time_point, Domain*, int>> expiries_;
+    // Of the domains in each ring, each by the oldest email it has at that
+    // level, for aging
+    std::array<std::set<std::pair<Clock::time_point, Domain*>>, kPriorities> aged_;
+    std::unordered_map<std::string, std::unique_ptr<Domain>> domains_;
+    std::set<std::pair<Clock::time_point, Domain*>> paused_;
+    std::map<std::string, size_t> limits_;
+    size_t default_limit_;
+    std::chrono::milliseconds initial_backoff_;
+    std::chrono::milliseconds max_backoff_;
+    std::chrono::milliseconds aging_step_;
+    size_t quantum_;
+    size_t size_;
+    std::atomic<size_t> urgent_;
+
+    Domain& domainFor(QueueItem& item);
+    size_t limitFor(const Domain& domain) const;
+    bool eligible(const Domain& domain) const;
+    void enter(Domain& domain, int priority);
+    void leave(Domain& domain, int priority);
+    void retrack(Domain& domain, int level);
+    void reage(Domain& domain, int level);
+    void taken(Domain& domain, int level);
+    void park(Domain& domain);
+    void update(Domain& domain);
+    void resumeDue(Clock::time_point now);
+    static int levelOf(const QueueItem& item);
+    size_t costOf(const QueueItem& item) const;
+};
+
+} // namespace ssmtp_mailer
@@ -1,97 +1,420 @@
 #include "core/queue/email_queue.hpp"
 #include "core/logging/logger.hpp"
 #include "simple-smtp-mailer/mailer.hpp"
+#include <unistd.h>
 #include <algorithm>
 #include <chrono>
 #include <cmath>
+#include <cstdio>
+#include <map>
 
 namespace ssmtp_mailer {
 
+namespace {
+
+// Emails enqueue() can hand over before producers fall back to the queue lock
+constexpr size_t kIngestCapacity = 1024;
+
+// Share of the count and byte limits each priority may fill, in eighths:
+// LOW, NORMAL, HIGH, URGENT
+constexpr size_t kAdmitEighths[] = {6, 8, 9, 10};
+
+size_t shareOf(size_t limit, size_t eighths) {
+    return limit / 8 * eighths + limit % 8 * eighths / 8;
+}
+
+// Backstop for waiting producers: a claim another producer backs out of
+// frees room without notifying anyone
+constexpr auto kAdmissionRecheck = std::chrono::milliseconds(10);
+
+// For an email whose compressed payload will not decompress; a rejection,
+// so its domain is not held back for it
+SMTPResult corruptPayloadResult() {
+    return SMTPResult::createError("Queued payload is corrupt", 554);
+}
+
+} // anonymous namespace
+
 EmailQueue::EmailQueue()
-    : email_queue_(comparePriority), running_(false), max_retries_(3),
+    : ingest_(kIngestCapacity), queued_(0), queued_bytes_(0), running_(false), work_version_(0),
+      sleepers_(0), worker_count_(QueueConfig().max_workers), bulk_workers_(0), max_retries_(3),
       retry_delay_(std::chrono::seconds(300)), batch_size_(10), max_queue_size_(1000),
-      total_processed_(0), total_failed_(0), total_retries_(0) {
+      max_queue_bytes_(256 * 1024 * 1024), max_in_flight_(256),
+      urgent_reserve_(QueueConfig().urgent_reserve), admission_waiters_(0),
+      admitter_stopping_(false), total_processed_(0), total_failed_(0), total_retries_(0),
+      total_expired_(0), in_flight_(0), schedule_changed_(false), schedule_unspooled_(false) {
+    
+    ready_.setAging(QueueConfig().priority_aging);
     
     Logger& logger = Logger::getInstance();
     logger.debug("EmailQueue initialized");
 }
 
 EmailQueue::~EmailQueue() {
+    {
+        std::lock_guard<std::mutex> lock(admission_mutex_);
+        admitter_stopping_ = true;
+        admission_cv_.notify_all();
+    }
+    if (admitter_.joinable()) {
+        admitter_.join();
+    }
     stop();
 }
 
-void EmailQueue::enqueue(const Email* email, EmailPriority priority) {
-    std::lock_guard<std::mutex> lock(queue_mutex_);
-    
-    if (email_queue_.size() >= max_queue_size_) {
-        Logger& logger = Logger::getInstance();
-        logger.warning("Queue is full, rejecting email from: " + email->from);
+EnqueueResult EmailQueue::enqueue(const Email* email, EmailPriority priority) {
+    return offer(toQueueItem(*email, priority),
+                 std::chrono::steady_clock::time_point());
+}
+
+EnqueueResult EmailQueue::enqueue(Email&& email, EmailPriority priority) {
+    return offer(toQueueItem(std::move(email), priority),
+                 std::chrono::steady_clock::time_point());
+}
+
+EnqueueResult EmailQueue::enqueueFor(Email&& email, EmailPriority priority, std::chrono::milliseconds timeout) {
+    return offer(toQueueItem(std::move(email), priority),
+                 std::chrono::steady_clock::now() + timeout);
+}
+
+void EmailQueue::enqueueAsync(Email&& email, EmailPriority priority, std::chrono::milliseconds timeout,
+                              AdmissionCallback done) {
+    QueueItem queued_email = toQueueItem(std::move(email), priority);
+    if (isDuplicate(queued_email)) {
+        if (done) {
+            done(EnqueueResult::DUPLICATE);
+        }
+        return;
+    }
+    if (tryClaim(priority, queued_email.heldSize())) {
+        accept(std::move(queued_email));
+        if (done) {
+            done(EnqueueResult::ACCEPTED);
+        }
         return;
     }
     
-    QueueItem queued_email(email->from, email->to, email->subject, email->body);
-    queued_email.priority = priority;
-    queued_email.html_body = email->html_body;
-    queued_email.attachments = email->attachments;
-    email_queue_.push(queued_email);
-    
+    {
+        std::lock_guard<std::mutex> lock(admission_mutex_);
+        if (!admitter_stopping_) {
+            if (!admitter_.joinable()) {
+                admitter_ = std::thread(&EmailQueue::admitterLoop, this);
+            }
+            WaitingAdmission waiting;
+            waiting.item = std::move(queued_email);
+            waiting.deadline = std::chrono::steady_clock::now() + timeout;
+            waiting.done = std::move(done);
+            waiting_[static_cast<size_t>(priority)].push_back(std::move(waiting));
+            admission_waiters_++;
+            admission_cv_.notify_all();
+            return;
+        }
+    }
+    forgetKey(queued_email);
+    if (done) {
+        done(EnqueueResult::UNAVAILABLE);
+    }
+}
+
+std::future<EnqueueResult> EmailQueue::enqueueAsync(Email&& email, EmailPriority priority,
+                                                    std::chrono::milliseconds timeout) {
+    auto promise = std::make_shared<std::promise<EnqueueResult>>();
+    std::future<EnqueueResult> result = promise->get_future();
+    enqueueAsync(std::move(email), priority, timeout,
+                 [promise](EnqueueResult outcome) { promise->set_value(outcome); });
+    return result;
+}
+
+EnqueueResult EmailQueue::offer(QueueItem queued_email, std::chrono::steady_clock::time_point deadline) {
     Logger& logger = Logger::getInstance();
-    logger.debug("Email queued from: " + email->from + " with priority: " + 
-                std::to_string(static_cast<int>(priority)) + 
-                " (queue size: " + std::to_string(email_queue_.size()) + ")");
+    size_t bytes = queued_email.heldSize();
+    
+    if (isDuplicate(queued_email)) {
+        return EnqueueResult::DUPLICATE;
+    }
+    if (!tryClaim(queued_email.priority, bytes)) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            logger.warning("Queue is full, rejecting email from: " + queued_email.from_address);
+            forgetKey(queued_email);
+            return EnqueueResult::QUEUE_FULL;
+        }
+        
+        // Announce the wait before looking again: whoever frees room after
+        // that look sees the announcement and notifies
+        bool claimed = false;
+        {
+            std::unique_lock<std::mutex> lock(admission_mutex_);
+            admission_waiters_++;
+            while (!(claimed = tryClaim(queued_email.priority, bytes))) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) {
+                    break;
+                }
+                admission_cv_.wait_until(lock, std::min(deadline, now + kAdmissionRecheck));
+            }
+            admission_waiters_--;
+        }
+        if (!claimed) {
+            logger.warning("Timed out waiting for room in the queue for email from: " +
+                           queued_email.from_address);
+            forgetKey(queued_email);
+            return EnqueueResult::TIMED_OUT;
+        }
+    }
     
-    queue_cv_.notify_one();
+    accept(std::move(queued_email));
+    return EnqueueResult::ACCEPTED;
 }
 
-bool EmailQueue::dequeue(QueueItem& email) {
-    std::lock_guard<std::mutex> lock(queue_mutex_);
-    
-    if (email_queue_.empty()) {
+bool EmailQueue::tryClaim(EmailPriority priority, size_t bytes) {
+    // Claim room first and back out if over, so the limits hold without a lock
+    size_t eighths = kAdmitEighths[static_cast<size_t>(priority)];
+    size_t max_size = max_queue_size_.load(std::memory_order_relaxed);
+    size_t max_bytes = max_queue_bytes_.load(std::memory_order_relaxed);
+    size_t count_limit = std::max<size_t>(1, shareOf(max_size, eighths));
+    if (queued_.fetch_add(1) + 1 > count_limit) {
+        queued_--;
         return false;
     }
+    size_t held = queued_bytes_.fetch_add(bytes) + bytes;
+    if (max_bytes > 0) {
+        // An email over the limit on its own still gets in once nothing else is held
+        if (held > shareOf(max_bytes, eighths) && held != bytes) {
+            queued_bytes_ -= bytes;
+            queued_--;
+            return false;
+        }
+    }
+    return true;
+}
+
+void EmailQueue::accept(QueueItem queued_email) {
+    Logger& logger = Logger::getInstance();
+    std::shared_ptr<const Email> message = queued_email.message;
+    EmailPriority priority = queued_email.priority;
+    
+    uint64_t sequence = 0;
+    if (spool_) {
+        sequence = spool_->recordEnqueue(queued_email);
+    }
     
-    email = email_queue_.top();
-    email_queue_.pop();
+    // URGENT mail goes straight to the ready queue, where busy workers look
+    // for it between emails, rather than waiting for the ring to be drained
+    if (priority != EmailPriority::URGENT && ingest_.tryPush(std::move(queued_email))) {
+        wakeWorkers();
+    } else {
+        // The workers are behind, or it is urgent: join them at the lock, oldest emails first
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        drainIngestLocked();
+        admitLocked(std::move(queued_email));
+        signalWorkLocked();
+    }
     
+    if (logger.getLogLevel() == LogLevel::DEBUG) {
+        logger.debug("Email queued from: " + message->from + " with priority: " + 
+                    std::to_string(static_cast<int>(priority)) + 
+                    " (queue size: " + std::to_string(queued_) + ")");
+    }
+    
+    // Outside any lock, so concurrent enqueues share one fsync
+    if (spool_ && !spool_->waitDurable(sequence)) {
+        logger.warning("Email from: " + message->from + " is queued but not spooled to disk");
+    }
+}
+
+void EmailQueue::notifyRoom() {
+    // Pairs with the announcement a waiting producer makes before its last
+    // look: either it sees the room or we see it waiting
+    if (admission_waiters_.load() > 0) {
+        std::lock_guard<std::mutex> lock(admission_mutex_);
+        admission_cv_.notify_all();
+    }
+}
+
+bool EmailQueue::isDuplicate(const QueueItem& queued_email) {
+    if (queued_email.idempotency_key.empty() || dedup_.admit(queued_email.idempotency_key)) {
+        return false;
+    }
+    Logger::getInstance().info("Dropping duplicate email from: " + queued_email.from_address +
+                               " (idempotency key " + queued_email.idempotency_key + ")");
     return true;
 }
 
-size_t EmailQueue::size() const {
+void EmailQueue::forgetKey(const QueueItem& queued_email) {
+    // Not queued after all, so a resubmission should be let in
+    if (!queued_email.idempotency_key.empty()) {
+        dedup_.forget(queued_email.idempotency_key);
+    }
+}
+
+void EmailQueue::forgetBytes(const QueueItem& queued_email) {
+    queued_bytes_ -= queued_email.heldSize();
+    notifyRoom();
+}
+
+void EmailQueue::admitterLoop() {
+    std::unique_lock<std::mutex> lock(admission_mutex_);
+    while (!admitter_stopping_) {
+        // Highest priority first, each level in the order offered
+        std::vector<std::pair<WaitingAdmission, EnqueueResult>> resolved;
+        auto now = std::chrono::steady_clock::now();
+        auto next_deadline = std::chrono::steady_clock::time_point::max();
+        for (size_t level = waiting_.size(); level-- > 0;) {
+            auto& line = waiting_[level];
+            while (!line.empty() && tryClaim(line.front().item.priority, line.front().item.heldSize())) {
+                resolved.emplace_back(std::move(line.front()), EnqueueResult::ACCEPTED);
+                line.pop_front();
+            }
+            for (auto it = line.begin(); it != line.end();) {
+                if (it->deadline <= now) {
+                    resolved.emplace_back(std::move(*it), EnqueueResult::TIMED_OUT);
+                    it = line.erase(it);
+                } else {
+                    next_deadline = std::min(next_deadline, it->deadline);
+                    ++it;
+                }
+            }
+        }
+        
+        if (!resolved.empty()) {
+            admission_waiters_ -= resolved.size();
+            lock.unlock();
+            for (auto& entry : resolved) {
+                if (entry.second == EnqueueResult::ACCEPTED) {
+                    accept(std::move(entry.first.item));
+                } else {
+                    Logger::getInstance().warning("Timed out waiting for room in the queue for email from: " +
+                                                  entry.first.item.from_address);
+                    forgetKey(entry.first.item);
+                }
+                if (entry.first.done) {
+                    entry.first.done(entry.second);
+                }
+            }
+            lock.lock();
+            continue;
+        }
+        
+        if (next_deadline == std::chrono::steady_clock::time_point::max()) {
+            admission_cv_.wait(lock);
+        } else {
+            admission_cv_.wait_until(lock, std::min(next_deadline, now + kAdmissionRecheck));
+        }
+    }
+    
+    // Shutting down: nobody will make room for what still waits
+    std::vector<WaitingAdmission> abandoned;
+    for (auto& line : waiting_) {
+        for (auto& waiting : line) {
+            abandoned.push_back(std::move(waiting));
+        }
+        line.clear();
+    }
+    admission_waiters_ -= abandoned.size();
+    lock.unlock();
+    for (auto& waiting : abandoned) {
+        forgetKey(waiting.item);
+        if (waiting.done) {
+            waiting.done(EnqueueResult::UNAVAILABLE);
+        }
+    }
+}
+
+bool EmailQueue::dequeue(QueueItem& email) {
     std::lock_guard<std::mutex> lock(queue_mutex_);
-    return email_queue_.size();
+    
+    drainIngestLocked();
+    releaseDueLocked();
+    auto now = std::chrono::system_clock::now();
+    dropExpiredLocked(now);
+    bool failed = false;
+    while (ready_.pop(now, email)) {
+        queued_--;
+        
+        // A payload that no longer decompresses fails here, as it would
+        // have on sending, rather than reaching the caller blank
+        if (!email.copyMessage()) {
+            SMTPResult corrupt = corruptPayloadResult();
+            email.status = EmailStatus::FAILED;
+            email.error_message = corrupt.error_message;
+            total_failed_++;
+            recordComplete(email);
+            ready_.release(email.domain, DomainOutcome::REJECTED, now);
+            Logger::getInstance().error("Email failed permanently from: " + email.from_address + ": " +
+                                        corrupt.error_message);
+            failed = true;
+            continue;
+        }
+        
+        // The caller owns the email now: it is not recovered from the spool after
+        // a restart, and no longer counts against its domain
+        recordComplete(email);
+        ready_.release(email.domain, DomainOutcome::NOT_ATTEMPTED, now);
+        signalWorkLocked();
+        return true;
+    }
+    if (failed) {
+        signalWorkLocked();
+    }
+    return false;
+}
+
+size_t EmailQueue::size() const {
+    return queued_;
 }
 
 bool EmailQueue::empty() const {
-    std::lock_guard<std::mutex> lock(queue_mutex_);
-    return email_queue_.empty();
+    return queued_ == 0;
 }
 
 void EmailQueue::start() {
+    std::lock_guard<std::mutex> pool_lock(pool_mutex_);
     if (running_) {
         return;
     }
     
     running_ = true;
-    worker_thread_ = std::thread(&EmailQueue::workerLoop, this);
+    resizePoolLocked(worker_count_);
+    if (schedule_) {
+        promoter_ = std::thread(&EmailQueue::promoterLoop, this);
+    }
     
     Logger& logger = Logger::getInstance();
-    logger.info("EmailQueue worker thread started");
+    logger.info("EmailQueue started with " + std::to_string(worker_count_) + " worker threads");
 }
 
 void EmailQueue::stop() {
+    std::lock_guard<std::mutex> pool_lock(pool_mutex_);
     if (!running_) {
+        if (spool_) {
+            spool_->flush();
+        }
         return;
     }
     
-    running_ = false;
-    queue_cv_.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        running_ = false;
+        queue_cv_.notify_all();
+    }
+    resizePoolLocked(0);
+    if (promoter_.joinable()) {
+        notifyPromoter();
+        promoter_.join();
+    }
+    
+    // Wait for emails already handed to the asynchronous sender
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex_);
+        queue_cv_.wait(lock, [this] { return in_flight_ == 0; });
+    }
     
-    if (worker_thread_.joinable()) {
-        worker_thread_.join();
+    if (spool_) {
+        spool_->flush();
     }
     
     Logger& logger = Logger::getInstance();
-    logger.info("EmailQueue worker thread stopped");
+    logger.info("EmailQueue worker threads stopped");
 }
 
 bool EmailQueue::isRunning() const {
@@ -112,6 +435,202 @@ void EmailQueue::setBatchSize(size_t batch_size) {
 
 void EmailQueue::setMaxQueueSize(size_t max_size) {
     max_queue_size_ = max_size;
+    notifyRoom();
+}
+
+void EmailQueue::setMaxQueueBytes(size_t max_bytes) {
+    max_queue_bytes_ = max_bytes;
+    notifyRoom();
+}
+
+size_t EmailQueue::getQueuedBytes() const {
+    return queued_bytes_;
+}
+
+void EmailQueue::setPriorityAging(std::chrono::milliseconds step) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ready_.setAging(step);
+}
+
+void EmailQueue::setUrgentReserve(double share) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    urgent_reserve_ = std::min(1.0, std::max(0.0, share));
+    signalWorkLocked();
+}
+
+void EmailQueue::setMaxInFlight(size_t max_in_flight) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    max_in_flight_ = max_in_flight > 0 ? max_in_flight : 1;
+    signalWorkLocked();
+}
+
+void EmailQueue::setWorkerCount(size_t workers) {
+    std::lock_guard<std::mutex> pool_lock(pool_mutex_);
+    worker_count_ = workers > 0 ? workers : 1;
+    if (running_) {
+        resizePoolLocked(worker_count_);
+    }
+}
+
+size_t EmailQueue::getWorkerCount() const {
+    return worker_count_;
+}
+
+void EmailQueue::setDomainConcurrency(size_t limit) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ready_.setConcurrency(limit);
+    signalWorkLocked();
+}
+
+void EmailQueue::setDomainConcurrency(const std::string& domain, size_t limit) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ready_.setConcurrency(domain, limit);
+    signalWorkLocked();
+}
+
+void EmailQueue::setDomainBackoff(std::chrono::milliseconds initial, std::chrono::milliseconds max) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ready_.setBackoff(initial, max);
+}
+
+bool EmailQueue::enableSpool(const QueueSpoolOptions& options) {
+    Logger& logger = Logger::getInstance();
+    
+    if (running_ || spool_) {
+        logger.error("The queue spool must be enabled once, before the queue is started");
+        return false;
+    }
+    
+    auto spool = std::make_unique<QueueSpool>(options);
+    std::vector<QueueItem> recovered;
+    if (!spool->open(recovered)) {
+        logger.error("Cannot open queue spool: " + spool->getError());
+        return false;
+    }
+    
+    // Recovered mail was already accepted, so it is queued even past the limits
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    for (auto& queued_email : recovered) {
+        payloads_.intern(queued_email);
+        queued_bytes_ += queued_email.heldSize();
+        if (!queued_email.idempotency_key.empty()) {
+            dedup_.remember(queued_email.idempotency_key, queued_email.created_at);
+        }
+        if (queued_email.status == EmailStatus::RETRY) {
+            queued_email.shareMessage();
+            index_.update(queued_email, EmailStatus::RETRY);
+            deferLocked(std::move(queued_email));
+        } else {
+            admitLocked(std::move(queued_email));
+        }
+    }
+    queued_ += recovered.size();
+    spool_ = std::move(spool);
+    signalWorkLocked();
+    return true;
+}
+
+bool EmailQueue::isSpoolEnabled() const {
+    return spool_ != nullptr;
+}
+
+QueueSpoolStats EmailQueue::getSpoolStats() const {
+    return spool_ ? spool_->getStats() : QueueSpoolStats();
+}
+
+bool EmailQueue::enableScheduleStore(const ScheduleStoreOptions& options) {
+    Logger& logger = Logger::getInstance();
+    
+    if (running_ || schedule_) {
+        logger.error("The schedule store must be enabled once, before the queue is started");
+        return false;
+    }
+    
+    auto store = std::make_unique<ScheduleStore>(options);
+    if (!store->open()) {
+        logger.error("Cannot open schedule store: " + store->getError());
+        return false;
+    }
+    schedule_ = std::move(store);
+    return true;
+}
+
+bool EmailQueue::isScheduleStoreEnabled() const {
+    return schedule_ != nullptr;
+}
+
+std::string EmailQueue::scheduleEmail(const Email* email, std::chrono::system_clock::time_point send_at,
+                                      EmailPriority priority) {
+    Logger& logger = Logger::getInstance();
+    if (!schedule_) {
+        logger.error("Scheduled sending needs a schedule store; enable one first");
+        return "";
+    }
+    
+    QueueItem queued_email = toQueueItem(*email, priority);
+    queued_email.scheduled_for = send_at;
+    // A TTL counts from when it is due to be sent
+    queued_email.expires_at = deadlineOf(*email, send_at);
+    if (isDuplicate(queued_email)) {
+        return "";
+    }
+    std::string key = queued_email.idempotency_key;
+    std::string id = schedule_->schedule(std::move(queued_email));
+    if (id.empty()) {
+        logger.error("Cannot schedule email from: " + email->from + ": " + schedule_->getError());
+        if (!key.empty()) {
+            dedup_.forget(key);
+        }
+        return "";
+    }
+    notifyPromoter();
+    return id;
+}
+
+bool EmailQueue::cancelScheduled(const std::string& id) {
+    return schedule_ && schedule_->cancel(id);
+}
+
+std::string EmailQueue::reschedule(const std::string& id, std::chrono::system_clock::time_point send_at) {
+    if (!schedule_) {
+        return "";
+    }
+    std::string new_id = schedule_->reschedule(id, send_at);
+    if (!new_id.empty()) {
+        notifyPromoter();
+    }
+    return new_id;
+}
+
+ScheduleStoreStats EmailQueue::getScheduleStats() const {
+    return schedule_ ? schedule_->getStats() : ScheduleStoreStats();
+}
+
+void EmailQueue::setDedupOptions(const DedupIndexOptions& options) {
+    dedup_.configure(options);
+}
+
+void EmailQueue::setPayloadDedup(bool enabled) {
+    payloads_.setEnabled(enabled);
+}
+
+void EmailQueue::setPayloadCompression(const PayloadCompressionOptions& options) {
+    PayloadCompressionOptions applied = options;
+    if (!payload_codec::isAvailable(applied.codec)) {
+        Logger::getInstance().warning(std::string("Payload compression with ") +
+                                      payload_codec::nameOf(applied.codec) +
+                                      " is not available in this build; queued payloads stay uncompressed");
+        applied.codec = PayloadCodec::NONE;
+    }
+    payloads_.setCompression(applied);
+}
+
+QueuePayloadStats EmailQueue::getPayloadStats() const {
+    return payloads_.getStats();
+}
+
+QueueDedupStats EmailQueue::getDedupStats() const {
+    return dedup_.getStats();
 }
 
 size_t EmailQueue::getTotalProcessed() const {
@@ -126,98 +645,582 @@ size_t EmailQueue::getTotalRetries() const {
     return total_retries_;
 }
 
+size_t EmailQueue::getTotalExpired() const {
+    return total_expired_;
+}
+
+size_t EmailQueue::getInFlight() const {
+    return in_flight_;
+}
+
+std::vector<QueueWorkerStats> EmailQueue::getWorkerStats() const {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    auto now = std::chrono::steady_clock::now();
+    
+    std::vector<QueueWorkerStats> stats;
+    for (const auto& worker : workers_) {
+        QueueWorkerStats entry;
+        entry.index = worker->index;
+        entry.processed = worker->processed;
+        entry.stolen = worker->stolen;
+        {
+            std::lock_guard<std::mutex> worker_lock(worker->mutex);
+            entry.queued = worker->local.size();
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - worker->started).count();
+        if (elapsed > 0) {
+            entry.utilization = std::min(1.0, static_cast<double>(worker->busy_ns) / static_cast<double>(elapsed));
+        }
+        stats.push_back(entry);
+    }
+    return stats;
+}
+
+std::vector<QueueLatencyStats> EmailQueue::getLatencyStats() const {
+    std::vector<QueueLatencyStats> stats;
+    for (size_t level = 0; level < latency_.size(); ++level) {
+        const LatencyHistogram& histogram = latency_[level];
+        QueueLatencyStats level_stats;
+        level_stats.priority = static_cast<EmailPriority>(level);
+        level_stats.samples = histogram.count();
+        level_stats.p50 = histogram.percentile(0.50);
+        level_stats.p90 = histogram.percentile(0.90);
+        level_stats.p99 = histogram.percentile(0.99);
+        level_stats.max = histogram.max();
+        stats.push_back(level_stats);
+    }
+    return stats;
+}
+
+std::vector<QueueDomainStats> EmailQueue::getDomainStats() const {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    drainIngestLocked();
+    auto stats = ready_.getStats(std::chrono::system_clock::now());
+    
+    // Add the emails each domain has waiting out a retry delay
+    std::map<std::string, size_t> deferred;
+    deferred_.forEach([&deferred](const QueueItem& email) {
+        deferred[email.domain]++;
+    });
+    for (auto& entry : stats) {
+        auto it = deferred.find(entry.domain);
+        if (it != deferred.end()) {
+            entry.deferred = it->second;
+            deferred.erase(it);
+        }
+    }
+    for (const auto& entry : deferred) {
+        QueueDomainStats domain_stats;
+        domain_stats.domain = entry.first;
+        domain_stats.deferred = entry.second;
+        stats.push_back(domain_stats);
+    }
+    std::sort(stats.begin(), stats.end(), [](const QueueDomainStats& a, const QueueDomainStats& b) {
+        return a.domain < b.domain;
+    });
+    return stats;
+}
+
 void EmailQueue::setSendCallback(SendCallback callback) {
     send_callback_ = callback;
 }
 
+void EmailQueue::setAsyncSendCallback(AsyncSendCallback callback) {
+    async_send_callback_ = callback;
+}
+
+void EmailQueue::setBatchSendCallback(BatchSendCallback callback) {
+    batch_send_callback_ = callback;
+}
+
 std::vector<QueueItem> EmailQueue::getPendingEmails() const {
     std::lock_guard<std::mutex> lock(queue_mutex_);
+    drainIngestLocked();
     
     std::vector<QueueItem> pending_emails;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, 
-                       std::function<bool(const QueueItem&, const QueueItem&)>> temp_queue = email_queue_;
-    
-    while (!temp_queue.empty()) {
-        QueueItem email = temp_queue.top();
+    ready_.forEach([&pending_emails](const QueueItem& email) {
         if (email.status == EmailStatus::PENDING || email.status == EmailStatus::RETRY) {
             pending_emails.push_back(email);
+            pending_emails.back().copyMessage();
         }
-        temp_queue.pop();
-    }
+    });
+    // Highest priority first, oldest first within a priority. Not the order
+    // they go out in: that also depends on domain turns, deadlines and aging
+    std::stable_sort(pending_emails.begin(), pending_emails.end(), [](const QueueItem& a, const QueueItem& b) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        return a.created_at < b.created_at;
+    });
+    
+    // Emails waiting out a retry delay
+    deferred_.forEach([&pending_emails](const QueueItem& email) {
+        pending_emails.push_back(email);
+        pending_emails.back().copyMessage();
+    });
     
     return pending_emails;
 }
 
 std::vector<QueueItem> EmailQueue::getFailedEmails() const {
     std::lock_guard<std::mutex> lock(queue_mutex_);
+    drainIngestLocked();
     
     std::vector<QueueItem> failed_emails;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, 
-                       std::function<bool(const QueueItem&, const QueueItem&)>> temp_queue = email_queue_;
-    
-    while (!temp_queue.empty()) {
-        QueueItem email = temp_queue.top();
+    ready_.forEach([&failed_emails](const QueueItem& email) {
         if (email.status == EmailStatus::FAILED) {
             failed_emails.push_back(email);
+            failed_emails.back().copyMessage();
         }
-        temp_queue.pop();
-    }
+    });
     
     return failed_emails;
 }
 
-void EmailQueue::workerLoop() {
+QueueStatusCounts EmailQueue::getStatusCounts() const {
+    drainIngestForInspection();
+    return index_.counts();
+}
+
+QueuePage EmailQueue::getPage(EmailStatus status, const std::string& cursor, size_t limit) const {
+    drainIngestForInspection();
+    return index_.page(status, cursor, limit);
+}
+
+void EmailQueue::workerLoop(Worker& worker) {
     Logger& logger = Logger::getInstance();
-    logger.debug("EmailQueue worker loop started");
+    logger.debug("EmailQueue worker " + std::to_string(worker.index) + " started");
     
-    while (running_) {
-        std::unique_lock<std::mutex> lock(queue_mutex_);
+    while (running_ && !worker.retiring) {
+        bool async = static_cast<bool>(async_send_callback_);
+        
+        QueueItem queued_email;
+        bool stolen = false;
+        bool reserved = false;
+        if (ready_.urgentQueued() > 0 && refill(worker, queued_email, async, EmailPriority::URGENT)) {
+            // Ahead of whatever is left of this worker's batch
+            reserved = async;
+        } else if (!takeLocal(worker, queued_email)) {
+            // Done with its batch: its place among the bulk workers is free
+            leaveBulk(worker);
+            if (refill(worker, queued_email, async)) {
+                reserved = async;
+            } else if ((async || enterBulk(worker)) && steal(worker, queued_email)) {
+                stolen = true;
+            } else {
+                leaveBulk(worker);
+                // Nothing ready: wait for new work, a free in-flight or domain
+                // slot, the next retry to fall due or a domain's backoff to end
+                std::unique_lock<std::mutex> lock(queue_mutex_);
+                // Announce the wait before the last look at the ingest ring:
+                // a producer pushing after that look sees the announcement
+                sleepers_++;
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (!ingest_.empty()) {
+                    sleepers_--;
+                    continue;
+                }
+                auto woken = [this, &worker] {
+                    return !running_ || worker.retiring || work_version_ != worker.seen_version;
+                };
+                std::chrono::system_clock::time_point deadline;
+                std::chrono::system_clock::time_point resume;
+                bool timed = deferred_.nextDeadline(deadline);
+                if (ready_.nextDeadline(resume) && (!timed || resume < deadline)) {
+                    deadline = resume;
+                    timed = true;
+                }
+                // Expired emails still take room until someone drops them
+                if (ready_.nextExpiry(resume) && (!timed || resume < deadline)) {
+                    deadline = resume;
+                    timed = true;
+                }
+                if (timed) {
+                    queue_cv_.wait_until(lock, deadline, woken);
+                } else {
+                    queue_cv_.wait(lock, woken);
+                }
+                sleepers_--;
+                continue;
+            }
+        }
         
-        // Wait for emails or stop signal
-        queue_cv_.wait(lock, [this] { return !running_ || !email_queue_.empty(); });
+        if (queued_email.expiredAt(std::chrono::system_clock::now())) {
+            // Ran out of time waiting in a batch
+            if (reserved) {
+                std::lock_guard<std::mutex> lock(queue_mutex_);
+                in_flight_--;
+            }
+            expire(queued_email);
+            releaseDomain(queued_email, DomainOutcome::NOT_ATTEMPTED);
+            continue;
+        }
+        
+        if (async && !reserved) {
+            // Left in a deque by synchronous sending before the async sender was set
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            in_flight_++;
+            reserved = true;
+        }
         
         if (!running_) {
+            // Not handed off yet, keep it for the next start()
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            index_.move(queued_email.id, EmailStatus::PENDING);
+            ready_.giveBack(queued_email);
+            queued_++;
+            if (reserved) {
+                in_flight_--;
+            }
+            signalWorkLocked();
             break;
         }
         
-        // Process emails in batches
-        std::vector<QueueItem> batch;
-        for (size_t i = 0; i < batch_size_ && !email_queue_.empty(); ++i) {
-            QueueItem email = email_queue_.top();
-            email_queue_.pop();
-            
-            // Check if email is ready for processing
-            if (email.status == EmailStatus::RETRY) {
-                auto now = std::chrono::system_clock::now();
-                auto time_since_last_attempt = std::chrono::duration_cast<std::chrono::seconds>(
-                    now - email.last_attempt);
-                
-                if (time_since_last_attempt < email.retry_delay) {
-                    // Not ready for retry, put back in queue
-                    email_queue_.push(email);
-                    continue;
+        auto started = std::chrono::steady_clock::now();
+        size_t handled = 1;
+        if (async) {
+            dispatchEmail(queued_email);
+        } else if (batch_send_callback_) {
+            // Along with whatever of its batch nobody has stolen yet
+            std::vector<QueueItem> batch;
+            batch.push_back(std::move(queued_email));
+            QueueItem next;
+            auto now = std::chrono::system_clock::now();
+            while (batch.size() < batch_size_ && takeLocal(worker, next)) {
+                if (next.expiredAt(now)) {
+                    expire(next);
+                    releaseDomain(next, DomainOutcome::NOT_ATTEMPTED);
+                } else {
+                    batch.push_back(std::move(next));
                 }
             }
-            
-            batch.push_back(email);
+            handled = batch.size();
+            processBatch(batch);
+        } else {
+            processEmail(queued_email);
         }
+        worker.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        worker.processed += handled;
+        if (stolen) {
+            worker.stolen++;
+        }
+    }
+    
+    returnLocal(worker);
+    leaveBulk(worker);
+    logger.debug("EmailQueue worker " + std::to_string(worker.index) + " ended");
+}
+
+bool EmailQueue::takeLocal(Worker& worker, QueueItem& email) {
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    if (worker.local.empty()) {
+        return false;
+    }
+    email = std::move(worker.local.front());
+    worker.local.pop_front();
+    return true;
+}
+
+bool EmailQueue::refill(Worker& worker, QueueItem& email, bool async, EmailPriority lowest) {
+    std::vector<QueueItem> batch;
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        worker.seen_version = work_version_;
         
-        lock.unlock();
+        // Asynchronous sends return at once, so take one email per free
+        // in-flight slot and reserve the slot before anyone else can. The
+        // last reserved slots, or workers, only take URGENT mail.
+        bool bulk = lowest != EmailPriority::URGENT;
+        if (async) {
+            if (in_flight_ >= max_in_flight_) {
+                return false;
+            }
+            bulk = bulk && in_flight_ + reservedOf(max_in_flight_) < max_in_flight_;
+        } else if (bulk) {
+            bulk = enterBulk(worker);
+        }
+        if (!bulk) {
+            lowest = EmailPriority::URGENT;
+        }
+        size_t limit = async || !bulk ? 1 : batch_size_;
         
-        // Process batch
-        for (auto& queued_email : batch) {
-            if (!running_) {
-                break;
+        // Everything in the ready queue may be sent; new emails join it in
+        // one batch from the ingest ring, retries when due, and the
+        // scheduler holds back domains at their limit
+        drainIngestLocked();
+        releaseDueLocked();
+        auto now = std::chrono::system_clock::now();
+        dropExpiredLocked(now);
+        QueueItem next;
+        while (batch.size() < limit && ready_.pop(now, next, lowest)) {
+            index_.move(next.id, EmailStatus::PROCESSING);
+            batch.push_back(std::move(next));
+        }
+        queued_ -= batch.size();
+        
+        if (batch.empty()) {
+            return false;
+        }
+        if (async) {
+            in_flight_++;
+        }
+    }
+    notifyRoom();
+    
+    email = std::move(batch.front());
+    if (batch.size() > 1) {
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            for (size_t i = 1; i < batch.size(); ++i) {
+                worker.local.push_back(std::move(batch[i]));
             }
-            
-            processEmail(queued_email);
         }
+        // Idle workers may now steal the rest of the batch
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        signalWorkLocked();
+    }
+    return true;
+}
+
+bool EmailQueue::steal(Worker& worker, QueueItem& email) {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    size_t count = workers_.size();
+    for (size_t offset = 1; offset < count; ++offset) {
+        Worker& victim = *workers_[(worker.index + offset) % count];
+        if (&victim == &worker) {
+            continue;
+        }
+        std::lock_guard<std::mutex> victim_lock(victim.mutex);
+        if (!victim.local.empty()) {
+            // Take from the back, the email its owner would reach last
+            email = std::move(victim.local.back());
+            victim.local.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EmailQueue::enterBulk(Worker& worker) {
+    if (worker.bulk) {
+        return true;
+    }
+    size_t workers = worker_count_;
+    size_t limit = workers - reservedOf(workers);
+    if (bulk_workers_.fetch_add(1) >= limit) {
+        bulk_workers_--;
+        return false;
+    }
+    worker.bulk = true;
+    return true;
+}
+
+void EmailQueue::leaveBulk(Worker& worker) {
+    if (worker.bulk) {
+        worker.bulk = false;
+        bulk_workers_--;
+    }
+}
+
+size_t EmailQueue::reservedOf(size_t capacity) const {
+    if (urgent_reserve_ <= 0.0 || capacity < 2) {
+        return 0;
+    }
+    // At least one, but never all of it
+    size_t reserved = static_cast<size_t>(static_cast<double>(capacity) * urgent_reserve_);
+    return std::min(std::max<size_t>(reserved, 1), capacity - 1);
+}
+
+void EmailQueue::returnLocal(Worker& worker) {
+    std::deque<QueueItem> local;
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        local.swap(worker.local);
+    }
+    if (local.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    // Back to the front of their domains' queues, keeping their order
+    for (auto it = local.rbegin(); it != local.rend(); ++it) {
+        index_.move(it->id, EmailStatus::PENDING);
+        ready_.giveBack(std::move(*it));
+    }
+    queued_ += local.size();
+    signalWorkLocked();
+}
+
+void EmailQueue::resizePoolLocked(size_t workers) {
+    std::vector<std::unique_ptr<Worker>> retired;
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        while (workers_.size() < workers) {
+            auto worker = std::make_unique<Worker>(workers_.size());
+            Worker* raw = worker.get();
+            worker->thread = std::thread(&EmailQueue::workerLoop, this, std::ref(*raw));
+            workers_.push_back(std::move(worker));
+        }
+        // Retired workers leave the pool first, so nobody steals from them
+        // while they hand their deques back to the shared queue
+        while (workers_.size() > workers) {
+            workers_.back()->retiring = true;
+            retired.push_back(std::move(workers_.back()));
+            workers_.pop_back();
+        }
+    }
+    
+    if (!retired.empty()) {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            queue_cv_.notify_all();
+        }
+        for (auto& worker : retired) {
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
+        }
+    }
+}
+
+void EmailQueue::promoterLoop() {
+    Logger& logger = Logger::getInstance();
+    logger.debug("EmailQueue schedule promoter started");
+    
+    std::unique_lock<std::mutex> lock(schedule_mutex_);
+    while (running_) {
+        schedule_changed_ = false;
+        lock.unlock();
+        promoteDue();
+        lock.lock();
         
-        // Small delay to prevent busy waiting
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // Sleep until the next email or bucket is due, or an earlier one is scheduled
+        auto woken = [this] { return !running_ || schedule_changed_; };
+        std::chrono::system_clock::time_point deadline;
+        if (schedule_->nextDeadline(deadline)) {
+            schedule_cv_.wait_until(lock, deadline, woken);
+        } else {
+            schedule_cv_.wait(lock, woken);
+        }
+    }
+    
+    logger.debug("EmailQueue schedule promoter ended");
+}
+
+void EmailQueue::promoteDue() {
+    std::vector<QueueItem> due;
+    if (schedule_->takeDue(std::chrono::system_clock::now(), due) == 0) {
+        if (!schedule_unspooled_) {
+            schedule_->retireTaken();
+        }
+        return;
+    }
+    
+    std::vector<QueueItem> promoted;
+    uint64_t sequence = 0;
+    for (auto& queued_email : due) {
+        // Queued already if we crashed after spooling it but before its bucket went
+        if (spool_ && spool_->contains(queued_email.id)) {
+            continue;
+        }
+        payloads_.intern(queued_email);
+        if (spool_) {
+            sequence = spool_->recordEnqueue(queued_email);
+        }
+        queued_bytes_ += queued_email.heldSize();
+        promoted.push_back(std::move(queued_email));
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        for (auto& queued_email : promoted) {
+            admitLocked(std::move(queued_email));
+        }
+        queued_ += promoted.size();
+        signalWorkLocked();
     }
     
-    logger.debug("EmailQueue worker loop ended");
+    // Bucket files go only once the emails they held are safe in the spool
+    if (spool_ && sequence != 0) {
+        schedule_unspooled_ = !spool_->waitDurable(sequence);
+    }
+    if (schedule_unspooled_) {
+        Logger::getInstance().warning("Scheduled emails are queued but not spooled to disk; "
+                                      "keeping their schedule files");
+        return;
+    }
+    schedule_->retireTaken();
+    Logger::getInstance().debug("Promoted " + std::to_string(promoted.size()) + " scheduled emails");
+}
+
+void EmailQueue::notifyPromoter() {
+    std::lock_guard<std::mutex> lock(schedule_mutex_);
+    schedule_changed_ = true;
+    schedule_cv_.notify_all();
+}
+
+void EmailQueue::deferLocked(QueueItem queued_email) {
+    auto due = queued_email.last_attempt + queued_email.retry_delay;
+    deferred_.schedule(std::move(queued_email), due);
+}
+
+void EmailQueue::releaseDueLocked() {
+    std::vector<QueueItem> due;
+    if (deferred_.advance(std::chrono::system_clock::now(), due) > 0) {
+        for (auto& queued_email : due) {
+            index_.move(queued_email.id, EmailStatus::PENDING);
+            ready_.push(std::move(queued_email));
+        }
+    }
+}
+
+void EmailQueue::dropExpiredLocked(std::chrono::system_clock::time_point now) {
+    std::vector<QueueItem> expired;
+    if (ready_.dropExpired(now, expired) == 0) {
+        return;
+    }
+    queued_ -= expired.size();
+    for (auto& queued_email : expired) {
+        expire(queued_email);
+    }
+}
+
+void EmailQueue::drainIngestLocked() const {
+    QueueItem queued_email;
+    while (ingest_.tryPop(queued_email)) {
+        admitLocked(std::move(queued_email));
+    }
+}
+
+void EmailQueue::admitLocked(QueueItem queued_email) const {
+    // Emails recovered from disk arrive with their payload inline
+    queued_email.shareMessage();
+    index_.update(queued_email, EmailStatus::PENDING);
+    ready_.push(std::move(queued_email));
+}
+
+void EmailQueue::drainIngestForInspection() const {
+    // Only if nobody holds the lock: a worker that does is draining it anyway
+    std::unique_lock<std::mutex> lock(queue_mutex_, std::try_to_lock);
+    if (lock.owns_lock()) {
+        drainIngestLocked();
+    }
+}
+
+void EmailQueue::signalWorkLocked() {
+    work_version_++;
+    queue_cv_.notify_all();
+}
+
+void EmailQueue::wakeWorkers() {
+    // Pairs with the fence a worker passes before its last look at the
+    // ingest ring: either it sees the new email or we see it waiting. Only
+    // then is the lock needed, so busy workers cost producers nothing.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        signalWorkLocked();
+    }
 }
 
 void EmailQueue::processEmail(QueueItem& queued_email) {
@@ -228,63 +1231,226 @@ void EmailQueue::processEmail(QueueItem& queued_email) {
         queued_email.status = EmailStatus::FAILED;
         queued_email.error_message = "No send callback configured";
         total_failed_++;
+        recordComplete(queued_email);
+        releaseDomain(queued_email, DomainOutcome::NOT_ATTEMPTED);
         return;
     }
     
     queued_email.status = EmailStatus::PROCESSING;
     queued_email.last_attempt = std::chrono::system_clock::now();
+    recordLatency(queued_email);
     
     logger.debug("Processing email from: " + queued_email.from_address + 
                 " to: " + (queued_email.to_addresses.empty() ? "none" : queued_email.to_addresses[0]));
     
     try {
-        // Create Email object from QueueItem for the callback
-        Email email;
-        email.from = queued_email.from_address;
-        email.to = queued_email.to_addresses;
-        email.subject = queued_email.subject;
-        email.body = queued_email.body;
-        email.html_body = queued_email.html_body;
-        email.attachments = queued_email.attachments;
-        
-        SMTPResult result = send_callback_(&email);
-        
-        if (result.success) {
-            queued_email.status = EmailStatus::SENT;
-            total_processed_++;
-            logger.info("Email sent successfully from: " + queued_email.from_address);
-        } else {
-            if (shouldRetry(queued_email)) {
-                queued_email.status = EmailStatus::RETRY;
-                updateRetryInfo(queued_email);
-                total_retries_++;
-                
-                // Re-queue for retry
-                std::lock_guard<std::mutex> lock(queue_mutex_);
-                email_queue_.push(queued_email);
-                
-                logger.warning("Email queued for retry from: " + queued_email.from_address + 
-                              " (attempt " + std::to_string(queued_email.retry_count) + "/" + 
-                              std::to_string(queued_email.max_retries) + ")");
-            } else {
-                queued_email.status = EmailStatus::FAILED;
-                queued_email.error_message = result.error_message;
-                total_failed_++;
-                
-                logger.error("Email failed permanently from: " + queued_email.from_address + 
-                            ": " + result.error_message);
-            }
-        }
+        queued_email.shareMessage();
+        std::shared_ptr<const Email> message = queued_email.outgoingMessage();
+        SMTPResult result = message ? send_callback_(message.get()) : corruptPayloadResult();
+        handleResult(queued_email, result);
     } catch (const std::exception& e) {
         queued_email.status = EmailStatus::FAILED;
         queued_email.error_message = "Exception: " + std::string(e.what());
         total_failed_++;
+        recordComplete(queued_email);
+        releaseDomain(queued_email, DomainOutcome::REJECTED);
         
         logger.error("Exception while processing email from: " + queued_email.from_address + 
                     ": " + e.what());
     }
 }
 
+void EmailQueue::processBatch(std::vector<QueueItem>& batch) {
+    Logger& logger = Logger::getInstance();
+    
+    std::vector<std::shared_ptr<const Email>> outgoing;
+    std::vector<const Email*> messages;
+    outgoing.reserve(batch.size());
+    messages.reserve(batch.size());
+    auto now = std::chrono::system_clock::now();
+    for (auto it = batch.begin(); it != batch.end();) {
+        QueueItem& queued_email = *it;
+        queued_email.status = EmailStatus::PROCESSING;
+        queued_email.last_attempt = now;
+        recordLatency(queued_email);
+        queued_email.shareMessage();
+        std::shared_ptr<const Email> message = queued_email.outgoingMessage();
+        if (!message) {
+            handleResult(queued_email, corruptPayloadResult());
+            it = batch.erase(it);
+            continue;
+        }
+        outgoing.push_back(std::move(message));
+        messages.push_back(outgoing.back().get());
+        ++it;
+    }
+    if (batch.empty()) {
+        return;
+    }
+    
+    logger.debug("Processing a batch of " + std::to_string(batch.size()) + " emails");
+    
+    std::vector<SMTPResult> results;
+    try {
+        results = batch_send_callback_(messages);
+    } catch (const std::exception& e) {
+        // As for an asynchronous sender that throws: the batch may not have gone out
+        results.assign(batch.size(), SMTPResult::createError("Exception: " + std::string(e.what())));
+    }
+    if (results.size() != batch.size()) {
+        logger.warning("Batch sender returned " + std::to_string(results.size()) + " results for " +
+                       std::to_string(batch.size()) + " emails");
+    }
+    
+    for (size_t i = 0; i < batch.size(); ++i) {
+        handleResult(batch[i], i < results.size() ? results[i]
+                                                  : SMTPResult::createError("No result from the batch sender"));
+    }
+}
+
+void EmailQueue::dispatchEmail(QueueItem queued_email) {
+    Logger& logger = Logger::getInstance();
+    
+    // The in-flight slot was reserved when the email was taken from the queue
+    queued_email.status = EmailStatus::PROCESSING;
+    queued_email.last_attempt = std::chrono::system_clock::now();
+    recordLatency(queued_email);
+    
+    logger.debug("Dispatching email from: " + queued_email.from_address + 
+                " to: " + (queued_email.to_addresses.empty() ? "none" : queued_email.to_addresses[0]));
+    
+    // The sender shares the message rather than copying it
+    queued_email.shareMessage();
+    std::shared_ptr<const Email> message = queued_email.outgoingMessage();
+    auto done = [this, queued_email](const SMTPResult& result) mutable {
+        handleResult(queued_email, result);
+        
+        std::lock_guard<std::mutex> lock(queue_mutex_);
+        in_flight_--;
+        signalWorkLocked();
+    };
+    
+    if (!message) {
+        done(corruptPayloadResult());
+        return;
+    }
+    try {
+        async_send_callback_(std::move(message), done);
+    } catch (const std::exception& e) {
+        done(SMTPResult::createError("Exception: " + std::string(e.what())));
+    }
+}
+
+void EmailQueue::handleResult(QueueItem& queued_email, const SMTPResult& result) {
+    Logger& logger = Logger::getInstance();
+    
+    DomainOutcome outcome = outcomeOf(result);
+    if (result.success) {
+        queued_email.status = EmailStatus::SENT;
+        total_processed_++;
+        recordComplete(queued_email);
+        releaseDomain(queued_email, outcome);
+        logger.info("Email sent successfully from: " + queued_email.from_address);
+    } else {
+        if (!result.permanent && shouldRetry(queued_email)) {
+            if (!result.delivered_recipients.empty()) {
+                queued_email.dropRecipients(result.delivered_recipients);
+            }
+            updateRetryInfo(queued_email);
+            if (queued_email.expiredAt(queued_email.last_attempt + queued_email.retry_delay)) {
+                // The retry would only send it too late to be of use
+                expire(queued_email);
+                releaseDomain(queued_email, outcome);
+                return;
+            }
+            queued_email.status = EmailStatus::RETRY;
+            total_retries_++;
+            
+            // Re-queue for retry
+            std::lock_guard<std::mutex> lock(queue_mutex_);
+            if (spool_) {
+                spool_->recordAttempt(queued_email);
+            }
+            ready_.release(queued_email.domain, outcome, std::chrono::system_clock::now());
+            index_.update(queued_email, EmailStatus::RETRY);
+            deferLocked(queued_email);
+            queued_++;
+            // Sleeping workers recompute when to wake
+            signalWorkLocked();
+            
+            logger.warning("Email queued for retry from: " + queued_email.from_address + 
+                          " (attempt " + std::to_string(queued_email.retry_count) + "/" + 
+                          std::to_string(queued_email.max_retries) + ")");
+        } else {
+            queued_email.status = EmailStatus::FAILED;
+            queued_email.error_message = result.error_message;
+            total_failed_++;
+            recordComplete(queued_email);
+            releaseDomain(queued_email, outcome);
+            
+            logger.error("Email failed permanently from: " + queued_email.from_address + 
+                        ": " + result.error_message);
+        }
+    }
+}
+
+void EmailQueue::releaseDomain(const QueueItem& queued_email, DomainOutcome outcome) {
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    ready_.release(queued_email.domain, outcome, std::chrono::system_clock::now());
+    signalWorkLocked();
+}
+
+DomainOutcome EmailQueue::outcomeOf(const SMTPResult& result) {
+    if (result.success) {
+        return DomainOutcome::SENT;
+    }
+    // A 5xx reply rejects this message but shows the domain is answering;
+    // 4xx replies (421 throttling among them) and connection failures mean
+    // the domain should be given a rest
+    if (result.error_code >= 500 && result.error_code < 600) {
+        return DomainOutcome::REJECTED;
+    }
+    return DomainOutcome::DEFERRED;
+}
+
+QueueItem EmailQueue::toQueueItem(Email email, EmailPriority priority) {
+    // An email with the payload of one already queued, or with one held
+    // compressed, keeps only its envelope
+    PayloadStore::Interned interned = payloads_.intern(email);
+    auto message = std::make_shared<const Email>(std::move(email));
+    if (!interned.payload && !interned.packed) {
+        payloads_.remember(interned.digest, message);
+    }
+    
+    // Only the envelope is copied; the payload stays in the shared message
+    QueueItem queued_email(message->from, message->to, message->subject, "");
+    queued_email.id = generateId();
+    queued_email.priority = priority;
+    queued_email.idempotency_key = message->idempotency_key;
+    queued_email.expires_at = deadlineOf(*message, queued_email.created_at);
+    if (!message->to.empty()) {
+        queued_email.domain = DomainScheduler::domainOf(message->to.front());
+    }
+    queued_email.message = std::move(message);
+    queued_email.payload = std::move(interned.payload);
+    queued_email.packed = std::move(interned.packed);
+    queued_email.packed_shared = interned.shared;
+    queued_email.payload_digest = interned.digest;
+    return queued_email;
+}
+
+std::chrono::system_clock::time_point EmailQueue::deadlineOf(const Email& email,
+                                                             std::chrono::system_clock::time_point send_at) {
+    auto deadline = email.send_by;
+    if (email.ttl > std::chrono::seconds(0)) {
+        auto lived = send_at + email.ttl;
+        if (deadline == std::chrono::system_clock::time_point() || lived < deadline) {
+            deadline = lived;
+        }
+    }
+    return deadline;
+}
+
 bool EmailQueue::shouldRetry(const QueueItem& queued_email) const {
     return queued_email.retry_count < queued_email.max_retries;
 }
@@ -303,14 +1469,47 @@ void EmailQueue::updateRetryInfo(QueueItem& queued_email) {
     }
 }
 
-bool EmailQueue::comparePriority(const QueueItem& a, const QueueItem& b) {
-    // Higher priority values come first
-    if (a.priority != b.priority) {
-        return a.priority < b.priority;
+void EmailQueue::expire(QueueItem& queued_email) {
+    queued_email.status = EmailStatus::FAILED;
+    queued_email.error_message = "Expired before it could be sent";
+    total_expired_++;
+    recordComplete(queued_email);
+    Logger::getInstance().warning("Email expired unsent from: " + queued_email.from_address);
+}
+
+void EmailQueue::recordComplete(const QueueItem& queued_email) {
+    // Not waited for: if the record is lost in a crash the email is sent again
+    if (spool_) {
+        spool_->recordComplete(queued_email);
     }
-    
-    // For same priority, older emails come first (FIFO)
-    return a.created_at > b.created_at;
+    forgetBytes(queued_email);
+    if (queued_email.status == EmailStatus::FAILED) {
+        index_.update(queued_email, EmailStatus::FAILED);
+    } else {
+        index_.remove(queued_email.id);
+    }
+}
+
+void EmailQueue::recordLatency(const QueueItem& queued_email) {
+    // Only first attempts: a retry's wait is its retry delay, not the queue's
+    if (queued_email.retry_count > 0) {
+        return;
+    }
+    auto since = std::max(queued_email.created_at, queued_email.scheduled_for);
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(queued_email.last_attempt - since);
+    size_t level = std::min<size_t>(static_cast<size_t>(queued_email.priority), latency_.size() - 1);
+    latency_[level].record(waited);
+}
+
+std::string EmailQueue::generateId() {
+    // Unique across restarts and across processes sharing a spool directory
+    static std::atomic<unsigned long long> counter(0);
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    char id[64];
+    std::snprintf(id, sizeof(id), "%llx.%x.%llx", static_cast<unsigned long long>(now),
+                  static_cast<unsigned>(getpid()), counter++);
+    return id;
 }
 
 } // namespace ssmtp_mailer
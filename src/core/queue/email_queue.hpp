@@ -1,12 +1,26 @@
 #pragma once
 
+#include <array>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 #include <atomic>
 #include <chrono>
 #include <functional>
+#include <future>
+#include <memory>
+#include "core/queue/dedup_index.hpp"
+#include "core/queue/domain_scheduler.hpp"
+#include "core/queue/ingest_ring.hpp"
+#include "core/queue/latency_histogram.hpp"
+#include "core/queue/payload_store.hpp"
+#include "core/queue/queue_index.hpp"
+#include "core/queue/queue_spool.hpp"
+#include "core/queue/retry_wheel.hpp"
+#include "core/queue/schedule_store.hpp"
 #include "simple-smtp-mailer/queue_types.hpp"
 #include "simple-smtp-mailer/mailer.hpp"
 
@@ -20,7 +34,24 @@ public:
     ~EmailQueue();
 
     // Queue management
-    void enqueue(const Email* email, EmailPriority priority = EmailPriority::NORMAL);
+    // The queue keeps one shared copy of each message, which the send
+    // callback is handed directly; the rvalue overloads move it in.
+    //
+    // Admission is limited by email count and by payload bytes held. LOW
+    // emails are shed once the queue is 3/4 full; NORMAL ones fill it to
+    // the limits; HIGH and URGENT may go 1/8 and 1/4 past them, so urgent
+    // mail still gets in after normal producers have filled the queue.
+    // enqueue() answers at once; enqueueFor() waits up to timeout for room;
+    // enqueueAsync() waits without blocking the caller, admitting waiting
+    // emails highest priority first as room frees.
+    EnqueueResult enqueue(const Email* email, EmailPriority priority = EmailPriority::NORMAL);
+    EnqueueResult enqueue(Email&& email, EmailPriority priority = EmailPriority::NORMAL);
+    EnqueueResult enqueueFor(Email&& email, EmailPriority priority, std::chrono::milliseconds timeout);
+    using AdmissionCallback = std::function<void(EnqueueResult)>;
+    void enqueueAsync(Email&& email, EmailPriority priority, std::chrono::milliseconds timeout,
+                      AdmissionCallback done);
+    std::future<EnqueueResult> enqueueAsync(Email&& email, EmailPriority priority,
+                                            std::chrono::milliseconds timeout);
     bool dequeue(QueueItem& email);
     size_t size() const;
     bool empty() const;
@@ -35,55 +66,253 @@ public:
     void setRetryDelay(std::chrono::seconds delay);
     void setBatchSize(size_t batch_size);
     void setMaxQueueSize(size_t max_size);
+    void setMaxQueueBytes(size_t max_bytes);   // 0 for no byte limit
+    size_t getQueuedBytes() const;
+    void setMaxInFlight(size_t max_in_flight);
+    
+    // Worker pool size; may be changed while the queue is running
+    void setWorkerCount(size_t workers);
+    size_t getWorkerCount() const;
+    
+    // Per-recipient-domain pacing: how many emails to one domain may be
+    // sending at once, and how long a domain is left alone after a
+    // temporary failure (doubling with each one in a row)
+    void setDomainConcurrency(size_t limit);
+    void setDomainConcurrency(const std::string& domain, size_t limit);
+    void setDomainBackoff(std::chrono::milliseconds initial, std::chrono::milliseconds max);
+    
+    // Priority service: an email below HIGH that has waited an aging step
+    // is served one level higher per step, up to HIGH, so a flood of
+    // higher-priority mail delays it only so long. A share of the workers,
+    // or of the in-flight slots when sending asynchronously, is kept free
+    // for URGENT mail, which a worker also takes ahead of the rest of its
+    // batch. Call before start().
+    void setPriorityAging(std::chrono::milliseconds step);   // 0 for strict priority
+    void setUrgentReserve(double share);                     // 0 for no reserve
+    
+    // Deadlines: an email with a send-by deadline or TTL goes ahead of
+    // others of its priority with a later deadline or none. Once its
+    // deadline passes it is dropped unsent and counted as expired, not
+    // failed; a failed attempt whose retry would fall due after the
+    // deadline is not retried.
+    size_t getTotalExpired() const;
+    
+    // Durability: log queue changes to a spool and re-queue what it recovers.
+    // Call before start(); enqueue() then returns once the email is on disk.
+    bool enableSpool(const QueueSpoolOptions& options);
+    bool isSpoolEnabled() const;
+    QueueSpoolStats getSpoolStats() const;
+    
+    // Scheduled sending: emails wait in an on-disk store, only the ones due
+    // soon in memory, and join the queue when due. Call before start().
+    // Ids returned name the email in the store; rescheduling may change it.
+    bool enableScheduleStore(const ScheduleStoreOptions& options);
+    bool isScheduleStoreEnabled() const;
+    std::string scheduleEmail(const Email* email, std::chrono::system_clock::time_point send_at,
+                              EmailPriority priority = EmailPriority::NORMAL);
+    bool cancelScheduled(const std::string& id);
+    std::string reschedule(const std::string& id, std::chrono::system_clock::time_point send_at);
+    ScheduleStoreStats getScheduleStats() const;
+    
+    // Idempotency: an email whose idempotency key was accepted within the
+    // dedup window is turned away as DUPLICATE before it takes any room.
+    // Emails without a key are not checked. New settings forget every key.
+    void setDedupOptions(const DedupIndexOptions& options);
+    QueueDedupStats getDedupStats() const;
+    
+    // Payload dedup: emails with the same body, HTML body and attachments,
+    // as a fan-out queues, keep one copy of them between them, in memory
+    // and in the spool, and are charged for it once against the byte
+    // limit. Each send still gets a whole message. On by default.
+    void setPayloadDedup(bool enabled);
+    
+    // Payloads of at least the threshold are held compressed while they
+    // wait, in memory and in the spool, and decompressed for each send.
+    // Off by default; a codec this build lacks leaves it off.
+    void setPayloadCompression(const PayloadCompressionOptions& options);
+    QueuePayloadStats getPayloadStats() const;
     
     // Statistics
     size_t getTotalProcessed() const;
     size_t getTotalFailed() const;
     size_t getTotalRetries() const;
+    size_t getInFlight() const;
+    std::vector<QueueWorkerStats> getWorkerStats() const;
+    std::vector<QueueDomainStats> getDomainStats() const;
+    std::vector<QueueLatencyStats> getLatencyStats() const;   // LOW first
     
     // Callbacks
     using SendCallback = std::function<SMTPResult(const Email*)>;
     void setSendCallback(SendCallback callback);
     
-    // Queue inspection
+    // Asynchronous delivery: the worker hands each email off and moves on;
+    // the sender reports the outcome through the completion callback, from
+    // any thread. Takes precedence over the synchronous send callback.
+    using CompletionCallback = std::function<void(const SMTPResult&)>;
+    // The sender may keep the message until it calls the completion callback
+    using AsyncSendCallback = std::function<void(std::shared_ptr<const Email>, CompletionCallback)>;
+    void setAsyncSendCallback(AsyncSendCallback callback);
+    
+    // Batch delivery: a worker hands over its whole batch at once, so it
+    // can go out over one session or in one provider call. Results are
+    // matched to emails by position; an email with no result is retried.
+    // Takes precedence over the synchronous send callback, but not over
+    // the asynchronous one.
+    using BatchSendCallback = std::function<std::vector<SMTPResult>(const std::vector<const Email*>&)>;
+    void setBatchSendCallback(BatchSendCallback callback);
+    
+    // Queue inspection. The full copies hold the queue lock throughout;
+    // the counts and pages come from the status index and do not.
     std::vector<QueueItem> getPendingEmails() const;
     std::vector<QueueItem> getFailedEmails() const;
+    QueueStatusCounts getStatusCounts() const;
+    QueuePage getPage(EmailStatus status, const std::string& cursor = "", size_t limit = 100) const;
 
 private:
-    // Queue storage
+    // Queue storage. enqueue() only pushes onto the lock-free ingest ring;
+    // whoever next holds queue_mutex_ moves what is there into ready_,
+    // including the const inspectors, hence mutable.
     mutable std::mutex queue_mutex_;
-    std::priority_queue<QueueItem, std::vector<QueueItem>, 
-                       std::function<bool(const QueueItem&, const QueueItem&)>> email_queue_;
+    mutable IngestRing<QueueItem> ingest_;
+    mutable DomainScheduler ready_;   // Emails ready to send, taking turns by recipient domain
+    RetryTimerWheel deferred_;        // RETRY emails until their delay runs out
+    std::atomic<size_t> queued_;      // Emails in ingest_, ready_ and deferred_
+    std::atomic<size_t> queued_bytes_;   // Payload of every email accepted and not yet done with
+    mutable QueueIndex index_;        // Status of each email past the ingest ring, for inspection
+    DedupIndex dedup_;                // Idempotency keys accepted within the dedup window
+    PayloadStore payloads_;           // Payloads of queued emails, by content
     
     // Processing state
     std::atomic<bool> running_;
-    std::thread worker_thread_;
     std::condition_variable queue_cv_;
+    uint64_t work_version_;   // Bumped under queue_mutex_ whenever new work may be available
+    std::atomic<size_t> sleepers_;   // Workers waiting on queue_cv_, for enqueue() to wake
+    
+    // Worker pool: a worker moves a batch from the shared ready queue
+    // into its own deque and works through it from the front, while idle
+    // workers steal from the back, so one slow send only holds up what
+    // nobody else is free to take
+    struct Worker {
+        size_t index;
+        std::thread thread;
+        std::mutex mutex;                 // Guards local
+        std::deque<QueueItem> local;
+        std::atomic<bool> retiring;
+        std::atomic<size_t> processed;
+        std::atomic<size_t> stolen;
+        std::atomic<long long> busy_ns;
+        std::chrono::steady_clock::time_point started;
+        uint64_t seen_version;            // work_version_ when it last found nothing to do
+        bool bulk;                        // Counted in bulk_workers_; worker thread only
+        
+        explicit Worker(size_t worker_index)
+            : index(worker_index), retiring(false), processed(0), stolen(0), busy_ns(0),
+              started(std::chrono::steady_clock::now()), seen_version(0), bulk(false) {}
+    };
+    std::mutex pool_mutex_;               // Serializes start(), stop() and resizing
+    mutable std::mutex workers_mutex_;    // Guards workers_; taken before any Worker::mutex
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> worker_count_;
+    std::atomic<size_t> bulk_workers_;    // Synchronous workers holding mail below URGENT
     
     // Configuration
     int max_retries_;
     std::chrono::seconds retry_delay_;
     size_t batch_size_;
-    size_t max_queue_size_;
+    std::atomic<size_t> max_queue_size_;    // Read by producers without a lock
+    std::atomic<size_t> max_queue_bytes_;
+    size_t max_in_flight_;
+    double urgent_reserve_;
+    
+    // Admission: producers waiting for room in enqueueFor(), and emails
+    // offered through enqueueAsync() that the admitter thread places as
+    // room frees. Whoever frees room notifies only if someone waits.
+    struct WaitingAdmission {
+        QueueItem item;
+        std::chrono::steady_clock::time_point deadline;
+        AdmissionCallback done;
+    };
+    std::mutex admission_mutex_;
+    std::condition_variable admission_cv_;
+    std::atomic<size_t> admission_waiters_;
+    std::array<std::deque<WaitingAdmission>, 4> waiting_;   // By priority, LOW first
+    std::thread admitter_;
+    bool admitter_stopping_;
     
     // Statistics
     std::atomic<size_t> total_processed_;
     std::atomic<size_t> total_failed_;
     std::atomic<size_t> total_retries_;
+    std::atomic<size_t> total_expired_;
+    std::atomic<size_t> in_flight_;
+    std::array<LatencyHistogram, 4> latency_;   // Enqueue to first attempt, by priority
     
     // Callbacks
     SendCallback send_callback_;
+    AsyncSendCallback async_send_callback_;
+    BatchSendCallback batch_send_callback_;
+    
+    // Write-ahead log, when enabled
+    std::unique_ptr<QueueSpool> spool_;
+    
+    // Scheduled sending, when enabled: the promoter thread moves emails
+    // from the store into the queue as they fall due
+    std::unique_ptr<ScheduleStore> schedule_;
+    std::thread promoter_;
+    std::mutex schedule_mutex_;
+    std::condition_variable schedule_cv_;
+    bool schedule_changed_;   // Set under schedule_mutex_ when the next deadline may be earlier
+    bool schedule_unspooled_; // Promoter only: promoted emails failed to reach the spool
     
     // Worker thread function
-    void workerLoop();
+    void workerLoop(Worker& worker);
+    bool takeLocal(Worker& worker, QueueItem& email);
+    bool refill(Worker& worker, QueueItem& email, bool async,
+                EmailPriority lowest = EmailPriority::LOW);
+    bool steal(Worker& worker, QueueItem& email);
+    void returnLocal(Worker& worker);
+    bool enterBulk(Worker& worker);
+    void leaveBulk(Worker& worker);
+    size_t reservedOf(size_t capacity) const;
+    void resizePoolLocked(size_t workers);
+    void promoterLoop();
+    void promoteDue();
+    void notifyPromoter();
+    void deferLocked(QueueItem queued_email);
+    void releaseDueLocked();
+    void dropExpiredLocked(std::chrono::system_clock::time_point now);
+    void drainIngestLocked() const;
+    void admitLocked(QueueItem queued_email) const;
+    void drainIngestForInspection() const;
+    void signalWorkLocked();
+    void wakeWorkers();
+    
+    // Admission
+    EnqueueResult offer(QueueItem queued_email, std::chrono::steady_clock::time_point deadline);
+    bool tryClaim(EmailPriority priority, size_t bytes);
+    void accept(QueueItem queued_email);
+    void notifyRoom();
+    void admitterLoop();
+    void forgetBytes(const QueueItem& queued_email);
+    bool isDuplicate(const QueueItem& queued_email);
+    void forgetKey(const QueueItem& queued_email);
     
     // Helper methods
     void processEmail(QueueItem& queued_email);
+    void processBatch(std::vector<QueueItem>& batch);
+    void dispatchEmail(QueueItem queued_email);
+    void handleResult(QueueItem& queued_email, const SMTPResult& result);
+    void releaseDomain(const QueueItem& queued_email, DomainOutcome outcome);
+    static DomainOutcome outcomeOf(const SMTPResult& result);
+    QueueItem toQueueItem(Email email, EmailPriority priority);
+    static std::chrono::system_clock::time_point deadlineOf(const Email& email,
+                                                            std::chrono::system_clock::time_point send_at);
     bool shouldRetry(const QueueItem& queued_email) const;
     void updateRetryInfo(QueueItem& queued_email);
-    
-    // Priority comparison function
-    static bool comparePriority(const QueueItem& a, const QueueItem& b);
+    void expire(QueueItem& queued_email);
+    void recordComplete(const QueueItem& queued_email);
+    void recordLatency(const QueueItem& queued_email);
+    static std::string generateId();
 };
 
 } // namespace ssmtp_mailer
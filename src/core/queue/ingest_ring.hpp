@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Bounded lock-free multi-producer, multi-consumer FIFO
+ *
+ * Dmitry Vyukov's array queue: each cell carries a sequence number telling
+ * whether it is free for the producer at a given position or holds a value
+ * for the consumer at it. Producers and consumers each claim a position
+ * with one compare-and-swap on their own counter and otherwise touch only
+ * the cell, so pushes from many threads do not serialize on a lock. Both
+ * operations fail rather than wait when the ring is full or empty.
+ */
+template <typename T>
+class IngestRing {
+public:
+    /**
+     * @brief Constructor
+     * @param capacity Number of cells, rounded up to a power of two
+     */
+    explicit IngestRing(size_t capacity) {
+        size_t cells = 2;
+        while (cells < capacity) {
+            cells <<= 1;
+        }
+        mask_ = cells - 1;
+        cells_.reset(new Cell[cells]);
+        for (size_t i = 0; i < cells; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        enqueue_pos_.store(0, std::memory_order_relaxed);
+        dequeue_pos_.store(0, std::memory_order_relaxed);
+    }
+
+    IngestRing(const IngestRing&) = delete;
+    IngestRing& operator=(const IngestRing&) = delete;
+
+    /**
+     * @brief Append a value
+     * @return false, leaving value untouched, if the ring is full
+     */
+    bool tryPush(T&& value) {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Take the oldest value
+     * @return false if the ring is empty, or its oldest value is still being written
+     */
+    bool tryPop(T& value) {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief Whether no value has been claimed for pushing and not yet popped
+     *
+     * Reads both counters with sequential consistency, so a thread that
+     * announced itself before calling this and a producer that checks for
+     * such announcements after pushing cannot both miss each other.
+     */
+    bool empty() const {
+        return enqueue_pos_.load() == dequeue_pos_.load();
+    }
+
+    size_t capacity() const { return mask_ + 1; }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    // On separate cache lines: producers and consumers each hammer their own
+    alignas(64) std::atomic<size_t> enqueue_pos_;
+    alignas(64) std::atomic<size_t> dequeue_pos_;
+};
+
+} // namespace ssmtp_mailer
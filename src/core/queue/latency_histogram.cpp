@@ -0,0 +1,70 @@
+#include "core/queue/latency_histogram.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace ssmtp_mailer {
+
+LatencyHistogram::LatencyHistogram() : count_(0), max_(0) {
+    for (auto& bucket : buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::record(std::chrono::microseconds latency) {
+    uint64_t micros = latency.count() > 0 ? static_cast<uint64_t>(latency.count()) : 0;
+    buckets_[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    uint64_t seen = max_.load(std::memory_order_relaxed);
+    while (micros > seen && !max_.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+    }
+}
+
+size_t LatencyHistogram::count() const {
+    return static_cast<size_t>(count_.load(std::memory_order_relaxed));
+}
+
+std::chrono::microseconds LatencyHistogram::percentile(double fraction) const {
+    uint64_t total = count_.load(std::memory_order_relaxed);
+    if (total == 0) {
+        return std::chrono::microseconds(0);
+    }
+    fraction = std::min(1.0, std::max(0.0, fraction));
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+    uint64_t seen = 0;
+    uint64_t largest = max_.load(std::memory_order_relaxed);
+    for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+        seen += buckets_[bucket].load(std::memory_order_relaxed);
+        if (seen >= target) {
+            return std::chrono::microseconds(std::min(upperBoundOf(bucket), largest));
+        }
+    }
+    // Counts raced ahead of the buckets being read
+    return std::chrono::microseconds(largest);
+}
+
+std::chrono::microseconds LatencyHistogram::max() const {
+    return std::chrono::microseconds(max_.load(std::memory_order_relaxed));
+}
+
+size_t LatencyHistogram::bucketOf(uint64_t micros) {
+    constexpr uint64_t kLinear = uint64_t(1) << kSubBits;
+    if (micros < kLinear) {
+        return static_cast<size_t>(micros);
+    }
+    micros = std::min(micros, (uint64_t(1) << (kMaxExponent + 1)) - 1);
+    int exponent = 63 - __builtin_clzll(micros);
+    uint64_t sub = (micros >> (exponent - kSubBits)) & (kLinear - 1);
+    return static_cast<size_t>((exponent - kSubBits + 1) << kSubBits) + static_cast<size_t>(sub);
+}
+
+uint64_t LatencyHistogram::upperBoundOf(size_t bucket) {
+    constexpr uint64_t kLinear = uint64_t(1) << kSubBits;
+    if (bucket < kLinear) {
+        return bucket;
+    }
+    int exponent = static_cast<int>(bucket >> kSubBits) + kSubBits - 1;
+    uint64_t sub = bucket & (kLinear - 1);
+    return ((kLinear + sub + 1) << (exponent - kSubBits)) - 1;
+}
+
+} // namespace ssmtp_mailer
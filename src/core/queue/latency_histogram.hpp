@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Lock-free histogram of latencies, for percentiles
+ *
+ * Latencies are counted in microseconds into log-linear buckets: eight per
+ * power of two, so a percentile is reported as the upper bound of its
+ * bucket, at most 1/8 above the true value and never above the largest
+ * latency recorded. Recording is a few relaxed atomic adds, so any number
+ * of threads may record while others read.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(std::chrono::microseconds latency);
+
+    size_t count() const;
+
+    /**
+     * @brief Latency below which the given fraction of samples fall
+     * @param fraction Between 0 and 1, e.g. 0.99
+     * @return Zero if nothing has been recorded
+     */
+    std::chrono::microseconds percentile(double fraction) const;
+
+    std::chrono::microseconds max() const;
+
+private:
+    static constexpr int kSubBits = 3;                  // 8 buckets per power of two
+    static constexpr int kMaxExponent = 40;             // Longer latencies count as about 25 days
+    static constexpr size_t kBuckets = (kMaxExponent - kSubBits + 2) << kSubBits;
+
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> max_;
+
+    static size_t bucketOf(uint64_t micros);
+    static uint64_t upperBoundOf(size_t bucket);
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,152 @@
+#include "core/queue/payload_codec.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+
+#ifdef SSMTP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace ssmtp_mailer {
+
+namespace payload_codec {
+
+bool isAvailable(PayloadCodec codec) {
+    switch (codec) {
+        case PayloadCodec::NONE:
+            return true;
+#ifdef SSMTP_HAVE_ZLIB
+        case PayloadCodec::ZLIB:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+const char* nameOf(PayloadCodec codec) {
+    switch (codec) {
+        case PayloadCodec::NONE: return "none";
+        case PayloadCodec::ZLIB: return "zlib";
+    }
+    return "unknown";
+}
+
+bool parse(const std::string& name, PayloadCodec& codec) {
+    for (PayloadCodec candidate : {PayloadCodec::NONE, PayloadCodec::ZLIB}) {
+        if (name == nameOf(candidate)) {
+            codec = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool compress(PayloadCodec codec, int level, const std::string& input, std::string& output) {
+    switch (codec) {
+        case PayloadCodec::NONE:
+            output = input;
+            return true;
+#ifdef SSMTP_HAVE_ZLIB
+        case PayloadCodec::ZLIB: {
+            uLongf length = compressBound(static_cast<uLong>(input.size()));
+            output.resize(length);
+            int result = compress2(reinterpret_cast<Bytef*>(&output[0]), &length,
+                                   reinterpret_cast<const Bytef*>(input.data()), static_cast<uLong>(input.size()),
+                                   level > 0 ? level : Z_DEFAULT_COMPRESSION);
+            if (result != Z_OK) {
+                return false;
+            }
+            output.resize(length);
+            return true;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+bool decompress(PayloadCodec codec, const std::string& input, size_t size, std::string& output) {
+    switch (codec) {
+        case PayloadCodec::NONE:
+            if (input.size() != size) {
+                return false;
+            }
+            output = input;
+            return true;
+#ifdef SSMTP_HAVE_ZLIB
+        case PayloadCodec::ZLIB: {
+            output.resize(size);
+            uLongf length = static_cast<uLongf>(size);
+            int result = uncompress(reinterpret_cast<Bytef*>(&output[0]), &length,
+                                    reinterpret_cast<const Bytef*>(input.data()), static_cast<uLong>(input.size()));
+            return result == Z_OK && length == size;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+} // namespace payload_codec
+
+namespace {
+
+// Compress one part, keeping it as it is unless that makes it smaller
+bool packPart(const PayloadCompressionOptions& options, const std::string& part, PayloadCodec& codec,
+              std::string& packed) {
+    codec = PayloadCodec::NONE;
+    if (!part.empty() && payload_codec::compress(options.codec, options.level, part, packed) &&
+        packed.size() < part.size()) {
+        codec = options.codec;
+        return true;
+    }
+    packed = part;
+    return false;
+}
+
+} // anonymous namespace
+
+size_t PackedPayload::size() const {
+    size_t total = body_size + html_body_size;
+    for (const auto& attachment : attachments) {
+        total += attachment.size();
+    }
+    return total;
+}
+
+size_t PackedPayload::packedSize() const {
+    size_t total = body.size() + html_body.size();
+    for (const auto& attachment : attachments) {
+        total += attachment.size();
+    }
+    return total;
+}
+
+bool PackedPayload::isReadable() const {
+    return payload_codec::isAvailable(body_codec) && payload_codec::isAvailable(html_body_codec);
+}
+
+std::shared_ptr<const PackedPayload> PackedPayload::pack(const PayloadCompressionOptions& options,
+                                                         const std::string& body, const std::string& html_body,
+                                                         const std::vector<std::string>& attachments) {
+    if (options.codec == PayloadCodec::NONE || !payload_codec::isAvailable(options.codec)) {
+        return nullptr;
+    }
+    auto packed = std::make_shared<PackedPayload>();
+    bool shrunk = packPart(options, body, packed->body_codec, packed->body);
+    shrunk = packPart(options, html_body, packed->html_body_codec, packed->html_body) || shrunk;
+    if (!shrunk) {
+        return nullptr;
+    }
+    packed->body_size = body.size();
+    packed->html_body_size = html_body.size();
+    packed->attachments = attachments;
+    return packed;
+}
+
+bool PackedPayload::unpack(Email& email) const {
+    email.attachments = attachments;
+    return payload_codec::decompress(body_codec, body, body_size, email.body) &&
+           payload_codec::decompress(html_body_codec, html_body, html_body_size, email.html_body);
+}
+
+} // namespace ssmtp_mailer
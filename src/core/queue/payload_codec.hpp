@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Compression applied to the payloads of queued emails
+ *
+ * zlib is there when the build has ENABLE_ZLIB on, as it is by default.
+ * The values are stored in the spool, so a new codec takes the next one.
+ */
+enum class PayloadCodec : uint8_t {
+    NONE = 0,
+    ZLIB = 1
+};
+
+/**
+ * @brief Payload compression settings
+ */
+struct PayloadCompressionOptions {
+    PayloadCodec codec;    // NONE keeps payloads as they are
+    size_t threshold;      // Payloads smaller than this, in bytes, are not compressed
+    int level;             // Codec's compression level; 0 for its default
+
+    PayloadCompressionOptions() : codec(PayloadCodec::NONE), threshold(16 * 1024), level(0) {}
+};
+
+namespace payload_codec {
+
+bool isAvailable(PayloadCodec codec);
+const char* nameOf(PayloadCodec codec);
+
+/**
+ * @brief Codec named "none" or "zlib"
+ * @return false if the name is unknown
+ */
+bool parse(const std::string& name, PayloadCodec& codec);
+
+/**
+ * @brief Compress input into output
+ * @return false if the codec is not available or failed
+ */
+bool compress(PayloadCodec codec, int level, const std::string& input, std::string& output);
+
+/**
+ * @brief Decompress input, which must expand to exactly size bytes
+ */
+bool decompress(PayloadCodec codec, const std::string& input, size_t size, std::string& output);
+
+} // namespace payload_codec
+
+/**
+ * @brief Payload of a queued email held compressed until it is sent
+ *
+ * The body and HTML body are compressed separately, each only if that
+ * makes it smaller; attachment names are kept as they are.
+ */
+struct PackedPayload {
+    PayloadCodec body_codec;
+    PayloadCodec html_body_codec;
+    std::string body;               // As compressed with body_codec
+    std::string html_body;          // As compressed with html_body_codec
+    size_t body_size;               // Sizes before compression
+    size_t html_body_size;
+    std::vector<std::string> attachments;
+
+    PackedPayload()
+        : body_codec(PayloadCodec::NONE), html_body_codec(PayloadCodec::NONE),
+          body_size(0), html_body_size(0) {}
+
+    /**
+     * @brief Bytes of payload it stands for
+     */
+    size_t size() const;
+
+    /**
+     * @brief Bytes it holds
+     */
+    size_t packedSize() const;
+
+    /**
+     * @brief Whether this build has the codecs it was compressed with
+     */
+    bool isReadable() const;
+
+    /**
+     * @brief Compress body, HTML body and attachments, leaving them untouched
+     * @return nullptr if nothing would shrink
+     */
+    static std::shared_ptr<const PackedPayload> pack(const PayloadCompressionOptions& options,
+                                                     const std::string& body, const std::string& html_body,
+                                                     const std::vector<std::string>& attachments);
+
+    /**
+     * @brief Decompress into email's body, HTML body and attachments
+     * @return false if the compressed data is corrupt
+     */
+    bool unpack(Email& email) const;
+};
+
+} // namespace ssmtp_mailer
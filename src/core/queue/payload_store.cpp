@@ -0,0 +1,399 @@
+#include "core/queue/payload_store.hpp"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+constexpr uint64_t kPrime1 = 11400714785074694791ull;
+constexpr uint64_t kPrime2 = 14029467366897019727ull;
+constexpr uint64_t kPrime3 = 1609587929392839161ull;
+constexpr uint64_t kPrime4 = 9650029242287828579ull;
+constexpr uint64_t kPrime5 = 2870177450012600261ull;
+
+// Entries are not swept until there are at least this many
+constexpr size_t kMinSweep = 1024;
+
+uint64_t rotl(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+uint64_t read64(const char* data) {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t read32(const char* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint64_t xxhRound(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    acc = rotl(acc, 31);
+    return acc * kPrime1;
+}
+
+uint64_t mergeRound(uint64_t acc, uint64_t value) {
+    acc ^= xxhRound(0, value);
+    return acc * kPrime1 + kPrime4;
+}
+
+bool samePayload(const Email& held, const std::string& body, const std::string& html_body,
+                 const std::vector<std::string>& attachments) {
+    if (&held.body == &body) {
+        return true;
+    }
+    return held.body == body && held.html_body == html_body && held.attachments == attachments;
+}
+
+bool samePacked(const PackedPayload& held, const std::string& body, const std::string& html_body,
+                const std::vector<std::string>& attachments) {
+    if (held.body_size != body.size() || held.html_body_size != html_body.size() ||
+        held.attachments != attachments) {
+        return false;
+    }
+    Email unpacked;
+    return held.unpack(unpacked) && unpacked.body == body && unpacked.html_body == html_body;
+}
+
+template <typename T>
+void release(T& value) {
+    // clear() would keep the buffer
+    T().swap(value);
+}
+
+} // anonymous namespace
+
+PayloadStore::PayloadStore() : enabled_(true), sweep_at_(kMinSweep) {}
+
+void PayloadStore::setEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    enabled_ = enabled;
+}
+
+bool PayloadStore::isEnabled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return enabled_;
+}
+
+void PayloadStore::setCompression(const PayloadCompressionOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    compression_ = options;
+}
+
+PayloadCompressionOptions PayloadStore::getCompression() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return compression_;
+}
+
+PayloadStore::Interned PayloadStore::intern(Email& email) {
+    Interned interned;
+    size_t bytes = sizeOf(email.body, email.html_body, email.attachments);
+    if (isEnabled()) {
+        uint64_t digest = digestOf(email.body, email.html_body, email.attachments);
+        std::shared_ptr<const Email> holder;
+        std::shared_ptr<const PackedPayload> packed;
+        if (find(digest, email.body, email.html_body, email.attachments, bytes, holder, packed)) {
+            interned.digest = digest;
+        }
+        if (holder || packed) {
+            interned.payload = std::move(holder);
+            interned.packed = std::move(packed);
+            interned.shared = interned.packed != nullptr;
+        }
+    }
+    if (!interned.payload && !interned.packed) {
+        interned.packed = pack(email.body, email.html_body, email.attachments, bytes);
+        if (!interned.packed) {
+            return interned;
+        }
+        rememberPacked(interned.digest, interned.packed);
+    }
+    release(email.body);
+    release(email.html_body);
+    release(email.attachments);
+    return interned;
+}
+
+void PayloadStore::remember(uint64_t digest, const std::shared_ptr<const Email>& message) {
+    if (digest == 0 || !message) {
+        return;
+    }
+    Entry held;
+    held.holder = message;
+    held.bytes = sizeOf(message->body, message->html_body, message->attachments);
+    std::lock_guard<std::mutex> lock(mutex_);
+    rememberLocked(digest, held);
+}
+
+void PayloadStore::intern(QueueItem& item) {
+    bool enabled = isEnabled();
+    if (!enabled) {
+        item.payload_digest = 0;
+    }
+    std::shared_ptr<const Email> holder;
+    std::shared_ptr<const PackedPayload> packed;
+
+    if (item.packed) {
+        // Read back compressed; compared uncompressed, as queued emails are
+        item.shareMessage();
+        item.packed_shared = false;
+        Email unpacked;
+        if (item.payload_digest != 0 &&
+            (!item.packed->unpack(unpacked) ||
+             !find(item.payload_digest, unpacked.body, unpacked.html_body, unpacked.attachments,
+                   item.packed->size(), holder, packed))) {
+            item.payload_digest = 0;
+        }
+        if (holder) {
+            item.payload = std::move(holder);
+            item.packed.reset();
+        } else if (packed) {
+            item.packed = std::move(packed);
+            item.packed_shared = true;
+        } else {
+            rememberPacked(item.payload_digest, item.packed);
+        }
+        return;
+    }
+
+    if (item.payload) {
+        const Email& payload = *item.payload;
+        size_t bytes = sizeOf(payload.body, payload.html_body, payload.attachments);
+        if (item.payload_digest != 0 &&
+            !find(item.payload_digest, payload.body, payload.html_body, payload.attachments, bytes, holder,
+                  packed)) {
+            item.payload_digest = 0;
+        }
+        if (holder) {
+            item.payload = std::move(holder);
+            return;
+        }
+        item.shareMessage();
+        if (packed) {
+            item.packed = std::move(packed);
+            item.packed_shared = true;
+            item.payload.reset();
+            return;
+        }
+        // Nothing queued has it: this email takes a copy of its own, which
+        // those that follow share
+        item.packed = pack(payload.body, payload.html_body, payload.attachments, bytes);
+        if (item.packed) {
+            item.packed_shared = false;
+            item.payload.reset();
+            rememberPacked(item.payload_digest, item.packed);
+            return;
+        }
+        item.message = item.outgoingMessage();
+        item.payload.reset();
+        remember(item.payload_digest, item.message);
+        return;
+    }
+    if (item.message) {
+        return;
+    }
+
+    size_t bytes = sizeOf(item.body, item.html_body, item.attachments);
+    if (enabled) {
+        uint64_t digest = digestOf(item.body, item.html_body, item.attachments);
+        item.payload_digest =
+            find(digest, item.body, item.html_body, item.attachments, bytes, holder, packed) ? digest : 0;
+    }
+    if (holder || packed) {
+        item.payload = std::move(holder);
+        item.packed = std::move(packed);
+        item.packed_shared = item.packed != nullptr;
+    } else {
+        item.packed = pack(item.body, item.html_body, item.attachments, bytes);
+        item.packed_shared = false;
+        rememberPacked(item.payload_digest, item.packed);
+    }
+    if (item.payload || item.packed) {
+        release(item.body);
+        release(item.html_body);
+        release(item.attachments);
+    }
+    item.shareMessage();
+    if (!item.payload && !item.packed) {
+        remember(item.payload_digest, item.message);
+    }
+}
+
+QueuePayloadStats PayloadStore::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueuePayloadStats stats = stats_;
+    for (const auto& entry : entries_) {
+        if (!entry.second.expired()) {
+            stats.payloads++;
+            stats.stored_bytes += entry.second.bytes;
+        }
+    }
+    if (stats.bytes_checked > stats.bytes_shared) {
+        stats.dedup_ratio = static_cast<double>(stats.bytes_checked) /
+                            static_cast<double>(stats.bytes_checked - stats.bytes_shared);
+    }
+    if (stats.bytes_after > 0) {
+        stats.compression_ratio = static_cast<double>(stats.bytes_before) / static_cast<double>(stats.bytes_after);
+    }
+    return stats;
+}
+
+uint64_t PayloadStore::hash(const char* data, size_t length, uint64_t seed) {
+    const char* end = data + length;
+    uint64_t h;
+    if (length >= 32) {
+        uint64_t v1 = seed + kPrime1 + kPrime2;
+        uint64_t v2 = seed + kPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - kPrime1;
+        const char* limit = end - 32;
+        do {
+            v1 = xxhRound(v1, read64(data));
+            v2 = xxhRound(v2, read64(data + 8));
+            v3 = xxhRound(v3, read64(data + 16));
+            v4 = xxhRound(v4, read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = mergeRound(h, v1);
+        h = mergeRound(h, v2);
+        h = mergeRound(h, v3);
+        h = mergeRound(h, v4);
+    } else {
+        h = seed + kPrime5;
+    }
+    h += static_cast<uint64_t>(length);
+
+    while (end - data >= 8) {
+        h ^= xxhRound(0, read64(data));
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+        data += 8;
+    }
+    if (end - data >= 4) {
+        h ^= static_cast<uint64_t>(read32(data)) * kPrime1;
+        h = rotl(h, 23) * kPrime2 + kPrime3;
+        data += 4;
+    }
+    while (data < end) {
+        h ^= static_cast<uint64_t>(static_cast<unsigned char>(*data)) * kPrime5;
+        h = rotl(h, 11) * kPrime1;
+        data++;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t PayloadStore::digestOf(const std::string& body, const std::string& html_body,
+                                const std::vector<std::string>& attachments) {
+    // Each part's length is hashed with it, so the parts cannot run together
+    uint64_t digest = hash(body.data(), body.size());
+    digest = hash(html_body.data(), html_body.size(), digest);
+    for (const auto& attachment : attachments) {
+        digest = hash(attachment.data(), attachment.size(), digest);
+    }
+    return digest ? digest : 1;
+}
+
+bool PayloadStore::find(uint64_t digest, const std::string& body, const std::string& html_body,
+                        const std::vector<std::string>& attachments, size_t bytes,
+                        std::shared_ptr<const Email>& holder, std::shared_ptr<const PackedPayload>& packed) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.checked++;
+        stats_.bytes_checked += bytes;
+        auto it = entries_.find(digest);
+        if (it == entries_.end()) {
+            return true;
+        }
+        holder = it->second.holder.lock();
+        packed = it->second.packed.lock();
+        if (!holder && !packed) {
+            return true;
+        }
+    }
+
+    // Compared unlocked: the held payload is immutable
+    bool same = holder ? samePayload(*holder, body, html_body, attachments)
+                       : samePacked(*packed, body, html_body, attachments);
+    if (!same) {
+        holder.reset();
+        packed.reset();
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.shared++;
+    stats_.bytes_shared += bytes;
+    return true;
+}
+
+std::shared_ptr<const PackedPayload> PayloadStore::pack(const std::string& body, const std::string& html_body,
+                                                        const std::vector<std::string>& attachments,
+                                                        size_t bytes) {
+    PayloadCompressionOptions compression = getCompression();
+    if (compression.codec == PayloadCodec::NONE || bytes < compression.threshold) {
+        return nullptr;
+    }
+    // Compressed unlocked; only the counters are shared
+    auto packed = PackedPayload::pack(compression, body, html_body, attachments);
+    if (packed) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats_.compressed++;
+        stats_.bytes_before += bytes;
+        stats_.bytes_after += packed->packedSize();
+    }
+    return packed;
+}
+
+void PayloadStore::rememberPacked(uint64_t digest, const std::shared_ptr<const PackedPayload>& packed) {
+    if (digest == 0 || !packed) {
+        return;
+    }
+    Entry held;
+    held.packed = packed;
+    held.bytes = packed->packedSize();
+    std::lock_guard<std::mutex> lock(mutex_);
+    rememberLocked(digest, held);
+}
+
+void PayloadStore::rememberLocked(uint64_t digest, const Entry& held) {
+    Entry& entry = entries_[digest];
+    if (!entry.expired()) {
+        // Another email with this digest got there first; a collision or a
+        // race, either way this one keeps its payload to itself
+        return;
+    }
+    entry = held;
+
+    if (entries_.size() >= sweep_at_) {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.expired()) {
+                it = entries_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        sweep_at_ = std::max(kMinSweep, 2 * entries_.size());
+    }
+}
+
+size_t PayloadStore::sizeOf(const std::string& body, const std::string& html_body,
+                            const std::vector<std::string>& attachments) {
+    size_t size = body.size() + html_body.size();
+    for (const auto& attachment : attachments) {
+        size += attachment.size();
+    }
+    return size;
+}
+
+} // namespace ssmtp_mailer
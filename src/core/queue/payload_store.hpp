@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+#include "core/queue/payload_codec.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Content-addressed index of the payloads of queued emails
+ *
+ * Fan-outs queue many emails that differ only in their envelope. The store
+ * keys each payload (body, HTML body and attachment list) by a 64-bit
+ * XXH64 digest and remembers the queued message holding it, so an email
+ * with the same content shares that message's payload instead of keeping
+ * its own copy. Entries are weak: a payload is freed with the last queued
+ * email that uses it, and its entry is swept away later. A digest match is
+ * confirmed by comparing the content, so a collision costs only the
+ * sharing, never the wrong body.
+ *
+ * With compression on, a payload at least the threshold in size is held
+ * compressed instead, and emails with the same content share that.
+ *
+ * Thread-safe.
+ */
+class PayloadStore {
+public:
+    PayloadStore();
+
+    PayloadStore(const PayloadStore&) = delete;
+    PayloadStore& operator=(const PayloadStore&) = delete;
+
+    // Off, every email keeps its own payload and no digest is taken
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+    // Codec NONE, the default, keeps payloads uncompressed
+    void setCompression(const PayloadCompressionOptions& options);
+    PayloadCompressionOptions getCompression() const;
+
+    /**
+     * @brief Where an email about to be queued finds its payload
+     */
+    struct Interned {
+        uint64_t digest = 0;                           // 0 if the payload is not to be shared
+        std::shared_ptr<const Email> payload;          // Message of an equal email already queued
+        std::shared_ptr<const PackedPayload> packed;   // Compressed payload
+        bool shared = false;                           // packed belongs to an email already queued
+    };
+
+    /**
+     * @brief Look up an email about to be queued
+     *
+     * If an email with the same payload is queued, that payload is
+     * returned, and otherwise a compressed copy if worth making. Either way
+     * email's own body, HTML body and attachments are cleared. If neither
+     * is returned, the caller registers the message it makes of email with
+     * remember().
+     */
+    Interned intern(Email& email);
+
+    /**
+     * @brief Register a queued message as holding the payload with this digest
+     */
+    void remember(uint64_t digest, const std::shared_ptr<const Email>& message);
+
+    /**
+     * @brief Look up an email read back from disk or the schedule store
+     *
+     * It shares an equal payload already queued if there is one, and
+     * otherwise gets a shared message or compressed payload of its own, for
+     * the emails that follow to share. One already queued whole is left.
+     */
+    void intern(QueueItem& item);
+
+    QueuePayloadStats getStats() const;
+
+    /**
+     * @brief XXH64 of data, chained through seed
+     */
+    static uint64_t hash(const char* data, size_t length, uint64_t seed = 0);
+
+    /**
+     * @brief Digest of an email's body, HTML body and attachment list; never 0
+     */
+    static uint64_t digestOf(const std::string& body, const std::string& html_body,
+                             const std::vector<std::string>& attachments);
+
+private:
+    // A payload is held by a queued message or compressed, not both
+    struct Entry {
+        std::weak_ptr<const Email> holder;
+        std::weak_ptr<const PackedPayload> packed;
+        size_t bytes;   // As held
+
+        bool expired() const { return holder.expired() && packed.expired(); }
+    };
+
+    mutable std::mutex mutex_;
+    bool enabled_;
+    PayloadCompressionOptions compression_;
+    std::unordered_map<uint64_t, Entry> entries_;
+    size_t sweep_at_;   // Entry count at which entries of freed payloads are swept
+    QueuePayloadStats stats_;
+
+    // Finds the held payload equal to this one, if any; false if another
+    // payload holds its digest
+    bool find(uint64_t digest, const std::string& body, const std::string& html_body,
+              const std::vector<std::string>& attachments, size_t bytes, std::shared_ptr<const Email>& holder,
+              std::shared_ptr<const PackedPayload>& packed);
+    // Compresses a payload if on and at least the threshold in size
+    std::shared_ptr<const PackedPayload> pack(const std::string& body, const std::string& html_body,
+                                              const std::vector<std::string>& attachments, size_t bytes);
+    void rememberPacked(uint64_t digest, const std::shared_ptr<const PackedPayload>& packed);
+    void rememberLocked(uint64_t digest, const Entry& held);
+    static size_t sizeOf(const std::string& body, const std::string& html_body,
+                         const std::vector<std::string>& attachments);
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,225 @@
+#include "core/queue/queue_index.hpp"
+#include <cstdio>
+
+namespace ssmtp_mailer {
+
+QueueIndex::QueueIndex(size_t failed_history)
+    : failed_history_(failed_history), arrivals_(0) {}
+
+bool QueueIndex::listOf(EmailStatus status, size_t& list) {
+    switch (status) {
+        case EmailStatus::PENDING:
+            list = 0;
+            return true;
+        case EmailStatus::PROCESSING:
+            list = 1;
+            return true;
+        case EmailStatus::RETRY:
+            list = 2;
+            return true;
+        case EmailStatus::FAILED:
+            list = 3;
+            return true;
+        default:
+            return false;
+    }
+}
+
+QueueItemSummary QueueIndex::summarize(const QueueItem& item) {
+    QueueItemSummary summary;
+    summary.id = item.id;
+    summary.from_address = item.from_address;
+    if (!item.to_addresses.empty()) {
+        summary.first_recipient = item.to_addresses.front();
+    }
+    summary.recipient_count = item.to_addresses.size();
+    summary.subject = item.subject;
+    summary.domain = item.domain;
+    summary.priority = item.priority;
+    summary.status = item.status;
+    summary.size_bytes = item.payloadSize();
+    summary.retry_count = item.retry_count;
+    summary.error_message = item.error_message;
+    summary.created_at = item.created_at;
+    summary.last_attempt = item.last_attempt;
+    return summary;
+}
+
+void QueueIndex::update(const QueueItem& item, EmailStatus status) {
+    size_t list = 0;
+    if (!listOf(status, list)) {
+        remove(item.id);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t slot;
+    auto it = slots_.find(item.id);
+    if (it != slots_.end()) {
+        slot = it->second;
+        unlinkLocked(slot);
+    } else if (!free_.empty()) {
+        slot = free_.back();
+        free_.pop_back();
+        slots_[item.id] = slot;
+    } else {
+        slot = entries_.size();
+        entries_.emplace_back();
+        slots_[item.id] = slot;
+    }
+
+    Entry& entry = entries_[slot];
+    entry.summary = summarize(item);
+    entry.summary.status = status;
+    entry.used = true;
+    linkLocked(slot, list);
+    if (list == 3) {
+        trimFailedLocked();
+    }
+}
+
+void QueueIndex::move(const std::string& id, EmailStatus status) {
+    size_t list = 0;
+    if (!listOf(status, list)) {
+        remove(id);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(id);
+    if (it == slots_.end()) {
+        return;
+    }
+    size_t slot = it->second;
+    unlinkLocked(slot);
+    entries_[slot].summary.status = status;
+    linkLocked(slot, list);
+    if (list == 3) {
+        trimFailedLocked();
+    }
+}
+
+void QueueIndex::remove(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(id);
+    if (it == slots_.end()) {
+        return;
+    }
+    size_t slot = it->second;
+    slots_.erase(it);
+    unlinkLocked(slot);
+    releaseLocked(slot);
+}
+
+QueueStatusCounts QueueIndex::counts() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueStatusCounts counts;
+    counts.pending = lists_[0].count;
+    counts.processing = lists_[1].count;
+    counts.retry = lists_[2].count;
+    counts.failed = lists_[3].count;
+    return counts;
+}
+
+QueuePage QueueIndex::page(EmailStatus status, const std::string& cursor, size_t limit) const {
+    QueuePage page;
+    size_t list = 0;
+    if (!listOf(status, list)) {
+        return page;
+    }
+
+    size_t after_slot = kNone;
+    uint64_t after_arrival = 0;
+    if (!cursor.empty()) {
+        unsigned long long slot = 0;
+        unsigned long long arrival = 0;
+        if (std::sscanf(cursor.c_str(), "%llu:%llu", &slot, &arrival) != 2) {
+            return page;
+        }
+        after_slot = static_cast<size_t>(slot);
+        after_arrival = arrival;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    page.total = lists_[list].count;
+
+    size_t slot = lists_[list].head;
+    if (after_slot != kNone) {
+        if (after_slot < entries_.size() && entries_[after_slot].used &&
+            entries_[after_slot].list == list && entries_[after_slot].arrival == after_arrival) {
+            slot = entries_[after_slot].next;
+        } else {
+            // Moved since: lists run in arrival order, so skip to the first later one
+            while (slot != kNone && entries_[slot].arrival <= after_arrival) {
+                slot = entries_[slot].next;
+            }
+        }
+    }
+
+    size_t last = kNone;
+    while (slot != kNone && page.items.size() < limit) {
+        page.items.push_back(entries_[slot].summary);
+        last = slot;
+        slot = entries_[slot].next;
+    }
+    if (slot != kNone && last != kNone) {
+        page.next_cursor = std::to_string(last) + ":" + std::to_string(entries_[last].arrival);
+    }
+    return page;
+}
+
+size_t QueueIndex::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slots_.size();
+}
+
+void QueueIndex::linkLocked(size_t slot, size_t list) {
+    Entry& entry = entries_[slot];
+    List& target = lists_[list];
+    entry.list = list;
+    entry.arrival = ++arrivals_;
+    entry.prev = target.tail;
+    entry.next = kNone;
+    if (target.tail != kNone) {
+        entries_[target.tail].next = slot;
+    } else {
+        target.head = slot;
+    }
+    target.tail = slot;
+    target.count++;
+}
+
+void QueueIndex::unlinkLocked(size_t slot) {
+    Entry& entry = entries_[slot];
+    List& source = lists_[entry.list];
+    if (entry.prev != kNone) {
+        entries_[entry.prev].next = entry.next;
+    } else {
+        source.head = entry.next;
+    }
+    if (entry.next != kNone) {
+        entries_[entry.next].prev = entry.prev;
+    } else {
+        source.tail = entry.prev;
+    }
+    entry.prev = kNone;
+    entry.next = kNone;
+    source.count--;
+}
+
+void QueueIndex::releaseLocked(size_t slot) {
+    entries_[slot] = Entry();
+    free_.push_back(slot);
+}
+
+void QueueIndex::trimFailedLocked() {
+    List& failed = lists_[3];
+    while (failed.count > failed_history_) {
+        size_t oldest = failed.head;
+        slots_.erase(entries_[oldest].summary.id);
+        unlinkLocked(oldest);
+        releaseLocked(oldest);
+    }
+}
+
+} // namespace ssmtp_mailer
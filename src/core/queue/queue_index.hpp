@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Status index over the emails an EmailQueue holds, for inspection
+ *
+ * Keeps a summary of every queued email in a slot table, with a map from
+ * id to slot, and threads the slots of each status on an intrusive list in
+ * the order they reached it, with a count per list. The queue reports each
+ * move between statuses; inspection then reads counts in O(1) and a page
+ * in O(page size) under the index's own lock, never the queue's, so it
+ * does not hold up the workers and never copies bodies or attachments.
+ *
+ * A cursor names the last slot returned and the move that put it there.
+ * If that email has since moved on, the next page starts after the first
+ * later arrival in the list, found by walking from its head.
+ *
+ * Emails that failed for good stay listed as FAILED, the oldest dropped
+ * once there are more than the failure history allows.
+ *
+ * Thread-safe.
+ */
+class QueueIndex {
+public:
+    static constexpr size_t kDefaultFailedHistory = 1000;
+
+    /**
+     * @brief Constructor
+     * @param failed_history Failed emails kept listed
+     */
+    explicit QueueIndex(size_t failed_history = kDefaultFailedHistory);
+
+    QueueIndex(const QueueIndex&) = delete;
+    QueueIndex& operator=(const QueueIndex&) = delete;
+
+    /**
+     * @brief List an email under status, or move it there if already listed
+     *
+     * The summary is refreshed from item, so retry counts and errors show.
+     * FAILED evicts the oldest failed email beyond the history.
+     */
+    void update(const QueueItem& item, EmailStatus status);
+
+    /**
+     * @brief Move a listed email to status, keeping its summary
+     */
+    void move(const std::string& id, EmailStatus status);
+
+    /**
+     * @brief Stop listing an email, once sent or handed out of the queue
+     */
+    void remove(const std::string& id);
+
+    QueueStatusCounts counts() const;
+
+    /**
+     * @brief Up to limit summaries of emails with status, after cursor
+     * @param cursor Empty for the first page, else a previous page's next_cursor
+     */
+    QueuePage page(EmailStatus status, const std::string& cursor, size_t limit) const;
+
+    size_t size() const;
+
+private:
+    static constexpr size_t kNone = static_cast<size_t>(-1);
+
+    // PENDING, PROCESSING, RETRY, FAILED
+    static constexpr size_t kLists = 4;
+
+    struct Entry {
+        QueueItemSummary summary;
+        uint64_t arrival;   // Orders a list; bumped on every move
+        size_t list;
+        size_t prev;
+        size_t next;
+        bool used;
+
+        Entry() : arrival(0), list(0), prev(kNone), next(kNone), used(false) {}
+    };
+
+    struct List {
+        size_t head;
+        size_t tail;
+        size_t count;
+
+        List() : head(kNone), tail(kNone), count(0) {}
+    };
+
+    mutable std::mutex mutex_;
+    size_t failed_history_;
+    std::vector<Entry> entries_;
+    std::vector<size_t> free_;
+    std::unordered_map<std::string, size_t> slots_;
+    std::array<List, kLists> lists_;
+    uint64_t arrivals_;
+
+    static bool listOf(EmailStatus status, size_t& list);
+    static QueueItemSummary summarize(const QueueItem& item);
+    void linkLocked(size_t slot, size_t list);
+    void unlinkLocked(size_t slot);
+    void releaseLocked(size_t slot);
+    void trimFailedLocked();
+};
+
+} // namespace ssmtp_mailer
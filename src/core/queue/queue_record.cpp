@@ -0,0 +1,239 @@
+#include "core/queue/queue_record.hpp"
+#include "core/queue/payload_codec.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+#include <unistd.h>
+#include <cerrno>
+
+namespace ssmtp_mailer {
+
+namespace queue_record {
+
+uint32_t crc32(const char* data, size_t length) {
+    static const auto table = [] {
+        std::vector<uint32_t> entries(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            entries[i] = c;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+void putU32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+void putI64(std::string& out, int64_t value) {
+    uint64_t bits = static_cast<uint64_t>(value);
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(static_cast<char>((bits >> (8 * i)) & 0xFF));
+    }
+}
+
+void putString(std::string& out, const std::string& value) {
+    putU32(out, static_cast<uint32_t>(value.size()));
+    out += value;
+}
+
+void putStrings(std::string& out, const std::vector<std::string>& values) {
+    putU32(out, static_cast<uint32_t>(values.size()));
+    for (const auto& value : values) {
+        putString(out, value);
+    }
+}
+
+void putTime(std::string& out, std::chrono::system_clock::time_point time) {
+    putI64(out, std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count());
+}
+
+uint32_t getU32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return value;
+}
+
+uint8_t PayloadReader::u8() {
+    if (!need(1)) return 0;
+    return static_cast<uint8_t>(data_[pos_++]);
+}
+
+uint32_t PayloadReader::u32() {
+    if (!need(4)) return 0;
+    uint32_t value = getU32(data_ + pos_);
+    pos_ += 4;
+    return value;
+}
+
+int64_t PayloadReader::i64() {
+    if (!need(8)) return 0;
+    uint64_t bits = 0;
+    for (int i = 0; i < 8; ++i) {
+        bits |= static_cast<uint64_t>(static_cast<unsigned char>(data_[pos_ + i])) << (8 * i);
+    }
+    pos_ += 8;
+    return static_cast<int64_t>(bits);
+}
+
+std::string PayloadReader::string() {
+    uint32_t length = u32();
+    if (!need(length)) return std::string();
+    std::string value(data_ + pos_, length);
+    pos_ += length;
+    return value;
+}
+
+std::vector<std::string> PayloadReader::strings() {
+    uint32_t count = u32();
+    std::vector<std::string> values;
+    for (uint32_t i = 0; i < count && ok_; ++i) {
+        values.push_back(string());
+    }
+    return values;
+}
+
+std::chrono::system_clock::time_point PayloadReader::time() {
+    return std::chrono::system_clock::time_point(std::chrono::milliseconds(i64()));
+}
+
+bool PayloadReader::need(size_t length) {
+    if (!ok_ || length_ - pos_ < length) {
+        ok_ = false;
+    }
+    return ok_;
+}
+
+void putItem(std::string& out, const QueueItem& item, bool with_payload) {
+    putString(out, item.id);
+    putString(out, item.domain);
+    putString(out, item.user);
+    putString(out, item.from_address);
+    putStrings(out, item.to_addresses);
+    putString(out, item.subject);
+    if (with_payload && item.packed) {
+        Email unpacked;
+        item.packed->unpack(unpacked);
+        putString(out, unpacked.body);
+        putString(out, unpacked.html_body);
+        putStrings(out, unpacked.attachments);
+    } else if (with_payload) {
+        putString(out, item.bodyText());
+        putString(out, item.htmlBodyText());
+        putStrings(out, item.attachmentList());
+    } else {
+        putString(out, std::string());
+        putString(out, std::string());
+        putStrings(out, std::vector<std::string>());
+    }
+    out.push_back(static_cast<char>(item.priority));
+    out.push_back(static_cast<char>(item.status));
+    putTime(out, item.created_at);
+    putTime(out, item.scheduled_for);
+    putTime(out, item.last_attempt);
+    putI64(out, item.retry_delay.count());
+    putU32(out, static_cast<uint32_t>(item.retry_count));
+    putU32(out, static_cast<uint32_t>(item.max_retries));
+    putString(out, item.error_message);
+    putString(out, item.idempotency_key);
+    putTime(out, item.expires_at);
+}
+
+void putPacked(std::string& out, const PackedPayload& packed) {
+    out.push_back(static_cast<char>(packed.body_codec));
+    putI64(out, static_cast<int64_t>(packed.body_size));
+    putString(out, packed.body);
+    out.push_back(static_cast<char>(packed.html_body_codec));
+    putI64(out, static_cast<int64_t>(packed.html_body_size));
+    putString(out, packed.html_body);
+    putStrings(out, packed.attachments);
+}
+
+void getPacked(PayloadReader& reader, PackedPayload& packed) {
+    packed.body_codec = static_cast<PayloadCodec>(reader.u8());
+    packed.body_size = static_cast<size_t>(reader.i64());
+    packed.body = reader.string();
+    packed.html_body_codec = static_cast<PayloadCodec>(reader.u8());
+    packed.html_body_size = static_cast<size_t>(reader.i64());
+    packed.html_body = reader.string();
+    packed.attachments = reader.strings();
+}
+
+bool getItem(PayloadReader& reader, QueueItem& item) {
+    item.id = reader.string();
+    item.domain = reader.string();
+    item.user = reader.string();
+    item.from_address = reader.string();
+    item.to_addresses = reader.strings();
+    item.subject = reader.string();
+    item.body = reader.string();
+    item.html_body = reader.string();
+    item.attachments = reader.strings();
+    item.priority = static_cast<EmailPriority>(reader.u8());
+    item.status = static_cast<EmailStatus>(reader.u8());
+    item.created_at = reader.time();
+    item.scheduled_for = reader.time();
+    item.last_attempt = reader.time();
+    item.retry_delay = std::chrono::seconds(reader.i64());
+    item.retry_count = static_cast<int>(reader.u32());
+    item.max_retries = static_cast<int>(reader.u32());
+    item.error_message = reader.string();
+    if (!reader.atEnd()) {
+        item.idempotency_key = reader.string();
+    }
+    if (!reader.atEnd()) {
+        item.expires_at = reader.time();
+    }
+    return reader.ok();
+}
+
+std::string frame(const std::string& payload) {
+    std::string out;
+    out.reserve(kFrameSize + payload.size());
+    putU32(out, static_cast<uint32_t>(payload.size()));
+    putU32(out, crc32(payload.data(), payload.size()));
+    out += payload;
+    return out;
+}
+
+size_t intactPrefix(const char* data, size_t length) {
+    size_t pos = 0;
+    while (length - pos >= kFrameSize) {
+        uint32_t size = getU32(data + pos);
+        if (length - pos - kFrameSize < size ||
+            getU32(data + pos + 4) != crc32(data + pos + kFrameSize, size)) {
+            break;
+        }
+        pos += kFrameSize + size;
+    }
+    return pos;
+}
+
+bool writeAll(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+} // namespace queue_record
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+struct PackedPayload;
+
+/**
+ * @brief On-disk record encoding shared by the queue spool and the schedule store
+ *
+ * Records are framed as [payload length][CRC-32 of payload][payload], with
+ * integers little-endian, strings length-prefixed and times in milliseconds
+ * since the epoch.
+ */
+namespace queue_record {
+
+// Bytes of framing before each payload
+constexpr size_t kFrameSize = 8;
+
+uint32_t crc32(const char* data, size_t length);
+
+void putU32(std::string& out, uint32_t value);
+void putI64(std::string& out, int64_t value);
+void putString(std::string& out, const std::string& value);
+void putStrings(std::string& out, const std::vector<std::string>& values);
+void putTime(std::string& out, std::chrono::system_clock::time_point time);
+uint32_t getU32(const char* data);
+
+/**
+ * @brief Append every field of a queue item
+ * @param with_payload false to write the body, HTML body and attachments
+ *        as empty, for an item whose payload is stored in its own record.
+ *        A packed payload is written decompressed.
+ */
+void putItem(std::string& out, const QueueItem& item, bool with_payload = true);
+
+/**
+ * @brief Append a compressed payload as it is held: each part's codec,
+ *        size and bytes, then the attachments
+ */
+void putPacked(std::string& out, const PackedPayload& packed);
+
+/**
+ * @brief Frame a payload as it is stored on disk
+ */
+std::string frame(const std::string& payload);
+
+/**
+ * @brief Length of the intact records at the start of data, stopping at
+ *        the first one that is cut short or fails its CRC
+ */
+size_t intactPrefix(const char* data, size_t length);
+
+/**
+ * @brief write() all of data, retrying on EINTR and short writes
+ */
+bool writeAll(int fd, const char* data, size_t length);
+
+/**
+ * @brief Bounds-checked decoder for one record payload
+ */
+class PayloadReader {
+public:
+    PayloadReader(const char* data, size_t length) : data_(data), length_(length), pos_(0), ok_(true) {}
+
+    bool ok() const { return ok_ && pos_ == length_; }
+    bool atEnd() const { return pos_ == length_; }
+
+    uint8_t u8();
+    uint32_t u32();
+    int64_t i64();
+    std::string string();
+    std::vector<std::string> strings();
+    std::chrono::system_clock::time_point time();
+
+private:
+    bool need(size_t length);
+
+    const char* data_;
+    size_t length_;
+    size_t pos_;
+    bool ok_;
+};
+
+/**
+ * @brief Decode the fields written by putItem(), which must end the payload
+ *
+ * Records written before items carried an idempotency key or a deadline
+ * end without them.
+ */
+bool getItem(PayloadReader& reader, QueueItem& item);
+
+/**
+ * @brief Decode what putPacked() wrote; the reader tells if it was cut short
+ */
+void getPacked(PayloadReader& reader, PackedPayload& packed);
+
+} // namespace queue_record
+
+} // namespace ssmtp_mailer
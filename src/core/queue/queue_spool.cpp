@@ -0,0 +1,928 @@
+#include "core/queue/queue_spool.hpp"
+#include "core/queue/queue_record.hpp"
+#include "core/queue/payload_codec.hpp"
+#include "core/logging/logger.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+using namespace queue_record;
+
+// Segment files start with this magic and a format version
+const char kMagic[8] = {'S', 'S', 'M', 'T', 'P', 'W', 'A', 'L'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = sizeof(kMagic) + 4;
+
+enum class RecordType : uint8_t {
+    ENQUEUE = 1,
+    ATTEMPT = 2,
+    COMPLETE = 3,
+    PAYLOAD = 4,          // A payload shared by SHARED records, under its digest
+    SHARED = 5,           // ENQUEUE without the payload, naming its digest instead
+    PACKED_PAYLOAD = 6,   // PAYLOAD, compressed
+    PACKED = 7            // ENQUEUE with its payload compressed, ahead of the other fields
+};
+
+std::string encodeItem(const QueueItem& item) {
+    std::string out;
+    if (item.payload_digest != 0) {
+        out.push_back(static_cast<char>(RecordType::SHARED));
+        putI64(out, static_cast<int64_t>(item.payload_digest));
+        putItem(out, item, false);
+    } else if (item.packed) {
+        out.push_back(static_cast<char>(RecordType::PACKED));
+        putPacked(out, *item.packed);
+        putItem(out, item, false);
+    } else {
+        out.push_back(static_cast<char>(RecordType::ENQUEUE));
+        putItem(out, item);
+    }
+    return out;
+}
+
+std::string encodePayload(const QueueItem& item) {
+    std::string out;
+    if (item.packed) {
+        out.push_back(static_cast<char>(RecordType::PACKED_PAYLOAD));
+        putI64(out, static_cast<int64_t>(item.payload_digest));
+        putPacked(out, *item.packed);
+        return out;
+    }
+    out.push_back(static_cast<char>(RecordType::PAYLOAD));
+    putI64(out, static_cast<int64_t>(item.payload_digest));
+    putString(out, item.bodyText());
+    putString(out, item.htmlBodyText());
+    putStrings(out, item.attachmentList());
+    return out;
+}
+
+// Name of the codec a payload needs that this build lacks
+std::string missingCodec(const PackedPayload& packed) {
+    PayloadCodec codec = payload_codec::isAvailable(packed.body_codec) ? packed.html_body_codec : packed.body_codec;
+    return payload_codec::nameOf(codec);
+}
+
+bool isEnqueue(RecordType type) {
+    return type == RecordType::ENQUEUE || type == RecordType::SHARED || type == RecordType::PACKED;
+}
+
+// Decode the fields of an ENQUEUE, SHARED or PACKED record after its type
+bool getEnqueued(RecordType type, PayloadReader& reader, QueueItem& item) {
+    uint64_t digest = type == RecordType::SHARED ? static_cast<uint64_t>(reader.i64()) : 0;
+    std::shared_ptr<PackedPayload> packed;
+    if (type == RecordType::PACKED) {
+        packed = std::make_shared<PackedPayload>();
+        getPacked(reader, *packed);
+    }
+    if (!getItem(reader, item)) {
+        return false;
+    }
+    item.packed = std::move(packed);
+    item.payload_digest = digest;
+    return true;
+}
+
+} // anonymous namespace
+
+QueueSpool::QueueSpool(const QueueSpoolOptions& options)
+    : options_(options), pending_bytes_(0), appended_sequence_(0), durable_sequence_(0),
+      flush_requested_(false), compactions_requested_(0), compactions_done_(0),
+      open_(false), stopping_(false), failed_(false), active_segment_(0), fd_(-1), fd_segment_(0) {
+    if (options_.segment_size < kHeaderSize + kFrameSize) {
+        options_.segment_size = kHeaderSize + kFrameSize;
+    }
+}
+
+QueueSpool::~QueueSpool() {
+    close();
+}
+
+bool QueueSpool::open(std::vector<QueueItem>& recovered) {
+    Logger& logger = Logger::getInstance();
+    recovered.clear();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (open_) {
+        error_ = "Spool is already open";
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(options_.directory, ec);
+    if (ec) {
+        error_ = "Cannot create spool directory " + options_.directory + ": " + ec.message();
+        return false;
+    }
+
+    // Segment files are named by a hexadecimal sequence number
+    std::vector<uint64_t> numbers;
+    for (const auto& file : std::filesystem::directory_iterator(options_.directory, ec)) {
+        std::string name = file.path().filename().string();
+        unsigned long long number = 0;
+        char suffix[8] = {0};
+        if (std::sscanf(name.c_str(), "segment-%16llx.%4s", &number, suffix) == 2 &&
+            std::strcmp(suffix, "wal") == 0) {
+            numbers.push_back(number);
+        }
+    }
+    if (ec) {
+        error_ = "Cannot read spool directory " + options_.directory + ": " + ec.message();
+        return false;
+    }
+    std::sort(numbers.begin(), numbers.end());
+
+    index_.clear();
+    payloads_.clear();
+    segments_.clear();
+    std::map<std::string, QueueItem> items;
+    std::vector<std::string> order;
+    std::map<uint64_t, StoredPayload> contents;
+    for (size_t i = 0; i < numbers.size(); ++i) {
+        if (!replaySegment(numbers[i], i + 1 == numbers.size(), items, order, contents)) {
+            return false;
+        }
+    }
+
+    // Count who refers to each payload; a message whose payload was lost
+    // with a corrupt segment cannot be sent
+    for (auto it = index_.begin(); it != index_.end();) {
+        if (it->second.digest == 0) {
+            ++it;
+            continue;
+        }
+        auto payload = payloads_.find(it->second.digest);
+        if (payload == payloads_.end()) {
+            logger.error("Queue spool: payload of message " + it->first + " is lost; dropping it");
+            segments_[it->second.segment].live--;
+            items.erase(it->first);
+            it = index_.erase(it);
+            continue;
+        }
+        payload->second.refs++;
+        const StoredPayload& content = contents[it->second.digest];
+        items[it->first].payload = content.plain;
+        items[it->first].packed = content.packed;
+        ++it;
+    }
+    for (auto it = payloads_.begin(); it != payloads_.end();) {
+        if (it->second.refs == 0) {
+            segments_[it->second.segment].live--;
+            it = payloads_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (const auto& id : order) {
+        auto it = items.find(id);
+        if (it != items.end()) {
+            recovered.push_back(std::move(it->second));
+            items.erase(it);
+        }
+    }
+
+    // Never append to a replayed segment; start a fresh one
+    active_segment_ = numbers.empty() ? 1 : numbers.back() + 1;
+    segments_[active_segment_] = Segment{kHeaderSize, 0, 0};
+
+    stats_ = QueueSpoolStats();
+    stats_.live = index_.size();
+    stats_.payloads = payloads_.size();
+    stats_.recovered = recovered.size();
+    stats_.segments = numbers.size();
+
+    pending_.clear();
+    pending_bytes_ = 0;
+    appended_sequence_ = durable_sequence_ = 0;
+    flush_requested_ = false;
+    compactions_requested_ = 1;  // Drop whatever replay found fully delivered
+    compactions_done_ = 0;
+    stopping_ = false;
+    failed_ = false;
+    error_.clear();
+    open_ = true;
+    committer_ = std::thread(&QueueSpool::committerLoop, this);
+
+    logger.info("Queue spool opened at " + options_.directory + ": " +
+                std::to_string(recovered.size()) + " messages recovered from " +
+                std::to_string(numbers.size()) + " segments");
+    return true;
+}
+
+void QueueSpool::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_ || stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    commit_cv_.notify_all();
+    if (committer_.joinable()) {
+        committer_.join();
+    }
+    closeSegmentFile();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    open_ = false;
+    durable_cv_.notify_all();
+}
+
+uint64_t QueueSpool::recordEnqueue(const QueueItem& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_ || failed_ || index_.count(item.id)) {
+        return 0;
+    }
+    return appendEnqueueLocked(item);
+}
+
+uint64_t QueueSpool::recordAttempt(const QueueItem& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(item.id);
+    if (!open_ || failed_ || it == index_.end()) {
+        return 0;
+    }
+
+    AttemptState attempt = attemptState(item);
+    std::string payload;
+    payload.push_back(static_cast<char>(RecordType::ATTEMPT));
+    putString(payload, item.id);
+    payload.push_back(static_cast<char>(attempt.status));
+    putU32(payload, static_cast<uint32_t>(attempt.retry_count));
+    putI64(payload, attempt.retry_delay.count());
+    putTime(payload, attempt.last_attempt);
+    putString(payload, attempt.error_message);
+    putStrings(payload, attempt.to_addresses);
+
+    it->second.attempted = true;
+    it->second.attempt = attempt;
+    return appendLocked(payload, nullptr, nullptr);
+}
+
+uint64_t QueueSpool::recordComplete(const QueueItem& item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(item.id);
+    if (!open_ || failed_ || it == index_.end()) {
+        return 0;
+    }
+
+    std::string payload;
+    payload.push_back(static_cast<char>(RecordType::COMPLETE));
+    putString(payload, item.id);
+    payload.push_back(static_cast<char>(item.status));
+    putString(payload, item.error_message);
+
+    segments_[it->second.segment].live--;
+    uint64_t digest = it->second.digest;
+    index_.erase(it);
+    stats_.live = index_.size();
+    if (digest != 0) {
+        releasePayloadLocked(digest);
+    }
+    return appendLocked(payload, nullptr, nullptr);
+}
+
+bool QueueSpool::waitDurable(uint64_t sequence) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (sequence == 0) {
+        return false;
+    }
+    durable_cv_.wait(lock, [this, sequence] {
+        return durable_sequence_ >= sequence || failed_ || !open_;
+    });
+    return durable_sequence_ >= sequence;
+}
+
+bool QueueSpool::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_ || failed_) {
+        return false;
+    }
+    uint64_t sequence = appended_sequence_;
+    flush_requested_ = true;
+    commit_cv_.notify_all();
+    durable_cv_.wait(lock, [this, sequence] {
+        return durable_sequence_ >= sequence || failed_ || !open_;
+    });
+    return durable_sequence_ >= sequence;
+}
+
+void QueueSpool::compact() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!open_ || failed_) {
+        return;
+    }
+    uint64_t wanted = ++compactions_requested_;
+    commit_cv_.notify_all();
+    durable_cv_.wait(lock, [this, wanted] {
+        return compactions_done_ >= wanted || failed_ || !open_;
+    });
+}
+
+bool QueueSpool::contains(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.count(id) > 0;
+}
+
+bool QueueSpool::isOpen() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return open_;
+}
+
+QueueSpoolStats QueueSpool::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+std::string QueueSpool::getError() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+void QueueSpool::committerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        commit_cv_.wait(lock, [this] {
+            return stopping_ || !pending_.empty() || compactions_requested_ > compactions_done_;
+        });
+
+        if (!pending_.empty() && !stopping_ && !flush_requested_ && options_.commit_interval.count() > 0) {
+            // Give other appenders the chance to share this fsync
+            commit_cv_.wait_for(lock, options_.commit_interval, [this] {
+                return stopping_ || flush_requested_ || pending_bytes_ >= options_.commit_bytes;
+            });
+        }
+
+        if (!pending_.empty()) {
+            commitLocked(lock);
+        }
+
+        if (compactions_requested_ > compactions_done_ && !failed_ && !stopping_) {
+            uint64_t target = compactions_requested_;
+            compactSegments(lock);
+            compactions_done_ = target;
+            durable_cv_.notify_all();
+        }
+
+        if (stopping_ && pending_.empty()) {
+            break;
+        }
+    }
+}
+
+bool QueueSpool::commitLocked(std::unique_lock<std::mutex>& lock) {
+    std::deque<Chunk> batch;
+    batch.swap(pending_);
+    pending_bytes_ = 0;
+    flush_requested_ = false;
+    uint64_t sequence = appended_sequence_;
+    if (failed_) {
+        return false;
+    }
+
+    lock.unlock();
+    std::string error;
+    bool ok = true;
+    for (const auto& chunk : batch) {
+        if (!writeChunk(chunk, error)) {
+            ok = false;
+            break;
+        }
+    }
+    if (ok && fd_ >= 0 && fdatasync(fd_) != 0) {
+        error = "fdatasync failed on " + segmentPath(fd_segment_) + ": " + std::strerror(errno);
+        ok = false;
+    }
+    lock.lock();
+
+    if (!ok) {
+        failLocked(error);
+        return false;
+    }
+    durable_sequence_ = sequence;
+    stats_.commits++;
+    durable_cv_.notify_all();
+    return true;
+}
+
+bool QueueSpool::writeChunk(const Chunk& chunk, std::string& error) {
+    if (fd_ < 0 || fd_segment_ != chunk.segment) {
+        // The sealed segment must be durable before records follow it elsewhere
+        if (fd_ >= 0 && fdatasync(fd_) != 0) {
+            error = "fdatasync failed on " + segmentPath(fd_segment_) + ": " + std::strerror(errno);
+            return false;
+        }
+        closeSegmentFile();
+        if (!openSegmentFile(chunk.segment, error)) {
+            return false;
+        }
+    }
+    if (!writeAll(fd_, chunk.data.data(), chunk.data.size())) {
+        error = "Write failed on " + segmentPath(fd_segment_) + ": " + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool QueueSpool::openSegmentFile(uint64_t segment, std::string& error) {
+    std::string path = segmentPath(segment);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd_ < 0) {
+        error = "Cannot create spool segment " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    fd_segment_ = segment;
+
+    std::string header(kMagic, sizeof(kMagic));
+    putU32(header, kVersion);
+    if (!writeAll(fd_, header.data(), header.size())) {
+        error = "Write failed on " + path + ": " + std::strerror(errno);
+        return false;
+    }
+    syncDirectory();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.segments++;
+    return true;
+}
+
+void QueueSpool::closeSegmentFile() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+void QueueSpool::compactSegments(std::unique_lock<std::mutex>& lock) {
+    Logger& logger = Logger::getInstance();
+
+    // Only a prefix of the log can go: a later segment may hold the
+    // COMPLETE records that keep messages in earlier ones delivered
+    std::vector<uint64_t> drop;
+    std::vector<std::pair<std::string, Entry>> moves;
+    std::vector<std::pair<uint64_t, PayloadEntry>> payload_moves;
+    for (const auto& segment : segments_) {
+        if (segment.first == active_segment_) {
+            break;
+        }
+        if (segment.second.live == 0) {
+            drop.push_back(segment.first);
+            continue;
+        }
+        if (static_cast<double>(segment.second.live) <
+            options_.compaction_ratio * static_cast<double>(segment.second.enqueued)) {
+            drop.push_back(segment.first);
+            for (const auto& entry : index_) {
+                if (entry.second.segment == segment.first) {
+                    moves.push_back(entry);
+                }
+            }
+            for (const auto& entry : payloads_) {
+                if (entry.second.segment == segment.first) {
+                    payload_moves.push_back(entry);
+                }
+            }
+            continue;
+        }
+        break;
+    }
+    if (drop.empty()) {
+        return;
+    }
+
+    // Sealed segments are never written again, so they can be read unlocked
+    lock.unlock();
+    int fd = -1;
+    uint64_t fd_segment = 0;
+    auto read = [&](uint64_t segment, uint64_t offset, uint32_t length, std::string& record) {
+        if (fd < 0 || fd_segment != segment) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+            fd = ::open(segmentPath(segment).c_str(), O_RDONLY | O_CLOEXEC);
+            fd_segment = segment;
+            if (fd < 0) {
+                return false;
+            }
+        }
+        record.assign(length, '\0');
+        ssize_t got = pread(fd, &record[0], record.size(), static_cast<off_t>(offset));
+        return got == static_cast<ssize_t>(record.size()) && record.size() > kFrameSize &&
+               getU32(record.data() + 4) == crc32(record.data() + kFrameSize, record.size() - kFrameSize);
+    };
+
+    std::vector<QueueItem> items;
+    std::vector<std::string> payloads;
+    bool ok = true;
+    for (const auto& move : moves) {
+        const Entry& entry = move.second;
+        std::string record;
+        QueueItem item;
+        if (!read(entry.segment, entry.offset, entry.length, record)) {
+            ok = false;
+            break;
+        }
+        RecordType type = static_cast<RecordType>(record[kFrameSize]);
+        PayloadReader reader(record.data() + kFrameSize + 1, record.size() - kFrameSize - 1);
+        if (!getEnqueued(type, reader, item)) {
+            ok = false;
+            break;
+        }
+        items.push_back(std::move(item));
+    }
+    for (size_t i = 0; ok && i < payload_moves.size(); ++i) {
+        const PayloadEntry& entry = payload_moves[i].second;
+        std::string record;
+        if (!read(entry.segment, entry.offset, entry.length, record)) {
+            ok = false;
+            break;
+        }
+        payloads.push_back(record.substr(kFrameSize));
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    lock.lock();
+
+    if (!ok) {
+        logger.error("Queue spool compaction could not read segment " + segmentPath(fd_segment));
+        return;
+    }
+
+    // Rewrite the moved messages at the tail with their current attempt
+    // state; any that completed while unlocked need no copy
+    size_t moved = 0;
+    for (size_t i = 0; i < payloads.size(); ++i) {
+        // Unless it was freed, and perhaps written again, while unlocked
+        auto it = payloads_.find(payload_moves[i].first);
+        if (it == payloads_.end() || it->second.segment != payload_moves[i].second.segment ||
+            it->second.offset != payload_moves[i].second.offset) {
+            continue;
+        }
+        appendPayloadLocked(it->first, payloads[i]);
+        moved++;
+    }
+    for (auto& item : items) {
+        auto it = index_.find(item.id);
+        if (it == index_.end()) {
+            continue;
+        }
+        if (it->second.attempted) {
+            applyAttempt(item, it->second.attempt);
+        }
+        appendEnqueueLocked(item);
+        moved++;
+    }
+    stats_.compacted += moved;
+
+    // The copies must be on disk before the originals are deleted
+    if (!pending_.empty() && !commitLocked(lock)) {
+        return;
+    }
+
+    std::vector<std::string> paths;
+    for (uint64_t segment : drop) {
+        auto it = segments_.find(segment);
+        if (it == segments_.end() || it->second.live != 0) {
+            break;
+        }
+        segments_.erase(it);
+        paths.push_back(segmentPath(segment));
+    }
+
+    lock.unlock();
+    size_t removed = 0;
+    for (const auto& path : paths) {
+        if (::unlink(path.c_str()) == 0) {
+            removed++;
+        } else if (errno != ENOENT) {
+            logger.warning("Cannot remove spool segment " + path + ": " + std::strerror(errno));
+        }
+    }
+    syncDirectory();
+    lock.lock();
+
+    stats_.segments -= std::min(stats_.segments, removed);
+    logger.debug("Queue spool compaction removed " + std::to_string(removed) + " segments, moved " +
+                 std::to_string(moved) + " live messages and payloads");
+}
+
+uint64_t QueueSpool::appendLocked(const std::string& payload, uint64_t* offset, uint32_t* length) {
+    std::string record = frame(payload);
+
+    Segment* segment = &segments_[active_segment_];
+    if (segment->size + record.size() > options_.segment_size && segment->size > kHeaderSize) {
+        // Seal the active segment; the committer then sees what can be dropped
+        active_segment_++;
+        segment = &segments_[active_segment_];
+        *segment = Segment{kHeaderSize, 0, 0};
+        compactions_requested_++;
+    }
+
+    if (offset) {
+        *offset = segment->size;
+    }
+    if (length) {
+        *length = static_cast<uint32_t>(record.size());
+    }
+    segment->size += record.size();
+
+    if (pending_.empty() || pending_.back().segment != active_segment_) {
+        pending_.push_back(Chunk{active_segment_, std::string()});
+    }
+    pending_.back().data += record;
+    pending_bytes_ += record.size();
+    stats_.records++;
+    commit_cv_.notify_all();
+    return ++appended_sequence_;
+}
+
+uint64_t QueueSpool::appendEnqueueLocked(const QueueItem& item) {
+    auto it = index_.find(item.id);
+    uint64_t digest = item.payload_digest;
+    uint64_t previous = it != index_.end() ? it->second.digest : 0;
+    if (digest != 0 && digest != previous) {
+        // The payload goes first, the first time a live message refers to it
+        if (!payloads_.count(digest)) {
+            appendPayloadLocked(digest, encodePayload(item));
+        }
+        payloads_[digest].refs++;
+    }
+    if (previous != 0 && previous != digest) {
+        releasePayloadLocked(previous);
+    }
+
+    Entry entry;
+    entry.attempted = false;
+    entry.digest = digest;
+    uint64_t sequence = appendLocked(encodeItem(item), &entry.offset, &entry.length);
+    entry.segment = active_segment_;
+
+    it = index_.find(item.id);
+    if (it != index_.end()) {
+        segments_[it->second.segment].live--;
+        it->second = entry;
+    } else {
+        index_.emplace(item.id, entry);
+    }
+    Segment& segment = segments_[active_segment_];
+    segment.enqueued++;
+    segment.live++;
+    stats_.live = index_.size();
+    return sequence;
+}
+
+void QueueSpool::appendPayloadLocked(uint64_t digest, const std::string& payload) {
+    PayloadEntry entry{0, 0, 0, 0};
+    auto it = payloads_.find(digest);
+    if (it != payloads_.end()) {
+        // Relocated by compaction
+        segments_[it->second.segment].live--;
+        entry.refs = it->second.refs;
+    }
+    appendLocked(payload, &entry.offset, &entry.length);
+    entry.segment = active_segment_;
+    payloads_[digest] = entry;
+
+    Segment& segment = segments_[active_segment_];
+    segment.enqueued++;
+    segment.live++;
+    stats_.payloads = payloads_.size();
+}
+
+void QueueSpool::releasePayloadLocked(uint64_t digest) {
+    auto it = payloads_.find(digest);
+    if (it == payloads_.end() || --it->second.refs > 0) {
+        return;
+    }
+    // Nothing is written: replay finds no live message referring to it
+    segments_[it->second.segment].live--;
+    payloads_.erase(it);
+    stats_.payloads = payloads_.size();
+}
+
+void QueueSpool::failLocked(const std::string& error) {
+    if (!failed_) {
+        Logger::getInstance().error("Queue spool failed, queued mail is no longer durable: " + error);
+    }
+    failed_ = true;
+    error_ = error;
+    pending_.clear();
+    pending_bytes_ = 0;
+    durable_cv_.notify_all();
+}
+
+bool QueueSpool::replaySegment(uint64_t segment, bool last, std::map<std::string, QueueItem>& items,
+                               std::vector<std::string>& order,
+                               std::map<uint64_t, StoredPayload>& contents) {
+    Logger& logger = Logger::getInstance();
+    std::string path = segmentPath(segment);
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error_ = "Cannot read spool segment " + path;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+
+    Segment& state = segments_[segment];
+    state = Segment{kHeaderSize, 0, 0};
+
+    if (data.size() < kHeaderSize || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0 ||
+        getU32(data.data() + sizeof(kMagic)) != kVersion) {
+        if (last && data.size() < kHeaderSize) {
+            // Crashed while creating the segment; nothing was committed to it
+            return true;
+        }
+        error_ = "Spool segment " + path + " is not a queue spool segment";
+        return false;
+    }
+
+    size_t pos = kHeaderSize;
+    while (pos < data.size()) {
+        if (data.size() - pos < kFrameSize) {
+            break;
+        }
+        uint32_t length = getU32(data.data() + pos);
+        uint32_t crc = getU32(data.data() + pos + 4);
+        if (length == 0 || length > data.size() - pos - kFrameSize) {
+            break;
+        }
+        const char* payload = data.data() + pos + kFrameSize;
+        if (crc32(payload, length) != crc) {
+            break;
+        }
+
+        RecordType type = static_cast<RecordType>(payload[0]);
+        PayloadReader reader(payload + 1, length - 1);
+        if (isEnqueue(type)) {
+            QueueItem item;
+            if (!getEnqueued(type, reader, item)) {
+                break;
+            }
+            if (item.packed && !item.packed->isReadable()) {
+                // Intact, but this build cannot decompress it. Skipping it
+                // would let compaction delete it, so the spool stays closed
+                // until a build with the codec opens it.
+                error_ = "Spool segment " + path + ": message " + item.id + " is compressed with " +
+                         missingCodec(*item.packed) + ", which this build lacks";
+                return false;
+            }
+            auto it = index_.find(item.id);
+            if (it != index_.end()) {
+                // A copy written by compaction supersedes the original
+                segments_[it->second.segment].live--;
+            } else {
+                order.push_back(item.id);
+            }
+            Entry& entry = index_[item.id];
+            entry.segment = segment;
+            entry.offset = pos;
+            entry.length = static_cast<uint32_t>(kFrameSize + length);
+            entry.attempted = false;
+            entry.digest = item.payload_digest;
+            state.enqueued++;
+            state.live++;
+            items[item.id] = std::move(item);
+        } else if (type == RecordType::PAYLOAD || type == RecordType::PACKED_PAYLOAD) {
+            uint64_t digest = static_cast<uint64_t>(reader.i64());
+            StoredPayload content;
+            if (type == RecordType::PACKED_PAYLOAD) {
+                auto packed = std::make_shared<PackedPayload>();
+                getPacked(reader, *packed);
+                if (!reader.ok()) {
+                    break;
+                }
+                if (!packed->isReadable()) {
+                    // As for a message, above
+                    error_ = "Spool segment " + path + ": a shared payload is compressed with " +
+                             missingCodec(*packed) + ", which this build lacks";
+                    return false;
+                }
+                content.packed = std::move(packed);
+            } else {
+                auto plain = std::make_shared<Email>();
+                plain->body = reader.string();
+                plain->html_body = reader.string();
+                plain->attachments = reader.strings();
+                if (!reader.ok()) {
+                    break;
+                }
+                content.plain = std::move(plain);
+            }
+            // References are counted once every segment is replayed
+            auto it = payloads_.find(digest);
+            if (it != payloads_.end()) {
+                segments_[it->second.segment].live--;
+            }
+            payloads_[digest] = PayloadEntry{segment, pos, static_cast<uint32_t>(kFrameSize + length), 0};
+            contents[digest] = std::move(content);
+            state.enqueued++;
+            state.live++;
+        } else if (type == RecordType::ATTEMPT) {
+            std::string id = reader.string();
+            AttemptState attempt;
+            attempt.status = static_cast<EmailStatus>(reader.u8());
+            attempt.retry_count = static_cast<int>(reader.u32());
+            attempt.retry_delay = std::chrono::seconds(reader.i64());
+            attempt.last_attempt = reader.time();
+            attempt.error_message = reader.string();
+            if (!reader.atEnd()) {
+                // Records written before a retry could narrow the recipients end here
+                attempt.to_addresses = reader.strings();
+            }
+            if (!reader.ok()) {
+                break;
+            }
+            auto it = index_.find(id);
+            if (it != index_.end()) {
+                it->second.attempted = true;
+                it->second.attempt = attempt;
+                applyAttempt(items[id], attempt);
+            }
+        } else if (type == RecordType::COMPLETE) {
+            std::string id = reader.string();
+            reader.u8();
+            reader.string();
+            if (!reader.ok()) {
+                break;
+            }
+            auto it = index_.find(id);
+            if (it != index_.end()) {
+                segments_[it->second.segment].live--;
+                index_.erase(it);
+                items.erase(id);
+            }
+        } else {
+            break;
+        }
+        pos += kFrameSize + length;
+    }
+    state.size = pos;
+
+    if (pos < data.size()) {
+        if (last) {
+            // A torn write at the tail: the records before it were all that got committed
+            logger.warning("Queue spool: discarding " + std::to_string(data.size() - pos) +
+                           " bytes of incomplete records at the end of " + path);
+            if (::truncate(path.c_str(), static_cast<off_t>(pos)) != 0) {
+                logger.warning("Cannot truncate " + path + ": " + std::strerror(errno));
+            }
+        } else {
+            logger.error("Queue spool: segment " + path + " is corrupt at offset " +
+                         std::to_string(pos) + "; later records in it are lost");
+        }
+    }
+    return true;
+}
+
+std::string QueueSpool::segmentPath(uint64_t segment) const {
+    char name[40];
+    std::snprintf(name, sizeof(name), "segment-%016llx.wal", static_cast<unsigned long long>(segment));
+    return options_.directory + "/" + name;
+}
+
+void QueueSpool::syncDirectory() const {
+    // Make created and removed segment names durable too
+    int fd = ::open(options_.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+QueueSpool::AttemptState QueueSpool::attemptState(const QueueItem& item) {
+    AttemptState attempt;
+    attempt.status = item.status;
+    attempt.retry_count = item.retry_count;
+    attempt.retry_delay = item.retry_delay;
+    attempt.last_attempt = item.last_attempt;
+    attempt.error_message = item.error_message;
+    attempt.to_addresses = item.to_addresses;
+    return attempt;
+}
+
+void QueueSpool::applyAttempt(QueueItem& item, const AttemptState& attempt) {
+    item.status = attempt.status;
+    item.retry_count = attempt.retry_count;
+    item.retry_delay = attempt.retry_delay;
+    item.last_attempt = attempt.last_attempt;
+    item.error_message = attempt.error_message;
+    if (!attempt.to_addresses.empty()) {
+        item.to_addresses = attempt.to_addresses;
+    }
+}
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Spool settings
+ */
+struct QueueSpoolOptions {
+    std::string directory;                    // Holds the segment files; created if missing
+    size_t segment_size;                      // Bytes after which a new segment is started
+    std::chrono::milliseconds commit_interval; // Longest a record waits for others to share its fsync
+    size_t commit_bytes;                      // Buffered bytes that trigger a commit before the interval
+    double compaction_ratio;                  // Relocate a sealed segment's live records below this live fraction
+
+    QueueSpoolOptions()
+        : segment_size(16 * 1024 * 1024), commit_interval(std::chrono::milliseconds(5)),
+          commit_bytes(1024 * 1024), compaction_ratio(0.5) {}
+};
+
+/**
+ * @brief Spool statistics
+ */
+struct QueueSpoolStats {
+    size_t records;     // Records appended since open
+    size_t commits;     // fsync batches written since open
+    size_t segments;    // Segment files on disk
+    size_t live;        // Messages enqueued and not yet completed
+    size_t recovered;   // Messages found live when the spool was opened
+    size_t compacted;   // Live records relocated by compaction
+    size_t payloads;    // Shared payloads stored for live messages
+
+    QueueSpoolStats()
+        : records(0), commits(0), segments(0), live(0), recovered(0), compacted(0), payloads(0) {}
+};
+
+/**
+ * @brief Durable write-ahead log of EmailQueue state
+ *
+ * Every message accepted into the queue is written as an ENQUEUE record,
+ * every failed attempt that will be retried as an ATTEMPT record, with
+ * the recipients still owed the message, and the final outcome as a
+ * COMPLETE record. Records go to append-only segment files of about
+ * segment_size bytes, each framed with its length and a CRC-32, so a
+ * record torn by a crash is detected and cut off on recovery.
+ *
+ * Appends only copy into a buffer. A committer thread writes the buffer
+ * and calls fdatasync() once per batch (group commit): it waits up to
+ * commit_interval, or until commit_bytes are buffered, for other records
+ * to share the sync. Callers that need a record on disk wait for its
+ * sequence number with waitDurable().
+ *
+ * A message whose payload the queue shares with others (payload_digest
+ * set) is written without it, naming the digest, and the payload goes in
+ * a PAYLOAD record of its own, written once while any live message refers
+ * to it. The spool then grows with the distinct content queued rather
+ * than with the number of recipients. A payload the queue holds
+ * compressed is written compressed, in either record.
+ *
+ * The in-memory index holds only where each live message's ENQUEUE record
+ * is and its latest attempt state, and where each shared payload is and
+ * how many live messages refer to it. When a segment is sealed, segments at
+ * the head of the log with no live messages are deleted, and those with
+ * few are compacted: their live messages are rewritten at the tail so the
+ * segment can go.
+ */
+class QueueSpool {
+public:
+    explicit QueueSpool(const QueueSpoolOptions& options);
+    ~QueueSpool();
+
+    QueueSpool(const QueueSpool&) = delete;
+    QueueSpool& operator=(const QueueSpool&) = delete;
+
+    /**
+     * @brief Open the spool, replaying existing segments
+     * @param recovered Set to the messages still live, in enqueue order
+     * @return true on success; see getError() otherwise
+     */
+    bool open(std::vector<QueueItem>& recovered);
+
+    /**
+     * @brief Commit everything buffered and stop the committer thread
+     */
+    void close();
+
+    /**
+     * @brief Record a message accepted into the queue
+     * @param item Message; item.id must be set and unique
+     * @return Sequence number to pass to waitDurable()
+     */
+    uint64_t recordEnqueue(const QueueItem& item);
+
+    /**
+     * @brief Record a failed attempt after which the message stays queued
+     * @param item Message with its updated retry state
+     */
+    uint64_t recordAttempt(const QueueItem& item);
+
+    /**
+     * @brief Record that a message left the queue (sent or failed for good)
+     * @param item Message with its final status and error
+     */
+    uint64_t recordComplete(const QueueItem& item);
+
+    /**
+     * @brief Block until the record with this sequence number is on disk
+     * @return false if the spool failed or was closed first
+     */
+    bool waitDurable(uint64_t sequence);
+
+    /**
+     * @brief Commit everything appended so far and wait for it
+     */
+    bool flush();
+
+    /**
+     * @brief Drop or compact sealed segments at the head of the log now
+     */
+    void compact();
+
+    /**
+     * @brief Whether a message with this id is live in the spool
+     */
+    bool contains(const std::string& id) const;
+
+    bool isOpen() const;
+    QueueSpoolStats getStats() const;
+    std::string getError() const;
+
+private:
+    // Mutable per-attempt state, carried by ATTEMPT records
+    struct AttemptState {
+        EmailStatus status;
+        int retry_count;
+        std::chrono::seconds retry_delay;
+        std::chrono::system_clock::time_point last_attempt;
+        std::string error_message;
+        std::vector<std::string> to_addresses;   // Those still owed the message
+    };
+
+    // Index entry for a live message
+    struct Entry {
+        uint64_t segment;   // Segment and position of the ENQUEUE record
+        uint64_t offset;
+        uint32_t length;
+        bool attempted;
+        AttemptState attempt;
+        uint64_t digest;    // Shared payload it refers to; 0 if its own is inline
+    };
+
+    // Index entry for a shared payload
+    struct PayloadEntry {
+        uint64_t segment;   // Segment and position of the PAYLOAD record
+        uint64_t offset;
+        uint32_t length;
+        size_t refs;        // Live messages referring to it
+    };
+
+    struct Segment {
+        uint64_t size;      // Bytes appended, including buffered ones
+        size_t enqueued;    // ENQUEUE and PAYLOAD records in the segment
+        size_t live;        // Of those, messages and payloads still live
+    };
+
+    // Payload read back from a PAYLOAD or PACKED_PAYLOAD record
+    struct StoredPayload {
+        std::shared_ptr<const Email> plain;
+        std::shared_ptr<const PackedPayload> packed;
+    };
+
+    // Bytes appended to one segment, not yet written
+    struct Chunk {
+        uint64_t segment;
+        std::string data;
+    };
+
+    QueueSpoolOptions options_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable commit_cv_;   // Wakes the committer
+    std::condition_variable durable_cv_;  // Wakes waitDurable()
+    std::deque<Chunk> pending_;
+    size_t pending_bytes_;
+    uint64_t appended_sequence_;
+    uint64_t durable_sequence_;
+    bool flush_requested_;
+    uint64_t compactions_requested_;
+    uint64_t compactions_done_;
+    bool open_;
+    bool stopping_;
+    bool failed_;
+    std::string error_;
+
+    std::map<std::string, Entry> index_;
+    std::map<uint64_t, PayloadEntry> payloads_;
+    std::map<uint64_t, Segment> segments_;
+    uint64_t active_segment_;
+    QueueSpoolStats stats_;
+
+    // Committer-owned file state
+    int fd_;
+    uint64_t fd_segment_;
+    std::thread committer_;
+
+    void committerLoop();
+    bool commitLocked(std::unique_lock<std::mutex>& lock);
+    bool writeChunk(const Chunk& chunk, std::string& error);
+    bool openSegmentFile(uint64_t segment, std::string& error);
+    void closeSegmentFile();
+    void compactSegments(std::unique_lock<std::mutex>& lock);
+
+    uint64_t appendLocked(const std::string& payload, uint64_t* offset, uint32_t* length);
+    uint64_t appendEnqueueLocked(const QueueItem& item);
+    void appendPayloadLocked(uint64_t digest, const std::string& payload);
+    void releasePayloadLocked(uint64_t digest);
+    void failLocked(const std::string& error);
+
+    bool replaySegment(uint64_t segment, bool last, std::map<std::string, QueueItem>& items,
+                       std::vector<std::string>& order,
+                       std::map<uint64_t, StoredPayload>& contents);
+    std::string segmentPath(uint64_t segment) const;
+    void syncDirectory() const;
+
+    static AttemptState attemptState(const QueueItem& item);
+    static void applyAttempt(QueueItem& item, const AttemptState& attempt);
+};
+
+} // namespace ssmtp_mailer
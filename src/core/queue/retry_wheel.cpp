@@ -0,0 +1,120 @@
+#include "core/queue/retry_wheel.hpp"
+
+namespace ssmtp_mailer {
+
+RetryTimerWheel::RetryTimerWheel(Clock::time_point now) : now_(toTick(now)), size_(0) {
+    for (auto& level : levels_) {
+        level.occupied = 0;
+    }
+}
+
+void RetryTimerWheel::schedule(QueueItem item, Clock::time_point due) {
+    // Round up, so an item is never released before its due time
+    file(Timer{toTick(due + std::chrono::milliseconds(1) - Clock::duration(1)), std::move(item)});
+    size_++;
+}
+
+size_t RetryTimerWheel::advance(Clock::time_point now, std::vector<QueueItem>& due) {
+    size_t before = due.size();
+    for (auto& timer : expired_) {
+        due.push_back(std::move(timer.item));
+    }
+    expired_.clear();
+
+    uint64_t target = toTick(now);
+    while (true) {
+        int level = 0;
+        while (level < kLevels && levels_[level].occupied == 0) {
+            level++;
+        }
+        if (level == kLevels) {
+            break;
+        }
+
+        // The lowest occupied level always changes first: its slots all
+        // lie before the current tick's next boundary one level up
+        int slot = __builtin_ctzll(levels_[level].occupied);
+        int shift = kLevelBits * level;
+        uint64_t upper = level + 1 < kLevels ? (now_ >> (shift + kLevelBits)) << (shift + kLevelBits) : 0;
+        uint64_t tick = upper | (static_cast<uint64_t>(slot) << shift);
+        if (tick > target) {
+            break;
+        }
+
+        now_ = tick;
+        std::vector<Timer> timers;
+        timers.swap(levels_[level].slots[slot]);
+        levels_[level].occupied &= ~(uint64_t(1) << slot);
+        for (auto& timer : timers) {
+            // Re-filed relative to the new tick, these land on a lower level
+            file(std::move(timer));
+        }
+        for (auto& timer : expired_) {
+            due.push_back(std::move(timer.item));
+        }
+        expired_.clear();
+    }
+    if (target > now_) {
+        now_ = target;
+    }
+
+    size_ -= due.size() - before;
+    return due.size() - before;
+}
+
+bool RetryTimerWheel::nextDeadline(Clock::time_point& deadline) const {
+    if (size_ == 0) {
+        return false;
+    }
+    if (!expired_.empty()) {
+        deadline = fromTick(now_);
+        return true;
+    }
+    for (int level = 0; level < kLevels; ++level) {
+        if (levels_[level].occupied != 0) {
+            int slot = __builtin_ctzll(levels_[level].occupied);
+            int shift = kLevelBits * level;
+            uint64_t upper = level + 1 < kLevels ? (now_ >> (shift + kLevelBits)) << (shift + kLevelBits) : 0;
+            deadline = fromTick(upper | (static_cast<uint64_t>(slot) << shift));
+            return true;
+        }
+    }
+    return false;
+}
+
+void RetryTimerWheel::forEach(const std::function<void(const QueueItem&)>& visit) const {
+    for (const auto& timer : expired_) {
+        visit(timer.item);
+    }
+    for (const auto& level : levels_) {
+        for (const auto& slot : level.slots) {
+            for (const auto& timer : slot) {
+                visit(timer.item);
+            }
+        }
+    }
+}
+
+void RetryTimerWheel::file(Timer&& timer) {
+    if (timer.due <= now_) {
+        expired_.push_back(std::move(timer));
+        return;
+    }
+    // File under the most significant base-64 digit where due and now differ
+    int level = (63 - __builtin_clzll(timer.due ^ now_)) / kLevelBits;
+    int slot = static_cast<int>((timer.due >> (kLevelBits * level)) & (kSlots - 1));
+    levels_[level].slots[slot].push_back(std::move(timer));
+    levels_[level].occupied |= uint64_t(1) << slot;
+}
+
+uint64_t RetryTimerWheel::toTick(Clock::time_point time) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+    return ms > 0 ? static_cast<uint64_t>(ms) : 0;
+}
+
+RetryTimerWheel::Clock::time_point RetryTimerWheel::fromTick(uint64_t tick) {
+    return Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+        std::chrono::milliseconds(static_cast<long long>(tick))));
+}
+
+} // namespace ssmtp_mailer
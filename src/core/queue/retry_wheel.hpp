@@ -0,0 +1,89 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Hierarchical timing wheel holding queue items until their retry is due
+ *
+ * Time is counted in millisecond ticks and read as base-64 digits: level L
+ * of the wheel has one slot per value of digit L. An item is filed at the
+ * most significant digit where its due tick differs from the current tick,
+ * in the slot for its own digit there. When the current tick reaches the
+ * start of that slot the items in it are re-filed one level down, until at
+ * level 0 they fall due. Scheduling is O(1); each item is moved at most
+ * once per level (11 levels cover every 64-bit tick). An occupancy bitmap
+ * per level finds the next slot to visit without stepping through idle
+ * ticks, which also gives the exact time to sleep until.
+ */
+class RetryTimerWheel {
+public:
+    using Clock = std::chrono::system_clock;
+
+    /**
+     * @brief Constructor
+     * @param now Starting time; items due at or before it are due at once
+     */
+    explicit RetryTimerWheel(Clock::time_point now = Clock::now());
+
+    /**
+     * @brief Hold an item until due
+     */
+    void schedule(QueueItem item, Clock::time_point due);
+
+    /**
+     * @brief Move the clock forward and collect what fell due
+     * @param now Current time; earlier times are ignored
+     * @param due Items now due are appended here, in due order
+     * @return Number of items appended
+     */
+    size_t advance(Clock::time_point now, std::vector<QueueItem>& due);
+
+    /**
+     * @brief Time of the next change: an item falling due, or the wheel
+     *        re-filing a slot on the way to one
+     * @param deadline Set to that time (the current time if items are due)
+     * @return false if the wheel is empty
+     */
+    bool nextDeadline(Clock::time_point& deadline) const;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /**
+     * @brief Visit every held item, in no particular order
+     */
+    void forEach(const std::function<void(const QueueItem&)>& visit) const;
+
+private:
+    static constexpr int kLevelBits = 6;
+    static constexpr int kSlots = 1 << kLevelBits;
+    static constexpr int kLevels = (64 + kLevelBits - 1) / kLevelBits;
+
+    struct Timer {
+        uint64_t due;
+        QueueItem item;
+    };
+
+    struct Level {
+        uint64_t occupied;  // Bit s set when slots[s] is non-empty
+        std::array<std::vector<Timer>, kSlots> slots;
+    };
+
+    std::array<Level, kLevels> levels_;
+    std::vector<Timer> expired_;  // Scheduled already due
+    uint64_t now_;
+    size_t size_;
+
+    void file(Timer&& timer);
+    static uint64_t toTick(Clock::time_point time);
+    static Clock::time_point fromTick(uint64_t tick);
+};
+
+} // namespace ssmtp_mailer
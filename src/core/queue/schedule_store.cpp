@@ -0,0 +1,567 @@
+#include "core/queue/schedule_store.hpp"
+#include "core/queue/queue_record.hpp"
+#include "core/logging/logger.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+using namespace queue_record;
+
+// Bucket files start with this magic and a format version
+const char kMagic[8] = {'S', 'S', 'M', 'T', 'P', 'S', 'C', 'H'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderSize = sizeof(kMagic) + 4;
+
+enum class RecordType : uint8_t {
+    SCHEDULE = 1,
+    CANCEL = 2
+};
+
+int64_t toMillis(std::chrono::system_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+}
+
+std::chrono::system_clock::time_point fromMillis(int64_t ms) {
+    return std::chrono::system_clock::time_point(std::chrono::milliseconds(ms));
+}
+
+std::string encodeSchedule(const QueueItem& item) {
+    std::string out;
+    out.push_back(static_cast<char>(RecordType::SCHEDULE));
+    putItem(out, item);
+    return out;
+}
+
+std::string encodeCancel(const std::string& id) {
+    std::string out;
+    out.push_back(static_cast<char>(RecordType::CANCEL));
+    putString(out, id);
+    return out;
+}
+
+bool readFile(const std::string& path, std::string& data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+} // anonymous namespace
+
+ScheduleStore::ScheduleStore(const ScheduleStoreOptions& options)
+    : options_(options), width_ms_(0), open_(false), fd_(-1), fd_bucket_(0) {
+    width_ms_ = std::chrono::duration_cast<std::chrono::milliseconds>(options_.bucket_width).count();
+    if (width_ms_ <= 0) {
+        width_ms_ = 1000;
+    }
+}
+
+ScheduleStore::~ScheduleStore() {
+    close();
+}
+
+bool ScheduleStore::open() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (open_) {
+        error_ = "Schedule store is already open";
+        return false;
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(options_.directory, ec);
+    if (ec) {
+        error_ = "Cannot create schedule directory " + options_.directory + ": " + ec.message();
+        return false;
+    }
+
+    // Bucket files are named by their start time in hexadecimal milliseconds
+    buckets_.clear();
+    for (const auto& file : std::filesystem::directory_iterator(options_.directory, ec)) {
+        std::string name = file.path().filename().string();
+        unsigned long long start = 0;
+        char suffix[8] = {0};
+        if (std::sscanf(name.c_str(), "bucket-%16llx.%6s", &start, suffix) == 2 &&
+            std::strcmp(suffix, "sched") == 0) {
+            buckets_.insert(static_cast<int64_t>(start));
+        }
+    }
+    if (ec) {
+        error_ = "Cannot read schedule directory " + options_.directory + ": " + ec.message();
+        return false;
+    }
+
+    loaded_.clear();
+    checked_.clear();
+    drained_.clear();
+    held_.clear();
+    timeline_.clear();
+    stats_ = ScheduleStoreStats();
+    error_.clear();
+    open_ = true;
+
+    Logger::getInstance().info("Schedule store opened at " + options_.directory + " with " +
+                               std::to_string(buckets_.size()) + " buckets");
+    return true;
+}
+
+void ScheduleStore::close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closeFileLocked();
+    open_ = false;
+    held_.clear();
+    timeline_.clear();
+    loaded_.clear();
+}
+
+std::string ScheduleStore::schedule(QueueItem item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_) {
+        error_ = "Schedule store is not open";
+        return "";
+    }
+
+    int64_t previous = 0;
+    std::string base = item.id;
+    parseId(item.id, previous, base);
+    int64_t bucket = bucketOf(item.scheduled_for);
+    item.id = makeId(bucket, base);
+    item.status = EmailStatus::PENDING;
+    if (!appendLocked(bucket, encodeSchedule(item))) {
+        return "";
+    }
+
+    buckets_.insert(bucket);
+    std::string id = item.id;
+    if (loaded_.count(bucket)) {
+        holdLocked(bucket, std::move(item));
+    }
+    stats_.scheduled++;
+    return id;
+}
+
+bool ScheduleStore::cancel(const std::string& id) {
+    int64_t bucket = 0;
+    std::string base;
+    if (!parseId(id, bucket, base)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_ || !buckets_.count(bucket)) {
+        return false;
+    }
+    // In memory we know whether it is still there; on disk a stray CANCEL is harmless
+    if (loaded_.count(bucket) && !held_.count(id)) {
+        return false;
+    }
+    if (!appendLocked(bucket, encodeCancel(id))) {
+        return false;
+    }
+    releaseLocked(id, nullptr);
+    stats_.cancelled++;
+    return true;
+}
+
+std::string ScheduleStore::reschedule(const std::string& id, Clock::time_point send_at) {
+    int64_t bucket = 0;
+    std::string base;
+    if (!parseId(id, bucket, base)) {
+        return "";
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_ || !buckets_.count(bucket)) {
+        return "";
+    }
+
+    QueueItem item;
+    if (loaded_.count(bucket)) {
+        auto it = held_.find(id);
+        if (it == held_.end()) {
+            return "";
+        }
+        item = it->second.item;
+    } else {
+        // Not in memory: find it in its bucket file
+        std::map<std::string, QueueItem> items;
+        std::vector<std::string> order;
+        if (!readBucketLocked(bucket, items, order)) {
+            return "";
+        }
+        auto it = items.find(id);
+        if (it == items.end()) {
+            return "";
+        }
+        item = std::move(it->second);
+    }
+
+    // Write the new record before cancelling the old one, so a crash in
+    // between sends the email twice rather than never. Within one bucket
+    // the later SCHEDULE record simply replaces the earlier one.
+    int64_t target = bucketOf(send_at);
+    item.scheduled_for = send_at;
+    item.id = makeId(target, base);
+    if (!appendLocked(target, encodeSchedule(item))) {
+        return "";
+    }
+    buckets_.insert(target);
+    if (target != bucket && !appendLocked(bucket, encodeCancel(id))) {
+        return "";
+    }
+
+    releaseLocked(id, nullptr);
+    std::string new_id = item.id;
+    if (loaded_.count(target)) {
+        holdLocked(target, std::move(item));
+    }
+    stats_.rescheduled++;
+    return new_id;
+}
+
+size_t ScheduleStore::takeDue(Clock::time_point now, std::vector<QueueItem>& due) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!open_) {
+        return 0;
+    }
+
+    int64_t horizon = toMillis(now + options_.window);
+    std::vector<int64_t> coming;
+    for (int64_t bucket : buckets_) {
+        if (bucket >= horizon) {
+            break;
+        }
+        if (!loaded_.count(bucket)) {
+            coming.push_back(bucket);
+        }
+    }
+    for (int64_t bucket : coming) {
+        loadLocked(bucket);
+    }
+
+    size_t before = due.size();
+    while (!timeline_.empty() && timeline_.begin()->first <= now) {
+        QueueItem item;
+        std::string id = timeline_.begin()->second;
+        releaseLocked(id, &item);
+        due.push_back(std::move(item));
+    }
+    size_t taken = due.size() - before;
+    stats_.taken += taken;
+
+    // A bucket that is over can gain no more emails; once empty its file can go
+    int64_t now_ms = toMillis(now);
+    for (const auto& entry : loaded_) {
+        if (entry.second == 0 && entry.first + width_ms_ <= now_ms &&
+            std::find(drained_.begin(), drained_.end(), entry.first) == drained_.end()) {
+            drained_.push_back(entry.first);
+        }
+    }
+    return taken;
+}
+
+void ScheduleStore::retireTaken() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool removed = false;
+    for (int64_t bucket : drained_) {
+        auto it = loaded_.find(bucket);
+        if (it == loaded_.end() || it->second != 0) {
+            continue;
+        }
+        if (fd_bucket_ == bucket) {
+            closeFileLocked();
+        }
+        ::unlink(bucketPath(bucket).c_str());
+        buckets_.erase(bucket);
+        loaded_.erase(it);
+        checked_.erase(bucket);
+        removed = true;
+    }
+    drained_.clear();
+    if (removed && options_.sync) {
+        syncDirectory();
+    }
+}
+
+bool ScheduleStore::nextDeadline(Clock::time_point& deadline) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool found = false;
+    auto consider = [&](Clock::time_point time) {
+        if (!found || time < deadline) {
+            deadline = time;
+            found = true;
+        }
+    };
+
+    if (!timeline_.empty()) {
+        consider(timeline_.begin()->first);
+    }
+    for (int64_t bucket : buckets_) {
+        auto it = loaded_.find(bucket);
+        if (it == loaded_.end()) {
+            // The first bucket not read yet; later ones come after it
+            consider(fromMillis(bucket) - options_.window);
+            break;
+        }
+        if (it->second == 0) {
+            // Emptied, and removable once over
+            consider(fromMillis(bucket + width_ms_));
+        }
+    }
+    return found;
+}
+
+ScheduleStoreStats ScheduleStore::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ScheduleStoreStats stats = stats_;
+    stats.buckets = buckets_.size();
+    stats.loaded = loaded_.size();
+    stats.in_memory = held_.size();
+    return stats;
+}
+
+std::string ScheduleStore::getError() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+int64_t ScheduleStore::bucketOf(Clock::time_point time) const {
+    int64_t ms = toMillis(time);
+    int64_t bucket = ms / width_ms_;
+    if (ms < 0 && ms % width_ms_ != 0) {
+        bucket--;
+    }
+    return bucket * width_ms_;
+}
+
+bool ScheduleStore::parseId(const std::string& id, int64_t& bucket, std::string& base) {
+    size_t dash = id.find('-');
+    if (dash == std::string::npos || dash == 0 || dash > 16) {
+        return false;
+    }
+    unsigned long long start = 0;
+    for (size_t i = 0; i < dash; ++i) {
+        char c = id[i];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (digit < 0) {
+            return false;
+        }
+        start = start * 16 + static_cast<unsigned long long>(digit);
+    }
+    bucket = static_cast<int64_t>(start);
+    base = id.substr(dash + 1);
+    return true;
+}
+
+std::string ScheduleStore::makeId(int64_t bucket, const std::string& base) {
+    char prefix[24];
+    std::snprintf(prefix, sizeof(prefix), "%llx-", static_cast<unsigned long long>(bucket));
+    return prefix + base;
+}
+
+bool ScheduleStore::appendLocked(int64_t bucket, const std::string& payload) {
+    if (!openBucketLocked(bucket)) {
+        return false;
+    }
+    std::string record = frame(payload);
+    if (!writeAll(fd_, record.data(), record.size()) || (options_.sync && ::fdatasync(fd_) != 0)) {
+        error_ = "Cannot write " + bucketPath(bucket) + ": " + std::strerror(errno);
+        Logger::getInstance().error(error_);
+        closeFileLocked();
+        // Whatever part of the record made it is cut off before the next append
+        checked_.erase(bucket);
+        return false;
+    }
+    return true;
+}
+
+bool ScheduleStore::openBucketLocked(int64_t bucket) {
+    if (fd_ >= 0 && fd_bucket_ == bucket) {
+        return true;
+    }
+    closeFileLocked();
+
+    std::string path = bucketPath(bucket);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd < 0) {
+        error_ = "Cannot open " + path + ": " + std::strerror(errno);
+        Logger::getInstance().error(error_);
+        return false;
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        error_ = "Cannot stat " + path + ": " + std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        std::string header(kMagic, sizeof(kMagic));
+        putU32(header, kVersion);
+        if (!writeAll(fd, header.data(), header.size())) {
+            error_ = "Cannot write " + path + ": " + std::strerror(errno);
+            ::close(fd);
+            return false;
+        }
+        if (options_.sync) {
+            syncDirectory();
+        }
+        checked_.insert(bucket);
+    } else if (!checked_.count(bucket)) {
+        // Appending after a record torn by a crash would hide everything after it
+        std::string data;
+        if (!readFile(path, data) || data.size() < kHeaderSize ||
+            std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0 ||
+            getU32(data.data() + sizeof(kMagic)) != kVersion) {
+            error_ = "Bad schedule bucket file " + path;
+            Logger::getInstance().error(error_);
+            ::close(fd);
+            return false;
+        }
+        size_t intact = kHeaderSize + intactPrefix(data.data() + kHeaderSize, data.size() - kHeaderSize);
+        if (intact < data.size()) {
+            Logger::getInstance().warning("Truncating torn record at offset " + std::to_string(intact) +
+                                          " of " + path);
+            if (::ftruncate(fd, static_cast<off_t>(intact)) != 0) {
+                error_ = "Cannot truncate " + path + ": " + std::strerror(errno);
+                ::close(fd);
+                return false;
+            }
+        }
+        checked_.insert(bucket);
+    }
+
+    fd_ = fd;
+    fd_bucket_ = bucket;
+    return true;
+}
+
+void ScheduleStore::closeFileLocked() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool ScheduleStore::readBucketLocked(int64_t bucket, std::map<std::string, QueueItem>& items,
+                                     std::vector<std::string>& order) {
+    Logger& logger = Logger::getInstance();
+    std::string path = bucketPath(bucket);
+    std::string data;
+    if (!readFile(path, data)) {
+        logger.error("Cannot read schedule bucket file " + path);
+        return false;
+    }
+    if (data.size() < kHeaderSize || std::memcmp(data.data(), kMagic, sizeof(kMagic)) != 0 ||
+        getU32(data.data() + sizeof(kMagic)) != kVersion) {
+        logger.error("Bad schedule bucket file " + path);
+        return false;
+    }
+
+    // Replay in order: a later SCHEDULE of the same id replaces an earlier
+    // one, a CANCEL removes it. A torn tail is simply not read.
+    const char* records = data.data() + kHeaderSize;
+    size_t length = intactPrefix(records, data.size() - kHeaderSize);
+    for (size_t pos = 0; pos < length;) {
+        uint32_t size = getU32(records + pos);
+        const char* payload = records + pos + kFrameSize;
+        pos += kFrameSize + size;
+        if (size == 0) {
+            continue;
+        }
+
+        PayloadReader reader(payload + 1, size - 1);
+        switch (static_cast<RecordType>(payload[0])) {
+            case RecordType::SCHEDULE: {
+                QueueItem item;
+                if (getItem(reader, item)) {
+                    if (!items.count(item.id)) {
+                        order.push_back(item.id);
+                    }
+                    std::string id = item.id;
+                    items[id] = std::move(item);
+                }
+                break;
+            }
+            case RecordType::CANCEL: {
+                std::string id = reader.string();
+                if (reader.ok()) {
+                    items.erase(id);
+                }
+                break;
+            }
+            default:
+                logger.warning("Skipping unknown record in " + path);
+                break;
+        }
+    }
+    return true;
+}
+
+void ScheduleStore::loadLocked(int64_t bucket) {
+    std::map<std::string, QueueItem> items;
+    std::vector<std::string> order;
+    if (!readBucketLocked(bucket, items, order)) {
+        // Left on disk for inspection, and forgotten until the store is reopened
+        buckets_.erase(bucket);
+        return;
+    }
+    loaded_[bucket] = 0;
+    for (const auto& id : order) {
+        auto it = items.find(id);
+        if (it != items.end()) {
+            holdLocked(bucket, std::move(it->second));
+            items.erase(it);
+        }
+    }
+}
+
+void ScheduleStore::holdLocked(int64_t bucket, QueueItem item) {
+    releaseLocked(item.id, nullptr);
+    std::string id = item.id;
+    auto position = timeline_.emplace(item.scheduled_for, id);
+    held_[id] = Held{std::move(item), bucket, position};
+    loaded_[bucket]++;
+}
+
+bool ScheduleStore::releaseLocked(const std::string& id, QueueItem* item) {
+    auto it = held_.find(id);
+    if (it == held_.end()) {
+        return false;
+    }
+    if (item) {
+        *item = std::move(it->second.item);
+    }
+    timeline_.erase(it->second.position);
+    loaded_[it->second.bucket]--;
+    held_.erase(it);
+    return true;
+}
+
+std::string ScheduleStore::bucketPath(int64_t bucket) const {
+    char name[48];
+    std::snprintf(name, sizeof(name), "bucket-%016llx.sched", static_cast<unsigned long long>(bucket));
+    return (std::filesystem::path(options_.directory) / name).string();
+}
+
+void ScheduleStore::syncDirectory() const {
+    int fd = ::open(options_.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+} // namespace ssmtp_mailer
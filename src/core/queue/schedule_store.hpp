@@ -0,0 +1,169 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include "simple-smtp-mailer/queue_types.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Schedule store settings
+ */
+struct ScheduleStoreOptions {
+    std::string directory;               // Holds the bucket files; created if missing
+    std::chrono::seconds bucket_width;   // Span of send times sharing one bucket file
+    std::chrono::seconds window;         // How far ahead buckets are read into memory
+    bool sync;                           // fdatasync() every change before returning
+
+    ScheduleStoreOptions()
+        : bucket_width(std::chrono::seconds(60)), window(std::chrono::seconds(60)), sync(true) {}
+};
+
+/**
+ * @brief Schedule store statistics
+ */
+struct ScheduleStoreStats {
+    size_t buckets;        // Bucket files on disk
+    size_t loaded;         // Of those, read into memory
+    size_t in_memory;      // Emails held in memory, all due within the window
+    size_t scheduled;      // Emails scheduled since open
+    size_t cancelled;      // Cancelled since open
+    size_t rescheduled;    // Moved to another send time since open
+    size_t taken;          // Handed to the queue since open
+
+    ScheduleStoreStats()
+        : buckets(0), loaded(0), in_memory(0), scheduled(0), cancelled(0),
+          rescheduled(0), taken(0) {}
+};
+
+/**
+ * @brief Durable store of emails to send at a later time
+ *
+ * Send times are cut into buckets of bucket_width, each an append-only
+ * file of framed SCHEDULE and CANCEL records named by the bucket's start.
+ * Only the set of bucket names is kept in memory until a bucket comes
+ * within window of the current time; then its file is replayed and its
+ * emails are held, ordered by send time, until takeDue() hands them over.
+ * Memory therefore follows the emails due in the next window, not the
+ * whole backlog.
+ *
+ * An email's id starts with its bucket's start time, so cancel() appends
+ * its CANCEL record straight to the right file without an index. Moving
+ * an email to another bucket gives it a new id. A record torn by a crash
+ * is cut off the file before anything more is appended to it.
+ *
+ * Thread-safe.
+ */
+class ScheduleStore {
+public:
+    using Clock = std::chrono::system_clock;
+
+    explicit ScheduleStore(const ScheduleStoreOptions& options);
+    ~ScheduleStore();
+
+    ScheduleStore(const ScheduleStore&) = delete;
+    ScheduleStore& operator=(const ScheduleStore&) = delete;
+
+    /**
+     * @brief Open the store, listing the bucket files already there
+     * @return true on success; see getError() otherwise
+     */
+    bool open();
+
+    void close();
+
+    /**
+     * @brief Store an email until item.scheduled_for
+     * @param item Email; its id is replaced by one naming its bucket
+     * @return The new id, or empty on failure
+     */
+    std::string schedule(QueueItem item);
+
+    /**
+     * @brief Cancel a scheduled email
+     * @return false if the id names no bucket still pending, or the email
+     *         was already taken, or the cancellation could not be written
+     */
+    bool cancel(const std::string& id);
+
+    /**
+     * @brief Move a scheduled email to another send time
+     * @return The email's id from now on, or empty if it was not found
+     */
+    std::string reschedule(const std::string& id, Clock::time_point send_at);
+
+    /**
+     * @brief Hand over the emails due by now, oldest first
+     *
+     * Reads buckets coming within the window into memory first. The files
+     * of buckets that are over and emptied stay until retireTaken(), so a
+     * caller can make the emails durable elsewhere before they go.
+     * @return Number of emails appended to due
+     */
+    size_t takeDue(Clock::time_point now, std::vector<QueueItem>& due);
+
+    /**
+     * @brief Delete the files of buckets emptied by takeDue()
+     */
+    void retireTaken();
+
+    /**
+     * @brief When takeDue() next has work: the earliest send time held in
+     *        memory, or when the next bucket comes within the window
+     * @return false if the store is empty
+     */
+    bool nextDeadline(Clock::time_point& deadline) const;
+
+    ScheduleStoreStats getStats() const;
+    std::string getError() const;
+
+private:
+    using Timeline = std::multimap<Clock::time_point, std::string>;
+
+    // An email of a bucket read into memory
+    struct Held {
+        QueueItem item;
+        int64_t bucket;
+        Timeline::iterator position;
+    };
+
+    ScheduleStoreOptions options_;
+    int64_t width_ms_;
+
+    mutable std::mutex mutex_;
+    bool open_;
+    std::string error_;
+
+    std::set<int64_t> buckets_;                 // Start (ms) of every bucket file
+    std::map<int64_t, size_t> loaded_;          // Buckets read into memory, with emails held
+    std::set<int64_t> checked_;                 // Buckets whose tail was checked before appending
+    std::vector<int64_t> drained_;              // Emptied and over, awaiting retireTaken()
+    std::map<std::string, Held> held_;
+    Timeline timeline_;
+    ScheduleStoreStats stats_;
+
+    int fd_;
+    int64_t fd_bucket_;
+
+    int64_t bucketOf(Clock::time_point time) const;
+    static bool parseId(const std::string& id, int64_t& bucket, std::string& base);
+    static std::string makeId(int64_t bucket, const std::string& base);
+
+    bool appendLocked(int64_t bucket, const std::string& payload);
+    bool openBucketLocked(int64_t bucket);
+    void closeFileLocked();
+    bool readBucketLocked(int64_t bucket, std::map<std::string, QueueItem>& items,
+                          std::vector<std::string>& order);
+    void loadLocked(int64_t bucket);
+    void holdLocked(int64_t bucket, QueueItem item);
+    bool releaseLocked(const std::string& id, QueueItem* item);
+    std::string bucketPath(int64_t bucket) const;
+    void syncDirectory() const;
+};
+
+} // namespace ssmtp_mailer
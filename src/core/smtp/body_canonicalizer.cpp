@@ -0,0 +1,169 @@
+#include "core/smtp/body_canonicalizer.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define SSMTP_CANONICALIZER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace ssmtp_mailer {
+
+namespace {
+
+using ScanFunction = size_t (*)(const char*, size_t);
+
+/**
+ * @brief Offset of the first CR or LF in data, or length if there is none
+ */
+size_t scanScalar(const char* data, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] == '\r' || data[i] == '\n') {
+            return i;
+        }
+    }
+    return length;
+}
+
+#ifdef SSMTP_CANONICALIZER_X86
+
+size_t scanSSE2(const char* data, size_t length) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, cr), _mm_cmpeq_epi8(block, lf)));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+    }
+    return i + scanScalar(data + i, length - i);
+}
+
+__attribute__((target("avx2")))
+size_t scanAVX2(const char* data, size_t length) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, lf))));
+        if (mask != 0) {
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+        }
+    }
+    return i + scanSSE2(data + i, length - i);
+}
+
+#endif
+
+struct Scanner {
+    ScanFunction scan;
+    const char* name;
+};
+
+const Scanner& scanner() {
+    static const Scanner selected = [] {
+#ifdef SSMTP_CANONICALIZER_X86
+        if (__builtin_cpu_supports("avx2")) {
+            return Scanner{scanAVX2, "avx2"};
+        }
+        return Scanner{scanSSE2, "sse2"};
+#else
+        return Scanner{scanScalar, "scalar"};
+#endif
+    }();
+    return selected;
+}
+
+} // anonymous namespace
+
+BodyCanonicalizer::BodyCanonicalizer(bool dot_stuff, size_t max_line_length)
+    : dot_stuff_(dot_stuff), max_line_length_(0), line_length_(0), at_line_start_(true), after_cr_(false) {
+    setMaxLineLength(max_line_length);
+}
+
+size_t BodyCanonicalizer::maxOutput(size_t length) const {
+    // A byte becomes at most two (bare CR or LF to CRLF, a dot at line
+    // start to ".."), and a forced break adds CRLF after at least
+    // max_line_length_ - 1 input bytes
+    size_t breaks = max_line_length_ == 0 ? 0 : length / (max_line_length_ - 1) + 1;
+    return 2 * length + 2 * breaks;
+}
+
+void BodyCanonicalizer::setMaxLineLength(size_t max_line_length) {
+    // A stuffed dot counts towards the line, so it needs room for one more byte
+    max_line_length_ = max_line_length == 0 ? 0 : std::max<size_t>(max_line_length, 2);
+    if (max_line_length_ > 0) {
+        line_length_ = std::min(line_length_, max_line_length_);
+    }
+}
+
+size_t BodyCanonicalizer::transform(const char* input, size_t length, char* output) {
+    ScanFunction scan = scanner().scan;
+    char* out = output;
+    size_t i = 0;
+
+    while (i < length) {
+        if (at_line_start_ && dot_stuff_ && input[i] == '.') {
+            *out++ = '.';
+            line_length_++;
+        }
+
+        // Copy up to the next line break, or to where the line must be broken
+        size_t limit = length - i;
+        if (max_line_length_ > 0) {
+            limit = std::min(limit, max_line_length_ - line_length_);
+        }
+        size_t run = scan(input + i, limit);
+        if (run > 0) {
+            std::memcpy(out, input + i, run);
+            out += run;
+            i += run;
+            line_length_ += run;
+            at_line_start_ = false;
+            after_cr_ = false;
+            if (i == length) {
+                break;
+            }
+        }
+
+        char c = input[i];
+        if (c == '\n') {
+            // The CRLF was already written for the preceding CR
+            if (!after_cr_) {
+                *out++ = '\r';
+                *out++ = '\n';
+            }
+            after_cr_ = false;
+            i++;
+        } else if (c == '\r') {
+            *out++ = '\r';
+            *out++ = '\n';
+            after_cr_ = true;
+            i++;
+        } else {
+            // Line reached max_line_length_: break it here
+            *out++ = '\r';
+            *out++ = '\n';
+            after_cr_ = false;
+        }
+        line_length_ = 0;
+        at_line_start_ = true;
+    }
+    return static_cast<size_t>(out - output);
+}
+
+void BodyCanonicalizer::resetLine(bool at_line_start) {
+    at_line_start_ = at_line_start;
+    after_cr_ = false;
+    line_length_ = 0;
+}
+
+const char* BodyCanonicalizer::implementation() {
+    return scanner().name;
+}
+
+} // namespace ssmtp_mailer
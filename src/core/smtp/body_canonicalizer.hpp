@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Streaming transform of message text into its SMTP wire form
+ *
+ * In a single pass over each input block it
+ *  - turns bare LF, bare CR and CRLF into CRLF,
+ *  - dot-stuffs lines that start with '.' (RFC 5321 section 4.5.2), and
+ *  - breaks lines longer than the RFC 5322 limit of 998 octets.
+ *
+ * Runs of ordinary text between line breaks are located 16 or 32 bytes at
+ * a time (SSE2, or AVX2 when the CPU has it) and copied with memcpy; other
+ * targets use a scalar scan. State is carried across calls, so input may be
+ * split anywhere, including between CR and LF.
+ */
+class BodyCanonicalizer {
+public:
+    /**
+     * @brief Longest line allowed by RFC 5322, excluding CRLF
+     */
+    static constexpr size_t kMaxLineLength = 998;
+
+    /**
+     * @brief Constructor
+     * @param dot_stuff Whether to dot-stuff lines for the DATA command
+     * @param max_line_length Line length at which to break (0 to never break)
+     */
+    explicit BodyCanonicalizer(bool dot_stuff, size_t max_line_length = kMaxLineLength);
+
+    /**
+     * @brief Worst-case output size for length input bytes
+     * @param length Input length
+     * @return Capacity transform() may need
+     */
+    size_t maxOutput(size_t length) const;
+
+    /**
+     * @brief Change the line length limit, e.g. between headers and body
+     * @param max_line_length Line length at which to break (0 to never break)
+     */
+    void setMaxLineLength(size_t max_line_length);
+
+    /**
+     * @brief Canonicalize a block of input
+     * @param input Input bytes
+     * @param length Number of input bytes
+     * @param output Caller buffer of at least maxOutput(length) bytes
+     * @return Number of bytes written to output
+     */
+    size_t transform(const char* input, size_t length, char* output);
+
+    /**
+     * @brief Tell the transform that the caller wrote output of its own
+     *
+     * Used when literal CRLF-terminated text (MIME headers, base64 lines)
+     * is interleaved with transformed text.
+     * @param at_line_start Whether that output ended with CRLF
+     */
+    void resetLine(bool at_line_start);
+
+    /**
+     * @brief Check whether the output so far ends with CRLF (or is empty)
+     */
+    bool atLineStart() const { return at_line_start_; }
+
+    /**
+     * @brief Name of the scan implementation in use ("avx2", "sse2" or "scalar")
+     */
+    static const char* implementation();
+
+private:
+    bool dot_stuff_;
+    size_t max_line_length_;
+    size_t line_length_;
+    bool at_line_start_;
+    bool after_cr_;
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,999 @@
+#include "core/smtp/dns_resolver.hpp"
+#include "core/logging/logger.hpp"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+constexpr uint16_t kTypeA = 1;
+constexpr uint16_t kTypeCNAME = 5;
+constexpr uint16_t kTypeSOA = 6;
+constexpr uint16_t kTypeMX = 15;
+constexpr uint16_t kTypeAAAA = 28;
+constexpr uint16_t kClassIN = 1;
+
+constexpr int kRcodeNoError = 0;
+constexpr int kRcodeNXDomain = 3;
+
+// Large enough for any answer a nameserver sends without EDNS0
+constexpr size_t kMaxResponseSize = 4096;
+
+std::string normalizeHost(const std::string& host) {
+    std::string name = host;
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return name;
+}
+
+bool parseLiteral(const std::string& text, ResolvedAddress& result) {
+    result = ResolvedAddress();
+    auto* v4 = reinterpret_cast<struct sockaddr_in*>(&result.address);
+    if (inet_pton(AF_INET, text.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        result.length = sizeof(struct sockaddr_in);
+        return true;
+    }
+    auto* v6 = reinterpret_cast<struct sockaddr_in6*>(&result.address);
+    if (inet_pton(AF_INET6, text.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        result.length = sizeof(struct sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+void setPort(ResolvedAddress& address, int port) {
+    if (address.family() == AF_INET) {
+        reinterpret_cast<struct sockaddr_in*>(&address.address)->sin_port = htons(static_cast<uint16_t>(port));
+    } else if (address.family() == AF_INET6) {
+        reinterpret_cast<struct sockaddr_in6*>(&address.address)->sin6_port = htons(static_cast<uint16_t>(port));
+    }
+}
+
+/**
+ * @brief Parse "ip", "ip:port" or "[ipv6]:port"
+ */
+bool parseNameserver(const std::string& text, ResolvedAddress& result) {
+    std::string host = text;
+    int port = 53;
+
+    if (!host.empty() && host[0] == '[') {
+        size_t close_pos = host.find(']');
+        if (close_pos == std::string::npos) {
+            return false;
+        }
+        if (close_pos + 1 < host.size() && host[close_pos + 1] == ':') {
+            port = std::atoi(host.c_str() + close_pos + 2);
+        }
+        host = host.substr(1, close_pos - 1);
+    } else if (std::count(host.begin(), host.end(), ':') == 1) {
+        size_t colon = host.find(':');
+        port = std::atoi(host.c_str() + colon + 1);
+        host = host.substr(0, colon);
+    }
+
+    if (port <= 0 || port > 65535 || !parseLiteral(host, result)) {
+        return false;
+    }
+    setPort(result, port);
+    return true;
+}
+
+bool sameEndpoint(const struct sockaddr_storage& a, const struct sockaddr_storage& b) {
+    if (a.ss_family != b.ss_family) {
+        return false;
+    }
+    if (a.ss_family == AF_INET) {
+        auto* x = reinterpret_cast<const struct sockaddr_in*>(&a);
+        auto* y = reinterpret_cast<const struct sockaddr_in*>(&b);
+        return x->sin_port == y->sin_port && x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (a.ss_family == AF_INET6) {
+        auto* x = reinterpret_cast<const struct sockaddr_in6*>(&a);
+        auto* y = reinterpret_cast<const struct sockaddr_in6*>(&b);
+        return x->sin6_port == y->sin6_port &&
+               std::memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+    }
+    return false;
+}
+
+bool validHostName(const std::string& host) {
+    if (host.empty() || host.size() > 253) {
+        return false;
+    }
+    size_t start = 0;
+    while (start <= host.size()) {
+        size_t dot = host.find('.', start);
+        size_t end = dot == std::string::npos ? host.size() : dot;
+        if (end == start || end - start > 63) {
+            return false;
+        }
+        if (dot == std::string::npos) {
+            break;
+        }
+        start = dot + 1;
+    }
+    return true;
+}
+
+std::string buildQuery(const std::string& host, uint16_t id, uint16_t type) {
+    std::string packet;
+    packet.reserve(host.size() + 18);
+    packet += static_cast<char>(id >> 8);
+    packet += static_cast<char>(id & 0xff);
+    packet += '\x01';  // RD
+    packet += '\x00';
+    packet += std::string("\x00\x01\x00\x00\x00\x00\x00\x00", 8);  // QDCOUNT 1
+
+    size_t start = 0;
+    while (start < host.size()) {
+        size_t dot = host.find('.', start);
+        size_t end = dot == std::string::npos ? host.size() : dot;
+        packet += static_cast<char>(end - start);
+        packet.append(host, start, end - start);
+        start = end + 1;
+    }
+    packet += '\x00';
+    packet += static_cast<char>(type >> 8);
+    packet += static_cast<char>(type & 0xff);
+    packet += static_cast<char>(kClassIN >> 8);
+    packet += static_cast<char>(kClassIN & 0xff);
+    return packet;
+}
+
+uint16_t read16(const unsigned char* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+uint32_t read32(const unsigned char* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+/**
+ * @brief Skip an encoded (possibly compressed) name
+ * @return Offset just past the name, or 0 if it runs off the packet
+ */
+size_t skipName(const unsigned char* data, size_t length, size_t offset) {
+    while (offset < length) {
+        unsigned char label = data[offset];
+        if ((label & 0xc0) == 0xc0) {
+            return offset + 2 <= length ? offset + 2 : 0;
+        }
+        if (label == 0) {
+            return offset + 1;
+        }
+        offset += 1 + label;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decode an encoded (possibly compressed) name
+ * @return false if the name is malformed or runs off the packet
+ */
+bool readName(const unsigned char* data, size_t length, size_t offset, std::string& name) {
+    name.clear();
+    // Each pointer must go backwards, which also rules out loops
+    size_t limit = offset;
+    while (offset < length) {
+        unsigned char label = data[offset];
+        if ((label & 0xc0) == 0xc0) {
+            if (offset + 2 > length) {
+                return false;
+            }
+            size_t target = static_cast<size_t>(((label & 0x3f) << 8) | data[offset + 1]);
+            if (target >= limit) {
+                return false;
+            }
+            offset = limit = target;
+            continue;
+        }
+        if (label == 0) {
+            return true;
+        }
+        if (offset + 1 + label > length) {
+            return false;
+        }
+        if (!name.empty()) {
+            name += '.';
+        }
+        name.append(reinterpret_cast<const char*>(data + offset + 1), label);
+        offset += 1 + label;
+    }
+    return false;
+}
+
+/**
+ * @brief Host inside an address literal domain, "[192.0.2.1]" or "[ipv6:2001:db8::1]"
+ */
+bool parseAddressLiteral(const std::string& domain, std::string& host) {
+    if (domain.size() < 3 || domain.front() != '[' || domain.back() != ']') {
+        return false;
+    }
+    host = domain.substr(1, domain.size() - 2);
+    if (host.compare(0, 5, "ipv6:") == 0) {
+        host.erase(0, 5);
+    }
+    ResolvedAddress address;
+    return parseLiteral(host, address);
+}
+
+uint16_t randomId() {
+    thread_local std::mt19937 generator(std::random_device{}());
+    return static_cast<uint16_t>(generator() & 0xffff);
+}
+
+} // namespace
+
+// ResolvedAddress
+
+ResolvedAddress::ResolvedAddress() : length(0) {
+    std::memset(&address, 0, sizeof(address));
+}
+
+std::string ResolvedAddress::toString() const {
+    char buffer[INET6_ADDRSTRLEN] = {0};
+    if (family() == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const struct sockaddr_in*>(&address)->sin_addr,
+                  buffer, sizeof(buffer));
+    } else if (family() == AF_INET6) {
+        inet_ntop(AF_INET6, &reinterpret_cast<const struct sockaddr_in6*>(&address)->sin6_addr,
+                  buffer, sizeof(buffer));
+    }
+    return buffer;
+}
+
+// DNSQuery
+
+DNSQuery::DNSQuery(DNSResolver& resolver, const std::string& host, bool mail_exchange)
+    : resolver_(resolver), host_(host), mail_exchange_(mail_exchange), name_index_(0), attempts_(0),
+      timeout_(std::chrono::milliseconds(0)), fd_(-1),
+      family_(AF_UNSPEC), done_(false), server_index_(0), tries_left_(0), truncated_(false), tcp_(false),
+      out_offset_(0),
+      ttl_(std::numeric_limits<uint32_t>::max()), negative_ttl_(0), have_negative_ttl_(false),
+      server_failure_(false), nxdomain_(false), permanent_(false) {}
+
+DNSQuery::~DNSQuery() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void DNSQuery::onReady() {
+    if (done_ || fd_ < 0) {
+        return;
+    }
+    if (tcp_) {
+        exchangeTCP();
+        return;
+    }
+
+    unsigned char buffer[kMaxResponseSize];
+    while (!done_) {
+        struct sockaddr_storage from;
+        socklen_t from_length = sizeof(from);
+        ssize_t n = recvfrom(fd_, buffer, sizeof(buffer), 0,
+                             reinterpret_cast<struct sockaddr*>(&from), &from_length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        // Only accept answers from a nameserver we asked
+        bool known = std::any_of(servers_.begin(), servers_.end(), [&from](const ResolvedAddress& server) {
+            return sameEndpoint(server.address, from);
+        });
+        if (!known) {
+            continue;
+        }
+
+        handleResponse(buffer, static_cast<size_t>(n));
+        if (truncated_) {
+            sendTCP();
+            return;
+        }
+        bool answered = std::all_of(pending_.begin(), pending_.end(),
+                                    [](const Pending& p) { return p.answered; });
+        if (answered) {
+            complete();
+        }
+    }
+}
+
+void DNSQuery::sendTCP() {
+    truncated_ = false;
+
+    // Opened before the UDP socket is closed, so that owners see fd() change
+    const ResolvedAddress& server = servers_[server_index_ % servers_.size()];
+    int fd = socket(server.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error_ = "failed to create socket: " + std::string(strerror(errno));
+        complete();
+        return;
+    }
+    if (::connect(fd, reinterpret_cast<const struct sockaddr*>(&server.address), server.length) < 0 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        server_index_++;
+        send();
+        return;
+    }
+    close(fd_);
+    fd_ = fd;
+    tcp_ = true;
+
+    out_.clear();
+    out_offset_ = 0;
+    in_.clear();
+    for (const auto& pending : pending_) {
+        if (pending.answered) {
+            continue;
+        }
+        std::string packet = buildQuery(names_[name_index_], pending.id, pending.type);
+        out_.push_back(static_cast<char>(packet.size() >> 8));
+        out_.push_back(static_cast<char>(packet.size() & 0xff));
+        out_ += packet;
+        resolver_.countQuery();
+    }
+    deadline_ = std::chrono::steady_clock::now() + timeout_;
+}
+
+void DNSQuery::exchangeTCP() {
+    while (out_offset_ < out_.size()) {
+        ssize_t n = ::send(fd_, out_.data() + out_offset_, out_.size() - out_offset_, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            server_index_++;
+            send();
+            return;
+        }
+        out_offset_ += static_cast<size_t>(n);
+    }
+
+    bool closed = false;
+    char buffer[kMaxResponseSize];
+    while (true) {
+        ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            in_.append(buffer, static_cast<size_t>(n));
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            closed = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+    }
+
+    // Each answer comes with a two-byte length in front (RFC 1035 section 4.2.2)
+    while (in_.size() >= 2) {
+        const unsigned char* data = reinterpret_cast<const unsigned char*>(in_.data());
+        size_t length = read16(data);
+        if (in_.size() < 2 + length) {
+            break;
+        }
+        handleResponse(data + 2, length);
+        in_.erase(0, 2 + length);
+    }
+
+    bool answered = std::all_of(pending_.begin(), pending_.end(),
+                                [](const Pending& p) { return p.answered; });
+    if (answered) {
+        complete();
+    } else if (closed) {
+        server_index_++;
+        send();
+    }
+}
+
+void DNSQuery::closeTCP() {
+    close(fd_);
+    fd_ = -1;
+    tcp_ = false;
+    out_.clear();
+    out_offset_ = 0;
+    in_.clear();
+}
+
+void DNSQuery::onTimeout() {
+    if (done_) {
+        return;
+    }
+    server_index_++;
+    send();
+}
+
+std::vector<ResolvedAddress> DNSQuery::addresses(int port) const {
+    std::vector<ResolvedAddress> v6;
+    std::vector<ResolvedAddress> v4;
+    for (const auto& address : found_) {
+        (address.family() == AF_INET6 ? v6 : v4).push_back(address);
+    }
+
+    std::vector<ResolvedAddress> ordered;
+    ordered.reserve(found_.size());
+    for (size_t i = 0; i < std::max(v6.size(), v4.size()); ++i) {
+        if (i < v6.size()) {
+            ordered.push_back(v6[i]);
+        }
+        if (i < v4.size()) {
+            ordered.push_back(v4[i]);
+        }
+    }
+    for (auto& address : ordered) {
+        setPort(address, port);
+    }
+    return ordered;
+}
+
+std::string DNSQuery::cacheKey() const {
+    // A space cannot appear in a host name, so the keys never collide. A
+    // name that went through the search list may answer differently from
+    // the same name taken as absolute.
+    if (mail_exchange_) {
+        return "MX " + host_;
+    }
+    return names_.size() > 1 ? "search " + host_ : host_;
+}
+
+void DNSQuery::start() {
+    pending_.clear();
+    if (mail_exchange_) {
+        pending_.push_back(Pending{kTypeMX, randomId(), false});
+    } else {
+        pending_.push_back(Pending{kTypeAAAA, randomId(), false});
+        pending_.push_back(Pending{kTypeA, randomId(), false});
+        if (pending_[1].id == pending_[0].id) {
+            pending_[1].id++;
+        }
+    }
+    tries_left_ = attempts_;
+    send();
+}
+
+void DNSQuery::send() {
+    if (tries_left_ <= 0) {
+        // An answer for one family is still worth using
+        if (found_.empty() && exchanges_.empty()) {
+            error_ = "timed out waiting for nameserver";
+        }
+        complete();
+        return;
+    }
+    tries_left_--;
+    if (tcp_) {
+        // Back to UDP for the next nameserver or the next name
+        closeTCP();
+    }
+
+    const ResolvedAddress& server = servers_[server_index_ % servers_.size()];
+    if (fd_ < 0 || family_ != server.family()) {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        family_ = server.family();
+        fd_ = socket(family_, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd_ < 0) {
+            error_ = "failed to create socket: " + std::string(strerror(errno));
+            complete();
+            return;
+        }
+    }
+
+    for (const auto& pending : pending_) {
+        if (pending.answered) {
+            continue;
+        }
+        std::string packet = buildQuery(names_[name_index_], pending.id, pending.type);
+        sendto(fd_, packet.data(), packet.size(), 0,
+               reinterpret_cast<const struct sockaddr*>(&server.address), server.length);
+        resolver_.countQuery();
+    }
+    deadline_ = std::chrono::steady_clock::now() + timeout_;
+}
+
+void DNSQuery::handleResponse(const unsigned char* data, size_t length) {
+    if (length < 12) {
+        return;
+    }
+
+    uint16_t id = read16(data);
+    auto pending = std::find_if(pending_.begin(), pending_.end(),
+                                [id](const Pending& p) { return p.id == id && !p.answered; });
+    if (pending == pending_.end()) {
+        return;
+    }
+
+    uint16_t flags = read16(data + 2);
+    if (!(flags & 0x8000)) {
+        return;
+    }
+    int rcode = flags & 0x000f;
+    bool truncated = (flags & 0x0200) != 0;
+    uint16_t questions = read16(data + 4);
+    uint16_t answers = read16(data + 6);
+    uint16_t authority = read16(data + 8);
+
+    if (rcode != kRcodeNoError && rcode != kRcodeNXDomain) {
+        server_failure_ = true;
+        pending->answered = true;
+        return;
+    }
+
+    size_t offset = 12;
+    for (uint16_t i = 0; i < questions; ++i) {
+        offset = skipName(data, length, offset);
+        if (offset == 0 || offset + 4 > length) {
+            return;
+        }
+        offset += 4;
+    }
+
+    size_t before = found_.size() + exchanges_.size();
+    uint32_t answer_ttl = std::numeric_limits<uint32_t>::max();
+    for (uint16_t i = 0; i < answers; ++i) {
+        offset = skipName(data, length, offset);
+        if (offset == 0 || offset + 10 > length) {
+            return;
+        }
+        uint16_t type = read16(data + offset);
+        uint16_t klass = read16(data + offset + 2);
+        uint32_t ttl = read32(data + offset + 4);
+        uint16_t rdlength = read16(data + offset + 8);
+        offset += 10;
+        if (offset + rdlength > length) {
+            return;
+        }
+
+        if (klass == kClassIN && type == pending->type) {
+            ResolvedAddress address;
+            if (type == kTypeA && rdlength == 4) {
+                auto* v4 = reinterpret_cast<struct sockaddr_in*>(&address.address);
+                v4->sin_family = AF_INET;
+                std::memcpy(&v4->sin_addr, data + offset, 4);
+                address.length = sizeof(struct sockaddr_in);
+                found_.push_back(address);
+                answer_ttl = std::min(answer_ttl, ttl);
+            } else if (type == kTypeAAAA && rdlength == 16) {
+                auto* v6 = reinterpret_cast<struct sockaddr_in6*>(&address.address);
+                v6->sin6_family = AF_INET6;
+                std::memcpy(&v6->sin6_addr, data + offset, 16);
+                address.length = sizeof(struct sockaddr_in6);
+                found_.push_back(address);
+                answer_ttl = std::min(answer_ttl, ttl);
+            } else if (type == kTypeMX && rdlength >= 3) {
+                MXRecord record;
+                record.preference = read16(data + offset);
+                if (readName(data, offset + rdlength, offset + 2, record.exchange)) {
+                    record.exchange = normalizeHost(record.exchange);
+                    exchanges_.push_back(record);
+                    answer_ttl = std::min(answer_ttl, ttl);
+                }
+            }
+        } else if (klass == kClassIN && type == kTypeCNAME) {
+            // The answer is only valid as long as every alias in the chain
+            answer_ttl = std::min(answer_ttl, ttl);
+        }
+        offset += rdlength;
+    }
+
+    if (found_.size() + exchanges_.size() > before) {
+        ttl_ = std::min(ttl_, answer_ttl);
+    } else if (truncated && !tcp_) {
+        // Asked again over TCP, so the question stays open
+        truncated_ = true;
+        return;
+    } else if (truncated) {
+        server_failure_ = true;
+    } else {
+        if (rcode == kRcodeNXDomain) {
+            nxdomain_ = true;
+        }
+        // Negative answers are cached for min(SOA TTL, SOA MINIMUM) (RFC 2308)
+        for (uint16_t i = 0; i < authority; ++i) {
+            offset = skipName(data, length, offset);
+            if (offset == 0 || offset + 10 > length) {
+                break;
+            }
+            uint16_t type = read16(data + offset);
+            uint32_t ttl = read32(data + offset + 4);
+            uint16_t rdlength = read16(data + offset + 8);
+            offset += 10;
+            if (offset + rdlength > length) {
+                break;
+            }
+            if (type == kTypeSOA && rdlength >= 22) {
+                uint32_t minimum = read32(data + offset + rdlength - 4);
+                uint32_t negative = std::min(ttl, minimum);
+                negative_ttl_ = have_negative_ttl_ ? std::min(negative_ttl_, negative) : negative;
+                have_negative_ttl_ = true;
+            }
+            offset += rdlength;
+        }
+    }
+    pending->answered = true;
+}
+
+void DNSQuery::complete() {
+    if (found_.empty() && exchanges_.empty() && error_.empty() && !server_failure_ &&
+        name_index_ + 1 < names_.size()) {
+        // Not under this name: go on to the next one of the search list
+        name_index_++;
+        nxdomain_ = false;
+        start();
+        return;
+    }
+
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    done_ = true;
+
+    if (!found_.empty() || !exchanges_.empty()) {
+        error_.clear();
+        std::stable_sort(exchanges_.begin(), exchanges_.end(), [](const MXRecord& a, const MXRecord& b) {
+            return a.preference != b.preference ? a.preference < b.preference : a.exchange < b.exchange;
+        });
+        resolver_.store(*this, ttl_);
+        checkExchanges();
+        return;
+    }
+    if (!error_.empty() || server_failure_) {
+        if (error_.empty()) {
+            error_ = "nameserver failure";
+        }
+        // Transient; not cached
+        resolver_.countFailure();
+        return;
+    }
+
+    long long negative_ttl = have_negative_ttl_ ? static_cast<long long>(negative_ttl_) : -1;
+    if (mail_exchange_ && !nxdomain_) {
+        // No MX records: the domain is its own mail exchanger (RFC 5321 section 5.1)
+        exchanges_.push_back(MXRecord(0, host_));
+        resolver_.store(*this, negative_ttl);
+        return;
+    }
+
+    error_ = nxdomain_ ? (mail_exchange_ ? "domain not found" : "host not found") : "no address records";
+    permanent_ = nxdomain_;
+    resolver_.store(*this, negative_ttl);
+}
+
+void DNSQuery::checkExchanges() {
+    // A null MX says the domain accepts no mail at all (RFC 7505)
+    bool null_mx = std::any_of(exchanges_.begin(), exchanges_.end(),
+                               [](const MXRecord& record) { return record.exchange.empty(); });
+    if (null_mx) {
+        exchanges_.clear();
+        error_ = "domain does not accept mail (null MX)";
+        permanent_ = true;
+    }
+}
+
+// DNSResolver
+
+DNSResolver& DNSResolver::getInstance() {
+    static DNSResolver instance;
+    return instance;
+}
+
+DNSResolver::DNSResolver() : loaded_(false), ndots_(1) {}
+
+void DNSResolver::setOptions(const DNSResolverOptions& options) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    options_ = options;
+    loaded_ = false;
+    cache_.clear();
+}
+
+DNSResolverOptions DNSResolver::getOptions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return options_;
+}
+
+std::unique_ptr<DNSQuery> DNSResolver::query(const std::string& host) {
+    std::unique_ptr<DNSQuery> query(new DNSQuery(*this, normalizeHost(host), false));
+    bool absolute = !host.empty() && host.back() == '.';
+
+    ResolvedAddress literal;
+    if (parseLiteral(query->host_, literal)) {
+        query->found_.push_back(literal);
+        query->done_ = true;
+        return query;
+    }
+    if (!validHostName(query->host_)) {
+        query->error_ = "invalid host name";
+        query->done_ = true;
+        return query;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loadConfiguration();
+
+        auto host_entry = hosts_.find(query->host_);
+        if (host_entry != hosts_.end()) {
+            query->found_ = host_entry->second;
+            query->done_ = true;
+            return query;
+        }
+        query->names_ = searchNames(query->host_, absolute);
+    }
+    return lookup(std::move(query));
+}
+
+std::unique_ptr<DNSQuery> DNSResolver::lookup(std::unique_ptr<DNSQuery> query) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        loadConfiguration();
+
+        auto cached = cache_.find(query->cacheKey());
+        if (cached != cache_.end()) {
+            if (std::chrono::steady_clock::now() < cached->second.expires) {
+                if (cached->second.addresses.empty() && cached->second.exchanges.empty()) {
+                    stats_.negative_hits++;
+                    query->error_ = cached->second.error;
+                    query->permanent_ = cached->second.permanent;
+                } else {
+                    stats_.hits++;
+                    query->found_ = cached->second.addresses;
+                    query->exchanges_ = cached->second.exchanges;
+                }
+                query->done_ = true;
+                query->checkExchanges();
+                return query;
+            }
+            cache_.erase(cached);
+        }
+
+        stats_.misses++;
+        query->servers_ = nameservers_;
+        query->timeout_ = options_.timeout;
+        query->attempts_ = std::max(1, options_.attempts) * static_cast<int>(nameservers_.size());
+        if (query->names_.empty()) {
+            query->names_.push_back(query->host_);
+        }
+    }
+
+    query->start();
+    return query;
+}
+
+std::unique_ptr<DNSQuery> DNSResolver::queryMX(const std::string& domain) {
+    std::unique_ptr<DNSQuery> query(new DNSQuery(*this, normalizeHost(domain), true));
+
+    std::string literal;
+    if (parseAddressLiteral(query->host_, literal)) {
+        query->exchanges_.push_back(MXRecord(0, literal));
+        query->done_ = true;
+        return query;
+    }
+    if (!validHostName(query->host_)) {
+        query->error_ = "invalid domain name";
+        query->done_ = true;
+        return query;
+    }
+    return lookup(std::move(query));
+}
+
+bool DNSResolver::resolve(const std::string& host, int port, std::vector<ResolvedAddress>& addresses,
+                          std::string& error) {
+    std::unique_ptr<DNSQuery> lookup = query(host);
+    wait(*lookup);
+
+    if (!lookup->success()) {
+        error = "Failed to resolve hostname " + host + ": " + lookup->getError();
+        return false;
+    }
+    addresses = lookup->addresses(port);
+    return true;
+}
+
+bool DNSResolver::resolveMX(const std::string& domain, std::vector<MXRecord>& exchanges, std::string& error) {
+    std::unique_ptr<DNSQuery> lookup = queryMX(domain);
+    wait(*lookup);
+
+    if (!lookup->success()) {
+        error = "Failed to look up mail exchangers for " + domain + ": " + lookup->getError();
+        return false;
+    }
+    exchanges = lookup->exchanges();
+    return true;
+}
+
+void DNSResolver::wait(DNSQuery& query) {
+    while (!query.done()) {
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+            query.deadline() - std::chrono::steady_clock::now()).count();
+        struct pollfd pfd;
+        pfd.fd = query.fd();
+        pfd.events = POLLIN | (query.wantsWrite() ? POLLOUT : 0);
+        pfd.revents = 0;
+        int rc = poll(&pfd, 1, remaining > 0 ? static_cast<int>(remaining) : 0);
+        if (rc > 0) {
+            query.onReady();
+        } else if (rc == 0 || errno != EINTR) {
+            if (std::chrono::steady_clock::now() >= query.deadline()) {
+                query.onTimeout();
+            }
+        }
+    }
+}
+
+void DNSResolver::clearCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cache_.clear();
+}
+
+DNSResolverStats DNSResolver::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    DNSResolverStats stats = stats_;
+    stats.cached_entries = cache_.size();
+    return stats;
+}
+
+void DNSResolver::loadConfiguration() {
+    auto now = std::chrono::steady_clock::now();
+    if (loaded_ && now - hosts_loaded_ < options_.hosts_ttl) {
+        return;
+    }
+    Logger& logger = Logger::getInstance();
+
+    if (!loaded_) {
+        nameservers_.clear();
+        search_.clear();
+        ndots_ = options_.ndots;
+        std::vector<std::string> servers = options_.nameservers;
+        std::vector<std::string> search = options_.search;
+        if (servers.empty() && !options_.resolv_conf.empty()) {
+            std::ifstream resolv(options_.resolv_conf);
+            std::string line;
+            std::vector<std::string> resolv_search;
+            while (std::getline(resolv, line)) {
+                std::istringstream fields(line);
+                std::string keyword;
+                std::string value;
+                if (!(fields >> keyword)) {
+                    continue;
+                }
+                if (keyword == "nameserver" && fields >> value) {
+                    servers.push_back(value);
+                } else if (keyword == "search" || keyword == "domain") {
+                    // Whichever comes last wins, as in resolv.conf(5)
+                    resolv_search.clear();
+                    while (fields >> value) {
+                        resolv_search.push_back(value);
+                    }
+                } else if (keyword == "options") {
+                    while (fields >> value) {
+                        if (value.compare(0, 6, "ndots:") == 0) {
+                            ndots_ = std::min(std::max(std::atoi(value.c_str() + 6), 0), 15);
+                        }
+                    }
+                }
+            }
+            if (search.empty()) {
+                search = resolv_search;
+            }
+        }
+        for (const auto& domain : search) {
+            std::string name = normalizeHost(domain);
+            if (validHostName(name)) {
+                search_.push_back(name);
+            }
+        }
+        for (const auto& server : servers) {
+            ResolvedAddress address;
+            if (parseNameserver(server, address)) {
+                nameservers_.push_back(address);
+            } else {
+                logger.warning("Ignoring invalid nameserver: " + server);
+            }
+        }
+        if (nameservers_.empty()) {
+            // Same fallback as the system resolver
+            ResolvedAddress local;
+            parseNameserver("127.0.0.1", local);
+            nameservers_.push_back(local);
+        }
+    }
+
+    hosts_.clear();
+    if (!options_.hosts_file.empty()) {
+        std::ifstream hosts(options_.hosts_file);
+        std::string line;
+        while (std::getline(hosts, line)) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string text;
+            ResolvedAddress address;
+            if (!(fields >> text) || !parseLiteral(text, address)) {
+                continue;
+            }
+            std::string name;
+            while (fields >> name) {
+                hosts_[normalizeHost(name)].push_back(address);
+            }
+        }
+    }
+
+    loaded_ = true;
+    hosts_loaded_ = now;
+}
+
+std::vector<std::string> DNSResolver::searchNames(const std::string& host, bool absolute) const {
+    if (absolute || search_.empty()) {
+        return {host};
+    }
+
+    // Names with at least ndots dots are tried as they are first, others last
+    std::vector<std::string> names;
+    bool qualified = std::count(host.begin(), host.end(), '.') >= ndots_;
+    if (qualified) {
+        names.push_back(host);
+    }
+    for (const auto& domain : search_) {
+        std::string name = host + "." + domain;
+        if (validHostName(name)) {
+            names.push_back(name);
+        }
+    }
+    if (!qualified) {
+        names.push_back(host);
+    }
+    return names;
+}
+
+void DNSResolver::store(const DNSQuery& query, long long ttl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::chrono::seconds lifetime = ttl < 0 ? options_.negative_ttl : std::chrono::seconds(ttl);
+    lifetime = std::max(lifetime, options_.min_ttl);
+    lifetime = std::min(lifetime, options_.max_ttl);
+    if (lifetime.count() <= 0) {
+        return;
+    }
+
+    CacheEntry& entry = cache_[query.cacheKey()];
+    entry.addresses = query.found_;
+    entry.exchanges = query.exchanges_;
+    entry.error = query.error_;
+    entry.permanent = query.permanent_;
+    entry.expires = std::chrono::steady_clock::now() + lifetime;
+}
+
+void DNSResolver::countQuery() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.queries++;
+}
+
+void DNSResolver::countFailure() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.failures++;
+}
+
+} // namespace ssmtp_mailer
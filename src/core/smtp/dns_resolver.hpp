@@ -0,0 +1,328 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <sys/socket.h>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief One address a host name resolved to
+ */
+struct ResolvedAddress {
+    struct sockaddr_storage address;
+    socklen_t length;
+
+    ResolvedAddress();
+
+    int family() const { return address.ss_family; }
+
+    /**
+     * @brief Printable form of the address (without port)
+     */
+    std::string toString() const;
+};
+
+/**
+ * @brief One mail exchanger for a domain
+ */
+struct MXRecord {
+    uint16_t preference;
+    std::string exchange;  // Host name; empty for a null MX (RFC 7505)
+
+    MXRecord() : preference(0) {}
+    MXRecord(uint16_t preference, const std::string& exchange)
+        : preference(preference), exchange(exchange) {}
+};
+
+/**
+ * @brief Resolver settings
+ */
+struct DNSResolverOptions {
+    std::vector<std::string> nameservers;   // "ip", "ip:port" or "[ipv6]:port"; empty reads resolv_conf
+    std::string resolv_conf;                // Nameserver source when nameservers is empty
+    std::vector<std::string> search;        // Domains tried for short host names; empty reads resolv_conf
+    int ndots;                              // Dots that make a name tried as is first; resolv_conf overrides
+    std::string hosts_file;                 // Consulted before DNS; empty to skip
+    std::chrono::milliseconds timeout;      // Per attempt, per nameserver
+    int attempts;                           // Rounds over the nameserver list
+    std::chrono::seconds min_ttl;           // Floor for cached answers
+    std::chrono::seconds max_ttl;           // Ceiling for cached answers
+    std::chrono::seconds negative_ttl;      // For NXDOMAIN/NODATA without an SOA record
+    std::chrono::seconds hosts_ttl;         // How long the parsed hosts file is trusted
+
+    DNSResolverOptions()
+        : resolv_conf("/etc/resolv.conf"), ndots(1), hosts_file("/etc/hosts"),
+          timeout(std::chrono::milliseconds(2000)), attempts(2),
+          min_ttl(std::chrono::seconds(0)), max_ttl(std::chrono::seconds(3600)),
+          negative_ttl(std::chrono::seconds(60)), hosts_ttl(std::chrono::seconds(60)) {}
+};
+
+/**
+ * @brief Resolver statistics
+ */
+struct DNSResolverStats {
+    size_t hits;             // Lookups answered from the positive cache
+    size_t negative_hits;    // Lookups answered from the negative cache
+    size_t misses;           // Lookups that needed a DNS query
+    size_t queries;          // DNS packets sent, including retransmissions
+    size_t failures;         // Lookups that got no usable answer (timeout, SERVFAIL)
+    size_t cached_entries;   // Names currently cached
+
+    DNSResolverStats()
+        : hits(0), negative_hits(0), misses(0), queries(0), failures(0), cached_entries(0) {}
+
+    /**
+     * @brief Fraction of lookups answered from the cache
+     */
+    double hitRate() const {
+        size_t total = hits + negative_hits + misses;
+        return total == 0 ? 0.0 : static_cast<double>(hits + negative_hits) / total;
+    }
+};
+
+class DNSResolver;
+
+/**
+ * @brief A single non-blocking A + AAAA lookup, or an MX lookup
+ *
+ * A query answered from an IP literal, the hosts file or the cache is done
+ * as soon as it is created. Otherwise the owner waits for fd() to become
+ * readable, or writable while wantsWrite(), and calls onReady(), and calls
+ * onTimeout() once deadline() has passed. fd() and deadline() may change
+ * after either call: onTimeout() moves on to the next nameserver, and a
+ * truncated UDP answer moves the query to TCP (RFC 7766). Both record
+ * types are asked for in parallel. A host name
+ * that is not found is tried under each domain of the search list in
+ * turn, as the system resolver does; mail domains never are.
+ */
+class DNSQuery {
+public:
+    ~DNSQuery();
+
+    DNSQuery(const DNSQuery&) = delete;
+    DNSQuery& operator=(const DNSQuery&) = delete;
+
+    bool done() const { return done_; }
+    bool success() const { return done_ && error_.empty(); }
+    const std::string& getError() const { return error_; }
+    const std::string& host() const { return host_; }
+
+    /**
+     * @brief Whether the lookup failed in a way no retry will mend: the name
+     *        does not exist (NXDOMAIN), or the domain has a null MX
+     */
+    bool failedPermanently() const { return done_ && permanent_; }
+
+    int fd() const { return fd_; }
+    bool wantsWrite() const { return tcp_ && out_offset_ < out_.size(); }
+    std::chrono::steady_clock::time_point deadline() const { return deadline_; }
+
+    void onReady();
+    void onTimeout();
+
+    /**
+     * @brief Resolved addresses with port filled in, in connection order
+     *
+     * IPv6 and IPv4 addresses are interleaved, IPv6 first (RFC 8305).
+     * @param port Port to connect to
+     */
+    std::vector<ResolvedAddress> addresses(int port) const;
+
+    /**
+     * @brief Mail exchangers of an MX lookup, most preferred first
+     *
+     * Equal preferences are ordered by name so that every lookup of a
+     * domain picks the same host. A domain without MX records has itself
+     * as its only exchanger (RFC 5321 section 5.1).
+     */
+    const std::vector<MXRecord>& exchanges() const { return exchanges_; }
+
+private:
+    friend class DNSResolver;
+
+    struct Pending {
+        uint16_t type;
+        uint16_t id;
+        bool answered;
+    };
+
+    DNSQuery(DNSResolver& resolver, const std::string& host, bool mail_exchange);
+
+    std::string cacheKey() const;
+    void start();
+    void send();
+    void sendTCP();
+    void exchangeTCP();
+    void closeTCP();
+    void handleResponse(const unsigned char* data, size_t length);
+    void complete();
+    void checkExchanges();
+
+    DNSResolver& resolver_;
+    std::string host_;
+    bool mail_exchange_;
+    std::vector<std::string> names_;   // Names to ask for in turn: host_, with the search list applied
+    size_t name_index_;
+    int attempts_;                     // Packets per name: rounds times nameservers
+    std::vector<ResolvedAddress> servers_;
+    std::chrono::milliseconds timeout_;
+    int fd_;
+    int family_;
+    bool done_;
+    std::string error_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::vector<Pending> pending_;
+    size_t server_index_;
+    int tries_left_;
+    bool truncated_;                   // A UDP answer did not fit; ask again over TCP
+    bool tcp_;
+    std::string out_;                  // Length-prefixed TCP queries
+    size_t out_offset_;
+    std::string in_;                   // TCP bytes not yet making up a whole answer
+
+    std::vector<ResolvedAddress> found_;
+    std::vector<MXRecord> exchanges_;
+    uint32_t ttl_;
+    uint32_t negative_ttl_;
+    bool have_negative_ttl_;
+    bool server_failure_;
+    bool nxdomain_;
+    bool permanent_;
+};
+
+/**
+ * @brief Process-wide stub resolver with a TTL-respecting cache
+ *
+ * Queries the nameservers from resolv.conf (or the configured ones) over
+ * UDP, and over TCP for truncated answers, without blocking, so
+ * SMTPEventLoop can keep resolving hosts while other sessions are busy.
+ * Short host names go through the search list by the ndots rule, as in
+ * resolv.conf(5). Answers are cached for their DNS TTL; NXDOMAIN and
+ * NODATA answers are cached for the SOA minimum (RFC 2308). Replaces
+ * gethostbyname(), which was blocking, IPv4-only and uncached. MX lookups
+ * share the cache and serve direct-to-MX delivery.
+ */
+class DNSResolver {
+public:
+    /**
+     * @brief Get the resolver instance
+     * @return Reference to the resolver
+     */
+    static DNSResolver& getInstance();
+
+    DNSResolver(const DNSResolver&) = delete;
+    DNSResolver& operator=(const DNSResolver&) = delete;
+
+    /**
+     * @brief Replace the resolver settings and clear the cache
+     * @param options New settings
+     */
+    void setOptions(const DNSResolverOptions& options);
+
+    /**
+     * @brief Get the current settings
+     */
+    DNSResolverOptions getOptions() const;
+
+    /**
+     * @brief Start a lookup
+     * @param host Host name or IP literal
+     * @return Query, possibly already done
+     */
+    std::unique_ptr<DNSQuery> query(const std::string& host);
+
+    /**
+     * @brief Resolve host, blocking until the lookup completes
+     * @param host Host name or IP literal
+     * @param port Port to fill into the addresses
+     * @param addresses Set to the addresses in connection order
+     * @param error Set on failure
+     * @return true if at least one address was found
+     */
+    bool resolve(const std::string& host, int port, std::vector<ResolvedAddress>& addresses,
+                 std::string& error);
+
+    /**
+     * @brief Start an MX lookup
+     * @param domain Mail domain, or an address literal such as "[192.0.2.1]"
+     * @return Query, possibly already done
+     */
+    std::unique_ptr<DNSQuery> queryMX(const std::string& domain);
+
+    /**
+     * @brief Look up the mail exchangers of domain, blocking until done
+     * @param domain Mail domain, or an address literal
+     * @param exchanges Set to the exchangers, most preferred first
+     * @param error Set on failure, including a null MX
+     * @return true if mail for the domain can be delivered somewhere
+     */
+    bool resolveMX(const std::string& domain, std::vector<MXRecord>& exchanges, std::string& error);
+
+    /**
+     * @brief Drop every cached answer
+     */
+    void clearCache();
+
+    /**
+     * @brief Get resolver statistics
+     * @return Snapshot of the counters
+     */
+    DNSResolverStats getStats() const;
+
+private:
+    friend class DNSQuery;
+
+    struct CacheEntry {
+        std::vector<ResolvedAddress> addresses;  // Both empty for a negative entry
+        std::vector<MXRecord> exchanges;
+        std::string error;
+        bool permanent;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    DNSResolver();
+
+    void loadConfiguration();
+
+    /**
+     * @brief Names to ask for, in order, when looking up host
+     * @param absolute Whether host was written with a trailing dot
+     */
+    std::vector<std::string> searchNames(const std::string& host, bool absolute) const;
+
+    /**
+     * @brief Answer query from the cache or send it to the nameservers
+     */
+    std::unique_ptr<DNSQuery> lookup(std::unique_ptr<DNSQuery> query);
+
+    /**
+     * @brief Drive query to completion with poll()
+     */
+    static void wait(DNSQuery& query);
+
+    /**
+     * @brief Cache the answer of query; a negative ttl selects the default negative TTL
+     */
+    void store(const DNSQuery& query, long long ttl);
+    void countQuery();
+    void countFailure();
+
+    mutable std::mutex mutex_;
+    DNSResolverOptions options_;
+    bool loaded_;
+    std::vector<ResolvedAddress> nameservers_;
+    std::vector<std::string> search_;
+    int ndots_;
+    std::map<std::string, std::vector<ResolvedAddress>> hosts_;
+    std::chrono::steady_clock::time_point hosts_loaded_;
+    std::map<std::string, CacheEntry> cache_;
+    DNSResolverStats stats_;
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,302 @@
+#include "core/smtp/mime_stream.hpp"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+// Raw bytes canonicalized per fill step
+constexpr size_t kSourceBlock = 16 * 1024;
+
+// Attachment bytes encoded per fill step: whole 76-column base64 lines
+constexpr size_t kBase64LineInput = 57;
+constexpr size_t kFileBlock = kBase64LineInput * 256;
+
+const char kBase64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void appendBase64(std::string& out, const unsigned char* data, size_t length) {
+    size_t i = 0;
+    for (; i + 3 <= length; i += 3) {
+        unsigned int triple = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+        out.push_back(kBase64Chars[(triple >> 18) & 0x3F]);
+        out.push_back(kBase64Chars[(triple >> 12) & 0x3F]);
+        out.push_back(kBase64Chars[(triple >> 6) & 0x3F]);
+        out.push_back(kBase64Chars[triple & 0x3F]);
+    }
+    if (i < length) {
+        unsigned int triple = data[i] << 16;
+        if (i + 1 < length) {
+            triple |= data[i + 1] << 8;
+        }
+        out.push_back(kBase64Chars[(triple >> 18) & 0x3F]);
+        out.push_back(kBase64Chars[(triple >> 12) & 0x3F]);
+        out.push_back(i + 1 < length ? kBase64Chars[(triple >> 6) & 0x3F] : '=');
+        out.push_back('=');
+    }
+}
+
+/**
+ * @brief Append "Name: a, b, ..." folded before an address once a line passes 78 characters
+ */
+void appendAddressHeader(std::string& headers, const std::string& name, const std::vector<std::string>& addresses) {
+    size_t line_start = headers.size();
+    headers += name + ": ";
+    for (size_t i = 0; i < addresses.size(); ++i) {
+        if (i > 0) {
+            headers += ',';
+            if (headers.size() - line_start + 1 + addresses[i].size() > 78) {
+                line_start = headers.size() + 2;
+                headers += "\r\n";
+            }
+            headers += ' ';
+        }
+        headers += addresses[i];
+    }
+    headers += "\r\n";
+}
+
+// File name for the Content-Type/Content-Disposition parameters
+std::string attachmentName(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    for (auto& c : name) {
+        if (c == '"' || c == '\\' || c == '\r' || c == '\n') {
+            c = '_';
+        }
+    }
+    return name;
+}
+
+} // anonymous namespace
+
+MimeMessageStream::MimeMessageStream(const Email& email, const std::string& message_id,
+                                     const std::string& date, bool dot_stuff)
+    : email_(email), message_id_(message_id), date_(date), dot_stuff_(dot_stuff),
+      segment_index_(0), segment_offset_(0), pending_offset_(0),
+      canonicalizer_(dot_stuff), finished_(false) {
+    std::string headers = "From: " + email.from + "\r\n";
+    appendAddressHeader(headers, "To", email.to);
+    if (!email.cc.empty()) {
+        appendAddressHeader(headers, "Cc", email.cc);
+    }
+    headers += "Subject: " + email.subject + "\r\n";
+    headers += "Date: " + date + "\r\n";
+    headers += "Message-ID: " + message_id + "\r\n";
+    headers += "MIME-Version: 1.0\r\n";
+    addText(headers);
+
+    // Boundaries are derived from the Message-ID so that measure() sees the same bytes
+    std::string unique = message_id.substr(1, message_id.find('@') - 1);
+    std::string mixed_boundary = "=_mix_" + unique;
+    bool mixed = !email.attachments.empty();
+
+    if (mixed) {
+        addText("Content-Type: multipart/mixed; boundary=\"" + mixed_boundary + "\"\r\n"
+                "\r\n"
+                "--" + mixed_boundary + "\r\n");
+    }
+
+    if (!email.html_body.empty()) {
+        std::string boundary = "=_alt_" + unique;
+        addText("Content-Type: multipart/alternative; boundary=\"" + boundary + "\"\r\n"
+                "\r\n"
+                "--" + boundary + "\r\n"
+                "Content-Type: text/plain; charset=UTF-8\r\n"
+                "\r\n");
+        addBody(email.body);
+        addText("\r\n"
+                "--" + boundary + "\r\n"
+                "Content-Type: text/html; charset=UTF-8\r\n"
+                "\r\n");
+        addBody(email.html_body);
+        addText("\r\n"
+                "--" + boundary + "--\r\n");
+    } else {
+        addText("Content-Type: text/plain; charset=UTF-8\r\n"
+                "\r\n");
+        addBody(email.body);
+        addText("\r\n");
+    }
+
+    if (mixed) {
+        for (const auto& path : email.attachments) {
+            std::string name = attachmentName(path);
+            addText("--" + mixed_boundary + "\r\n"
+                    "Content-Type: application/octet-stream; name=\"" + name + "\"\r\n"
+                    "Content-Transfer-Encoding: base64\r\n"
+                    "Content-Disposition: attachment; filename=\"" + name + "\"\r\n"
+                    "\r\n");
+            addFile(path);
+        }
+        addText("--" + mixed_boundary + "--\r\n");
+    }
+}
+
+size_t MimeMessageStream::read(char* buffer, size_t max_length) {
+    fill(max_length);
+
+    size_t length = std::min(pending_.size() - pending_offset_, max_length);
+    std::memcpy(buffer, pending_.data() + pending_offset_, length);
+    pending_offset_ += length;
+
+    // Keep only the unread tail so pending_ stays around one chunk in size
+    pending_.erase(0, pending_offset_);
+    pending_offset_ = 0;
+
+    // Look ahead so that eof() is exact after the last chunk
+    fill(1);
+    return length;
+}
+
+bool MimeMessageStream::eof() const {
+    return finished_ && pending_offset_ == pending_.size();
+}
+
+bool MimeMessageStream::failed() const {
+    return !error_.empty();
+}
+
+const std::string& MimeMessageStream::getError() const {
+    return error_;
+}
+
+size_t MimeMessageStream::measure() const {
+    MimeMessageStream counter(email_, message_id_, date_, dot_stuff_);
+    char buffer[kSourceBlock];
+    size_t total = 0;
+    size_t length;
+    while ((length = counter.read(buffer, sizeof(buffer))) > 0) {
+        total += length;
+    }
+    return total;
+}
+
+std::string MimeMessageStream::generateMessageId(const std::string& domain) {
+    thread_local std::mt19937_64 generator(std::random_device{}());
+
+    std::ostringstream id;
+    id << "<" << std::hex << std::setfill('0')
+       << std::setw(16) << generator() << std::setw(16) << generator()
+       << "@" << (domain.empty() ? "localhost" : domain) << ">";
+    return id.str();
+}
+
+std::string MimeMessageStream::currentDate() {
+    time_t now = time(0);
+    struct tm timeinfo;
+    gmtime_r(&now, &timeinfo);
+    char buffer[80];
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &timeinfo);
+    return std::string(buffer);
+}
+
+void MimeMessageStream::addText(const std::string& text) {
+    Segment segment;
+    segment.kind = Segment::Kind::TEXT;
+    segment.text = text;
+    segment.body = nullptr;
+    segments_.push_back(std::move(segment));
+}
+
+void MimeMessageStream::addBody(const std::string& body) {
+    Segment segment;
+    segment.kind = Segment::Kind::BODY;
+    segment.body = &body;
+    segments_.push_back(std::move(segment));
+}
+
+void MimeMessageStream::addFile(const std::string& path) {
+    // Fail before anything is sent rather than halfway through the message
+    std::ifstream probe(path, std::ios::binary);
+    if (!probe && error_.empty()) {
+        error_ = "Cannot read attachment: " + path;
+    }
+
+    Segment segment;
+    segment.kind = Segment::Kind::FILE;
+    segment.text = path;
+    segment.body = nullptr;
+    segments_.push_back(std::move(segment));
+}
+
+void MimeMessageStream::fill(size_t wanted) {
+    while (!finished_ && pending_.size() - pending_offset_ < wanted) {
+        if (failed()) {
+            pending_.clear();
+            pending_offset_ = 0;
+            finished_ = true;
+            break;
+        }
+
+        if (segment_index_ == segments_.size()) {
+            if (!canonicalizer_.atLineStart()) {
+                pending_.append("\r\n");
+                canonicalizer_.resetLine(true);
+            }
+            finished_ = true;
+            break;
+        }
+
+        const Segment& segment = segments_[segment_index_];
+        if (segment.kind == Segment::Kind::FILE) {
+            if (!file_.is_open()) {
+                file_.open(segment.text, std::ios::binary);
+                if (!file_) {
+                    error_ = "Cannot read attachment: " + segment.text;
+                    continue;
+                }
+            }
+            if (!encodeFileBlock()) {
+                file_.close();
+                file_.clear();
+                segment_index_++;
+            }
+            continue;
+        }
+
+        const std::string& source = segment.kind == Segment::Kind::TEXT ? segment.text : *segment.body;
+        // Generated header lines are folded where they are built; only bodies are broken
+        canonicalizer_.setMaxLineLength(segment.kind == Segment::Kind::BODY ? BodyCanonicalizer::kMaxLineLength : 0);
+        size_t length = std::min(source.size() - segment_offset_, kSourceBlock);
+        canonicalize(source.data() + segment_offset_, length);
+        segment_offset_ += length;
+        if (segment_offset_ == source.size()) {
+            segment_index_++;
+            segment_offset_ = 0;
+        }
+    }
+}
+
+void MimeMessageStream::canonicalize(const char* data, size_t length) {
+    size_t start = pending_.size();
+    pending_.resize(start + canonicalizer_.maxOutput(length));
+    size_t written = canonicalizer_.transform(data, length, &pending_[start]);
+    pending_.resize(start + written);
+}
+
+bool MimeMessageStream::encodeFileBlock() {
+    unsigned char raw[kFileBlock];
+    file_.read(reinterpret_cast<char*>(raw), sizeof(raw));
+    size_t length = static_cast<size_t>(file_.gcount());
+    if (length == 0) {
+        if (file_.bad()) {
+            error_ = "Failed to read attachment: " + segments_[segment_index_].text;
+        }
+        return false;
+    }
+
+    for (size_t offset = 0; offset < length; offset += kBase64LineInput) {
+        appendBase64(pending_, raw + offset, std::min(kBase64LineInput, length - offset));
+        pending_.append("\r\n");
+    }
+    // Base64 never starts a line with '.', so no stuffing is needed
+    canonicalizer_.resetLine(true);
+    return true;
+}
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include "core/smtp/body_canonicalizer.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief Incremental generator for the wire form of a MIME message
+ *
+ * Produces headers, text/HTML parts and base64-encoded attachments on demand,
+ * already canonicalized to CRLF line endings (and dot-stuffed for DATA), with
+ * address headers folded and body lines kept within 998 octets.
+ * Bodies are read in place from the Email and attachments are streamed from
+ * disk, so memory use is bounded by the caller's read size rather than by
+ * the size of the message.
+ */
+class MimeMessageStream {
+public:
+    /**
+     * @brief Constructor
+     * @param email Email to render (must outlive the stream)
+     * @param message_id Message-ID header value
+     * @param date Date header value
+     * @param dot_stuff Whether to dot-stuff lines for the DATA command
+     */
+    MimeMessageStream(const Email& email, const std::string& message_id,
+                      const std::string& date, bool dot_stuff);
+
+    MimeMessageStream(const MimeMessageStream&) = delete;
+    MimeMessageStream& operator=(const MimeMessageStream&) = delete;
+
+    /**
+     * @brief Copy the next bytes of the message into buffer
+     * @param buffer Destination buffer
+     * @param max_length Capacity of buffer
+     * @return Number of bytes written, 0 once the message is complete
+     */
+    size_t read(char* buffer, size_t max_length);
+
+    /**
+     * @brief Check whether every byte of the message has been read
+     * @return true if the next read() would return 0
+     */
+    bool eof() const;
+
+    /**
+     * @brief Check whether the message could not be generated
+     * @return true if an attachment was missing or unreadable
+     */
+    bool failed() const;
+
+    /**
+     * @brief Get the reason the message could not be generated
+     * @return Error message
+     */
+    const std::string& getError() const;
+
+    /**
+     * @brief Compute the size of the generated message without keeping it
+     * @return Total number of bytes read() will produce
+     */
+    size_t measure() const;
+
+    /**
+     * @brief Generate a unique Message-ID
+     * @param domain Domain part to use
+     * @return Message-ID including angle brackets
+     */
+    static std::string generateMessageId(const std::string& domain);
+
+    /**
+     * @brief Format the current time for the Date header
+     * @return RFC 5322 date in GMT
+     */
+    static std::string currentDate();
+
+private:
+    struct Segment {
+        enum class Kind { TEXT, BODY, FILE };
+        Kind kind;
+        std::string text;          // Literal text, or the path for FILE
+        const std::string* body;   // Borrowed body for BODY
+    };
+
+    void addText(const std::string& text);
+    void addBody(const std::string& body);
+    void addFile(const std::string& path);
+
+    /**
+     * @brief Generate more output into pending_
+     * @param wanted Number of bytes the caller would like available
+     */
+    void fill(size_t wanted);
+
+    /**
+     * @brief Append data to pending_ through canonicalizer_
+     */
+    void canonicalize(const char* data, size_t length);
+
+    /**
+     * @brief Append the next base64 lines of the current attachment
+     * @return false at end of file or on a read error
+     */
+    bool encodeFileBlock();
+
+    const Email& email_;
+    std::string message_id_;
+    std::string date_;
+    bool dot_stuff_;
+
+    std::vector<Segment> segments_;
+    size_t segment_index_;
+    size_t segment_offset_;
+    std::ifstream file_;
+
+    std::string pending_;
+    size_t pending_offset_;
+    BodyCanonicalizer canonicalizer_;
+    bool finished_;
+    std::string error_;
+};
+
+} // namespace ssmtp_mailer
@@ -1,4 +1,7 @@
 #include "core/smtp/smtp_client.hpp"
+#include "core/smtp/mime_stream.hpp"
+#include "core/smtp/tls_context.hpp"
+#include "core/smtp/dns_resolver.hpp"
 #include "simple-smtp-mailer/mailer.hpp"
 #include "core/logging/logger.hpp"
 #include <sys/socket.h>
@@ -6,132 +9,249 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <iomanip>
 #include <sstream>
-#include <regex>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/x509v3.h>
+#include <curl/curl.h>
 
 namespace ssmtp_mailer {
 
-SMTPClient::SMTPClient(const ConfigManager& config) : config_(config), socket_fd_(-1), ssl_context_(nullptr), ssl_connection_(nullptr) {
-    // Initialize OpenSSL
-    SSL_library_init();
-    SSL_load_error_strings();
-    OpenSSL_add_all_algorithms();
+namespace {
+
+// Message bytes generated and written per send; bounds memory per message
+constexpr size_t kDataChunkSize = 64 * 1024;
+
+std::string toUpper(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+    return value;
+}
+
+std::string opensslErrorString() {
+    unsigned long err = ERR_get_error();
+    if (err == 0) {
+        return "unknown error";
+    }
+    char buffer[256];
+    ERR_error_string_n(err, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return buffer;
+}
+
+// libcurl read callback feeding the upload from the MIME generator
+size_t readMessage(char* buffer, size_t size, size_t count, void* stream) {
+    MimeMessageStream* message = static_cast<MimeMessageStream*>(stream);
+    size_t length = message->read(buffer, size * count);
+    return message->failed() ? CURL_READFUNC_ABORT : length;
+}
+
+} // namespace
+
+SMTPClient::SMTPClient(const ConfigManager& config)
+    : config_(config), socket_fd_(-1), ssl_connection_(nullptr),
+      state_(SMTPState::DISCONNECTED), authenticated_(false), port_(0), use_ssl_(false),
+      transaction_replied_(false), ssl_verify_peer_(true) {
+    const GlobalConfig& global = config_.getGlobalConfig();
+    connection_timeout_ = global.connection_timeout;
+    read_timeout_ = global.read_timeout;
+    write_timeout_ = global.write_timeout;
 }
 
 SMTPClient::~SMTPClient() {
     disconnect();
-    if (ssl_context_) {
-        SSL_CTX_free(ssl_context_);
-    }
 }
 
 SMTPResult SMTPClient::send(const Email& email) {
     Logger& logger = Logger::getInstance();
-    
+
     try {
         // Get domain configuration for the from address
         std::string domain = email.from.substr(email.from.find('@') + 1);
         const DomainConfig* domain_config = config_.getDomainConfig(domain);
-        
+
         if (!domain_config) {
             return SMTPResult::createError("No configuration found for domain: " + domain);
         }
-        
-        // Use curl to send email via SMTP
-        return sendViaCurl(email, domain_config);
-        
+
+        // The curl transport is kept as an opt-in fallback only
+        if (domain_config->smtp_transport == "curl") {
+            return sendViaCurl(email, domain_config);
+        }
+
+        return sendNative(email, *domain_config);
+
     } catch (const std::exception& e) {
         logger.error("SMTP send error: " + std::string(e.what()));
+        disconnect();
         return SMTPResult::createError("SMTP error: " + std::string(e.what()));
     }
 }
 
 bool SMTPClient::connect(const std::string& server, int port, bool use_ssl) {
     Logger& logger = Logger::getInstance();
-    
-    // Create socket
-    socket_fd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd_ < 0) {
-        logger.error("Failed to create socket");
+
+    disconnect();
+    server_ = server;
+    port_ = port;
+    use_ssl_ = use_ssl;
+
+    // Resolve through the shared cache; addresses come back in connection order
+    std::vector<ResolvedAddress> addresses;
+    std::string error;
+    if (!DNSResolver::getInstance().resolve(server, port, addresses, error)) {
+        setError(error);
         return false;
     }
-    
-    // Get server address
-    struct hostent* server_info = gethostbyname(server.c_str());
-    if (!server_info) {
-        logger.error("Failed to resolve hostname: " + server);
+
+    // Try each address in turn, without blocking past connection_timeout_ on any one
+    int flags = 0;
+    int rc = -1;
+    for (const auto& address : addresses) {
+        socket_fd_ = socket(address.family(), SOCK_STREAM, 0);
+        if (socket_fd_ < 0) {
+            continue;
+        }
+
+#ifdef SO_NOSIGPIPE
+        int no_sigpipe = 1;
+        setsockopt(socket_fd_, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+
+        flags = fcntl(socket_fd_, F_GETFL, 0);
+        fcntl(socket_fd_, F_SETFL, flags | O_NONBLOCK);
+
+        rc = ::connect(socket_fd_, reinterpret_cast<const struct sockaddr*>(&address.address), address.length);
+        if (rc < 0 && errno == EINPROGRESS) {
+            struct pollfd pfd;
+            pfd.fd = socket_fd_;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            rc = poll(&pfd, 1, connection_timeout_ * 1000);
+            if (rc == 1) {
+                int so_error = 0;
+                socklen_t len = sizeof(so_error);
+                getsockopt(socket_fd_, SOL_SOCKET, SO_ERROR, &so_error, &len);
+                rc = so_error == 0 ? 0 : -1;
+            } else {
+                rc = -1;
+            }
+        }
+        if (rc == 0) {
+            break;
+        }
+
+        logger.debug("Connection to " + address.toString() + " failed, trying next address");
         close(socket_fd_);
         socket_fd_ = -1;
+    }
+
+    if (rc < 0) {
+        setError("Failed to connect to SMTP server: " + server + ":" + std::to_string(port));
+        disconnect();
         return false;
     }
-    
-    // Set up server address
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, server_info->h_addr, server_info->h_length);
-    
-    // Connect to server
-    if (::connect(socket_fd_, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        logger.error("Failed to connect to SMTP server: " + server + ":" + std::to_string(port));
-        close(socket_fd_);
-        socket_fd_ = -1;
+
+    fcntl(socket_fd_, F_SETFL, flags);
+
+    struct timeval read_tv;
+    read_tv.tv_sec = read_timeout_;
+    read_tv.tv_usec = 0;
+    setsockopt(socket_fd_, SOL_SOCKET, SO_RCVTIMEO, &read_tv, sizeof(read_tv));
+
+    struct timeval write_tv;
+    write_tv.tv_sec = write_timeout_;
+    write_tv.tv_usec = 0;
+    setsockopt(socket_fd_, SOL_SOCKET, SO_SNDTIMEO, &write_tv, sizeof(write_tv));
+
+    // Implicit TLS wraps the whole session, including the greeting
+    if (use_ssl && !setupSSL()) {
+        disconnect();
         return false;
     }
-    
+
     // Read initial response
-    std::string response = readResponse();
-    if (response.empty() || response[0] != '2') {
-        logger.error("SMTP server rejected connection: " + response);
-        close(socket_fd_);
-        socket_fd_ = -1;
+    std::string response;
+    int code = readResponse(response);
+    if (code != 220) {
+        setError("SMTP server rejected connection: " + response);
+        disconnect();
         return false;
     }
-    
-    // Set up SSL if required
-    if (use_ssl) {
-        if (!setupSSL()) {
-            disconnect();
-            return false;
-        }
-    }
-    
+
+    state_ = SMTPState::CONNECTED;
     logger.info("Connected to SMTP server: " + server + ":" + std::to_string(port));
     return true;
 }
 
 void SMTPClient::disconnect() {
+    if (ssl_connection_) {
+        SSL_shutdown(ssl_connection_);
+        SSL_free(ssl_connection_);
+        ssl_connection_ = nullptr;
+    }
     if (socket_fd_ >= 0) {
-        if (ssl_connection_) {
-            SSL_free(ssl_connection_);
-            ssl_connection_ = nullptr;
-        }
         close(socket_fd_);
         socket_fd_ = -1;
     }
+    state_ = SMTPState::DISCONNECTED;
+    authenticated_ = false;
+    reader_.clear();
+    extensions_.clear();
 }
 
 bool SMTPClient::authenticate(const std::string& username, const std::string& password, SMTPAuthMethod auth_method) {
     Logger& logger = Logger::getInstance();
-    
+
     switch (auth_method) {
+        case SMTPAuthMethod::NONE:
+            return true;
         case SMTPAuthMethod::LOGIN:
             return authenticateLogin(username, password);
         case SMTPAuthMethod::PLAIN:
             return authenticatePlain(username, password);
+        case SMTPAuthMethod::CRAM_MD5:
+            return authenticateCramMD5(username, password);
+        case SMTPAuthMethod::OAUTH2:
+        case SMTPAuthMethod::XOAUTH2:
+            return authenticateOAuth2(username, password);
         default:
             logger.warning("Unsupported authentication method");
             return false;
     }
 }
 
+bool SMTPClient::isConnected() const {
+    return socket_fd_ >= 0 && state_ != SMTPState::DISCONNECTED;
+}
+
+bool SMTPClient::isAuthenticated() const {
+    return isConnected() && authenticated_;
+}
+
+SMTPState SMTPClient::getState() const {
+    return state_;
+}
+
+std::string SMTPClient::getLastError() const {
+    return last_error_;
+}
+
+bool SMTPClient::hasExtension(const std::string& keyword) const {
+    return extensions_.find(toUpper(keyword)) != extensions_.end();
+}
+
 bool SMTPClient::testConnection() {
     // This is a simple test - just try to connect and disconnect
     const DomainConfig* domain_config = nullptr;
-    
+
     // Try to find any configured domain
     // For now, we'll just return true if we have a socket
     return socket_fd_ >= 0;
@@ -140,368 +260,728 @@ bool SMTPClient::testConnection() {
 // Private helper methods
 bool SMTPClient::setupSSL() {
     Logger& logger = Logger::getInstance();
-    
-    // Create SSL context
-    ssl_context_ = SSL_CTX_new(TLS_client_method());
-    if (!ssl_context_) {
-        logger.error("Failed to create SSL context");
-        return false;
-    }
-    
-    // Create SSL connection
-    ssl_connection_ = SSL_new(ssl_context_);
+
+    // Shared context and cached session for this server
+    TLSContextOptions options;
+    options.ca_file = ssl_ca_file_;
+    options.cert_file = ssl_cert_file_;
+    options.key_file = ssl_key_file_;
+    options.verify_peer = ssl_verify_peer_;
+
+    TLSContextManager& tls = TLSContextManager::getInstance();
+    std::string error;
+    ssl_connection_ = tls.createConnection(options, server_, port_, error);
     if (!ssl_connection_) {
-        logger.error("Failed to create SSL connection");
+        setError(error);
         return false;
     }
-    
+
     // Set socket for SSL
-    if (SSL_set_fd(ssl_connection_, socket_fd_) != 1) {
-        logger.error("Failed to set SSL socket");
+    if (!tls.attachSocket(ssl_connection_, socket_fd_)) {
+        setError("Failed to set SSL socket");
         return false;
     }
-    
+
     // Perform SSL handshake
     if (SSL_connect(ssl_connection_) != 1) {
-        logger.error("SSL handshake failed");
+        std::string reason = opensslErrorString();
+        long verify_result = SSL_get_verify_result(ssl_connection_);
+        if (verify_result != X509_V_OK) {
+            reason = X509_verify_cert_error_string(verify_result);
+        }
+        setError("SSL handshake failed: " + reason);
         return false;
     }
-    
-    logger.info("SSL connection established");
+
+    tls.handshakeCompleted(ssl_connection_);
+    logger.info("SSL connection established (" + std::string(SSL_get_version(ssl_connection_)) +
+                (SSL_session_reused(ssl_connection_) ? ", resumed" : "") + ")");
     return true;
 }
 
-std::string SMTPClient::readResponse() {
-    std::string response;
-    char buffer[1024];
-    
+int SMTPClient::readResponse(std::string& response) {
+    response.clear();
+
+    while (true) {
+        SMTPReplyReader::Status status = reader_.next(reply_);
+        if (status == SMTPReplyReader::Status::COMPLETE) {
+            response.assign(reply_.text());
+            transaction_replied_ = true;
+            return reply_.code();
+        }
+        if (status == SMTPReplyReader::Status::MALFORMED) {
+            setError(reader_.getError());
+            return -1;
+        }
+
+        // Read straight into the reply buffer
+        size_t available = 0;
+        char* space = reader_.prepare(available);
+        int bytes_read = readData(space, available);
+        if (bytes_read <= 0) {
+            setError("Connection closed while reading SMTP reply");
+            return -1;
+        }
+        reader_.commit(static_cast<size_t>(bytes_read));
+    }
+}
+
+int SMTPClient::executeCommand(const std::string& command, std::string& response) {
+    if (!sendCommand(command)) {
+        response.clear();
+        setError("Failed to send SMTP command");
+        return -1;
+    }
+    return readResponse(response);
+}
+
+bool SMTPClient::sendCommand(const std::string& command) {
+    std::string full_command = command + "\r\n";
+    return writeData(full_command.data(), full_command.size());
+}
+
+bool SMTPClient::writeData(const char* data, size_t length) {
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        int bytes_sent;
+        if (ssl_connection_) {
+            bytes_sent = SSL_write(ssl_connection_, data + total_sent, static_cast<int>(length - total_sent));
+        } else {
+#ifdef MSG_NOSIGNAL
+            bytes_sent = ::send(socket_fd_, data + total_sent, length - total_sent, MSG_NOSIGNAL);
+#else
+            bytes_sent = ::send(socket_fd_, data + total_sent, length - total_sent, 0);
+#endif
+        }
+
+        if (bytes_sent <= 0) {
+            if (!ssl_connection_ && bytes_sent < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        total_sent += static_cast<size_t>(bytes_sent);
+    }
+    return true;
+}
+
+int SMTPClient::readData(char* buffer, size_t max_length) {
+    if (socket_fd_ < 0) {
+        return -1;
+    }
+
     while (true) {
         int bytes_read;
         if (ssl_connection_) {
-            bytes_read = SSL_read(ssl_connection_, buffer, sizeof(buffer) - 1);
+            bytes_read = SSL_read(ssl_connection_, buffer, static_cast<int>(max_length));
         } else {
-            bytes_read = recv(socket_fd_, buffer, sizeof(buffer) - 1, 0);
+            bytes_read = static_cast<int>(recv(socket_fd_, buffer, max_length, 0));
         }
-        
-        if (bytes_read <= 0) {
-            break;
+
+        if (bytes_read < 0 && !ssl_connection_ && errno == EINTR) {
+            continue;
         }
-        
-        buffer[bytes_read] = '\0';
-        response += buffer;
-        
-        // Check if response is complete (ends with \r\n)
-        if (response.length() >= 2 && 
-            response[response.length() - 2] == '\r' && 
-            response[response.length() - 1] == '\n') {
-            break;
+        return bytes_read;
+    }
+}
+
+bool SMTPClient::sendEHLO(const std::string& hostname) {
+    std::string response;
+    int code = executeCommand("EHLO " + hostname, response);
+
+    extensions_.clear();
+    if (code == 250) {
+        // First line is the server greeting, the rest are "KEYWORD params"
+        for (size_t i = 1; i < reply_.lineCount(); ++i) {
+            std::string_view extension = reply_.line(i);
+            if (extension.empty()) {
+                continue;
+            }
+            size_t space = extension.find(' ');
+            std::string keyword = toUpper(std::string(extension.substr(0, space)));
+            extensions_[keyword] = space == std::string_view::npos ? "" : std::string(extension.substr(space + 1));
         }
+        return true;
+    }
+
+    if (code < 0) {
+        return false;
     }
-    
-    return response;
+
+    // Pre-ESMTP servers only understand HELO
+    code = executeCommand("HELO " + hostname, response);
+    if (code != 250) {
+        setError("HELO rejected: " + response);
+        return false;
+    }
+    return true;
 }
 
-bool SMTPClient::sendCommand(const std::string& command) {
-    std::string full_command = command + "\r\n";
-    
-    int bytes_sent;
-    if (ssl_connection_) {
-        bytes_sent = SSL_write(ssl_connection_, full_command.c_str(), full_command.length());
-    } else {
-        bytes_sent = ::send(socket_fd_, full_command.c_str(), full_command.length(), 0);
+bool SMTPClient::sendSTARTTLS() {
+    std::string response;
+    int code = executeCommand("STARTTLS", response);
+    if (code != 220) {
+        setError("STARTTLS rejected: " + response);
+        return false;
     }
-    
-    return bytes_sent == static_cast<int>(full_command.length());
+
+    // Anything buffered before the handshake could be injected plaintext
+    if (reader_.hasBufferedData()) {
+        setError("Unexpected data received before TLS negotiation");
+        return false;
+    }
+
+    if (!setupSSL()) {
+        return false;
+    }
+
+    // Capabilities must be discarded and re-learned after STARTTLS
+    extensions_.clear();
+    return true;
 }
 
-bool SMTPClient::authenticateLogin(const std::string& username, const std::string& password) {
+bool SMTPClient::sendQUIT() {
+    if (!isConnected()) {
+        return false;
+    }
+
+    std::string response;
+    int code = executeCommand("QUIT", response);
+    state_ = SMTPState::QUIT_SENT;
+    return code == 221;
+}
+
+bool SMTPClient::openSession(const DomainConfig& domain_config) {
     Logger& logger = Logger::getInstance();
-    
-    // Send AUTH LOGIN command
-    if (!sendCommand("AUTH LOGIN")) {
+
+    ssl_ca_file_ = domain_config.ssl_ca_file;
+    ssl_cert_file_ = domain_config.ssl_cert_file;
+    ssl_key_file_ = domain_config.ssl_key_file;
+    ssl_verify_peer_ = domain_config.ssl_verify_peer;
+
+    if (!connect(domain_config.smtp_server, domain_config.smtp_port, domain_config.use_ssl)) {
         return false;
     }
-    
-    std::string response = readResponse();
-    if (response[0] != '3') {
-        logger.error("AUTH LOGIN not supported: " + response);
+
+    std::string hostname = getLocalHostname();
+    if (!sendEHLO(hostname)) {
         return false;
     }
-    
-    // Send username (base64 encoded)
-    std::string encoded_username = base64Encode(username);
-    if (!sendCommand(encoded_username)) {
+
+    if (!domain_config.use_ssl && domain_config.use_starttls) {
+        // Never silently downgrade to plaintext when TLS was requested
+        if (!hasExtension("STARTTLS")) {
+            setError("SMTP server " + domain_config.smtp_server + " does not offer STARTTLS");
+            return false;
+        }
+        if (!sendSTARTTLS() || !sendEHLO(hostname)) {
+            return false;
+        }
+    }
+
+    SMTPAuthMethod method = stringToAuthMethod(toUpper(domain_config.auth_method));
+    if (method == SMTPAuthMethod::NONE || domain_config.username.empty()) {
+        return true;
+    }
+
+    if (!hasExtension("AUTH")) {
+        setError("SMTP server " + domain_config.smtp_server + " does not support authentication");
         return false;
     }
-    
-    response = readResponse();
-    if (response[0] != '3') {
-        logger.error("Username rejected: " + response);
+
+    bool authenticated = (method == SMTPAuthMethod::OAUTH2 || method == SMTPAuthMethod::XOAUTH2)
+        ? authenticateOAuth2(domain_config.username, domain_config.oauth2_token)
+        : authenticate(domain_config.username, domain_config.password, method);
+
+    if (!authenticated) {
+        logger.error("SMTP authentication failed for " + domain_config.username + ": " + last_error_);
         return false;
     }
-    
-    // Send password (base64 encoded)
-    std::string encoded_password = base64Encode(password);
-    if (!sendCommand(encoded_password)) {
+    return true;
+}
+
+bool SMTPClient::authenticateLogin(const std::string& username, const std::string& password) {
+    Logger& logger = Logger::getInstance();
+    std::string response;
+
+    // Send AUTH LOGIN command
+    if (executeCommand("AUTH LOGIN", response) != 334) {
+        setError("AUTH LOGIN not supported: " + response);
         return false;
     }
-    
-    response = readResponse();
-    if (response[0] != '2') {
-        logger.error("Authentication failed: " + response);
+
+    // Send username (base64 encoded)
+    if (executeCommand(base64Encode(username), response) != 334) {
+        setError("Username rejected: " + response);
+        return false;
+    }
+
+    // Send password (base64 encoded)
+    if (executeCommand(base64Encode(password), response) != 235) {
+        setError("Authentication failed: " + response);
         return false;
     }
-    
+
+    state_ = SMTPState::AUTHENTICATED;
+    authenticated_ = true;
     logger.info("SMTP authentication successful");
     return true;
 }
 
 bool SMTPClient::authenticatePlain(const std::string& username, const std::string& password) {
     Logger& logger = Logger::getInstance();
-    
-    // Create PLAIN authentication string
-    std::string auth_string = "\0" + username + "\0" + password;
-    std::string encoded_auth = base64Encode(auth_string);
-    
+
+    // Create PLAIN authentication string: authzid NUL authcid NUL passwd
+    std::string auth_string;
+    auth_string.push_back('\0');
+    auth_string += username;
+    auth_string.push_back('\0');
+    auth_string += password;
+
     // Send AUTH PLAIN command
-    if (!sendCommand("AUTH PLAIN " + encoded_auth)) {
+    std::string response;
+    if (executeCommand("AUTH PLAIN " + base64Encode(auth_string), response) != 235) {
+        setError("PLAIN authentication failed: " + response);
         return false;
     }
-    
-    std::string response = readResponse();
-    if (response[0] != '2') {
-        logger.error("PLAIN authentication failed: " + response);
+
+    state_ = SMTPState::AUTHENTICATED;
+    authenticated_ = true;
+    logger.info("SMTP PLAIN authentication successful");
+    return true;
+}
+
+bool SMTPClient::authenticateCramMD5(const std::string& username, const std::string& password) {
+    Logger& logger = Logger::getInstance();
+    std::string response;
+
+    if (executeCommand("AUTH CRAM-MD5", response) != 334 || response.size() < 4) {
+        setError("AUTH CRAM-MD5 not supported: " + response);
         return false;
     }
-    
-    logger.info("SMTP PLAIN authentication successful");
+
+    // Reply is HMAC-MD5(password, challenge) in lowercase hex
+    std::string challenge = base64Decode(response.substr(4));
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    HMAC(EVP_md5(), password.data(), static_cast<int>(password.size()),
+         reinterpret_cast<const unsigned char*>(challenge.data()), challenge.size(),
+         digest, &digest_length);
+
+    std::ostringstream hex;
+    hex << std::hex << std::setfill('0');
+    for (unsigned int i = 0; i < digest_length; ++i) {
+        hex << std::setw(2) << static_cast<int>(digest[i]);
+    }
+
+    if (executeCommand(base64Encode(username + " " + hex.str()), response) != 235) {
+        setError("CRAM-MD5 authentication failed: " + response);
+        return false;
+    }
+
+    state_ = SMTPState::AUTHENTICATED;
+    authenticated_ = true;
+    logger.info("SMTP CRAM-MD5 authentication successful");
     return true;
 }
 
-SMTPResult SMTPClient::sendViaCurl(const Email& email, const DomainConfig* domain_config) {
+bool SMTPClient::authenticateOAuth2(const std::string& username, const std::string& oauth2_token) {
     Logger& logger = Logger::getInstance();
-    
-    try {
-        // Create temporary file for email content
-        std::string temp_file = "/tmp/ssmtp_email_" + std::to_string(time(nullptr)) + ".txt";
-        std::ofstream email_file(temp_file);
-        
-        if (!email_file.is_open()) {
-            return SMTPResult::createError("Failed to create temporary email file");
-        }
-        
-        // Write email headers and body
-        email_file << "From: " << email.from << "\n";
-        email_file << "To: ";
-        for (size_t i = 0; i < email.to.size(); ++i) {
-            if (i > 0) email_file << ", ";
-            email_file << email.to[i];
-        }
-        email_file << "\n";
-        email_file << "Subject: " << email.subject << "\n";
-        email_file << "Date: " << getCurrentTimestamp() << "\n";
-        email_file << "MIME-Version: 1.0\n";
-        
-        if (!email.html_body.empty()) {
-            email_file << "Content-Type: multipart/alternative; boundary=\"boundary123\"\n";
-            email_file << "\n";
-            email_file << "--boundary123\n";
-            email_file << "Content-Type: text/plain; charset=UTF-8\n";
-            email_file << "\n";
-            email_file << email.body << "\n";
-            email_file << "--boundary123\n";
-            email_file << "Content-Type: text/html; charset=UTF-8\n";
-            email_file << "\n";
-            email_file << email.html_body << "\n";
-            email_file << "--boundary123--\n";
-        } else {
-            email_file << "Content-Type: text/plain; charset=UTF-8\n";
-            email_file << "\n";
-            email_file << email.body << "\n";
-        }
-        
-        email_file.close();
-        
-        // Build curl command for SMTP
-        std::ostringstream cmd;
-        cmd << "curl -s --url smtp://" << domain_config->smtp_server << ":" << domain_config->smtp_port;
-        
-        // Add authentication if required
-        if (domain_config->auth_method != "NONE" && !domain_config->username.empty()) {
-            cmd << " --user " << domain_config->username << ":" << domain_config->password;
-        }
-        
-        // Add SSL/TLS options
-        if (domain_config->use_ssl) {
-            cmd << " --ssl-reqd";
-        } else if (domain_config->use_starttls) {
-            cmd << " --ssl-reqd";
-        }
-        
-        // Add mail options
-        cmd << " --mail-from " << email.from;
-        
-        // Add recipients
-        for (const auto& recipient : email.to) {
-            cmd << " --mail-rcpt " << recipient;
-        }
-        
-        // Add email content file
-        cmd << " --upload-file " << temp_file;
-        
-        logger.info("Executing curl command: " + cmd.str());
-        
-        // Execute curl command
-        int result = system(cmd.str().c_str());
-        
-        // Clean up temporary file
-        unlink(temp_file.c_str());
-        
-        if (result == 0) {
-            logger.info("Email sent successfully via curl SMTP");
-            return SMTPResult::createSuccess("Email sent successfully via SMTP");
-        } else {
-            return SMTPResult::createError("curl SMTP command failed with exit code: " + std::to_string(result));
+
+    std::string auth_string = "user=" + username + "\x01" "auth=Bearer " + oauth2_token + "\x01\x01";
+    std::string response;
+    int code = executeCommand("AUTH XOAUTH2 " + base64Encode(auth_string), response);
+
+    // On failure the server sends a 334 with a JSON error and expects an empty reply
+    if (code == 334) {
+        std::string error_details = response;
+        executeCommand("", response);
+        setError("XOAUTH2 authentication failed: " + error_details);
+        return false;
+    }
+
+    if (code != 235) {
+        setError("XOAUTH2 authentication failed: " + response);
+        return false;
+    }
+
+    state_ = SMTPState::AUTHENTICATED;
+    authenticated_ = true;
+    logger.info("SMTP XOAUTH2 authentication successful");
+    return true;
+}
+
+SMTPResult SMTPClient::sendNative(const Email& email, const DomainConfig& domain_config) {
+    if (!openSession(domain_config)) {
+        std::string error = last_error_;
+        disconnect();
+        return SMTPResult::createError("SMTP session setup failed: " + error);
+    }
+
+    SMTPResult result = sendMessage(email);
+
+    quit();
+    return result;
+}
+
+SMTPResult SMTPClient::sendMessage(const Email& email) {
+    transaction_replied_ = false;
+    if (!isConnected()) {
+        return SMTPResult::createError("Not connected to SMTP server");
+    }
+    if (email.getAllRecipients().empty()) {
+        return SMTPResult::createError("No recipients specified");
+    }
+
+    SMTPResult result = sendEmailData(email);
+    if (!result.success) {
+        // Server rejections leave a usable session; I/O failures do not
+        if (result.error_code == 0 || !reset()) {
+            disconnect();
         }
-        
-    } catch (const std::exception& e) {
-        return SMTPResult::createError("Curl SMTP error: " + std::string(e.what()));
     }
+    return result;
+}
+
+bool SMTPClient::reset() {
+    std::string response;
+    if (executeCommand("RSET", response) != 250) {
+        return false;
+    }
+    state_ = authenticated_ ? SMTPState::AUTHENTICATED : SMTPState::CONNECTED;
+    return true;
+}
+
+bool SMTPClient::isAlive() const {
+    if (socket_fd_ < 0 || state_ == SMTPState::DISCONNECTED || state_ == SMTPState::QUIT_SENT) {
+        return false;
+    }
+    if (reader_.hasBufferedData() || (ssl_connection_ && SSL_pending(ssl_connection_) > 0)) {
+        return false;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = socket_fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+void SMTPClient::quit() {
+    sendQUIT();
+    disconnect();
+}
+
+SMTPResult SMTPClient::sendViaCurl(const Email& email, const DomainConfig* domain_config) {
+    Logger& logger = Logger::getInstance();
+
+    // Stream the same CRLF-canonical message as the native path; curl does its own dot-stuffing
+    std::string domain = email.from.substr(email.from.find('@') + 1);
+    std::string message_id = generateMessageID(domain);
+    MimeMessageStream message(email, message_id, getCurrentTimestamp(), false);
+    if (message.failed()) {
+        return SMTPResult::createError(message.getError());
+    }
+
+    CURL* curl = curl_easy_init();
+    if (!curl) {
+        return SMTPResult::createError("Failed to initialize CURL");
+    }
+
+    // Implicit TLS needs the smtps:// scheme
+    std::string url = std::string(domain_config->use_ssl ? "smtps://" : "smtp://") + domain_config->smtp_server +
+                      ":" + std::to_string(domain_config->smtp_port);
+    std::string mail_from = "<" + email.from + ">";
+    struct curl_slist* recipients = nullptr;
+    for (const auto& recipient : email.getAllRecipients()) {
+        recipients = curl_slist_append(recipients, ("<" + recipient + ">").c_str());
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_MAIL_FROM, mail_from.c_str());
+    curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, readMessage);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &message);
+    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(connection_timeout_));
+
+    // STARTTLS must succeed rather than fall back to plaintext
+    if (!domain_config->use_ssl && domain_config->use_starttls) {
+        curl_easy_setopt(curl, CURLOPT_USE_SSL, static_cast<long>(CURLUSESSL_ALL));
+    }
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, domain_config->ssl_verify_peer ? 1L : 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, domain_config->ssl_verify_peer ? 2L : 0L);
+    if (!domain_config->ssl_ca_file.empty()) {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, domain_config->ssl_ca_file.c_str());
+    }
+
+    // Credentials stay in this process: nothing is passed on a command line
+    if (domain_config->auth_method != "NONE" && !domain_config->username.empty()) {
+        curl_easy_setopt(curl, CURLOPT_USERNAME, domain_config->username.c_str());
+        curl_easy_setopt(curl, CURLOPT_PASSWORD, domain_config->password.c_str());
+    }
+
+    logger.debug("Sending via libcurl SMTP to " + url);
+    CURLcode res = curl_easy_perform(curl);
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_slist_free_all(recipients);
+    curl_easy_cleanup(curl);
+
+    if (message.failed()) {
+        return SMTPResult::createError(message.getError());
+    }
+    if (res != CURLE_OK) {
+        // A reply code tells a rejection from a connection failure, as on the native path
+        return SMTPResult::createError("curl SMTP send failed: " + std::string(curl_easy_strerror(res)),
+                                       code >= 400 ? static_cast<int>(code) : 0);
+    }
+
+    logger.info("Email sent successfully via curl SMTP");
+    return SMTPResult::createSuccess(message_id);
 }
 
 SMTPResult SMTPClient::sendEmailData(const Email& email) {
     Logger& logger = Logger::getInstance();
-    
-    // Send MAIL FROM command
+
+    std::vector<std::string> recipients = email.getAllRecipients();
+    std::string domain = email.from.substr(email.from.find('@') + 1);
+    std::string message_id = generateMessageID(domain);
+    std::string response;
+
+    // With CHUNKING (RFC 3030) the message goes out as raw BDAT chunks,
+    // otherwise it is dot-stuffed for DATA
+    bool chunking = hasExtension("CHUNKING");
+    MimeMessageStream message(email, message_id, getCurrentTimestamp(), !chunking);
+    if (message.failed()) {
+        return SMTPResult::createError(message.getError());
+    }
+
+    // Send MAIL FROM command, declaring the size up front when supported
     std::string mail_from = "MAIL FROM:<" + email.from + ">";
-    if (!sendCommand(mail_from)) {
-        return SMTPResult::createError("Failed to send MAIL FROM command");
-    }
-    
-    std::string response = readResponse();
-    if (response[0] != '2') {
-        return SMTPResult::createError("MAIL FROM rejected: " + response);
-    }
-    
-    // Send RCPT TO commands for each recipient
-    for (const auto& recipient : email.to) {
-        std::string rcpt_to = "RCPT TO:<" + recipient + ">";
-        if (!sendCommand(rcpt_to)) {
-            return SMTPResult::createError("Failed to send RCPT TO command");
-        }
-        
-        response = readResponse();
-        if (response[0] != '2') {
-            return SMTPResult::createError("RCPT TO rejected: " + response);
-        }
-    }
-    
-    // Send DATA command
-    if (!sendCommand("DATA")) {
-        return SMTPResult::createError("Failed to send DATA command");
-    }
-    
-    response = readResponse();
-    if (response[0] != '3') {
-        return SMTPResult::createError("DATA command rejected: " + response);
-    }
-    
-    // Send email headers and body
-    std::string email_data = buildEmailData(email);
-    if (!sendCommand(email_data)) {
-        return SMTPResult::createError("Failed to send email data");
+    if (hasExtension("SIZE")) {
+        mail_from += " SIZE=" + std::to_string(message.measure());
     }
-    
-    // Send end of data marker
-    if (!sendCommand(".")) {
-        return SMTPResult::createError("Failed to send end of data marker");
+
+    // With PIPELINING (RFC 2920) the whole envelope goes out in one write and
+    // the replies are read back in command order; otherwise one round trip each
+    bool pipelining = hasExtension("PIPELINING");
+    if (pipelining) {
+        std::string envelope = mail_from + "\r\n";
+        for (const auto& recipient : recipients) {
+            envelope += "RCPT TO:<" + recipient + ">\r\n";
+        }
+        if (!chunking) {
+            envelope += "DATA\r\n";
+        }
+        if (!writeData(envelope.data(), envelope.size())) {
+            return SMTPResult::createError("Failed to send message envelope");
+        }
     }
-    
-    response = readResponse();
-    if (response[0] != '2') {
-        return SMTPResult::createError("Email data rejected: " + response);
+    auto envelopeReply = [&](const std::string& command) {
+        return pipelining ? readResponse(response) : executeCommand(command, response);
+    };
+
+    SMTPResult failure;
+    bool rejected = false;
+
+    int code = envelopeReply(mail_from);
+    if (code != 250) {
+        failure = SMTPResult::createError("MAIL FROM rejected: " + response, std::max(code, 0));
+        // Pipelined replies for the rest of the envelope are still in flight
+        if (!pipelining || code < 0) {
+            return failure;
+        }
+        rejected = true;
+    }
+    state_ = SMTPState::MAIL_FROM_SENT;
+
+    // Collect every RCPT TO reply so each rejection maps to its address
+    for (const auto& recipient : recipients) {
+        code = envelopeReply("RCPT TO:<" + recipient + ">");
+        if (code < 0) {
+            return SMTPResult::createError("Connection lost during RCPT TO: " + last_error_);
+        }
+        if (code != 250 && code != 251) {
+            if (!rejected) {
+                failure = SMTPResult::createError("RCPT TO rejected for " + recipient + ": " + response, code);
+                rejected = true;
+            }
+            failure.rejected_recipients.push_back(recipient);
+        }
+    }
+    state_ = SMTPState::RCPT_TO_SENT;
+
+    if (rejected && (!pipelining || chunking)) {
+        return failure;
+    }
+
+    if (!chunking) {
+        code = envelopeReply("DATA");
+        if (rejected) {
+            // A pipelined DATA that was accepted leaves the server waiting for a
+            // message we will not send; only dropping the connection aborts it
+            if (code == 354) {
+                disconnect();
+            }
+            return failure;
+        }
+        if (code != 354) {
+            return SMTPResult::createError("DATA command rejected: " + response, std::max(code, 0));
+        }
+    }
+
+    // Stream the headers and body straight from the MIME generator
+    state_ = SMTPState::DATA_SENT;
+    code = chunking ? streamChunks(message, response) : streamData(message, response);
+    if (message.failed()) {
+        // The server already holds part of the message; abandon the session
+        disconnect();
+        return SMTPResult::createError(message.getError());
+    }
+    if (code < 0) {
+        return SMTPResult::createError("Failed to send email data");
+    }
+    if (code != 250) {
+        return SMTPResult::createError("Email data rejected: " + response, code);
     }
-    
-    // Send QUIT command
-    sendCommand("QUIT");
-    
+    state_ = authenticated_ ? SMTPState::AUTHENTICATED : SMTPState::CONNECTED;
+
     logger.info("Email sent successfully");
-    return SMTPResult::createSuccess("Email sent successfully");
-}
-
-std::string SMTPClient::buildEmailData(const Email& email) {
-    std::ostringstream email_data;
-    
-    // Headers
-    email_data << "From: " << email.from << "\r\n";
-    email_data << "To: ";
-    for (size_t i = 0; i < email.to.size(); ++i) {
-        if (i > 0) email_data << ", ";
-        email_data << email.to[i];
-    }
-    email_data << "\r\n";
-    email_data << "Subject: " << email.subject << "\r\n";
-    email_data << "Date: " << getCurrentTimestamp() << "\r\n";
-    email_data << "MIME-Version: 1.0\r\n";
-    
-    if (!email.html_body.empty()) {
-        email_data << "Content-Type: multipart/alternative; boundary=\"boundary123\"\r\n";
-        email_data << "\r\n";
-        email_data << "--boundary123\r\n";
-        email_data << "Content-Type: text/plain; charset=UTF-8\r\n";
-        email_data << "\r\n";
-        email_data << email.body << "\r\n";
-        email_data << "--boundary123\r\n";
-        email_data << "Content-Type: text/html; charset=UTF-8\r\n";
-        email_data << "\r\n";
-        email_data << email.html_body << "\r\n";
-        email_data << "--boundary123--\r\n";
-    } else {
-        email_data << "Content-Type: text/plain; charset=UTF-8\r\n";
-        email_data << "\r\n";
-        email_data << email.body << "\r\n";
-    }
-    
-    return email_data.str();
+    return SMTPResult::createSuccess(message_id);
+}
+
+int SMTPClient::streamData(MimeMessageStream& message, std::string& response) {
+    // Spare room for the end of data marker after the last chunk
+    std::vector<char> buffer(kDataChunkSize + 3);
+
+    while (true) {
+        size_t length = message.read(buffer.data(), kDataChunkSize);
+        if (message.failed()) {
+            return -1;
+        }
+        bool last = message.eof();
+        if (last) {
+            // The generated message always ends in CRLF
+            std::memcpy(buffer.data() + length, ".\r\n", 3);
+            length += 3;
+        }
+        if (!writeData(buffer.data(), length)) {
+            return -1;
+        }
+        if (last) {
+            return readResponse(response);
+        }
+    }
+}
+
+int SMTPClient::streamChunks(MimeMessageStream& message, std::string& response) {
+    // Headroom in front of each chunk so the BDAT command and its payload go
+    // out in a single write
+    constexpr size_t kHeadroom = 32;
+    std::vector<char> buffer(kHeadroom + kDataChunkSize);
+    char* chunk = buffer.data() + kHeadroom;
+
+    while (true) {
+        size_t length = message.read(chunk, kDataChunkSize);
+        if (message.failed()) {
+            return -1;
+        }
+        bool last = message.eof();
+        std::string command = "BDAT " + std::to_string(length) + (last ? " LAST" : "") + "\r\n";
+        char* start = chunk - command.size();
+        std::memcpy(start, command.data(), command.size());
+        if (!writeData(start, command.size() + length)) {
+            return -1;
+        }
+
+        int code = readResponse(response);
+        if (code != 250 || last) {
+            return code;
+        }
+    }
+}
+
+std::string SMTPClient::generateMessageID(const std::string& domain) const {
+    return MimeMessageStream::generateMessageId(domain);
+}
+
+std::string SMTPClient::getLocalHostname() const {
+    const std::string& configured = config_.getGlobalConfig().default_hostname;
+    if (!configured.empty()) {
+        return configured;
+    }
+
+    char buffer[256];
+    if (gethostname(buffer, sizeof(buffer)) == 0) {
+        buffer[sizeof(buffer) - 1] = '\0';
+        if (buffer[0] != '\0') {
+            return buffer;
+        }
+    }
+    return "localhost";
+}
+
+void SMTPClient::setError(const std::string& error) {
+    last_error_ = error;
+    Logger::getInstance().error(error);
 }
 
 std::string SMTPClient::getCurrentTimestamp() {
-    time_t now = time(0);
-    struct tm* timeinfo = gmtime(&now);
-    char buffer[80];
-    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", timeinfo);
-    return std::string(buffer);
+    return MimeMessageStream::currentDate();
 }
 
 std::string SMTPClient::base64Encode(const std::string& input) {
     const std::string chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     std::string result;
     int val = 0, valb = -6;
-    
+
     for (unsigned char c : input) {
-        val = (val << 8) + c;
+        val = ((val << 8) + c) & 0xFFFFFF;
         valb += 8;
         while (valb >= 0) {
             result.push_back(chars[(val >> valb) & 0x3F]);
             valb -= 6;
         }
     }
-    
+
     if (valb > -6) {
         result.push_back(chars[((val << 8) >> (valb + 8)) & 0x3F]);
     }
-    
+
     while (result.size() % 4) {
         result.push_back('=');
     }
-    
+
+    return result;
+}
+
+std::string SMTPClient::base64Decode(const std::string& input) {
+    const std::string chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string result;
+    int val = 0, valb = -8;
+
+    for (unsigned char c : input) {
+        size_t pos = chars.find(static_cast<char>(c));
+        if (pos == std::string::npos) {
+            break;
+        }
+        val = ((val << 6) + static_cast<int>(pos)) & 0xFFFFFF;
+        valb += 6;
+        if (valb >= 0) {
+            result.push_back(static_cast<char>((val >> valb) & 0xFF));
+            valb -= 8;
+        }
+    }
+
     return result;
 }
 
 SMTPAuthMethod SMTPClient::stringToAuthMethod(const std::string& method) {
     if (method == "LOGIN") return SMTPAuthMethod::LOGIN;
     if (method == "PLAIN") return SMTPAuthMethod::PLAIN;
-    if (method == "CRAM_MD5") return SMTPAuthMethod::CRAM_MD5;
+    if (method == "CRAM_MD5" || method == "CRAM-MD5") return SMTPAuthMethod::CRAM_MD5;
     if (method == "OAUTH2") return SMTPAuthMethod::OAUTH2;
     if (method == "XOAUTH2") return SMTPAuthMethod::XOAUTH2;
     return SMTPAuthMethod::NONE;
@@ -2,14 +2,18 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include <memory>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 #include "core/config/config_manager.hpp"
+#include "core/smtp/smtp_reply.hpp"
 #include "simple-smtp-mailer/mailer.hpp"
 
 namespace ssmtp_mailer {
 
+class MimeMessageStream;
+
 /**
  * @brief SMTP connection state
  */
@@ -37,6 +41,10 @@ enum class SMTPAuthMethod {
 
 /**
  * @brief SMTP client class for handling SMTP connections and sending emails
+ *
+ * By default messages are delivered in-process over a native SMTP session
+ * (EHLO, STARTTLS, AUTH, MAIL/RCPT/DATA). Domains configured with
+ * smtp_transport = curl fall back to libcurl's SMTP client instead.
  */
 class SMTPClient {
 public:
@@ -45,33 +53,84 @@ public:
      * @param config Configuration manager instance
      */
     explicit SMTPClient(const ConfigManager& config);
-    
+
     /**
      * @brief Destructor
      */
     ~SMTPClient();
-    
+
+    SMTPClient(const SMTPClient&) = delete;
+    SMTPClient& operator=(const SMTPClient&) = delete;
+
     /**
      * @brief Send an email
      * @param email Email object to send
      * @return SMTPResult with operation status
      */
     SMTPResult send(const Email& email);
-    
+
+    /**
+     * @brief Open an authenticated session for the given domain
+     *
+     * Connects, greets, negotiates TLS and authenticates so that any number
+     * of sendMessage() transactions can follow on the same connection.
+     * @param domain_config Domain configuration
+     * @return true if the session is ready for a mail transaction
+     */
+    bool openSession(const DomainConfig& domain_config);
+
+    /**
+     * @brief Run one mail transaction on an open session
+     *
+     * Does not QUIT. On a server rejection the transaction is reset so the
+     * session can be reused; on a transport error the client disconnects.
+     * @param email Email object to send
+     * @return SMTPResult with operation status
+     */
+    SMTPResult sendMessage(const Email& email);
+
+    /**
+     * @brief Whether the server replied to anything in the last sendMessage()
+     *
+     * If it did not, the message cannot have been accepted, so a failed
+     * transaction may safely be retried elsewhere.
+     */
+    bool transactionReplied() const { return transaction_replied_; }
+
+    /**
+     * @brief Abort the current transaction (RSET)
+     * @return true if the server acknowledged the reset
+     */
+    bool reset();
+
     /**
-     * @brief Connect to SMTP server
+     * @brief Check that an idle session has not been closed by the server
+     *
+     * Does not block or send anything: an idle session must be silent, so
+     * any pending input (EOF, 421 timeout notice) marks it as dead.
+     * @return true if the session can be reused
+     */
+    bool isAlive() const;
+
+    /**
+     * @brief Send QUIT and close the connection
+     */
+    void quit();
+
+    /**
+     * @brief Connect to SMTP server and read the greeting
      * @param server SMTP server hostname
      * @param port SMTP server port
-     * @param use_ssl Whether to use SSL
+     * @param use_ssl Whether to use implicit TLS (SMTPS)
      * @return true if successful, false otherwise
      */
     bool connect(const std::string& server, int port, bool use_ssl = false);
-    
+
     /**
      * @brief Disconnect from SMTP server
      */
     void disconnect();
-    
+
     /**
      * @brief Authenticate with SMTP server
      * @param username Username for authentication
@@ -79,42 +138,49 @@ public:
      * @param auth_method Authentication method to use
      * @return true if successful, false otherwise
      */
-    bool authenticate(const std::string& username, 
-                     const std::string& password, 
+    bool authenticate(const std::string& username,
+                     const std::string& password,
                      SMTPAuthMethod auth_method = SMTPAuthMethod::LOGIN);
-    
+
     /**
-     * @brief Authenticate using OAuth2
+     * @brief Authenticate using OAuth2 (SASL XOAUTH2)
      * @param username Username (usually email)
      * @param oauth2_token OAuth2 access token
      * @return true if successful, false otherwise
      */
     bool authenticateOAuth2(const std::string& username, const std::string& oauth2_token);
-    
+
     /**
      * @brief Check if connected to SMTP server
      * @return true if connected, false otherwise
      */
     bool isConnected() const;
-    
+
     /**
      * @brief Check if authenticated
      * @return true if authenticated, false otherwise
      */
     bool isAuthenticated() const;
-    
+
     /**
      * @brief Get current SMTP state
      * @return Current SMTP state
      */
     SMTPState getState() const;
-    
+
     /**
      * @brief Get last error message
      * @return Last error message
      */
     std::string getLastError() const;
-    
+
+    /**
+     * @brief Check whether the server advertised an ESMTP extension
+     * @param keyword Extension keyword (e.g. "STARTTLS", "AUTH")
+     * @return true if advertised in the last EHLO response
+     */
+    bool hasExtension(const std::string& keyword) const;
+
     /**
      * @brief Test SMTP connection
      * @return true if connection successful, false otherwise
@@ -123,120 +189,71 @@ public:
 
 private:
     /**
-     * @brief Initialize SSL context
-     * @return true if successful, false otherwise
-     */
-    bool initializeSSL();
-    
-    /**
-     * @brief Clean up SSL context
-     */
-    void cleanupSSL();
-    
-    /**
-     * @brief Read SMTP response
+     * @brief Read a complete (possibly multi-line) SMTP reply
      * @param response Response string to store result
-     * @return SMTP response code
+     * @return SMTP reply code, or -1 on I/O error
      */
     int readResponse(std::string& response);
-    
+
     /**
-     * @brief Check SMTP response code
-     * @param code Response code to check
-     * @return true if successful (2xx or 3xx), false otherwise
+     * @brief Send a command and read its reply
+     * @param command Command line without CRLF
+     * @param response Response string to store result
+     * @return SMTP reply code, or -1 on I/O error
      */
-    bool isResponseSuccess(int code) const;
-    
+    int executeCommand(const std::string& command, std::string& response);
+
     /**
-     * @brief Send EHLO command
+     * @brief Send EHLO (falling back to HELO) and record extensions
      * @param hostname Hostname to send
      * @return true if successful, false otherwise
      */
     bool sendEHLO(const std::string& hostname);
-    
+
     /**
-     * @brief Send STARTTLS command
+     * @brief Send STARTTLS command and upgrade the connection
      * @return true if successful, false otherwise
      */
     bool sendSTARTTLS();
-    
-    /**
-     * @brief Send MAIL FROM command
-     * @param from_address From address
-     * @return true if successful, false otherwise
-     */
-    bool sendMAILFROM(const std::string& from_address);
-    
-    /**
-     * @brief Send RCPT TO command
-     * @param to_address To address
-     * @return true if successful, false otherwise
-     */
-    bool sendRCPTTO(const std::string& to_address);
-    
-    /**
-     * @brief Send DATA command and email content
-     * @param email Email object to send
-     * @return true if successful, false otherwise
-     */
-    bool sendDATA(const Email& email);
-    
+
     /**
      * @brief Send QUIT command
      * @return true if successful, false otherwise
      */
     bool sendQUIT();
-    
-    /**
-     * @brief Format email headers
-     * @param email Email object
-     * @return Formatted email headers
-     */
-    std::string formatEmailHeaders(const Email& email) const;
-    
-    /**
-     * @brief Format email body
-     * @param email Email object
-     * @return Formatted email body
-     */
-    std::string formatEmailBody(const Email& email) const;
-    
+
     /**
      * @brief Generate Message-ID
+     * @param domain Domain part to use
      * @return Generated Message-ID
      */
-    std::string generateMessageID() const;
-    
-    /**
-     * @brief Get current timestamp
-     * @return Current timestamp string
-     */
-    std::string getCurrentTimestamp() const;
-    
+    std::string generateMessageID(const std::string& domain) const;
+
     /**
      * @brief Write data to socket
      * @param data Data to write
      * @param length Length of data
-     * @return Number of bytes written
+     * @return true if everything was written
      */
-    int writeData(const char* data, size_t length);
-    
+    bool writeData(const char* data, size_t length);
+
     /**
      * @brief Read data from socket
      * @param buffer Buffer to store data
      * @param max_length Maximum length to read
-     * @return Number of bytes read
+     * @return Number of bytes read, 0 on EOF, -1 on error
      */
     int readData(char* buffer, size_t max_length);
 
 private:
     /**
-     * @brief Send email using SMTP protocol
+     * @brief Deliver an email over a native SMTP session
      * @param email Email object to send
+     * @param domain_config Domain configuration
      * @return SMTPResult with operation status
      */
-    SMTPResult sendEmail(const Email& email);
-    
+    SMTPResult sendNative(const Email& email, const DomainConfig& domain_config);
+
     /**
      * @brief Authenticate using LOGIN method
      * @param username Username for authentication
@@ -244,7 +261,7 @@ private:
      * @return true if successful, false otherwise
      */
     bool authenticateLogin(const std::string& username, const std::string& password);
-    
+
     /**
      * @brief Authenticate using PLAIN method
      * @param username Username for authentication
@@ -252,7 +269,7 @@ private:
      * @return true if successful, false otherwise
      */
     bool authenticatePlain(const std::string& username, const std::string& password);
-    
+
     /**
      * @brief Authenticate using CRAM-MD5 method
      * @param username Username for authentication
@@ -264,33 +281,40 @@ private:
 private:
     const ConfigManager& config_;
     int socket_fd_;
-    SSL_CTX* ssl_context_;
     SSL* ssl_connection_;
     SMTPState state_;
+    bool authenticated_;
     std::string server_;
     int port_;
     bool use_ssl_;
     std::string last_error_;
-    std::string capabilities_;
-    
+    std::map<std::string, std::string> extensions_;
+    SMTPReplyReader reader_;
+    SMTPReply reply_;  // Last reply read, reused for every response
+    bool transaction_replied_;  // A reply was read since sendMessage() began
+
     // SSL configuration
     std::string ssl_cert_file_;
     std::string ssl_key_file_;
     std::string ssl_ca_file_;
-    
+    bool ssl_verify_peer_;
+
     // Connection settings
     int connection_timeout_;
     int read_timeout_;
     int write_timeout_;
-    
+
     // Helper methods
     bool setupSSL();
-    std::string readResponse();
     bool sendCommand(const std::string& command);
     SMTPResult sendEmailData(const Email& email);
-    std::string buildEmailData(const Email& email);
+    int streamData(MimeMessageStream& message, std::string& response);
+    int streamChunks(MimeMessageStream& message, std::string& response);
     std::string getCurrentTimestamp();
     std::string base64Encode(const std::string& input);
+    std::string base64Decode(const std::string& input);
+    std::string getLocalHostname() const;
+    void setError(const std::string& error);
     SMTPAuthMethod stringToAuthMethod(const std::string& method);
     SMTPResult sendViaCurl(const Email& email, const DomainConfig* domain_config);
 };
@@ -0,0 +1,380 @@
+#include "core/smtp/smtp_connection_pool.hpp"
+#include "core/logging/logger.hpp"
+#include <functional>
+#include <map>
+#include <sstream>
+
+namespace ssmtp_mailer {
+
+SMTPConnectionPool::SMTPConnectionPool(const ConfigManager& config)
+    : config_(config), open_connections_(0), idle_connections_(0),
+      hits_(0), misses_(0), evictions_(0) {
+    const GlobalConfig& global = config_.getGlobalConfig();
+    max_connections_ = global.max_connections > 0 ? static_cast<size_t>(global.max_connections) : 0;
+    idle_timeout_ = std::chrono::seconds(global.connection_idle_timeout);
+    acquire_timeout_ = std::chrono::seconds(global.connection_timeout);
+}
+
+SMTPConnectionPool::~SMTPConnectionPool() {
+    clear();
+}
+
+SMTPResult SMTPConnectionPool::send(const Email& email) {
+    std::string domain = email.from.substr(email.from.find('@') + 1);
+    const DomainConfig* domain_config = config_.getDomainConfig(domain);
+
+    if (!domain_config) {
+        return SMTPResult::createError("No configuration found for domain: " + domain);
+    }
+
+    // The curl fallback has no session to keep, hand it to a one-shot client
+    if (domain_config->smtp_transport == "curl") {
+        SMTPClient client(config_);
+        return client.send(email);
+    }
+
+    return send(email, *domain_config);
+}
+
+SMTPResult SMTPConnectionPool::send(const Email& email, const DomainConfig& domain_config) {
+    std::string key = makeKey(domain_config);
+
+    std::unique_ptr<SMTPClient> session;
+    if (!acquire(key, session)) {
+        return SMTPResult::createError("Timed out waiting for a free SMTP connection to " +
+                                       domain_config.smtp_server);
+    }
+
+    try {
+        bool pooled = session != nullptr;
+        if (!session && !openFresh(domain_config, session)) {
+            std::string error = session->getLastError();
+            release(key, std::move(session));
+            return SMTPResult::createError("SMTP session setup failed: " + error);
+        }
+
+        SMTPResult result = session->sendMessage(email);
+        if (pooled && !result.success && !session->transactionReplied() && !session->isConnected()) {
+            // The server dropped the pooled session after it passed the liveness
+            // check, typically its idle timeout. It answered nothing, so it
+            // cannot have taken the message: try once more
+            if (!openFresh(domain_config, session)) {
+                std::string error = session->getLastError();
+                release(key, std::move(session));
+                return SMTPResult::createError("SMTP session setup failed: " + error);
+            }
+            result = session->sendMessage(email);
+        }
+        release(key, std::move(session));
+        return result;
+
+    } catch (const std::exception& e) {
+        if (session) {
+            session->disconnect();
+        }
+        release(key, std::move(session));
+        return SMTPResult::createError("SMTP error: " + std::string(e.what()));
+    }
+}
+
+std::vector<SMTPResult> SMTPConnectionPool::sendBatch(const std::vector<const Email*>& emails) {
+    std::vector<SMTPResult> results(emails.size());
+
+    // Group by session, keeping each group in batch order
+    std::map<std::string, std::pair<const DomainConfig*, std::vector<size_t>>> groups;
+    for (size_t i = 0; i < emails.size(); ++i) {
+        const Email& email = *emails[i];
+        std::string domain = email.from.substr(email.from.find('@') + 1);
+        const DomainConfig* domain_config = config_.getDomainConfig(domain);
+        if (!domain_config) {
+            results[i] = SMTPResult::createError("No configuration found for domain: " + domain);
+        } else if (domain_config->smtp_transport == "curl") {
+            results[i] = send(email);
+        } else {
+            auto& group = groups[makeKey(*domain_config)];
+            group.first = domain_config;
+            group.second.push_back(i);
+        }
+    }
+
+    for (const auto& entry : groups) {
+        sendGroup(emails, entry.second.second, *entry.second.first, results);
+    }
+    return results;
+}
+
+void SMTPConnectionPool::sendGroup(const std::vector<const Email*>& emails, const std::vector<size_t>& indices,
+                                   const DomainConfig& domain_config, std::vector<SMTPResult>& results) {
+    std::string key = makeKey(domain_config);
+
+    std::unique_ptr<SMTPClient> session;
+    if (!acquire(key, session)) {
+        for (size_t index : indices) {
+            results[index] = SMTPResult::createError("Timed out waiting for a free SMTP connection to " +
+                                                     domain_config.smtp_server);
+        }
+        return;
+    }
+
+    size_t next = 0;
+    bool pooled = session != nullptr;
+    try {
+        for (; next < indices.size(); ++next) {
+            // First message without a pooled session, or the last one lost it;
+            // the new session takes over the slot
+            bool fresh = !session || !session->isConnected();
+            if (fresh && !openFresh(domain_config, session)) {
+                std::string error = "SMTP session setup failed: " + session->getLastError();
+                for (; next < indices.size(); ++next) {
+                    results[indices[next]] = SMTPResult::createError(error);
+                }
+                break;
+            }
+            const Email& email = *emails[indices[next]];
+            SMTPResult result = session->sendMessage(email);
+            if (pooled && !fresh && !result.success && !session->transactionReplied() &&
+                !session->isConnected()) {
+                // The pooled session died before its first message got a reply;
+                // retry that one message on a new session, as send() does
+                if (!openFresh(domain_config, session)) {
+                    std::string error = "SMTP session setup failed: " + session->getLastError();
+                    for (; next < indices.size(); ++next) {
+                        results[indices[next]] = SMTPResult::createError(error);
+                    }
+                    break;
+                }
+                result = session->sendMessage(email);
+            }
+            pooled = false;
+            results[indices[next]] = result;
+        }
+    } catch (const std::exception& e) {
+        if (session) {
+            session->disconnect();
+        }
+        for (; next < indices.size(); ++next) {
+            results[indices[next]] = SMTPResult::createError("SMTP error: " + std::string(e.what()));
+        }
+    }
+    release(key, std::move(session));
+}
+
+bool SMTPConnectionPool::openFresh(const DomainConfig& domain_config, std::unique_ptr<SMTPClient>& session) {
+    session = std::make_unique<SMTPClient>(config_);
+    if (!session->openSession(domain_config)) {
+        session->disconnect();
+        return false;
+    }
+    return true;
+}
+
+void SMTPConnectionPool::setMaxConnections(size_t max_connections) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        max_connections_ = max_connections;
+    }
+    slot_available_.notify_all();
+}
+
+void SMTPConnectionPool::setIdleTimeout(std::chrono::seconds timeout) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_timeout_ = timeout;
+}
+
+size_t SMTPConnectionPool::evictIdle() {
+    std::vector<std::unique_ptr<SMTPClient>> closed;
+    size_t evicted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        evicted = evictIdleLocked(closed);
+    }
+    closeSessions(closed);
+    if (evicted > 0) {
+        slot_available_.notify_all();
+    }
+    return evicted;
+}
+
+void SMTPConnectionPool::clear() {
+    std::vector<std::unique_ptr<SMTPClient>> closed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& entry : idle_sessions_) {
+            for (auto& pooled : entry.second) {
+                closed.push_back(std::move(pooled.client));
+            }
+        }
+        open_connections_ -= closed.size();
+        idle_connections_ = 0;
+        idle_sessions_.clear();
+    }
+    closeSessions(closed);
+    slot_available_.notify_all();
+}
+
+SMTPPoolStats SMTPConnectionPool::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SMTPPoolStats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.evictions = evictions_;
+    stats.open_connections = open_connections_;
+    stats.idle_connections = idle_connections_;
+    return stats;
+}
+
+std::string SMTPConnectionPool::makeKey(const DomainConfig& domain_config) {
+    // Credentials are part of the key but never stored in clear text
+    size_t secret_hash = std::hash<std::string>{}(domain_config.password + '\0' + domain_config.oauth2_token);
+
+    std::ostringstream key;
+    key << domain_config.smtp_server << ':' << domain_config.smtp_port
+        << '|' << (domain_config.use_ssl ? "ssl" : (domain_config.use_starttls ? "starttls" : "plain"))
+        << (domain_config.ssl_verify_peer ? "+verify" : "")
+        << '|' << domain_config.auth_method
+        << '|' << domain_config.username
+        << '|' << std::hex << secret_hash;
+    return key.str();
+}
+
+bool SMTPConnectionPool::acquire(const std::string& key, std::unique_ptr<SMTPClient>& session) {
+    std::vector<std::unique_ptr<SMTPClient>> closed;
+    std::unique_lock<std::mutex> lock(mutex_);
+    evictIdleLocked(closed);
+
+    auto deadline = std::chrono::steady_clock::now() + acquire_timeout_;
+    bool acquired = false;
+
+    while (!acquired) {
+        // Prefer the most recently used session: it is the least likely to have timed out
+        auto it = idle_sessions_.find(key);
+        while (it != idle_sessions_.end() && !it->second.empty()) {
+            PooledSession pooled = std::move(it->second.back());
+            it->second.pop_back();
+            idle_connections_--;
+
+            if (pooled.client->isAlive()) {
+                session = std::move(pooled.client);
+                hits_++;
+                acquired = true;
+                break;
+            }
+
+            open_connections_--;
+            evictions_++;
+            closed.push_back(std::move(pooled.client));
+        }
+        if (acquired) {
+            break;
+        }
+
+        // No reusable session: open a new one if there is (or we can make) room
+        if (max_connections_ == 0 || open_connections_ < max_connections_ || evictOldestLocked(closed)) {
+            open_connections_++;
+            misses_++;
+            acquired = true;
+            break;
+        }
+
+        if (slot_available_.wait_until(lock, deadline) == std::cv_status::timeout) {
+            break;
+        }
+    }
+
+    lock.unlock();
+    closeSessions(closed);
+    return acquired;
+}
+
+void SMTPConnectionPool::release(const std::string& key, std::unique_ptr<SMTPClient> session) {
+    std::vector<std::unique_ptr<SMTPClient>> closed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (session && session->isConnected()) {
+            PooledSession pooled;
+            pooled.client = std::move(session);
+            pooled.last_used = std::chrono::steady_clock::now();
+            idle_sessions_[key].push_back(std::move(pooled));
+            idle_connections_++;
+        } else {
+            open_connections_--;
+            if (session) {
+                closed.push_back(std::move(session));
+            }
+        }
+    }
+    slot_available_.notify_all();
+    closeSessions(closed);
+}
+
+size_t SMTPConnectionPool::evictIdleLocked(std::vector<std::unique_ptr<SMTPClient>>& closed) {
+    auto cutoff = std::chrono::steady_clock::now() - idle_timeout_;
+    size_t evicted = 0;
+
+    for (auto it = idle_sessions_.begin(); it != idle_sessions_.end();) {
+        auto& sessions = it->second;
+        // Sessions are appended on release, so the oldest are at the front
+        size_t expired = 0;
+        while (expired < sessions.size() && sessions[expired].last_used < cutoff) {
+            closed.push_back(std::move(sessions[expired].client));
+            expired++;
+        }
+        sessions.erase(sessions.begin(), sessions.begin() + expired);
+        evicted += expired;
+
+        if (sessions.empty()) {
+            it = idle_sessions_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    open_connections_ -= evicted;
+    idle_connections_ -= evicted;
+    evictions_ += evicted;
+    return evicted;
+}
+
+bool SMTPConnectionPool::evictOldestLocked(std::vector<std::unique_ptr<SMTPClient>>& closed) {
+    auto oldest = idle_sessions_.end();
+    for (auto it = idle_sessions_.begin(); it != idle_sessions_.end(); ++it) {
+        if (it->second.empty()) {
+            continue;
+        }
+        if (oldest == idle_sessions_.end() ||
+            it->second.front().last_used < oldest->second.front().last_used) {
+            oldest = it;
+        }
+    }
+
+    if (oldest == idle_sessions_.end()) {
+        return false;
+    }
+
+    closed.push_back(std::move(oldest->second.front().client));
+    oldest->second.erase(oldest->second.begin());
+    if (oldest->second.empty()) {
+        idle_sessions_.erase(oldest);
+    }
+
+    open_connections_--;
+    idle_connections_--;
+    evictions_++;
+    return true;
+}
+
+void SMTPConnectionPool::closeSessions(std::vector<std::unique_ptr<SMTPClient>>& sessions) {
+    for (auto& session : sessions) {
+        if (!session) {
+            continue;
+        }
+        if (session->isAlive()) {
+            session->quit();
+        } else {
+            session->disconnect();
+        }
+    }
+    sessions.clear();
+}
+
+} // namespace ssmtp_mailer
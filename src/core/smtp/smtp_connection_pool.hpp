@@ -0,0 +1,181 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_map>
+#include "core/config/config_manager.hpp"
+#include "core/smtp/smtp_client.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief SMTP connection pool statistics
+ */
+struct SMTPPoolStats {
+    size_t hits;              // Messages sent on a reused session
+    size_t misses;            // Messages that needed a new session
+    size_t evictions;         // Sessions closed for idleness, staleness or capacity
+    size_t open_connections;  // Sessions currently open (idle + in use)
+    size_t idle_connections;  // Sessions currently parked in the pool
+
+    SMTPPoolStats() : hits(0), misses(0), evictions(0), open_connections(0), idle_connections(0) {}
+};
+
+/**
+ * @brief Pool of authenticated SMTP sessions
+ *
+ * Sessions are keyed by (smtp_server, port, TLS mode, credentials) and kept
+ * open between messages, so a reused session costs one MAIL FROM round trip
+ * instead of TCP connect, TLS handshake, EHLO and AUTH. The number of open
+ * sessions is capped by GlobalConfig::max_connections.
+ */
+class SMTPConnectionPool {
+public:
+    /**
+     * @brief Constructor
+     * @param config Configuration manager instance
+     */
+    explicit SMTPConnectionPool(const ConfigManager& config);
+
+    /**
+     * @brief Destructor, closes every pooled session
+     */
+    ~SMTPConnectionPool();
+
+    SMTPConnectionPool(const SMTPConnectionPool&) = delete;
+    SMTPConnectionPool& operator=(const SMTPConnectionPool&) = delete;
+
+    /**
+     * @brief Send an email using the domain configured for its from address
+     * @param email Email object to send
+     * @return SMTPResult with operation status
+     */
+    SMTPResult send(const Email& email);
+
+    /**
+     * @brief Send an email through a specific domain configuration
+     * @param email Email object to send
+     * @param domain_config Domain configuration to use
+     * @return SMTPResult with operation status
+     */
+    SMTPResult send(const Email& email, const DomainConfig& domain_config);
+
+    /**
+     * @brief Send several emails, with those bound for the same server sharing one session
+     *
+     * Emails whose domains use the same server and credentials go out one
+     * transaction after another on a single session, opening a fresh one
+     * if the server drops it part way.
+     * @param emails Emails to send
+     * @return One result per email, in the same order
+     */
+    std::vector<SMTPResult> sendBatch(const std::vector<const Email*>& emails);
+
+    /**
+     * @brief Set the maximum number of open sessions across all servers
+     * @param max_connections Session cap (0 disables pooling limits)
+     */
+    void setMaxConnections(size_t max_connections);
+
+    /**
+     * @brief Set how long an unused session may stay open
+     * @param timeout Idle timeout
+     */
+    void setIdleTimeout(std::chrono::seconds timeout);
+
+    /**
+     * @brief Close sessions that have been idle longer than the idle timeout
+     * @return Number of sessions closed
+     */
+    size_t evictIdle();
+
+    /**
+     * @brief Close every idle session
+     */
+    void clear();
+
+    /**
+     * @brief Get pool statistics
+     * @return Snapshot of pool counters
+     */
+    SMTPPoolStats getStats() const;
+
+    /**
+     * @brief Build the session key for a domain configuration
+     *
+     * Sessions with equal keys are interchangeable: same server, port, TLS
+     * mode and credentials.
+     * @param domain_config Domain configuration
+     * @return Session key
+     */
+    static std::string makeKey(const DomainConfig& domain_config);
+
+private:
+    struct PooledSession {
+        std::unique_ptr<SMTPClient> client;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    /**
+     * @brief Take an idle session for key or reserve a slot for a new one
+     * @param key Pool key
+     * @param session Receives the reused session, if any
+     * @return false if no slot became available in time
+     */
+    bool acquire(const std::string& key, std::unique_ptr<SMTPClient>& session);
+
+    /**
+     * @brief Return a session to the pool, or release its slot if it is dead
+     */
+    void release(const std::string& key, std::unique_ptr<SMTPClient> session);
+
+    /**
+     * @brief Replace session with a new one, opened for domain_config
+     * @return false if it could not be opened; session is then disconnected
+     */
+    bool openFresh(const DomainConfig& domain_config, std::unique_ptr<SMTPClient>& session);
+
+    /**
+     * @brief Send the emails at indices over one session for domain_config
+     */
+    void sendGroup(const std::vector<const Email*>& emails, const std::vector<size_t>& indices,
+                   const DomainConfig& domain_config, std::vector<SMTPResult>& results);
+
+    /**
+     * @brief Close idle sessions past their timeout (caller holds mutex_)
+     */
+    size_t evictIdleLocked(std::vector<std::unique_ptr<SMTPClient>>& closed);
+
+    /**
+     * @brief Close the least recently used idle session (caller holds mutex_)
+     */
+    bool evictOldestLocked(std::vector<std::unique_ptr<SMTPClient>>& closed);
+
+    /**
+     * @brief QUIT sessions outside the lock
+     */
+    static void closeSessions(std::vector<std::unique_ptr<SMTPClient>>& sessions);
+
+    const ConfigManager& config_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable slot_available_;
+    std::unordered_map<std::string, std::vector<PooledSession>> idle_sessions_;
+    size_t max_connections_;
+    std::chrono::seconds idle_timeout_;
+    std::chrono::seconds acquire_timeout_;
+
+    // Statistics
+    size_t open_connections_;
+    size_t idle_connections_;
+    size_t hits_;
+    size_t misses_;
+    size_t evictions_;
+};
+
+} // namespace ssmtp_mailer
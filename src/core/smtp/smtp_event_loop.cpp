@@ -0,0 +1,1785 @@
+#include "core/smtp/smtp_event_loop.hpp"
+#include "core/smtp/smtp_connection_pool.hpp"
+#include "core/smtp/mime_stream.hpp"
+#include "core/smtp/tls_context.hpp"
+#include "core/smtp/dns_resolver.hpp"
+#include "core/smtp/smtp_reply.hpp"
+#include "core/logging/logger.hpp"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/x509v3.h>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+// Message bytes generated per write; bounds memory per session
+constexpr size_t kDataChunkSize = 64 * 1024;
+
+// Upper bound on a single epoll_wait so settings changes are picked up
+constexpr int kMaxWaitMs = 1000;
+
+constexpr int kMaxEvents = 256;
+
+std::string toLower(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return value;
+}
+
+std::string toUpper(std::string value) {
+    std::transform(value.begin(), value.end(), value.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::toupper(c)); });
+    return value;
+}
+
+// Lower-cased domain of a recipient, or empty if it has none
+std::string recipientDomain(const std::string& recipient) {
+    size_t at = recipient.rfind('@');
+    return at == std::string::npos ? "" : toLower(recipient.substr(at + 1));
+}
+
+std::string opensslErrorString() {
+    unsigned long err = ERR_get_error();
+    if (err == 0) {
+        return "unknown error";
+    }
+    char buffer[256];
+    ERR_error_string_n(err, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return buffer;
+}
+
+std::string base64Encode(const std::string& input) {
+    std::string output(4 * ((input.size() + 2) / 3), '\0');
+    int length = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(&output[0]),
+                                 reinterpret_cast<const unsigned char*>(input.data()),
+                                 static_cast<int>(input.size()));
+    output.resize(length > 0 ? static_cast<size_t>(length) : 0);
+    return output;
+}
+
+std::string base64Decode(const std::string& input) {
+    if (input.empty() || input.size() % 4 != 0) {
+        return "";
+    }
+    std::string output(3 * input.size() / 4, '\0');
+    int length = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(&output[0]),
+                                 reinterpret_cast<const unsigned char*>(input.data()),
+                                 static_cast<int>(input.size()));
+    if (length < 0) {
+        return "";
+    }
+    // EVP_DecodeBlock counts the padding as zero bytes
+    size_t padding = input[input.size() - 1] == '=' ? (input[input.size() - 2] == '=' ? 2 : 1) : 0;
+    output.resize(static_cast<size_t>(length) - padding);
+    return output;
+}
+
+} // anonymous namespace
+
+/**
+ * @brief One non-blocking SMTP connection and its current transaction
+ */
+class SMTPEventLoop::Session : public SMTPEventLoop::Watched {
+public:
+    enum class Phase {
+        RESOLVING,
+        CONNECTING,
+        HANDSHAKE,
+        GREETING,
+        EHLO,
+        HELO,
+        STARTTLS,
+        AUTH,
+        IDLE,
+        ENVELOPE,
+        BODY,
+        DATA_END,
+        BDAT,
+        RESET,
+        CLOSED
+    };
+
+    Session(SMTPEventLoop& loop, const DomainConfig& domain, const std::string& key)
+        : loop_(loop), domain_(domain), key_(key), fd_(-1), ssl_(nullptr), next_address_(0),
+          phase_(Phase::CONNECTING), registered_events_(0), greeted_(false), tls_(false),
+          handshake_wants_write_(false), read_wants_write_(false), pending_write_(0),
+          out_offset_(0), auth_step_(0), pipelining_(false), chunking_(false),
+          replies_(0), rejected_(false), bdat_last_(false) {}
+
+    ~Session() {
+        close();
+    }
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    const std::string& key() const { return key_; }
+    Phase phase() const { return phase_; }
+    int fd() const { return fd_; }
+    uint32_t& registeredEvents() { return registered_events_; }
+
+    std::chrono::steady_clock::time_point deadline() const { return deadline_; }
+    std::chrono::steady_clock::time_point lastUsed() const { return last_used_; }
+
+    bool wantsWrite() const {
+        if (phase_ == Phase::RESOLVING) {
+            return query_->wantsWrite();
+        }
+        return phase_ == Phase::CONNECTING ||
+               (phase_ == Phase::HANDSHAKE && handshake_wants_write_) ||
+               read_wants_write_ || out_offset_ < out_.size();
+    }
+
+    /**
+     * @brief Start a non-blocking connect on behalf of job
+     */
+    void connect(std::unique_ptr<Job> job) {
+        job_ = std::move(job);
+
+        query_ = DNSResolver::getInstance().query(domain_.smtp_server);
+        if (query_->done()) {
+            resolved();
+            return;
+        }
+
+        // Until the lookup finishes the session waits on the query's socket
+        phase_ = Phase::RESOLVING;
+        fd_ = query_->fd();
+        deadline_ = query_->deadline();
+    }
+
+    /**
+     * @brief Run job's mail transaction on this idle session
+     */
+    void begin(std::unique_ptr<Job> job) {
+        job_ = std::move(job);
+        chunking_ = hasExtension("CHUNKING");
+        pipelining_ = hasExtension("PIPELINING");
+
+        const Email& email = *job_->email;
+        std::string domain = email.from.substr(email.from.find('@') + 1);
+        message_id_ = job_->message_id.empty() ? MimeMessageStream::generateMessageId(domain)
+                                               : job_->message_id;
+        std::string date = job_->date.empty() ? MimeMessageStream::currentDate() : job_->date;
+        message_.reset(new MimeMessageStream(email, message_id_, date, !chunking_));
+        if (message_->failed()) {
+            finish(SMTPResult::createError(message_->getError()));
+            return;
+        }
+
+        recipients_ = job_->recipients.empty() ? email.getAllRecipients() : job_->recipients;
+        if (recipients_.empty()) {
+            finish(SMTPResult::createError("No recipients specified"));
+            return;
+        }
+
+        // Measured by the submitting thread, with dot-stuffing; over BDAT
+        // the message is that many bytes smaller, which SIZE allows
+        std::string mail_from = "MAIL FROM:<" + email.from + ">";
+        if (hasExtension("SIZE") && job_->size > 0) {
+            mail_from += " SIZE=" + std::to_string(job_->size);
+        }
+        envelope_.clear();
+        envelope_.push_back(mail_from);
+        for (const auto& recipient : recipients_) {
+            envelope_.push_back("RCPT TO:<" + recipient + ">");
+        }
+        if (!chunking_) {
+            envelope_.push_back("DATA");
+        }
+
+        replies_ = 0;
+        rejected_ = false;
+        failure_ = SMTPResult();
+        phase_ = Phase::ENVELOPE;
+
+        // With PIPELINING the whole envelope goes out at once (RFC 2920)
+        if (pipelining_) {
+            for (const auto& command : envelope_) {
+                queue(command);
+            }
+        } else {
+            queue(envelope_[0]);
+        }
+        flush();
+    }
+
+    /**
+     * @brief Handle epoll readiness
+     */
+    void onEvent(uint32_t events) override {
+        if (phase_ == Phase::CLOSED) {
+            return;
+        }
+
+        if (phase_ == Phase::RESOLVING) {
+            query_->onReady();
+            if (query_->done()) {
+                resolved();
+            } else {
+                followQuery();
+            }
+            return;
+        }
+
+        if (phase_ == Phase::CONNECTING) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(fd_, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                connect_error_ = strerror(error);
+                closeSocket();
+                connectNext();
+                return;
+            }
+            if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                return;
+            }
+            touch();
+            if (domain_.use_ssl) {
+                startTLS();
+            } else {
+                phase_ = Phase::GREETING;
+            }
+            return;
+        }
+
+        if (phase_ == Phase::HANDSHAKE) {
+            handshake();
+            return;
+        }
+
+        if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) || (read_wants_write_ && (events & EPOLLOUT))) {
+            receive();
+        }
+        if (phase_ != Phase::CLOSED && out_offset_ < out_.size()) {
+            flush();
+        }
+    }
+
+    /**
+     * @brief Handle an expired deadline
+     */
+    void onTimeout() {
+        if (phase_ == Phase::RESOLVING) {
+            query_->onTimeout();
+            if (query_->done()) {
+                resolved();
+            } else {
+                followQuery();
+            }
+        } else if (phase_ == Phase::CONNECTING && next_address_ < addresses_.size()) {
+            connect_error_ = "timed out";
+            closeSocket();
+            connectNext();
+        } else if (phase_ == Phase::IDLE) {
+            quit();
+        } else if (phase_ != Phase::CLOSED) {
+            fail("Timed out waiting for SMTP server " + domain_.smtp_server);
+        }
+    }
+
+    /**
+     * @brief Politely close an idle session
+     */
+    void quit() {
+        if (phase_ == Phase::IDLE) {
+            queue("QUIT");
+            flush();
+        }
+        close();
+    }
+
+    /**
+     * @brief Drop the connection without notifying anyone
+     */
+    void close() {
+        if (query_) {
+            // The socket belongs to the query
+            if (fd_ >= 0) {
+                epoll_ctl(loop_.epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+                fd_ = -1;
+            }
+            query_.reset();
+        }
+        if (ssl_) {
+            SSL_free(ssl_);
+            ssl_ = nullptr;
+        }
+        if (fd_ >= 0) {
+            epoll_ctl(loop_.epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+            ::close(fd_);
+            fd_ = -1;
+        }
+        if (phase_ != Phase::CLOSED) {
+            phase_ = Phase::CLOSED;
+            loop_.live_sessions_--;
+            loop_.sessions_closed_ = true;
+        }
+    }
+
+    /**
+     * @brief Hand back the job this session is working on, if any
+     */
+    std::unique_ptr<Job> takeJob() {
+        message_.reset();
+        return std::move(job_);
+    }
+
+private:
+    /**
+     * @brief Keep waiting on the lookup, which may have moved to a new socket
+     */
+    void followQuery() {
+        if (fd_ != query_->fd()) {
+            fd_ = query_->fd();
+            registered_events_ = 0;
+        }
+        deadline_ = query_->deadline();
+    }
+
+    /**
+     * @brief Start connecting once the lookup has finished
+     */
+    void resolved() {
+        // A finished query has already closed its socket, which also
+        // removed it from epoll
+        if (phase_ == Phase::RESOLVING) {
+            fd_ = -1;
+            registered_events_ = 0;
+        }
+
+        std::unique_ptr<DNSQuery> query = std::move(query_);
+        if (!query->success()) {
+            fail("Failed to resolve hostname " + domain_.smtp_server + ": " + query->getError());
+            return;
+        }
+        addresses_ = query->addresses(domain_.smtp_port);
+        next_address_ = 0;
+        connectNext();
+    }
+
+    /**
+     * @brief Connect to the next resolved address, failing when none are left
+     */
+    void connectNext() {
+        while (next_address_ < addresses_.size()) {
+            const ResolvedAddress& address = addresses_[next_address_++];
+            fd_ = socket(address.family(), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd_ < 0) {
+                connect_error_ = strerror(errno);
+                continue;
+            }
+            if (::connect(fd_, reinterpret_cast<const struct sockaddr*>(&address.address), address.length) < 0 &&
+                errno != EINPROGRESS) {
+                connect_error_ = strerror(errno);
+                ::close(fd_);
+                fd_ = -1;
+                continue;
+            }
+
+            phase_ = Phase::CONNECTING;
+            deadline_ = std::chrono::steady_clock::now() + loop_.connect_timeout_;
+            return;
+        }
+
+        fail("Failed to connect to " + domain_.smtp_server + ":" +
+             std::to_string(domain_.smtp_port) + ": " + connect_error_);
+    }
+
+    void closeSocket() {
+        if (fd_ >= 0) {
+            epoll_ctl(loop_.epoll_fd_, EPOLL_CTL_DEL, fd_, nullptr);
+            ::close(fd_);
+            fd_ = -1;
+        }
+        registered_events_ = 0;
+    }
+
+    bool hasExtension(const std::string& keyword) const {
+        return extensions_.find(keyword) != extensions_.end();
+    }
+
+    void touch() {
+        deadline_ = std::chrono::steady_clock::now() + loop_.io_timeout_;
+    }
+
+    void queue(const std::string& command) {
+        out_ += command;
+        out_ += "\r\n";
+        touch();
+    }
+
+    /**
+     * @brief Fail the current job (if any) and drop the connection
+     */
+    void fail(const std::string& error) {
+        bool in_transaction = phase_ > Phase::IDLE;
+        if (!in_transaction && job_ && !job_->fallbacks.empty()) {
+            // Nothing was sent yet, so the next mail exchanger can take the job
+            Logger::getInstance().warning("Mail exchanger " + domain_.smtp_server + " failed (" + error +
+                                          "), trying " + job_->fallbacks.front());
+            std::unique_ptr<Job> job = takeJob();
+            close();
+            loop_.failOver(std::move(job));
+            return;
+        }
+        drop(SMTPResult::createError(in_transaction ? error : "SMTP session setup failed: " + error));
+    }
+
+    void drop(const SMTPResult& result) {
+        std::unique_ptr<Job> job = takeJob();
+        close();
+        if (job) {
+            loop_.complete(std::move(job), result);
+        }
+    }
+
+    /**
+     * @brief End the current transaction on a healthy connection
+     */
+    void finish(const SMTPResult& result) {
+        std::unique_ptr<Job> job = takeJob();
+        bool success = result.success;
+        loop_.complete(std::move(job), result);
+
+        if (success) {
+            ready();
+        } else {
+            phase_ = Phase::RESET;
+            queue("RSET");
+        }
+    }
+
+    /**
+     * @brief Session is authenticated and has no transaction in progress
+     */
+    void ready() {
+        phase_ = Phase::IDLE;
+        last_used_ = std::chrono::steady_clock::now();
+        if (job_) {
+            // The job that opened this session goes first
+            std::unique_ptr<Job> job = std::move(job_);
+            begin(std::move(job));
+        } else {
+            loop_.sessionReady(this);
+        }
+    }
+
+    void startTLS() {
+        TLSContextOptions options;
+        options.ca_file = domain_.ssl_ca_file;
+        options.cert_file = domain_.ssl_cert_file;
+        options.key_file = domain_.ssl_key_file;
+        options.verify_peer = domain_.ssl_verify_peer;
+
+        std::string error;
+        ssl_ = TLSContextManager::getInstance().createConnection(options, domain_.smtp_server,
+                                                                 domain_.smtp_port, error);
+        if (!ssl_) {
+            fail(error);
+            return;
+        }
+        if (!TLSContextManager::getInstance().attachSocket(ssl_, fd_)) {
+            fail("Failed to create SSL connection: " + opensslErrorString());
+            return;
+        }
+        SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+        phase_ = Phase::HANDSHAKE;
+        touch();
+        handshake();
+    }
+
+    void handshake() {
+        int rc = SSL_connect(ssl_);
+        if (rc == 1) {
+            TLSContextManager::getInstance().handshakeCompleted(ssl_);
+            tls_ = true;
+            handshake_wants_write_ = false;
+            touch();
+            if (!greeted_) {
+                // Implicit TLS: the greeting arrives over the secured channel
+                phase_ = Phase::GREETING;
+            } else {
+                phase_ = Phase::EHLO;
+                queue("EHLO " + loop_.hostname_);
+                flush();
+            }
+            return;
+        }
+
+        int error = SSL_get_error(ssl_, rc);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            handshake_wants_write_ = error == SSL_ERROR_WANT_WRITE;
+            return;
+        }
+
+        std::string reason = opensslErrorString();
+        long verify_result = SSL_get_verify_result(ssl_);
+        if (verify_result != X509_V_OK) {
+            reason = X509_verify_cert_error_string(verify_result);
+        }
+        fail("SSL handshake failed: " + reason);
+    }
+
+    void receive() {
+        bool closed_by_peer = false;
+        read_wants_write_ = false;
+
+        while (true) {
+            // Read straight into the reply buffer
+            size_t available = 0;
+            char* buffer = reader_.prepare(available);
+            int bytes_read;
+            if (ssl_) {
+                bytes_read = SSL_read(ssl_, buffer, static_cast<int>(available));
+                if (bytes_read <= 0) {
+                    int error = SSL_get_error(ssl_, bytes_read);
+                    if (error == SSL_ERROR_WANT_READ) {
+                        break;
+                    }
+                    if (error == SSL_ERROR_WANT_WRITE) {
+                        read_wants_write_ = true;
+                        break;
+                    }
+                    if (error != SSL_ERROR_ZERO_RETURN && error != SSL_ERROR_SYSCALL) {
+                        fail("TLS read failed: " + opensslErrorString());
+                        return;
+                    }
+                    closed_by_peer = true;
+                    break;
+                }
+            } else {
+                bytes_read = static_cast<int>(recv(fd_, buffer, available, 0));
+                if (bytes_read < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        break;
+                    }
+                    fail("Read failed: " + std::string(strerror(errno)));
+                    return;
+                }
+                if (bytes_read == 0) {
+                    closed_by_peer = true;
+                    break;
+                }
+            }
+            reader_.commit(static_cast<size_t>(bytes_read));
+        }
+
+        parseReplies();
+
+        if (closed_by_peer && phase_ != Phase::CLOSED) {
+            if (phase_ == Phase::IDLE) {
+                close();
+            } else {
+                fail("Connection closed by SMTP server");
+            }
+        }
+    }
+
+    void parseReplies() {
+        while (phase_ != Phase::CLOSED) {
+            SMTPReplyReader::Status status = reader_.next(reply_);
+            if (status == SMTPReplyReader::Status::INCOMPLETE) {
+                return;
+            }
+            if (status == SMTPReplyReader::Status::MALFORMED) {
+                fail(reader_.getError());
+                return;
+            }
+            onReply(reply_.code(), reply_.text());
+        }
+    }
+
+    void flush() {
+        while (phase_ != Phase::CLOSED && out_offset_ < out_.size()) {
+            int bytes_sent;
+            if (ssl_) {
+                // A retried SSL_write must not shrink, so repeat the pending length
+                size_t length = pending_write_ > 0 ? pending_write_ : out_.size() - out_offset_;
+                bytes_sent = SSL_write(ssl_, out_.data() + out_offset_, static_cast<int>(length));
+                if (bytes_sent <= 0) {
+                    int error = SSL_get_error(ssl_, bytes_sent);
+                    if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+                        pending_write_ = length;
+                        return;
+                    }
+                    fail("TLS write failed: " + opensslErrorString());
+                    return;
+                }
+                pending_write_ = 0;
+            } else {
+                bytes_sent = static_cast<int>(::send(fd_, out_.data() + out_offset_,
+                                                     out_.size() - out_offset_, MSG_NOSIGNAL));
+                if (bytes_sent < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    fail("Write failed: " + std::string(strerror(errno)));
+                    return;
+                }
+            }
+
+            out_offset_ += static_cast<size_t>(bytes_sent);
+            if (out_offset_ == out_.size()) {
+                out_.clear();
+                out_offset_ = 0;
+                if (phase_ == Phase::BODY) {
+                    pumpBody();
+                }
+            }
+        }
+    }
+
+    void onReply(int code, const std::string& reply) {
+        switch (phase_) {
+        case Phase::GREETING:
+            if (code != 220) {
+                fail("Unexpected SMTP greeting: " + reply);
+                return;
+            }
+            greeted_ = true;
+            phase_ = Phase::EHLO;
+            queue("EHLO " + loop_.hostname_);
+            return;
+
+        case Phase::EHLO:
+            extensions_.clear();
+            if (code != 250) {
+                // Pre-ESMTP servers only understand HELO
+                phase_ = Phase::HELO;
+                queue("HELO " + loop_.hostname_);
+                return;
+            }
+            parseExtensions();
+            afterHello();
+            return;
+
+        case Phase::HELO:
+            if (code != 250) {
+                fail("HELO rejected: " + reply);
+                return;
+            }
+            afterHello();
+            return;
+
+        case Phase::STARTTLS:
+            if (code != 220) {
+                fail("STARTTLS rejected: " + reply);
+                return;
+            }
+            // Anything already buffered was sent before TLS and cannot be trusted
+            if (reader_.hasBufferedData()) {
+                fail("Unexpected data after STARTTLS");
+                return;
+            }
+            extensions_.clear();
+            startTLS();
+            return;
+
+        case Phase::AUTH:
+            onAuthReply(code, reply);
+            return;
+
+        case Phase::ENVELOPE:
+            onEnvelopeReply(code, reply);
+            return;
+
+        case Phase::DATA_END:
+            if (code != 250) {
+                finish(SMTPResult::createError("Email data rejected: " + reply, code));
+            } else {
+                finish(SMTPResult::createSuccess(message_id_));
+            }
+            return;
+
+        case Phase::BDAT:
+            if (code != 250) {
+                finish(SMTPResult::createError("Email data rejected: " + reply, code));
+            } else if (bdat_last_) {
+                finish(SMTPResult::createSuccess(message_id_));
+            } else {
+                sendChunk();
+            }
+            return;
+
+        case Phase::RESET:
+            if (code != 250) {
+                fail("RSET rejected: " + reply);
+                return;
+            }
+            ready();
+            return;
+
+        case Phase::IDLE:
+            // Unsolicited reply on an idle session, typically a 421 timeout notice
+            close();
+            return;
+
+        default:
+            fail("Unexpected SMTP reply: " + reply);
+            return;
+        }
+    }
+
+    void parseExtensions() {
+        // First line is the server greeting, the rest are "KEYWORD params"
+        for (size_t i = 1; i < reply_.lineCount(); ++i) {
+            std::string_view extension = reply_.line(i);
+            if (extension.empty()) {
+                continue;
+            }
+            size_t space = extension.find(' ');
+            std::string keyword = toUpper(std::string(extension.substr(0, space)));
+            extensions_[keyword] = space == std::string_view::npos ? "" : std::string(extension.substr(space + 1));
+        }
+    }
+
+    void afterHello() {
+        if (!domain_.use_ssl && domain_.use_starttls && !tls_) {
+            // Never silently downgrade to plaintext when TLS was requested;
+            // MX hosts get opportunistic TLS as between any two MTAs (RFC 3207)
+            if (!hasExtension("STARTTLS")) {
+                if (domain_.delivery_mode == "mx") {
+                    startAuth();
+                    return;
+                }
+                fail("SMTP server " + domain_.smtp_server + " does not offer STARTTLS");
+                return;
+            }
+            phase_ = Phase::STARTTLS;
+            queue("STARTTLS");
+            return;
+        }
+        startAuth();
+    }
+
+    void startAuth() {
+        auth_method_ = toUpper(domain_.auth_method);
+        if (auth_method_ == "CRAM_MD5") {
+            auth_method_ = "CRAM-MD5";
+        }
+        if (auth_method_ == "OAUTH2") {
+            auth_method_ = "XOAUTH2";
+        }
+
+        bool supported = auth_method_ == "PLAIN" || auth_method_ == "LOGIN" ||
+                         auth_method_ == "CRAM-MD5" || auth_method_ == "XOAUTH2";
+        if (!supported || domain_.username.empty()) {
+            ready();
+            return;
+        }
+        if (!hasExtension("AUTH")) {
+            fail("SMTP server " + domain_.smtp_server + " does not support authentication");
+            return;
+        }
+
+        phase_ = Phase::AUTH;
+        auth_step_ = 0;
+        if (auth_method_ == "PLAIN") {
+            std::string credentials;
+            credentials.push_back('\0');
+            credentials += domain_.username;
+            credentials.push_back('\0');
+            credentials += domain_.password;
+            queue("AUTH PLAIN " + base64Encode(credentials));
+        } else if (auth_method_ == "XOAUTH2") {
+            queue("AUTH XOAUTH2 " + base64Encode("user=" + domain_.username + "\x01" +
+                                                 "auth=Bearer " + domain_.oauth2_token + "\x01\x01"));
+        } else {
+            queue("AUTH " + auth_method_);
+        }
+    }
+
+    void onAuthReply(int code, const std::string& reply) {
+        if (code == 235) {
+            ready();
+            return;
+        }
+        if (code != 334) {
+            fail("Authentication failed: " + reply);
+            return;
+        }
+
+        if (auth_method_ == "LOGIN" && auth_step_ < 2) {
+            queue(base64Encode(auth_step_ == 0 ? domain_.username : domain_.password));
+            auth_step_++;
+        } else if (auth_method_ == "CRAM-MD5" && auth_step_ == 0 && reply.size() > 4) {
+            // Reply is HMAC-MD5(password, challenge) in lowercase hex
+            std::string challenge = base64Decode(reply.substr(4));
+            unsigned char digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_length = 0;
+            HMAC(EVP_md5(), domain_.password.data(), static_cast<int>(domain_.password.size()),
+                 reinterpret_cast<const unsigned char*>(challenge.data()), challenge.size(),
+                 digest, &digest_length);
+
+            std::ostringstream hex;
+            hex << std::hex << std::setfill('0');
+            for (unsigned int i = 0; i < digest_length; ++i) {
+                hex << std::setw(2) << static_cast<int>(digest[i]);
+            }
+            queue(base64Encode(domain_.username + " " + hex.str()));
+            auth_step_++;
+        } else if (auth_method_ == "XOAUTH2") {
+            // The server sent error details; an empty line makes it finish with 5xx
+            queue("");
+        } else {
+            fail("Authentication failed: " + reply);
+        }
+    }
+
+    void onEnvelopeReply(int code, const std::string& reply) {
+        size_t index = replies_++;
+        size_t recipient_count = recipients_.size();
+
+        if (index == 0) {
+            if (code != 250) {
+                failure_ = SMTPResult::createError("MAIL FROM rejected: " + reply, code);
+                rejected_ = true;
+                // Pipelined replies for the rest of the envelope are still in flight
+                if (!pipelining_) {
+                    finish(failure_);
+                    return;
+                }
+            }
+        } else if (index <= recipient_count) {
+            if (code != 250 && code != 251) {
+                const std::string& recipient = recipients_[index - 1];
+                if (!rejected_) {
+                    failure_ = SMTPResult::createError("RCPT TO rejected for " + recipient + ": " + reply, code);
+                    rejected_ = true;
+                }
+                failure_.rejected_recipients.push_back(recipient);
+            }
+        } else {
+            // Reply to DATA
+            if (rejected_) {
+                // An accepted DATA leaves the server waiting for a message we
+                // will not send; only dropping the connection aborts it
+                if (code == 354) {
+                    drop(failure_);
+                } else {
+                    finish(failure_);
+                }
+                return;
+            }
+            if (code != 354) {
+                finish(SMTPResult::createError("DATA command rejected: " + reply, code));
+                return;
+            }
+            phase_ = Phase::BODY;
+            pumpBody();
+            return;
+        }
+
+        if (index == recipient_count) {
+            // Last RCPT reply
+            if (rejected_ && (!pipelining_ || chunking_)) {
+                finish(failure_);
+                return;
+            }
+            if (chunking_) {
+                phase_ = Phase::BDAT;
+                sendChunk();
+                return;
+            }
+        }
+
+        if (!pipelining_) {
+            queue(envelope_[index + 1]);
+        }
+    }
+
+    /**
+     * @brief Refill the output buffer with the next piece of a DATA body
+     */
+    void pumpBody() {
+        size_t start = out_.size();
+        out_.resize(start + kDataChunkSize);
+        size_t length = message_->read(&out_[start], kDataChunkSize);
+        if (message_->failed()) {
+            drop(SMTPResult::createError(message_->getError()));
+            return;
+        }
+        out_.resize(start + length);
+
+        if (message_->eof()) {
+            // The generated message always ends in CRLF
+            out_ += ".\r\n";
+            phase_ = Phase::DATA_END;
+        }
+        touch();
+    }
+
+    /**
+     * @brief Queue the next BDAT chunk
+     */
+    void sendChunk() {
+        chunk_.resize(kDataChunkSize);
+        size_t length = message_->read(&chunk_[0], kDataChunkSize);
+        if (message_->failed()) {
+            drop(SMTPResult::createError(message_->getError()));
+            return;
+        }
+        bdat_last_ = message_->eof();
+        out_ += "BDAT " + std::to_string(length) + (bdat_last_ ? " LAST" : "") + "\r\n";
+        out_.append(chunk_.data(), length);
+        touch();
+    }
+
+    SMTPEventLoop& loop_;
+    DomainConfig domain_;
+    std::string key_;
+    int fd_;
+    SSL* ssl_;
+    std::unique_ptr<DNSQuery> query_;
+    std::vector<ResolvedAddress> addresses_;
+    size_t next_address_;
+    std::string connect_error_;
+    Phase phase_;
+    uint32_t registered_events_;
+    bool greeted_;
+    bool tls_;
+    bool handshake_wants_write_;
+    bool read_wants_write_;
+    size_t pending_write_;
+    std::chrono::steady_clock::time_point deadline_;
+    std::chrono::steady_clock::time_point last_used_;
+
+    SMTPReplyReader reader_;
+    SMTPReply reply_;
+    std::string out_;
+    size_t out_offset_;
+    std::map<std::string, std::string> extensions_;
+    std::string auth_method_;
+    int auth_step_;
+
+    // Current transaction
+    std::unique_ptr<Job> job_;
+    std::unique_ptr<MimeMessageStream> message_;
+    std::string message_id_;
+    std::vector<std::string> recipients_;
+    std::vector<std::string> envelope_;
+    std::string chunk_;
+    bool pipelining_;
+    bool chunking_;
+    size_t replies_;
+    bool rejected_;
+    bool bdat_last_;
+    SMTPResult failure_;
+};
+
+/**
+ * @brief MX lookups of one direct-to-MX message
+ *
+ * Every recipient domain is looked up at once through DNSQuery, on the
+ * loop and without blocking it, as sessions resolve their hosts. Once all
+ * are answered, recipients whose domains share the same exchangers are put
+ * in one job, and the message completes when every job has.
+ */
+class SMTPEventLoop::Routing {
+public:
+    /**
+     * @param measured A job for the whole message, measured by SMTPEventLoop::measure()
+     */
+    Routing(SMTPEventLoop& loop, std::unique_ptr<Job> measured)
+        : loop_(loop), email_(std::move(measured->email)), domain_(measured->domain),
+          done_(std::move(measured->done)), message_id_(measured->message_id), date_(measured->date),
+          size_(measured->size), pending_(0), finished_(false) {}
+
+    Routing(const Routing&) = delete;
+    Routing& operator=(const Routing&) = delete;
+
+    /**
+     * @brief Whether the jobs have been queued, or the message failed
+     */
+    bool finished() const { return finished_; }
+
+    /**
+     * @brief Start a lookup for every recipient domain
+     */
+    void start() {
+        DNSResolver& resolver = DNSResolver::getInstance();
+        for (const auto& recipient : email_->getAllRecipients()) {
+            std::string domain = recipientDomain(recipient);
+            std::unique_ptr<Lookup>& lookup = lookups_[domain];
+            if (lookup) {
+                continue;
+            }
+            lookup.reset(new Lookup(*this, domain));
+            if (domain.empty()) {
+                lookup->error = "Invalid recipient address: " + recipient;
+            } else {
+                lookup->query = resolver.queryMX(domain);
+                pending_++;
+            }
+        }
+
+        // Those answered from the cache are done already
+        for (auto& entry : lookups_) {
+            Lookup& lookup = *entry.second;
+            if (lookup.query && lookup.query->done()) {
+                answered(lookup);
+            }
+        }
+        if (pending_ == 0 && !finished_) {
+            route();
+        }
+    }
+
+    /**
+     * @brief Handle the lookups whose deadline has passed
+     */
+    void expire(std::chrono::steady_clock::time_point now) {
+        for (auto& entry : lookups_) {
+            Lookup& lookup = *entry.second;
+            if (!lookup.query || now < lookup.query->deadline()) {
+                continue;
+            }
+            lookup.query->onTimeout();
+            if (lookup.query->done()) {
+                answered(lookup);
+            }
+        }
+    }
+
+    /**
+     * @brief Bring next forward to the earliest deadline of a running lookup
+     */
+    void nextDeadline(std::chrono::steady_clock::time_point& next) const {
+        for (const auto& entry : lookups_) {
+            if (entry.second->query) {
+                next = std::min(next, entry.second->query->deadline());
+            }
+        }
+    }
+
+    /**
+     * @brief Register the sockets of the running lookups with epoll
+     */
+    void updateInterest() {
+        for (auto& entry : lookups_) {
+            Lookup& lookup = *entry.second;
+            if (lookup.query) {
+                // A query moved to a new socket has to be registered anew
+                if (lookup.query->fd() != lookup.fd) {
+                    lookup.fd = lookup.query->fd();
+                    lookup.registered = 0;
+                }
+                loop_.watch(&lookup, lookup.fd, lookup.query->wantsWrite(), lookup.registered);
+            }
+        }
+    }
+
+    /**
+     * @brief Fail the message if its lookups are still running
+     */
+    void abandon(const SMTPResult& result) {
+        if (finished_) {
+            return;
+        }
+        finished_ = true;
+        lookups_.clear();
+        try {
+            done_(result);
+        } catch (const std::exception& e) {
+            Logger::getInstance().error("SMTP completion callback threw: " + std::string(e.what()));
+        }
+    }
+
+private:
+    struct Lookup : public Watched {
+        Lookup(Routing& owner, const std::string& mail_domain)
+            : routing(owner), domain(mail_domain), permanent(false), fd(-1), registered(0) {}
+
+        void onEvent(uint32_t) override {
+            if (!query) {
+                return;
+            }
+            query->onReady();
+            if (query->done()) {
+                routing.answered(*this);
+            }
+        }
+
+        Routing& routing;
+        std::string domain;
+        std::unique_ptr<DNSQuery> query;   // Until it is answered
+        std::vector<MXRecord> exchanges;
+        std::string error;
+        bool permanent;                    // The domain does not exist or takes no mail
+        int fd;                            // The query's socket as registered with epoll
+        uint32_t registered;
+    };
+
+    void answered(Lookup& lookup) {
+        // A finished query has already closed its socket, which also
+        // removed it from epoll
+        std::unique_ptr<DNSQuery> query = std::move(lookup.query);
+        lookup.registered = 0;
+        if (query->success()) {
+            lookup.exchanges = query->exchanges();
+        } else {
+            lookup.error = "Failed to look up mail exchangers for " + lookup.domain + ": " + query->getError();
+            lookup.permanent = query->failedPermanently();
+        }
+        if (--pending_ == 0) {
+            route();
+        }
+    }
+
+    /**
+     * @brief Queue a job per set of exchangers
+     */
+    void route() {
+        finished_ = true;
+
+        // Outcome of one message split over several mail exchangers; only
+        // touched by the loop thread
+        struct Delivery {
+            size_t pending = 0;
+            size_t routes = 0;
+            size_t delivered = 0;
+            std::vector<std::string> delivered_recipients;
+            bool failed = false;
+            SMTPResult failure;
+            std::string message_id;
+            CompletionCallback done;
+        };
+        auto delivery = std::make_shared<Delivery>();
+        delivery->message_id = message_id_;
+        delivery->done = std::move(done_);
+
+        auto settle = [delivery](const std::vector<std::string>& recipients, const SMTPResult& result) {
+            if (result.success) {
+                delivery->delivered++;
+                delivery->delivered_recipients.insert(delivery->delivered_recipients.end(),
+                                                      recipients.begin(), recipients.end());
+            } else if (!delivery->failed || (delivery->failure.permanent && !result.permanent)) {
+                // A transient failure comes first, so that the message is
+                // retried for every recipient still owed it
+                std::vector<std::string> rejected = std::move(delivery->failure.rejected_recipients);
+                delivery->failed = true;
+                delivery->failure = result;
+                delivery->failure.rejected_recipients.insert(delivery->failure.rejected_recipients.end(),
+                                                             rejected.begin(), rejected.end());
+            } else {
+                delivery->failure.rejected_recipients.insert(delivery->failure.rejected_recipients.end(),
+                                                             result.rejected_recipients.begin(),
+                                                             result.rejected_recipients.end());
+            }
+            if (--delivery->pending > 0) {
+                return;
+            }
+
+            if (!delivery->failed) {
+                delivery->done(SMTPResult::createSuccess(delivery->message_id));
+                return;
+            }
+            SMTPResult outcome = delivery->failure;
+            if (delivery->delivered > 0) {
+                outcome.error_message = "Delivered to " + std::to_string(delivery->delivered) + " of " +
+                                        std::to_string(delivery->routes) + " mail exchangers; " +
+                                        outcome.error_message;
+                outcome.delivered_recipients = delivery->delivered_recipients;
+            }
+            delivery->done(outcome);
+        };
+
+        // Recipients whose domains share the same exchangers share a transaction
+        std::map<std::string, std::vector<std::string>> routes;
+        std::vector<std::string> route_order;
+        std::map<std::string, std::vector<std::string>> unroutable;
+        for (const auto& recipient : email_->getAllRecipients()) {
+            const Lookup& lookup = *lookups_[recipientDomain(recipient)];
+            if (!lookup.error.empty()) {
+                unroutable[lookup.domain].push_back(recipient);
+                continue;
+            }
+
+            std::string route;
+            for (const auto& record : lookup.exchanges) {
+                route += record.exchange + ' ';
+            }
+            if (!routes.count(route)) {
+                route_order.push_back(route);
+            }
+            routes[route].push_back(recipient);
+        }
+
+        if (routes.empty() && unroutable.empty()) {
+            delivery->done(SMTPResult::createError("No recipients specified"));
+            return;
+        }
+
+        delivery->routes = routes.size() + unroutable.size();
+        delivery->pending = delivery->routes;
+        for (const auto& entry : unroutable) {
+            // Mail to a domain that does not exist or takes none bounces
+            // (RFC 7505 section 4.2); the rest may be a passing DNS outage
+            const Lookup& lookup = *lookups_[entry.first];
+            SMTPResult failure = SMTPResult::createError(lookup.error, lookup.permanent ? 550 : 0);
+            if (lookup.permanent) {
+                failure.rejected_recipients = entry.second;
+                failure.permanent = true;
+            }
+            settle(entry.second, failure);
+        }
+
+        std::vector<std::unique_ptr<Job>> jobs;
+        for (const auto& route : route_order) {
+            std::vector<std::string> hosts;
+            std::istringstream names(route);
+            std::string host;
+            while (names >> host) {
+                hosts.push_back(host);
+            }
+
+            std::unique_ptr<Job> job(new Job());
+            job->email = email_;
+            job->domain = domain_;
+            job->domain.smtp_server = hosts.front();
+            job->domain.use_ssl = false;
+            // STARTTLS to an exchanger is opportunistic: most present
+            // certificates that do not match their MX name, and refusing
+            // them would only push the message to plaintext elsewhere
+            job->domain.use_starttls = true;
+            job->domain.ssl_verify_peer = false;
+            job->domain.auth_method = "NONE";
+            job->domain.username.clear();
+            job->domain.password.clear();
+            job->domain.oauth2_token.clear();
+            job->key = SMTPConnectionPool::makeKey(job->domain);
+            job->recipients = routes[route];
+            job->message_id = delivery->message_id;
+            job->date = date_;
+            job->size = size_;
+            job->fallbacks.assign(hosts.begin() + 1, hosts.end());
+            job->done = [settle, recipients = job->recipients](const SMTPResult& result) {
+                settle(recipients, result);
+            };
+            jobs.push_back(std::move(job));
+        }
+        loop_.enqueue(std::move(jobs));
+    }
+
+    SMTPEventLoop& loop_;
+    std::shared_ptr<const Email> email_;
+    DomainConfig domain_;
+    CompletionCallback done_;
+    std::string message_id_;
+    std::string date_;
+    size_t size_;
+    std::map<std::string, std::unique_ptr<Lookup>> lookups_;
+    size_t pending_;
+    bool finished_;
+};
+
+SMTPEventLoop::SMTPEventLoop(const ConfigManager& config)
+    : config_(config), epoll_fd_(-1), wake_fd_(-1), running_(false),
+      live_sessions_(0), sessions_closed_(false) {
+    const GlobalConfig& global = config_.getGlobalConfig();
+    max_sessions_ = global.max_connections > 0 ? static_cast<size_t>(global.max_connections) : 0;
+    idle_timeout_seconds_ = global.connection_idle_timeout;
+    connect_timeout_ = std::chrono::seconds(global.connection_timeout);
+    io_timeout_ = std::chrono::seconds(global.read_timeout);
+
+    hostname_ = global.default_hostname;
+    if (hostname_.empty()) {
+        char buffer[256];
+        hostname_ = gethostname(buffer, sizeof(buffer)) == 0 ? std::string(buffer) : "localhost";
+    }
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd_ >= 0 && wake_fd_ >= 0) {
+        struct epoll_event event;
+        std::memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event);
+    }
+}
+
+SMTPEventLoop::~SMTPEventLoop() {
+    stop();
+    if (wake_fd_ >= 0) {
+        close(wake_fd_);
+    }
+    if (epoll_fd_ >= 0) {
+        close(epoll_fd_);
+    }
+}
+
+bool SMTPEventLoop::start() {
+    if (epoll_fd_ < 0 || wake_fd_ < 0) {
+        Logger::getInstance().error("SMTP event loop could not create epoll instance");
+        return false;
+    }
+    // Senders may start the loop on demand from several threads
+    if (running_.exchange(true)) {
+        return true;
+    }
+
+    thread_ = std::thread(&SMTPEventLoop::run, this);
+    Logger::getInstance().info("SMTP event loop started");
+    return true;
+}
+
+void SMTPEventLoop::stop() {
+    if (!running_.exchange(false)) {
+        return;
+    }
+    wake();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    // Nothing can make progress any more: fail what is left, starting with
+    // the lookups so they queue no more jobs
+    SMTPResult stopped = SMTPResult::createError("SMTP event loop stopped");
+    std::vector<std::unique_ptr<Routing>> routings;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        routings.swap(routing_inbox_);
+    }
+    for (auto& routing : routings_) {
+        routings.push_back(std::move(routing));
+    }
+    routings_.clear();
+    for (auto& routing : routings) {
+        routing->abandon(stopped);
+    }
+    drainInbox();
+    for (auto& session : sessions_) {
+        std::unique_ptr<Job> job = session->takeJob();
+        session->quit();
+        if (job) {
+            complete(std::move(job), stopped);
+        }
+    }
+    while (!waiting_.empty()) {
+        std::unique_ptr<Job> job = std::move(waiting_.front());
+        waiting_.pop_front();
+        complete(std::move(job), stopped);
+    }
+    sessions_.clear();
+    idle_.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.waiting = 0;
+        stats_.active_sessions = 0;
+        stats_.idle_sessions = 0;
+    }
+    Logger::getInstance().info("SMTP event loop stopped");
+}
+
+bool SMTPEventLoop::isRunning() const {
+    return running_;
+}
+
+bool SMTPEventLoop::submit(const Email& email, CompletionCallback done) {
+    return submitMessage(email, nullptr, std::move(done));
+}
+
+bool SMTPEventLoop::submit(std::shared_ptr<const Email> email, CompletionCallback done) {
+    const Email& message = *email;
+    return submitMessage(message, std::move(email), std::move(done));
+}
+
+bool SMTPEventLoop::submitMessage(const Email& email, std::shared_ptr<const Email> shared,
+                                  CompletionCallback done) {
+    std::string domain = email.from.substr(email.from.find('@') + 1);
+    const DomainConfig* domain_config = config_.getDomainConfig(domain);
+
+    if (!domain_config) {
+        done(SMTPResult::createError("No configuration found for domain: " + domain));
+        return true;
+    }
+    if (domain_config->smtp_transport == "curl") {
+        return false;
+    }
+    if (!running_) {
+        done(SMTPResult::createError("SMTP event loop is not running"));
+        return true;
+    }
+    // Copied only once it is certain to be sent from here
+    if (!shared) {
+        shared = std::make_shared<const Email>(email);
+    }
+
+    std::unique_ptr<Job> job(new Job());
+    job->email = std::move(shared);
+    job->domain = *domain_config;
+    std::string error;
+    if (!measure(*job, error)) {
+        done(SMTPResult::createError(error));
+        return true;
+    }
+    job->done = std::move(done);
+    if (domain_config->delivery_mode == "mx") {
+        return submitDirect(std::move(job));
+    }
+    job->key = SMTPConnectionPool::makeKey(*domain_config);
+
+    std::vector<std::unique_ptr<Job>> jobs;
+    jobs.push_back(std::move(job));
+    enqueue(std::move(jobs));
+    return true;
+}
+
+bool SMTPEventLoop::measure(Job& job, std::string& error) {
+    const Email& email = *job.email;
+    std::string domain = email.from.substr(email.from.find('@') + 1);
+    job.message_id = MimeMessageStream::generateMessageId(domain);
+    job.date = MimeMessageStream::currentDate();
+
+    // With dot-stuffing, as for DATA: the larger of the two forms
+    MimeMessageStream message(email, job.message_id, job.date, true);
+    if (message.failed()) {
+        error = message.getError();
+        return false;
+    }
+    job.size = message.measure();
+    return true;
+}
+
+bool SMTPEventLoop::submitDirect(std::unique_ptr<Job> measured) {
+    // The MX lookups run on the loop, so the caller never waits on DNS
+    std::unique_ptr<Routing> routing(new Routing(*this, std::move(measured)));
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        routing_inbox_.push_back(std::move(routing));
+    }
+    wake();
+    return true;
+}
+
+void SMTPEventLoop::enqueue(std::vector<std::unique_ptr<Job>> jobs) {
+    if (jobs.empty()) {
+        return;
+    }
+    size_t count = jobs.size();
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        for (auto& job : jobs) {
+            inbox_.push_back(std::move(job));
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.submitted += count;
+    }
+    wake();
+}
+
+void SMTPEventLoop::setMaxSessions(size_t max_sessions) {
+    max_sessions_ = max_sessions;
+    wake();
+}
+
+void SMTPEventLoop::setIdleTimeout(std::chrono::seconds timeout) {
+    idle_timeout_seconds_ = timeout.count();
+    wake();
+}
+
+SMTPEventLoopStats SMTPEventLoop::getStats() const {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    return stats_;
+}
+
+void SMTPEventLoop::run() {
+    Logger& logger = Logger::getInstance();
+    struct epoll_event events[kMaxEvents];
+
+    while (running_) {
+        int count = epoll_wait(epoll_fd_, events, kMaxEvents, nextTimeoutMs());
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logger.error("SMTP event loop epoll_wait failed: " + std::string(strerror(errno)));
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t value;
+                while (read(wake_fd_, &value, sizeof(value)) > 0) {
+                }
+                continue;
+            }
+            static_cast<Watched*>(events[i].data.ptr)->onEvent(events[i].events);
+        }
+
+        drainInbox();
+        dispatch();
+        expireTimers();
+        reapSessions();
+
+        size_t active = 0;
+        size_t idle = 0;
+        for (auto& session : sessions_) {
+            if (session->phase() == Session::Phase::IDLE) {
+                idle++;
+            } else {
+                active++;
+            }
+            updateInterest(session.get());
+        }
+        for (auto& routing : routings_) {
+            routing->updateInterest();
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        stats_.waiting = waiting_.size();
+        stats_.active_sessions = active;
+        stats_.idle_sessions = idle;
+    }
+}
+
+void SMTPEventLoop::wake() {
+    uint64_t value = 1;
+    if (wake_fd_ >= 0) {
+        ssize_t ignored = write(wake_fd_, &value, sizeof(value));
+        (void)ignored;
+    }
+}
+
+void SMTPEventLoop::drainInbox() {
+    std::vector<std::unique_ptr<Job>> jobs;
+    std::vector<std::unique_ptr<Routing>> routings;
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        jobs.swap(inbox_);
+        routings.swap(routing_inbox_);
+    }
+    for (auto& job : jobs) {
+        waiting_.push_back(std::move(job));
+    }
+    // Lookups answered from the cache queue their jobs right away, through
+    // the inbox, for the next pass
+    for (auto& routing : routings) {
+        routing->start();
+        if (!routing->finished()) {
+            routings_.push_back(std::move(routing));
+        }
+    }
+}
+
+void SMTPEventLoop::dispatch() {
+    size_t max_sessions = max_sessions_;
+
+    for (auto it = waiting_.begin(); it != waiting_.end();) {
+        Session* session = nullptr;
+        auto idle = idle_.find((*it)->key);
+        while (idle != idle_.end() && !idle->second.empty() && !session) {
+            Session* candidate = idle->second.back();
+            idle->second.pop_back();
+            if (candidate->phase() == Session::Phase::IDLE) {
+                session = candidate;
+            }
+        }
+
+        if (session) {
+            std::unique_ptr<Job> job = std::move(*it);
+            it = waiting_.erase(it);
+            session->begin(std::move(job));
+            continue;
+        }
+
+        if (max_sessions == 0 || live_sessions_ < max_sessions || evictIdleSession()) {
+            std::unique_ptr<Job> job = std::move(*it);
+            it = waiting_.erase(it);
+            openSession(std::move(job));
+            continue;
+        }
+
+        ++it;
+    }
+}
+
+void SMTPEventLoop::expireTimers() {
+    auto now = std::chrono::steady_clock::now();
+    auto idle_timeout = std::chrono::seconds(idle_timeout_seconds_.load());
+
+    for (auto& routing : routings_) {
+        routing->expire(now);
+    }
+
+    for (auto& session : sessions_) {
+        Session::Phase phase = session->phase();
+        if (phase == Session::Phase::CLOSED) {
+            continue;
+        }
+        if (phase == Session::Phase::IDLE ? now - session->lastUsed() >= idle_timeout
+                                          : now >= session->deadline()) {
+            session->onTimeout();
+        }
+    }
+}
+
+void SMTPEventLoop::reapSessions() {
+    routings_.erase(std::remove_if(routings_.begin(), routings_.end(),
+                                   [](const std::unique_ptr<Routing>& r) { return r->finished(); }),
+                    routings_.end());
+
+    if (!sessions_closed_) {
+        return;
+    }
+    sessions_closed_ = false;
+
+    for (auto it = idle_.begin(); it != idle_.end();) {
+        auto& list = it->second;
+        list.erase(std::remove_if(list.begin(), list.end(),
+                                  [](Session* s) { return s->phase() != Session::Phase::IDLE; }),
+                   list.end());
+        it = list.empty() ? idle_.erase(it) : std::next(it);
+    }
+    sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
+                                   [](const std::unique_ptr<Session>& s) {
+                                       return s->phase() == Session::Phase::CLOSED;
+                                   }),
+                    sessions_.end());
+}
+
+int SMTPEventLoop::nextTimeoutMs() const {
+    auto now = std::chrono::steady_clock::now();
+    auto idle_timeout = std::chrono::seconds(idle_timeout_seconds_.load());
+    auto next = now + std::chrono::milliseconds(kMaxWaitMs);
+    for (const auto& routing : routings_) {
+        routing->nextDeadline(next);
+    }
+
+    for (const auto& session : sessions_) {
+        Session::Phase phase = session->phase();
+        if (phase == Session::Phase::CLOSED) {
+            continue;
+        }
+        auto deadline = phase == Session::Phase::IDLE ? session->lastUsed() + idle_timeout
+                                                      : session->deadline();
+        next = std::min(next, deadline);
+    }
+
+    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - now).count();
+    return wait < 0 ? 0 : static_cast<int>(wait) + 1;
+}
+
+SMTPEventLoop::Session* SMTPEventLoop::openSession(std::unique_ptr<Job> job) {
+    std::unique_ptr<Session> session(new Session(*this, job->domain, job->key));
+    Session* raw = session.get();
+    sessions_.push_back(std::move(session));
+    live_sessions_++;
+    raw->connect(std::move(job));
+    return raw;
+}
+
+void SMTPEventLoop::sessionReady(Session* session) {
+    idle_[session->key()].push_back(session);
+}
+
+void SMTPEventLoop::closeSession(Session* session) {
+    session->close();
+}
+
+bool SMTPEventLoop::evictIdleSession() {
+    Session* oldest = nullptr;
+    for (auto& entry : idle_) {
+        for (Session* session : entry.second) {
+            if (session->phase() != Session::Phase::IDLE) {
+                continue;
+            }
+            if (!oldest || session->lastUsed() < oldest->lastUsed()) {
+                oldest = session;
+            }
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+    oldest->quit();
+    return true;
+}
+
+void SMTPEventLoop::updateInterest(Session* session) {
+    if (session->phase() == Session::Phase::CLOSED) {
+        return;
+    }
+    watch(session, session->fd(), session->wantsWrite(), session->registeredEvents());
+}
+
+void SMTPEventLoop::watch(Watched* target, int fd, bool write, uint32_t& registered) {
+    if (fd < 0) {
+        return;
+    }
+    uint32_t wanted = EPOLLIN | (write ? EPOLLOUT : 0);
+    if (wanted == registered) {
+        return;
+    }
+
+    struct epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = wanted;
+    event.data.ptr = target;
+    epoll_ctl(epoll_fd_, registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event);
+    registered = wanted;
+}
+
+void SMTPEventLoop::failOver(std::unique_ptr<Job> job) {
+    job->domain.smtp_server = job->fallbacks.front();
+    job->fallbacks.erase(job->fallbacks.begin());
+    job->key = SMTPConnectionPool::makeKey(job->domain);
+
+    // Called from inside dispatch() and the event handlers, so it goes back
+    // in through the inbox rather than straight onto waiting_
+    {
+        std::lock_guard<std::mutex> lock(inbox_mutex_);
+        inbox_.push_back(std::move(job));
+    }
+    wake();
+}
+
+void SMTPEventLoop::complete(std::unique_ptr<Job> job, const SMTPResult& result) {
+    if (!job) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        if (result.success) {
+            stats_.sent++;
+        } else {
+            stats_.failed++;
+        }
+    }
+
+    if (job->done) {
+        try {
+            job->done(result);
+        } catch (const std::exception& e) {
+            Logger::getInstance().error("SMTP completion callback threw: " + std::string(e.what()));
+        }
+    }
+}
+
+} // namespace ssmtp_mailer
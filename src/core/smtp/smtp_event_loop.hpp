@@ -0,0 +1,227 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include "core/config/config_manager.hpp"
+#include "simple-smtp-mailer/mailer.hpp"
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief SMTP event loop statistics
+ */
+struct SMTPEventLoopStats {
+    size_t submitted;        // Transactions queued by submit(); one per MX for direct delivery
+    size_t sent;             // Transactions accepted by the server
+    size_t failed;           // Transactions that completed with an error
+    size_t waiting;          // Transactions waiting for a session
+    size_t active_sessions;  // Sessions connecting or running a transaction
+    size_t idle_sessions;    // Authenticated sessions parked for reuse
+
+    SMTPEventLoopStats()
+        : submitted(0), sent(0), failed(0), waiting(0), active_sessions(0), idle_sessions(0) {}
+};
+
+/**
+ * @brief Single-threaded epoll reactor driving many SMTP sessions at once
+ *
+ * Every session is a non-blocking state machine (connect, TLS handshake,
+ * EHLO, STARTTLS, AUTH, MAIL/RCPT/DATA or BDAT) advanced by readiness events,
+ * so one slow relay never holds up deliveries to another. TLS runs over the
+ * non-blocking socket BIO and resumes on SSL_ERROR_WANT_READ/WANT_WRITE.
+ * Authenticated sessions are parked per server and credentials and reused
+ * for later messages, as in SMTPConnectionPool.
+ *
+ * Domains with delivery_mode = mx bypass smtp_server: recipients are
+ * grouped by the MX hosts of their domain and each group is delivered in one
+ * transaction to the most preferred exchanger that accepts a connection.
+ * STARTTLS is used when the exchanger offers it, without verifying its
+ * certificate, since TLS between MTAs is opportunistic. Sessions are keyed
+ * by MX host, so later messages to the same exchanger reuse them.
+ *
+ * Domains configured with smtp_transport = curl are not handled here.
+ */
+class SMTPEventLoop {
+public:
+    /**
+     * @brief Completion callback, invoked on the loop thread
+     */
+    using CompletionCallback = std::function<void(const SMTPResult&)>;
+
+    /**
+     * @brief Constructor
+     * @param config Configuration manager instance
+     */
+    explicit SMTPEventLoop(const ConfigManager& config);
+
+    /**
+     * @brief Destructor, stops the loop
+     */
+    ~SMTPEventLoop();
+
+    SMTPEventLoop(const SMTPEventLoop&) = delete;
+    SMTPEventLoop& operator=(const SMTPEventLoop&) = delete;
+
+    /**
+     * @brief Start the loop thread
+     * @return true if the loop is running
+     */
+    bool start();
+
+    /**
+     * @brief Stop the loop thread, failing every unfinished message
+     */
+    void stop();
+
+    /**
+     * @brief Check if the loop is running
+     * @return true if running
+     */
+    bool isRunning() const;
+
+    /**
+     * @brief Queue an email for delivery
+     *
+     * The email is copied once, however many exchangers it goes to. done is
+     * called exactly once with the outcome; it runs on the loop thread, or
+     * before submit() returns when the email is rejected up front, and must
+     * not block. The message is generated once here, on the calling thread,
+     * to measure it for SIZE=, so an unreadable attachment is rejected up
+     * front and the loop never waits on the disk for it. For direct-to-MX
+     * delivery the MX lookups run on the loop without blocking it, and done
+     * reports success once every exchanger has accepted the message.
+     * @param email Email object to send
+     * @param done Completion callback
+     * @return false if the domain uses the curl transport (done is not called)
+     */
+    bool submit(const Email& email, CompletionCallback done);
+
+    /**
+     * @brief Queue a shared email for delivery without copying it
+     *
+     * As submit(const Email&, CompletionCallback), but the loop holds on to
+     * email until done has been called.
+     */
+    bool submit(std::shared_ptr<const Email> email, CompletionCallback done);
+
+    /**
+     * @brief Set the maximum number of concurrent sessions
+     * @param max_sessions Session cap (0 for unlimited)
+     */
+    void setMaxSessions(size_t max_sessions);
+
+    /**
+     * @brief Set how long an unused session may stay open
+     * @param timeout Idle timeout
+     */
+    void setIdleTimeout(std::chrono::seconds timeout);
+
+    /**
+     * @brief Get loop statistics
+     * @return Snapshot of loop counters
+     */
+    SMTPEventLoopStats getStats() const;
+
+private:
+    // Anything with a socket registered with epoll
+    class Watched {
+    public:
+        virtual ~Watched() = default;
+        virtual void onEvent(uint32_t events) = 0;
+    };
+
+    class Session;
+    class Routing;
+    friend class Session;
+    friend class Routing;
+
+    struct Job {
+        std::shared_ptr<const Email> email;   // Shared by every job of a split message
+        DomainConfig domain;
+        std::string key;
+        CompletionCallback done;
+        std::vector<std::string> recipients;  // Envelope recipients; empty for all of email's
+        std::string message_id;               // Shared by every copy of a split message
+        std::string date;                     // Date header; fixed when the message was measured
+        size_t size;                          // Bytes sent with DATA, for SIZE=; 0 if not measured
+        std::vector<std::string> fallbacks;   // Lower-preference MX hosts still to try
+    };
+
+    /**
+     * @brief Fix job's Message-ID and Date and measure the message they give
+     *
+     * Runs on the submitting thread: generating the message canonicalizes
+     * the body and base64-encodes the attachments from disk.
+     * @return false if the message cannot be generated; see error
+     */
+    static bool measure(Job& job, std::string& error);
+
+    /**
+     * @brief Queue email, sharing it if shared is set and copying it otherwise
+     */
+    bool submitMessage(const Email& email, std::shared_ptr<const Email> shared, CompletionCallback done);
+    bool submitDirect(std::unique_ptr<Job> measured);
+    void enqueue(std::vector<std::unique_ptr<Job>> jobs);
+
+    // Loop thread
+    void run();
+    void wake();
+    void drainInbox();
+    void dispatch();
+    void expireTimers();
+    void reapSessions();
+    int nextTimeoutMs() const;
+
+    // Session management (loop thread only)
+    Session* openSession(std::unique_ptr<Job> job);
+    void sessionReady(Session* session);
+    void closeSession(Session* session);
+    bool evictIdleSession();
+    void updateInterest(Session* session);
+    void watch(Watched* target, int fd, bool write, uint32_t& registered);
+    void complete(std::unique_ptr<Job> job, const SMTPResult& result);
+    void failOver(std::unique_ptr<Job> job);
+
+    const ConfigManager& config_;
+    std::string hostname_;
+    int epoll_fd_;
+    int wake_fd_;
+    std::thread thread_;
+    std::atomic<bool> running_;
+
+    // Submissions from other threads
+    mutable std::mutex inbox_mutex_;
+    std::vector<std::unique_ptr<Job>> inbox_;
+    std::vector<std::unique_ptr<Routing>> routing_inbox_;   // Direct-to-MX messages to look up
+
+    // Loop thread state
+    std::deque<std::unique_ptr<Job>> waiting_;
+    std::vector<std::unique_ptr<Routing>> routings_;         // With MX lookups running
+    std::vector<std::unique_ptr<Session>> sessions_;
+    std::unordered_map<std::string, std::vector<Session*>> idle_;
+    size_t live_sessions_;
+    bool sessions_closed_;
+
+    // Settings, read by the loop thread
+    std::atomic<size_t> max_sessions_;
+    std::atomic<long long> idle_timeout_seconds_;
+    std::chrono::seconds connect_timeout_;
+    std::chrono::seconds io_timeout_;
+
+    // Statistics
+    mutable std::mutex stats_mutex_;
+    SMTPEventLoopStats stats_;
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,164 @@
+#include "core/smtp/smtp_reply.hpp"
+#include <cctype>
+#include <cstring>
+#include <utility>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+// Bytes offered to each read; also the initial buffer size
+constexpr size_t kReadSize = 16 * 1024;
+
+bool isDigit(char c) {
+    return std::isdigit(static_cast<unsigned char>(c)) != 0;
+}
+
+/**
+ * @brief Length of an enhanced status code "class.subject.detail" at the start of text
+ * @return 0 if text does not start with one for reply class klass
+ */
+size_t enhancedStatusLength(const char* text, size_t length, char klass) {
+    if (length < 5 || text[0] != klass || text[1] != '.') {
+        return 0;
+    }
+    size_t pos = 2;
+    for (int part = 0; part < 2; ++part) {
+        size_t digits = 0;
+        while (pos < length && isDigit(text[pos]) && digits < 3) {
+            pos++;
+            digits++;
+        }
+        if (digits == 0) {
+            return 0;
+        }
+        if (part == 0) {
+            if (pos >= length || text[pos] != '.') {
+                return 0;
+            }
+            pos++;
+        }
+    }
+    return pos == length || text[pos] == ' ' ? pos : 0;
+}
+
+} // anonymous namespace
+
+// SMTPReply
+
+SMTPReply::SMTPReply() : code_(0), enhanced_offset_(0), enhanced_length_(0) {}
+
+std::string_view SMTPReply::enhancedStatus() const {
+    return std::string_view(text_).substr(enhanced_offset_, enhanced_length_);
+}
+
+std::string_view SMTPReply::line(size_t index) const {
+    if (index >= lines_.size()) {
+        return std::string_view();
+    }
+    return std::string_view(text_).substr(lines_[index].offset, lines_[index].length);
+}
+
+void SMTPReply::clear() {
+    code_ = 0;
+    text_.clear();
+    lines_.clear();
+    enhanced_offset_ = 0;
+    enhanced_length_ = 0;
+}
+
+// SMTPReplyReader
+
+SMTPReplyReader::SMTPReplyReader(size_t max_reply_size)
+    : buffer_(kReadSize), start_(0), end_(0), max_reply_size_(max_reply_size) {}
+
+char* SMTPReplyReader::prepare(size_t& available) {
+    if (start_ == end_) {
+        start_ = end_ = 0;
+    }
+    if (buffer_.size() - end_ < kReadSize) {
+        // Move the unparsed tail to the front before growing
+        if (start_ > 0) {
+            std::memmove(buffer_.data(), buffer_.data() + start_, end_ - start_);
+            end_ -= start_;
+            start_ = 0;
+        }
+        if (buffer_.size() - end_ < kReadSize) {
+            buffer_.resize(end_ + kReadSize);
+        }
+    }
+    available = buffer_.size() - end_;
+    return buffer_.data() + end_;
+}
+
+void SMTPReplyReader::commit(size_t length) {
+    end_ += length;
+}
+
+SMTPReplyReader::Status SMTPReplyReader::next(SMTPReply& reply) {
+    while (true) {
+        const char* begin = buffer_.data() + start_;
+        const char* eol = static_cast<const char*>(std::memchr(begin, '\n', end_ - start_));
+        if (!eol) {
+            if (end_ - start_ > max_reply_size_) {
+                error_ = "SMTP reply line too long";
+                return Status::MALFORMED;
+            }
+            return Status::INCOMPLETE;
+        }
+
+        size_t length = static_cast<size_t>(eol - begin);
+        start_ += length + 1;
+        if (length > 0 && begin[length - 1] == '\r') {
+            length--;
+        }
+
+        if (length < 3 || !isDigit(begin[0]) || !isDigit(begin[1]) || !isDigit(begin[2])) {
+            error_ = "Malformed SMTP reply: " + std::string(begin, length);
+            return Status::MALFORMED;
+        }
+
+        if (!partial_.text_.empty()) {
+            partial_.text_ += '\n';
+        }
+        size_t line_start = partial_.text_.size();
+        partial_.text_.append(begin, length);
+
+        SMTPReply::Line line;
+        line.offset = line_start + (length > 3 ? 4 : 3);
+        line.length = length > 3 ? length - 4 : 0;
+        if (partial_.lines_.empty()) {
+            size_t status = enhancedStatusLength(partial_.text_.data() + line.offset, line.length, begin[0]);
+            partial_.enhanced_offset_ = line.offset;
+            partial_.enhanced_length_ = status;
+        }
+        partial_.lines_.push_back(line);
+
+        // "250-..." continues a multi-line reply, "250 ..." ends it
+        if (length > 3 && begin[3] == '-') {
+            if (partial_.text_.size() > max_reply_size_) {
+                error_ = "SMTP reply too long";
+                return Status::MALFORMED;
+            }
+            continue;
+        }
+
+        partial_.code_ = (begin[0] - '0') * 100 + (begin[1] - '0') * 10 + (begin[2] - '0');
+        // The caller's old reply becomes the next partial, so storage circulates
+        std::swap(reply, partial_);
+        partial_.clear();
+        return Status::COMPLETE;
+    }
+}
+
+bool SMTPReplyReader::hasBufferedData() const {
+    return start_ != end_ || !partial_.empty();
+}
+
+void SMTPReplyReader::clear() {
+    start_ = end_ = 0;
+    partial_.clear();
+    error_.clear();
+}
+
+} // namespace ssmtp_mailer
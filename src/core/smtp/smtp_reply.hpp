@@ -0,0 +1,135 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief One complete, possibly multi-line SMTP reply (RFC 5321 section 4.2)
+ *
+ * Lines are views into a single text buffer. clear() keeps the storage, so
+ * a reply object reused for every response on a connection stops
+ * allocating once it has grown to fit.
+ */
+class SMTPReply {
+public:
+    SMTPReply();
+
+    /**
+     * @brief Three-digit reply code
+     */
+    int code() const { return code_; }
+
+    /**
+     * @brief Enhanced status code of the first line, e.g. "5.1.1" (RFC 3463)
+     * @return Empty when the server did not send one
+     */
+    std::string_view enhancedStatus() const;
+
+    /**
+     * @brief Number of lines in the reply
+     */
+    size_t lineCount() const { return lines_.size(); }
+
+    /**
+     * @brief Text of a line after the code and its "-" or " " separator
+     * @param index Line number, 0 for the first
+     */
+    std::string_view line(size_t index) const;
+
+    /**
+     * @brief Raw reply, lines joined with '\n' and without CRLF
+     */
+    const std::string& text() const { return text_; }
+
+    bool empty() const { return lines_.empty(); }
+
+    /**
+     * @brief Forget the contents, keeping the storage for reuse
+     */
+    void clear();
+
+private:
+    friend class SMTPReplyReader;
+
+    struct Line {
+        size_t offset;  // Into text_, just past the separator
+        size_t length;
+    };
+
+    int code_;
+    std::string text_;
+    std::vector<Line> lines_;
+    size_t enhanced_offset_;
+    size_t enhanced_length_;
+};
+
+/**
+ * @brief Per-connection receive buffer and incremental reply parser
+ *
+ * The caller reads from the socket straight into prepare() and reports the
+ * byte count with commit(); next() then assembles replies line by line.
+ * A reply split over several reads or TLS records is kept until its last
+ * line arrives, and bytes past the end of one reply (pipelined replies)
+ * stay buffered for the next call. The buffer is compacted in place rather
+ * than reallocated, and no line is copied more than once.
+ */
+class SMTPReplyReader {
+public:
+    enum class Status {
+        INCOMPLETE,  // Need more data
+        COMPLETE,    // A reply was stored
+        MALFORMED    // Protocol error; see getError()
+    };
+
+    /**
+     * @brief Constructor
+     * @param max_reply_size Longest line or multi-line reply accepted
+     */
+    explicit SMTPReplyReader(size_t max_reply_size = 64 * 1024);
+
+    /**
+     * @brief Free space to read into
+     * @param available Set to the number of bytes that fit
+     * @return Start of the free space
+     */
+    char* prepare(size_t& available);
+
+    /**
+     * @brief Mark bytes written at prepare() as received
+     * @param length Number of bytes read
+     */
+    void commit(size_t length);
+
+    /**
+     * @brief Take the next complete reply from the buffered data
+     * @param reply Replaced with the reply on COMPLETE
+     * @return Parse status
+     */
+    Status next(SMTPReply& reply);
+
+    /**
+     * @brief Check for unparsed bytes or a partly received reply
+     */
+    bool hasBufferedData() const;
+
+    /**
+     * @brief Discard everything buffered, e.g. after a reconnect
+     */
+    void clear();
+
+    const std::string& getError() const { return error_; }
+
+private:
+    std::vector<char> buffer_;
+    size_t start_;
+    size_t end_;
+    SMTPReply partial_;
+    size_t max_reply_size_;
+    std::string error_;
+};
+
+} // namespace ssmtp_mailer
@@ -0,0 +1,212 @@
+#include "core/smtp/tls_context.hpp"
+#include "core/logging/logger.hpp"
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <cerrno>
+
+namespace ssmtp_mailer {
+
+namespace {
+
+std::string opensslErrorString() {
+    unsigned long err = ERR_get_error();
+    if (err == 0) {
+        return "unknown error";
+    }
+    char buffer[256];
+    ERR_error_string_n(err, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return buffer;
+}
+
+// Frees the session cache key attached to each SSL object
+void freeSessionKey(void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+    delete static_cast<std::string*>(ptr);
+}
+
+// Socket BIO write that reports a closed peer as EPIPE without SIGPIPE
+int socketWrite(BIO* bio, const char* data, int length) {
+    int fd = -1;
+    BIO_get_fd(bio, &fd);
+    ssize_t written = ::send(fd, data, static_cast<size_t>(length), MSG_NOSIGNAL);
+    BIO_clear_retry_flags(bio);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        BIO_set_retry_write(bio);
+    }
+    return static_cast<int>(written);
+}
+
+} // namespace
+
+TLSContextManager& TLSContextManager::getInstance() {
+    static TLSContextManager instance;
+    return instance;
+}
+
+TLSContextManager::TLSContextManager() {
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, nullptr);
+    session_key_index_ = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, freeSessionKey);
+
+    // Everything but writes comes from the stock socket BIO
+    const BIO_METHOD* socket = BIO_s_socket();
+    socket_method_ = BIO_meth_new(BIO_TYPE_SOCKET, "socket (no SIGPIPE)");
+    if (socket_method_) {
+        BIO_meth_set_write(socket_method_, socketWrite);
+        BIO_meth_set_read(socket_method_, BIO_meth_get_read(socket));
+        BIO_meth_set_puts(socket_method_, BIO_meth_get_puts(socket));
+        BIO_meth_set_ctrl(socket_method_, BIO_meth_get_ctrl(socket));
+        BIO_meth_set_create(socket_method_, BIO_meth_get_create(socket));
+        BIO_meth_set_destroy(socket_method_, BIO_meth_get_destroy(socket));
+    }
+}
+
+TLSContextManager::~TLSContextManager() {
+    clearSessions();
+    for (auto& entry : contexts_) {
+        SSL_CTX_free(entry.second);
+    }
+    BIO_meth_free(socket_method_);
+}
+
+SSL* TLSContextManager::createConnection(const TLSContextOptions& options, const std::string& server,
+                                         int port, std::string& error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    SSL_CTX* ctx = context(options, error);
+    if (!ctx) {
+        return nullptr;
+    }
+
+    SSL* ssl = SSL_new(ctx);
+    if (!ssl) {
+        error = "Failed to create SSL connection: " + opensslErrorString();
+        return nullptr;
+    }
+
+    // Sessions are only valid with the context that negotiated them
+    std::string* key = new std::string(contextKey(options) + '|' + server + ':' + std::to_string(port));
+    SSL_set_ex_data(ssl, session_key_index_, key);
+
+    // SNI and hostname verification
+    SSL_set_tlsext_host_name(ssl, server.c_str());
+    if (options.verify_peer) {
+        SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
+        SSL_set_hostflags(ssl, X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS);
+        SSL_set1_host(ssl, server.c_str());
+    } else {
+        SSL_set_verify(ssl, SSL_VERIFY_NONE, nullptr);
+    }
+
+    auto it = sessions_.find(*key);
+    if (it != sessions_.end()) {
+        SSL_set_session(ssl, it->second);
+    }
+    return ssl;
+}
+
+bool TLSContextManager::attachSocket(SSL* ssl, int fd) {
+    if (!socket_method_) {
+        return SSL_set_fd(ssl, fd) == 1;
+    }
+    BIO* bio = BIO_new(socket_method_);
+    if (!bio) {
+        return false;
+    }
+    BIO_set_fd(bio, fd, BIO_NOCLOSE);
+    SSL_set_bio(ssl, bio, bio);
+    return true;
+}
+
+void TLSContextManager::handshakeCompleted(SSL* ssl) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (SSL_session_reused(ssl)) {
+        stats_.resumed_handshakes++;
+    } else {
+        stats_.full_handshakes++;
+    }
+}
+
+void TLSContextManager::clearSessions() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : sessions_) {
+        SSL_SESSION_free(entry.second);
+    }
+    sessions_.clear();
+}
+
+TLSContextStats TLSContextManager::getStats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    TLSContextStats stats = stats_;
+    stats.contexts = contexts_.size();
+    stats.cached_sessions = sessions_.size();
+    return stats;
+}
+
+SSL_CTX* TLSContextManager::context(const TLSContextOptions& options, std::string& error) {
+    std::string key = contextKey(options);
+    auto it = contexts_.find(key);
+    if (it != contexts_.end()) {
+        return it->second;
+    }
+
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx) {
+        error = "Failed to create SSL context: " + opensslErrorString();
+        return nullptr;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    if (options.verify_peer) {
+        bool loaded = options.ca_file.empty()
+            ? SSL_CTX_set_default_verify_paths(ctx) == 1
+            : SSL_CTX_load_verify_locations(ctx, options.ca_file.c_str(), nullptr) == 1;
+        if (!loaded) {
+            error = "Failed to load CA certificates: " + opensslErrorString();
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+    }
+
+    if (!options.cert_file.empty() && !options.key_file.empty()) {
+        if (SSL_CTX_use_certificate_chain_file(ctx, options.cert_file.c_str()) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, options.key_file.c_str(), SSL_FILETYPE_PEM) != 1) {
+            error = "Failed to load client certificate: " + opensslErrorString();
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+    }
+
+    // Client sessions are kept in sessions_, keyed by server, not in
+    // OpenSSL's internal cache (which is only consulted by servers)
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, &TLSContextManager::onNewSession);
+
+    contexts_[key] = ctx;
+    Logger::getInstance().debug("Created TLS context (" + std::to_string(contexts_.size()) + " total)");
+    return ctx;
+}
+
+int TLSContextManager::onNewSession(SSL* ssl, SSL_SESSION* session) {
+    TLSContextManager& manager = getInstance();
+    const std::string* key = static_cast<const std::string*>(SSL_get_ex_data(ssl, manager.session_key_index_));
+    if (!key || !SSL_SESSION_is_resumable(session)) {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(manager.mutex_);
+    SSL_SESSION*& slot = manager.sessions_[*key];
+    if (slot) {
+        SSL_SESSION_free(slot);
+    }
+    // Returning 1 keeps the reference OpenSSL passed in
+    slot = session;
+    return 1;
+}
+
+std::string TLSContextManager::contextKey(const TLSContextOptions& options) {
+    return options.ca_file + '|' + options.cert_file + '|' + options.key_file +
+           (options.verify_peer ? "|verify" : "|noverify");
+}
+
+} // namespace ssmtp_mailer
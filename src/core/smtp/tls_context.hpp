@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <openssl/ssl.h>
+
+namespace ssmtp_mailer {
+
+/**
+ * @brief TLS context statistics
+ */
+struct TLSContextStats {
+    size_t contexts;            // SSL_CTX instances created
+    size_t full_handshakes;     // Handshakes that negotiated a new session
+    size_t resumed_handshakes;  // Handshakes that resumed a cached session
+    size_t cached_sessions;     // Servers with a resumable session on hand
+
+    TLSContextStats() : contexts(0), full_handshakes(0), resumed_handshakes(0), cached_sessions(0) {}
+};
+
+/**
+ * @brief Client TLS settings that select a shared SSL_CTX
+ */
+struct TLSContextOptions {
+    std::string ca_file;    // Empty for the system trust store
+    std::string cert_file;  // Client certificate chain (optional)
+    std::string key_file;   // Client private key (optional)
+    bool verify_peer;
+
+    TLSContextOptions() : verify_peer(true) {}
+};
+
+/**
+ * @brief Process-wide owner of client SSL_CTX objects and TLS sessions
+ *
+ * One SSL_CTX is created per (CA file, client cert/key, verification) tuple
+ * and shared by every SMTP connection. Sessions handed out by servers
+ * (TLS 1.2 session IDs and TLS 1.3 tickets) are cached per context and
+ * server, and offered on the next connection so reconnecting to the same
+ * relay costs an abbreviated handshake.
+ */
+class TLSContextManager {
+public:
+    /**
+     * @brief Get the manager instance, initializing OpenSSL on first use
+     * @return Reference to the manager
+     */
+    static TLSContextManager& getInstance();
+
+    /**
+     * @brief Destructor, frees every context and cached session
+     */
+    ~TLSContextManager();
+
+    TLSContextManager(const TLSContextManager&) = delete;
+    TLSContextManager& operator=(const TLSContextManager&) = delete;
+
+    /**
+     * @brief Create an SSL object for a connection to server
+     *
+     * The SSL uses the shared context for options, has SNI, hostname
+     * verification and the verify mode set, and carries the cached session
+     * for server:port when one is available.
+     * @param options TLS settings
+     * @param server Server hostname
+     * @param port Server port
+     * @param error Set when nullptr is returned
+     * @return New SSL object owned by the caller, or nullptr
+     */
+    SSL* createConnection(const TLSContextOptions& options, const std::string& server, int port,
+                          std::string& error);
+
+    /**
+     * @brief Attach a connected socket to ssl, in place of SSL_set_fd
+     *
+     * Writes to a peer that has already closed fail with EPIPE instead of
+     * raising SIGPIPE, which would otherwise kill the process.
+     * @param ssl SSL object from createConnection()
+     * @param fd Connected socket, still owned by the caller
+     * @return false if the BIO could not be created
+     */
+    bool attachSocket(SSL* ssl, int fd);
+
+    /**
+     * @brief Record a completed handshake
+     * @param ssl SSL object that finished SSL_connect
+     */
+    void handshakeCompleted(SSL* ssl);
+
+    /**
+     * @brief Drop every cached session
+     */
+    void clearSessions();
+
+    /**
+     * @brief Get TLS statistics
+     * @return Snapshot of the counters
+     */
+    TLSContextStats getStats() const;
+
+private:
+    TLSContextManager();
+
+    /**
+     * @brief Find or create the context for options (caller holds mutex_)
+     */
+    SSL_CTX* context(const TLSContextOptions& options, std::string& error);
+
+    /**
+     * @brief OpenSSL new-session callback; stores the session for its server
+     */
+    static int onNewSession(SSL* ssl, SSL_SESSION* session);
+
+    static std::string contextKey(const TLSContextOptions& options);
+
+    mutable std::mutex mutex_;
+    std::map<std::string, SSL_CTX*> contexts_;
+    std::map<std::string, SSL_SESSION*> sessions_;
+    int session_key_index_;
+    BIO_METHOD* socket_method_;
+    TLSContextStats stats_;
+};
+
+} // namespace ssmtp_mailer
@@ -1,6 +1,7 @@
 #include "simple-smtp-mailer/unified_mailer.hpp"
 #include "core/config/config_manager.hpp"
-#include "simple-smtp-mailer/smtp_client.hpp"
+#include "core/smtp/smtp_client.hpp"
+#include "core/smtp/smtp_connection_pool.hpp"
 #include <algorithm>
 #include <iostream>
 #include <chrono>
@@ -20,6 +21,8 @@ UnifiedMailer::UnifiedMailer(const UnifiedMailerConfig& config) : config_(config
     stats_["api_failure"] = 0;
     stats_["retries"] = 0;
     stats_["fallbacks"] = 0;
+    stats_["smtp_pool_hits"] = 0;
+    stats_["smtp_pool_misses"] = 0;
 }
 
 UnifiedMailer::~UnifiedMailer() = default;
@@ -43,14 +46,13 @@ UnifiedMailerResult UnifiedMailer::sendViaSMTP(const Email& email) {
     result.method_used = SendMethod::SMTP;
     
     try {
-        if (!smtp_config_) {
+        if (!smtp_pool_) {
             result.error_message = "SMTP configuration not available";
             return result;
         }
         
-        // Create SMTP client and send email
-        SMTPClient smtp_client(*smtp_config_);
-        SMTPResult smtp_result = smtp_client.send(email);
+        // Send over a pooled, already authenticated session when possible
+        SMTPResult smtp_result = smtp_pool_->send(email);
         
         result.success = smtp_result.success;
         if (result.success) {
@@ -58,6 +60,7 @@ UnifiedMailerResult UnifiedMailer::sendViaSMTP(const Email& email) {
             updateStats("smtp_success", true);
         } else {
             result.error_message = smtp_result.error_message;
+            result.error_code = smtp_result.error_code;
             updateStats("smtp_failure", true);
         }
         
@@ -130,13 +133,58 @@ UnifiedMailerResult UnifiedMailer::sendAuto(const Email& email) {
 
 std::vector<UnifiedMailerResult> UnifiedMailer::sendBatch(const std::vector<Email>& emails, 
                                                          SendMethod method) {
-    std::vector<UnifiedMailerResult> results;
-    results.reserve(emails.size());
-    
+    std::vector<const Email*> batch;
+    batch.reserve(emails.size());
     for (const auto& email : emails) {
-        results.push_back(sendEmail(email, method));
+        batch.push_back(&email);
+    }
+    return sendBatch(batch, method);
+}
+
+std::vector<UnifiedMailerResult> UnifiedMailer::sendBatch(const std::vector<const Email*>& emails,
+                                                         SendMethod method) {
+    switch (method) {
+        case SendMethod::SMTP:
+            return sendBatchViaSMTP(emails);
+            
+        case SendMethod::API:
+            return sendBatchViaAPI(emails);
+            
+        case SendMethod::AUTO:
+        default:
+            break;
     }
     
+    // Try API first, then SMTP for whatever it failed
+    std::vector<UnifiedMailerResult> results = sendBatchViaAPI(emails);
+    if (!config_.enable_fallback) {
+        return results;
+    }
+    std::vector<const Email*> retry;
+    std::vector<size_t> retry_at;
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!results[i].success) {
+            retry.push_back(emails[i]);
+            retry_at.push_back(i);
+            updateStats("fallbacks", true);
+        }
+    }
+    if (!retry.empty()) {
+        std::vector<UnifiedMailerResult> fallback = sendBatchViaSMTP(retry);
+        for (size_t i = 0; i < retry_at.size(); ++i) {
+            results[retry_at[i]] = fallback[i];
+        }
+    }
+    return results;
+}
+
+std::vector<SMTPResult> UnifiedMailer::sendQueuedBatch(const std::vector<const Email*>& emails) {
+    std::vector<SMTPResult> results;
+    results.reserve(emails.size());
+    for (const auto& result : sendBatch(emails, config_.default_method)) {
+        results.push_back(result.success ? SMTPResult::createSuccess(result.message_id)
+                                         : SMTPResult::createError(result.error_message, result.error_code));
+    }
     return results;
 }
 
@@ -219,6 +267,11 @@ void UnifiedMailer::removeAPIConfig(const std::string& provider) {
 
 std::map<std::string, size_t> UnifiedMailer::getStatistics() const {
     std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (smtp_pool_) {
+        SMTPPoolStats pool_stats = smtp_pool_->getStats();
+        stats_["smtp_pool_hits"] = pool_stats.hits;
+        stats_["smtp_pool_misses"] = pool_stats.misses;
+    }
     return stats_;
 }
 
@@ -229,6 +282,7 @@ void UnifiedMailer::initializeSMTP() {
         try {
             smtp_config_ = std::make_unique<ConfigManager>();
             smtp_config_->loadFromFile(config_.smtp_config_file);
+            smtp_pool_ = std::make_unique<SMTPConnectionPool>(*smtp_config_);
         } catch (const std::exception& e) {
             std::cerr << "Failed to initialize SMTP configuration: " << e.what() << std::endl;
         }
@@ -289,6 +343,89 @@ bool UnifiedMailer::shouldRetry(const UnifiedMailerResult& result) {
     return false;
 }
 
+std::vector<UnifiedMailerResult> UnifiedMailer::sendBatchViaSMTP(const std::vector<const Email*>& emails) {
+    std::vector<UnifiedMailerResult> results(emails.size());
+    if (!smtp_pool_) {
+        for (auto& result : results) {
+            result.error_message = "SMTP configuration not available";
+        }
+        return results;
+    }
+    
+    std::vector<SMTPResult> smtp_results;
+    try {
+        smtp_results = smtp_pool_->sendBatch(emails);
+    } catch (const std::exception& e) {
+        smtp_results.assign(emails.size(), SMTPResult::createError("SMTP error: " + std::string(e.what())));
+    }
+    for (size_t i = 0; i < results.size(); ++i) {
+        UnifiedMailerResult& result = results[i];
+        result.method_used = SendMethod::SMTP;
+        result.success = smtp_results[i].success;
+        if (result.success) {
+            result.message_id = smtp_results[i].message_id;
+            updateStats("smtp_success", true);
+        } else {
+            result.error_message = smtp_results[i].error_message;
+            result.error_code = smtp_results[i].error_code;
+            updateStats("smtp_failure", true);
+        }
+    }
+    return results;
+}
+
+std::vector<UnifiedMailerResult> UnifiedMailer::sendBatchViaAPI(const std::vector<const Email*>& emails) {
+    std::vector<UnifiedMailerResult> results(emails.size());
+    for (auto& result : results) {
+        result.method_used = SendMethod::API;
+    }
+    
+    // Group by provider, keeping each group in batch order
+    std::map<std::string, std::vector<size_t>> groups;
+    for (size_t i = 0; i < emails.size(); ++i) {
+        std::string provider = selectBestProvider(*emails[i]);
+        if (provider.empty() || api_clients_.find(provider) == api_clients_.end()) {
+            results[i].error_message = "No API provider available";
+        } else {
+            groups[provider].push_back(i);
+        }
+    }
+    
+    for (const auto& group : groups) {
+        const std::string& provider = group.first;
+        const std::vector<size_t>& indices = group.second;
+        std::vector<const Email*> batch;
+        batch.reserve(indices.size());
+        for (size_t index : indices) {
+            batch.push_back(emails[index]);
+        }
+        
+        std::vector<APIResponse> responses;
+        try {
+            responses = api_clients_.at(provider)->sendBatch(batch);
+        } catch (const std::exception& e) {
+            APIResponse failed;
+            failed.error_message = "API error: " + std::string(e.what());
+            responses.assign(batch.size(), failed);
+        }
+        
+        for (size_t i = 0; i < indices.size(); ++i) {
+            UnifiedMailerResult& result = results[indices[i]];
+            result.provider_name = provider;
+            if (i >= responses.size()) {
+                result.error_message = "No response from API provider '" + provider + "'";
+            } else if (responses[i].success) {
+                result.success = true;
+                result.message_id = responses[i].message_id;
+            } else {
+                result.error_message = responses[i].error_message;
+            }
+            updateStats(result.success ? "api_success" : "api_failure", true);
+        }
+    }
+    return results;
+}
+
 UnifiedMailerResult UnifiedMailer::retryWithFallback(const Email& email, SendMethod original_method) {
     UnifiedMailerResult result;
     result.retry_count = 1;
@@ -1,5 +1,6 @@
 #include "simple-smtp-mailer/mailer.hpp"
 #include "utils/email.hpp"
+#include "core/queue/payload_codec.hpp"
 #include <algorithm>
 #include <sstream>
 #include <regex>
@@ -274,4 +275,106 @@ SMTPResult SMTPResult::createError(const std::string& error_msg, int error_code)
     return result;
 }
 
+// QueueItem methods
+const std::string& QueueItem::bodyText() const {
+    return payload ? payload->body : message ? message->body : body;
+}
+
+const std::string& QueueItem::htmlBodyText() const {
+    return payload ? payload->html_body : message ? message->html_body : html_body;
+}
+
+const std::vector<std::string>& QueueItem::attachmentList() const {
+    return payload ? payload->attachments : message ? message->attachments : attachments;
+}
+
+size_t QueueItem::payloadSize() const {
+    if (packed) {
+        return packed->size();
+    }
+    size_t size = bodyText().size() + htmlBodyText().size();
+    for (const auto& attachment : attachmentList()) {
+        size += attachment.size();
+    }
+    return size;
+}
+
+size_t QueueItem::heldSize() const {
+    if (packed) {
+        return packed_shared ? 0 : packed->packedSize();
+    }
+    return payload ? 0 : payloadSize();
+}
+
+std::shared_ptr<const Email> QueueItem::outgoingMessage() const {
+    if (!payload && !packed) {
+        return message;
+    }
+    // Only for the length of the send; the queue keeps the payload shared
+    // and compressed
+    auto full = std::make_shared<Email>(*message);
+    if (packed) {
+        if (!packed->unpack(*full)) {
+            return nullptr;
+        }
+        return full;
+    }
+    full->body = payload->body;
+    full->html_body = payload->html_body;
+    full->attachments = payload->attachments;
+    return full;
+}
+
+void QueueItem::shareMessage() {
+    if (message) {
+        return;
+    }
+    auto shared = std::make_shared<Email>(from_address, to_addresses, subject, "");
+    shared->body = std::move(body);
+    shared->html_body = std::move(html_body);
+    shared->attachments = std::move(attachments);
+    shared->idempotency_key = idempotency_key;
+    body.clear();
+    html_body.clear();
+    attachments.clear();
+    message = std::move(shared);
+}
+
+bool QueueItem::copyMessage() {
+    if (packed) {
+        Email unpacked;
+        if (!packed->unpack(unpacked)) {
+            return false;
+        }
+        body = std::move(unpacked.body);
+        html_body = std::move(unpacked.html_body);
+        attachments = std::move(unpacked.attachments);
+    } else if (payload || message) {
+        body = bodyText();
+        html_body = htmlBodyText();
+        attachments = attachmentList();
+    }
+    return true;
+}
+
+void QueueItem::dropRecipients(const std::vector<std::string>& delivered) {
+    auto drop = [&delivered](std::vector<std::string>& addresses) {
+        addresses.erase(std::remove_if(addresses.begin(), addresses.end(),
+                                       [&delivered](const std::string& address) {
+                                           return std::find(delivered.begin(), delivered.end(), address) !=
+                                                  delivered.end();
+                                       }),
+                        addresses.end());
+    };
+    drop(to_addresses);
+    if (message) {
+        // Others may hold the shared message, so the envelope is narrowed on a copy
+        auto narrowed = std::make_shared<Email>(*message);
+        drop(narrowed->to);
+        drop(narrowed->cc);
+        drop(narrowed->bcc);
+        message = std::move(narrowed);
+    }
+}
+
 } // namespace ssmtp_mailer
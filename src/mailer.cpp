@@ -2,8 +2,12 @@
 #include "core/logging/logger.hpp"
 #include "core/config/config_manager.hpp"
 #include "core/smtp/smtp_client.hpp"
+#include "core/smtp/smtp_connection_pool.hpp"
+#include "core/smtp/smtp_event_loop.hpp"
 #include "core/queue/email_queue.hpp"
 // #include "core/auth/auth_manager.hpp"  // TODO: Implement AuthManager or use existing auth classes
+#include <algorithm>
+#include <future>
 #include <memory>
 #include <stdexcept>
 
@@ -26,25 +30,50 @@ public:
     bool testConnection();
     
     // Queue management
-    void enqueue(const Email& email, EmailPriority priority = EmailPriority::NORMAL);
+    EnqueueResult enqueue(const Email& email, EmailPriority priority = EmailPriority::NORMAL);
+    EnqueueResult enqueue(Email&& email, EmailPriority priority);
+    std::string scheduleEmail(const Email& email, std::chrono::system_clock::time_point send_at,
+                              EmailPriority priority);
+    bool cancelScheduledEmail(const std::string& id);
+    std::string rescheduleEmail(const std::string& id, std::chrono::system_clock::time_point send_at);
     void startQueue();
     void stopQueue();
     bool isQueueRunning() const;
     size_t getQueueSize() const;
     std::vector<QueueItem> getPendingEmails() const;
     std::vector<QueueItem> getFailedEmails() const;
+    QueueStatusCounts getQueueStatusCounts() const;
+    QueuePage getQueuePage(EmailStatus status, const std::string& cursor, size_t limit) const;
+    void setQueueWorkers(size_t workers);
+    std::vector<QueueWorkerStats> getQueueWorkerStats() const;
+    void setQueueDomainConcurrency(const std::string& domain, size_t limit);
+    std::vector<QueueDomainStats> getQueueDomainStats() const;
+    QueueDedupStats getQueueDedupStats() const;
+    QueuePayloadStats getQueuePayloadStats() const;
+    std::vector<QueueLatencyStats> getQueueLatencyStats() const;
+    size_t getQueueExpiredCount() const;
     
 private:
     std::unique_ptr<ConfigManager> config_manager_;
     std::unique_ptr<SMTPClient> smtp_client_;
+    std::unique_ptr<SMTPConnectionPool> smtp_pool_;
     std::unique_ptr<EmailQueue> email_queue_;
+    // Declared after the queue so it is destroyed first and fails its
+    // unfinished messages back into a queue that still exists
+    std::unique_ptr<SMTPEventLoop> event_loop_;
     // std::unique_ptr<AuthManager> auth_manager_;  // TODO: Implement AuthManager
     std::string last_error_;
     bool is_configured_;
+    std::chrono::milliseconds enqueue_timeout_;   // How long enqueue() waits for room in a full queue
     
     bool initializeConfiguration(const std::string& config_file);
     bool validateEmailPermissions(const Email& email);
+    void noteEnqueueFailure(EnqueueResult result);
     SMTPResult sendEmailDirect(const Email& email);
+    std::vector<SMTPResult> sendBatchDirect(const std::vector<const Email*>& emails);
+    bool deliversToMX(const Email& email) const;
+    SMTPResult sendThroughEventLoop(const Email& email);
+    void sendEmailAsync(std::shared_ptr<const Email> email, EmailQueue::CompletionCallback done);
 };
 
 // Mailer implementation
@@ -82,8 +111,25 @@ bool Mailer::testConnection() {
 }
 
 // Queue management methods
-void Mailer::enqueue(const Email& email, EmailPriority priority) {
-    pImpl->enqueue(email, priority);
+EnqueueResult Mailer::enqueue(const Email& email, EmailPriority priority) {
+    return pImpl->enqueue(email, priority);
+}
+
+EnqueueResult Mailer::enqueue(Email&& email, EmailPriority priority) {
+    return pImpl->enqueue(std::move(email), priority);
+}
+
+std::string Mailer::scheduleEmail(const Email& email, std::chrono::system_clock::time_point send_at,
+                                  EmailPriority priority) {
+    return pImpl->scheduleEmail(email, send_at, priority);
+}
+
+bool Mailer::cancelScheduledEmail(const std::string& id) {
+    return pImpl->cancelScheduledEmail(id);
+}
+
+std::string Mailer::rescheduleEmail(const std::string& id, std::chrono::system_clock::time_point send_at) {
+    return pImpl->rescheduleEmail(id, send_at);
 }
 
 void Mailer::startQueue() {
@@ -110,9 +156,49 @@ std::vector<QueueItem> Mailer::getFailedEmails() const {
     return pImpl->getFailedEmails();
 }
 
+QueueStatusCounts Mailer::getQueueStatusCounts() const {
+    return pImpl->getQueueStatusCounts();
+}
+
+QueuePage Mailer::getQueuePage(EmailStatus status, const std::string& cursor, size_t limit) const {
+    return pImpl->getQueuePage(status, cursor, limit);
+}
+
+void Mailer::setQueueWorkers(size_t workers) {
+    pImpl->setQueueWorkers(workers);
+}
+
+std::vector<QueueWorkerStats> Mailer::getQueueWorkerStats() const {
+    return pImpl->getQueueWorkerStats();
+}
+
+void Mailer::setQueueDomainConcurrency(const std::string& domain, size_t limit) {
+    pImpl->setQueueDomainConcurrency(domain, limit);
+}
+
+std::vector<QueueDomainStats> Mailer::getQueueDomainStats() const {
+    return pImpl->getQueueDomainStats();
+}
+
+QueueDedupStats Mailer::getQueueDedupStats() const {
+    return pImpl->getQueueDedupStats();
+}
+
+QueuePayloadStats Mailer::getQueuePayloadStats() const {
+    return pImpl->getQueuePayloadStats();
+}
+
+std::vector<QueueLatencyStats> Mailer::getQueueLatencyStats() const {
+    return pImpl->getQueueLatencyStats();
+}
+
+size_t Mailer::getQueueExpiredCount() const {
+    return pImpl->getQueueExpiredCount();
+}
+
 // Implementation class methods
 Mailer::Impl::Impl(const std::string& config_file) 
-    : is_configured_(false) {
+    : is_configured_(false), enqueue_timeout_(0) {
     
     Logger& logger = Logger::getInstance();
     logger.info("Initializing Mailer with config: " + (config_file.empty() ? "default" : config_file));
@@ -124,13 +210,93 @@ Mailer::Impl::Impl(const std::string& config_file)
     
             try {
             smtp_client_ = std::make_unique<SMTPClient>(*config_manager_);
+            smtp_pool_ = std::make_unique<SMTPConnectionPool>(*config_manager_);
             // auth_manager_ = std::make_unique<AuthManager>();  // TODO: Implement AuthManager
             email_queue_ = std::make_unique<EmailQueue>();
+            event_loop_ = std::make_unique<SMTPEventLoop>(*config_manager_);
             
-            // Set up the queue callback
+            // Set up the queue callbacks; queued mail goes through the event
+            // loop so one slow relay does not hold up the rest, unless
+            // configured to go out in batches over pooled sessions
+            const GlobalConfig& global = config_manager_->getGlobalConfig();
             email_queue_->setSendCallback([this](const Email* email) -> SMTPResult {
                 return sendEmailDirect(*email);
             });
+            if (global.queue_batch_send) {
+                email_queue_->setBatchSendCallback([this](const std::vector<const Email*>& emails) {
+                    return sendBatchDirect(emails);
+                });
+            } else {
+                email_queue_->setAsyncSendCallback(
+                    [this](std::shared_ptr<const Email> email, EmailQueue::CompletionCallback done) {
+                        sendEmailAsync(std::move(email), std::move(done));
+                    });
+            }
+            if (global.max_connections > 0) {
+                email_queue_->setMaxInFlight(static_cast<size_t>(global.max_connections));
+            }
+            if (global.queue_workers > 0) {
+                email_queue_->setWorkerCount(static_cast<size_t>(global.queue_workers));
+            }
+            if (global.queue_domain_concurrency > 0) {
+                email_queue_->setDomainConcurrency(static_cast<size_t>(global.queue_domain_concurrency));
+            }
+            if (global.queue_priority_aging_seconds >= 0) {
+                email_queue_->setPriorityAging(std::chrono::seconds(global.queue_priority_aging_seconds));
+            }
+            if (global.queue_urgent_reserve_percent >= 0) {
+                email_queue_->setUrgentReserve(global.queue_urgent_reserve_percent / 100.0);
+            }
+            if (global.queue_max_size > 0) {
+                email_queue_->setMaxQueueSize(static_cast<size_t>(global.queue_max_size));
+            }
+            if (global.queue_max_mb >= 0) {
+                email_queue_->setMaxQueueBytes(static_cast<size_t>(global.queue_max_mb) * 1024 * 1024);
+            }
+            enqueue_timeout_ = std::chrono::milliseconds(std::max(0, global.queue_enqueue_timeout_ms));
+            if (global.queue_dedup_window_seconds > 0) {
+                DedupIndexOptions dedup_options;
+                dedup_options.window = std::chrono::seconds(global.queue_dedup_window_seconds);
+                if (global.queue_dedup_exact_keys >= 0) {
+                    dedup_options.exact_keys = static_cast<size_t>(global.queue_dedup_exact_keys);
+                }
+                email_queue_->setDedupOptions(dedup_options);
+            }
+            email_queue_->setPayloadDedup(global.queue_payload_dedup);
+            PayloadCompressionOptions compression;
+            if (!payload_codec::parse(global.queue_compression, compression.codec)) {
+                logger.warning("Unknown queue_compression " + global.queue_compression +
+                               "; queued payloads stay uncompressed");
+            }
+            if (global.queue_compression_threshold_kb >= 0) {
+                compression.threshold = static_cast<size_t>(global.queue_compression_threshold_kb) * 1024;
+            }
+            compression.level = global.queue_compression_level;
+            email_queue_->setPayloadCompression(compression);
+            if (!global.spool_dir.empty()) {
+                QueueSpoolOptions spool_options;
+                spool_options.directory = global.spool_dir;
+                if (global.spool_segment_size_mb > 0) {
+                    spool_options.segment_size = static_cast<size_t>(global.spool_segment_size_mb) * 1024 * 1024;
+                }
+                if (global.spool_commit_interval_ms >= 0) {
+                    spool_options.commit_interval = std::chrono::milliseconds(global.spool_commit_interval_ms);
+                }
+                if (!email_queue_->enableSpool(spool_options)) {
+                    logger.warning("Continuing with an in-memory queue; queued mail will not survive a restart");
+                }
+            }
+            if (!global.schedule_dir.empty()) {
+                ScheduleStoreOptions schedule_options;
+                schedule_options.directory = global.schedule_dir;
+                if (global.schedule_bucket_seconds > 0) {
+                    schedule_options.bucket_width = std::chrono::seconds(global.schedule_bucket_seconds);
+                    schedule_options.window = schedule_options.bucket_width;
+                }
+                if (!email_queue_->enableScheduleStore(schedule_options)) {
+                    logger.warning("Scheduled sending is unavailable");
+                }
+            }
             
             is_configured_ = true;
             logger.info("Mailer initialized successfully");
@@ -189,8 +355,8 @@ SMTPResult Mailer::Impl::send(const Email& email) {
     }
     
     try {
-        // Send email using SMTP client
-        SMTPResult result = smtp_client_->send(email);
+        // Send email over a pooled SMTP session, or straight to the MX hosts
+        SMTPResult result = deliversToMX(email) ? sendThroughEventLoop(email) : smtp_pool_->send(email);
         
         if (result.success) {
             logger.info("Email sent successfully with message ID: " + result.message_id);
@@ -271,13 +437,64 @@ bool Mailer::Impl::validateEmailPermissions(const Email& email) {
 }
 
 // Queue management implementations
-void Mailer::Impl::enqueue(const Email& email, EmailPriority priority) {
+EnqueueResult Mailer::Impl::enqueue(const Email& email, EmailPriority priority) {
     if (!email_queue_) {
         last_error_ = "Email queue not available";
-        return;
+        return EnqueueResult::UNAVAILABLE;
     }
     
-    email_queue_->enqueue(&email, priority);
+    if (enqueue_timeout_.count() > 0) {
+        return enqueue(Email(email), priority);
+    }
+    EnqueueResult result = email_queue_->enqueue(&email, priority);
+    if (result != EnqueueResult::ACCEPTED) {
+        noteEnqueueFailure(result);
+    }
+    return result;
+}
+
+EnqueueResult Mailer::Impl::enqueue(Email&& email, EmailPriority priority) {
+    if (!email_queue_) {
+        last_error_ = "Email queue not available";
+        return EnqueueResult::UNAVAILABLE;
+    }
+    
+    // Producers slow down to the queue's pace instead of losing mail
+    EnqueueResult result = enqueue_timeout_.count() > 0
+        ? email_queue_->enqueueFor(std::move(email), priority, enqueue_timeout_)
+        : email_queue_->enqueue(std::move(email), priority);
+    if (result != EnqueueResult::ACCEPTED) {
+        noteEnqueueFailure(result);
+    }
+    return result;
+}
+
+void Mailer::Impl::noteEnqueueFailure(EnqueueResult result) {
+    last_error_ = result == EnqueueResult::DUPLICATE
+        ? "Duplicate email: its idempotency key was already queued"
+        : "Email queue is full";
+}
+
+std::string Mailer::Impl::scheduleEmail(const Email& email, std::chrono::system_clock::time_point send_at,
+                                        EmailPriority priority) {
+    if (!email_queue_ || !email_queue_->isScheduleStoreEnabled()) {
+        last_error_ = "Scheduled sending is not configured (set schedule_dir)";
+        return "";
+    }
+    
+    std::string id = email_queue_->scheduleEmail(&email, send_at, priority);
+    if (id.empty()) {
+        last_error_ = "Failed to schedule email";
+    }
+    return id;
+}
+
+bool Mailer::Impl::cancelScheduledEmail(const std::string& id) {
+    return email_queue_ && email_queue_->cancelScheduled(id);
+}
+
+std::string Mailer::Impl::rescheduleEmail(const std::string& id, std::chrono::system_clock::time_point send_at) {
+    return email_queue_ ? email_queue_->reschedule(id, send_at) : "";
 }
 
 void Mailer::Impl::startQueue() {
@@ -286,6 +503,10 @@ void Mailer::Impl::startQueue() {
         return;
     }
     
+    if (!event_loop_ || !event_loop_->start()) {
+        last_error_ = "SMTP event loop could not be started";
+        return;
+    }
     email_queue_->start();
 }
 
@@ -296,6 +517,9 @@ void Mailer::Impl::stopQueue() {
     }
     
     email_queue_->stop();
+    if (event_loop_) {
+        event_loop_->stop();
+    }
 }
 
 bool Mailer::Impl::isQueueRunning() const {
@@ -314,17 +538,130 @@ std::vector<QueueItem> Mailer::Impl::getFailedEmails() const {
     return email_queue_ ? email_queue_->getFailedEmails() : std::vector<QueueItem>{};
 }
 
+QueueStatusCounts Mailer::Impl::getQueueStatusCounts() const {
+    return email_queue_ ? email_queue_->getStatusCounts() : QueueStatusCounts();
+}
+
+QueuePage Mailer::Impl::getQueuePage(EmailStatus status, const std::string& cursor, size_t limit) const {
+    return email_queue_ ? email_queue_->getPage(status, cursor, limit) : QueuePage();
+}
+
+void Mailer::Impl::setQueueWorkers(size_t workers) {
+    if (!email_queue_) {
+        last_error_ = "Email queue not available";
+        return;
+    }
+    
+    email_queue_->setWorkerCount(workers);
+}
+
+std::vector<QueueWorkerStats> Mailer::Impl::getQueueWorkerStats() const {
+    return email_queue_ ? email_queue_->getWorkerStats() : std::vector<QueueWorkerStats>{};
+}
+
+void Mailer::Impl::setQueueDomainConcurrency(const std::string& domain, size_t limit) {
+    if (!email_queue_) {
+        last_error_ = "Email queue not available";
+        return;
+    }
+    
+    email_queue_->setDomainConcurrency(domain, limit);
+}
+
+std::vector<QueueDomainStats> Mailer::Impl::getQueueDomainStats() const {
+    return email_queue_ ? email_queue_->getDomainStats() : std::vector<QueueDomainStats>{};
+}
+
+QueueDedupStats Mailer::Impl::getQueueDedupStats() const {
+    return email_queue_ ? email_queue_->getDedupStats() : QueueDedupStats();
+}
+
+QueuePayloadStats Mailer::Impl::getQueuePayloadStats() const {
+    return email_queue_ ? email_queue_->getPayloadStats() : QueuePayloadStats();
+}
+
+std::vector<QueueLatencyStats> Mailer::Impl::getQueueLatencyStats() const {
+    return email_queue_ ? email_queue_->getLatencyStats() : std::vector<QueueLatencyStats>{};
+}
+
+size_t Mailer::Impl::getQueueExpiredCount() const {
+    return email_queue_ ? email_queue_->getTotalExpired() : 0;
+}
+
 SMTPResult Mailer::Impl::sendEmailDirect(const Email& email) {
     // This method is called by the queue to send emails directly
-    if (!smtp_client_) {
+    if (!smtp_pool_) {
         return SMTPResult::createError("SMTP client not available");
     }
     
     try {
-        return smtp_client_->send(email);
+        return deliversToMX(email) ? sendThroughEventLoop(email) : smtp_pool_->send(email);
     } catch (const std::exception& e) {
         return SMTPResult::createError("Exception during email sending: " + std::string(e.what()));
     }
 }
 
+std::vector<SMTPResult> Mailer::Impl::sendBatchDirect(const std::vector<const Email*>& emails) {
+    if (!smtp_pool_) {
+        return std::vector<SMTPResult>(emails.size(), SMTPResult::createError("SMTP client not available"));
+    }
+    
+    // Relayed mail goes out in one call to the pool; direct-to-MX mail is
+    // submitted to the event loop all at once and collected after
+    std::vector<SMTPResult> results(emails.size());
+    std::vector<const Email*> relayed;
+    std::vector<size_t> relayed_at;
+    std::vector<std::pair<size_t, std::future<SMTPResult>>> direct;
+    for (size_t i = 0; i < emails.size(); ++i) {
+        if (!deliversToMX(*emails[i])) {
+            relayed.push_back(emails[i]);
+            relayed_at.push_back(i);
+        } else if (!event_loop_ || !event_loop_->start()) {
+            results[i] = SMTPResult::createError("SMTP event loop could not be started");
+        } else {
+            auto outcome = std::make_shared<std::promise<SMTPResult>>();
+            direct.emplace_back(i, outcome->get_future());
+            event_loop_->submit(*emails[i], [outcome](const SMTPResult& r) { outcome->set_value(r); });
+        }
+    }
+    
+    try {
+        std::vector<SMTPResult> relayed_results = smtp_pool_->sendBatch(relayed);
+        for (size_t i = 0; i < relayed_at.size(); ++i) {
+            results[relayed_at[i]] = relayed_results[i];
+        }
+    } catch (const std::exception& e) {
+        for (size_t index : relayed_at) {
+            results[index] = SMTPResult::createError("Exception during email sending: " + std::string(e.what()));
+        }
+    }
+    for (auto& entry : direct) {
+        results[entry.first] = entry.second.get();
+    }
+    return results;
+}
+
+bool Mailer::Impl::deliversToMX(const Email& email) const {
+    const DomainConfig* domain_config = config_manager_->getDomainConfig(Email::extractDomain(email.from));
+    return domain_config && domain_config->delivery_mode == "mx" && domain_config->smtp_transport != "curl";
+}
+
+SMTPResult Mailer::Impl::sendThroughEventLoop(const Email& email) {
+    // Direct-to-MX delivery is only implemented by the event loop
+    if (!event_loop_ || !event_loop_->start()) {
+        return SMTPResult::createError("SMTP event loop could not be started");
+    }
+    auto outcome = std::make_shared<std::promise<SMTPResult>>();
+    std::future<SMTPResult> result = outcome->get_future();
+    event_loop_->submit(email, [outcome](const SMTPResult& r) { outcome->set_value(r); });
+    return result.get();
+}
+
+void Mailer::Impl::sendEmailAsync(std::shared_ptr<const Email> email, EmailQueue::CompletionCallback done) {
+    // Domains on the curl transport are not handled by the event loop
+    if (!event_loop_ || !event_loop_->submit(email, done)) {
+        done(sendEmailDirect(*email));
+    }
+}
+
 } // namespace ssmtp_mailer
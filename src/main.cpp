@@ -609,6 +609,34 @@ int main(int argc, char* argv[]) {
                 std::cout << "Queue Status:" << std::endl;
                 std::cout << "  Running: " << (mailer.isQueueRunning() ? "Yes" : "No") << std::endl;
                 std::cout << "  Size: " << mailer.getQueueSize() << std::endl;
+                auto counts = mailer.getQueueStatusCounts();
+                std::cout << "  Pending: " << counts.pending << std::endl;
+                std::cout << "  Processing: " << counts.processing << std::endl;
+                std::cout << "  Retrying: " << counts.retry << std::endl;
+                std::cout << "  Failed: " << counts.failed << std::endl;
+                std::cout << "  Expired: " << mailer.getQueueExpiredCount() << std::endl;
+                auto dedup = mailer.getQueueDedupStats();
+                std::cout << "  Duplicates dropped: " << dedup.exact_hits + dedup.filter_hits << std::endl;
+                auto payloads = mailer.getQueuePayloadStats();
+                std::cout << "  Payloads: " << payloads.payloads << " held, " << payloads.shared
+                          << " of " << payloads.checked << " emails shared one (dedup ratio "
+                          << payloads.dedup_ratio << ")" << std::endl;
+                if (payloads.compressed > 0) {
+                    std::cout << "  Compressed: " << payloads.compressed << " payloads, "
+                              << payloads.bytes_before << " bytes to " << payloads.bytes_after
+                              << " (ratio " << payloads.compression_ratio << ")" << std::endl;
+                }
+                const char* priority_names[] = {"LOW", "NORMAL", "HIGH", "URGENT"};
+                for (const auto& latency : mailer.getQueueLatencyStats()) {
+                    if (latency.samples == 0) {
+                        continue;
+                    }
+                    std::cout << "  Latency " << priority_names[static_cast<int>(latency.priority)]
+                              << ": p50 " << latency.p50.count() / 1000.0 << " ms, p90 "
+                              << latency.p90.count() / 1000.0 << " ms, p99 "
+                              << latency.p99.count() / 1000.0 << " ms (" << latency.samples
+                              << " sent)" << std::endl;
+                }
                 return 0;
                 
             } else if (subcommand == "add") {
@@ -627,29 +655,43 @@ int main(int argc, char* argv[]) {
                 }
                 
                 ssmtp_mailer::Email email(from, to, subject, body);
-                mailer.enqueue(email);
+                if (mailer.enqueue(std::move(email)) != ssmtp_mailer::EnqueueResult::ACCEPTED) {
+                    std::cerr << "Error: " << mailer.getLastError() << std::endl;
+                    return 1;
+                }
                 std::cout << "Email added to queue" << std::endl;
                 logger.info("Email queued from " + from + " to " + to);
                 return 0;
                 
             } else if (subcommand == "list") {
-                auto pending = mailer.getPendingEmails();
-                std::cout << "Pending emails: " << pending.size() << std::endl;
-                for (const auto& queued : pending) {
-                    std::string recipient = queued.to_addresses.empty() ? "none" : queued.to_addresses[0];
-                    std::cout << "  - " << queued.from_address << " -> " << recipient 
-                              << " (Priority: " << static_cast<int>(queued.priority) << ")" << std::endl;
+                auto counts = mailer.getQueueStatusCounts();
+                std::cout << "Pending emails: " << counts.pending + counts.retry << std::endl;
+                for (auto status : {ssmtp_mailer::EmailStatus::PENDING, ssmtp_mailer::EmailStatus::RETRY}) {
+                    std::string cursor;
+                    do {
+                        auto page = mailer.getQueuePage(status, cursor);
+                        for (const auto& queued : page.items) {
+                            std::string recipient = queued.first_recipient.empty() ? "none" : queued.first_recipient;
+                            std::cout << "  - " << queued.from_address << " -> " << recipient 
+                                      << " (Priority: " << static_cast<int>(queued.priority) << ")" << std::endl;
+                        }
+                        cursor = page.next_cursor;
+                    } while (!cursor.empty());
                 }
                 return 0;
                 
             } else if (subcommand == "failed") {
-                auto failed = mailer.getFailedEmails();
-                std::cout << "Failed emails: " << failed.size() << std::endl;
-                for (const auto& queued : failed) {
-                    std::string recipient = queued.to_addresses.empty() ? "none" : queued.to_addresses[0];
-                    std::cout << "  - " << queued.from_address << " -> " << recipient 
-                              << " (Error: " << queued.error_message << ")" << std::endl;
-                }
+                std::cout << "Failed emails: " << mailer.getQueueStatusCounts().failed << std::endl;
+                std::string cursor;
+                do {
+                    auto page = mailer.getQueuePage(ssmtp_mailer::EmailStatus::FAILED, cursor);
+                    for (const auto& queued : page.items) {
+                        std::string recipient = queued.first_recipient.empty() ? "none" : queued.first_recipient;
+                        std::cout << "  - " << queued.from_address << " -> " << recipient 
+                                  << " (Error: " << queued.error_message << ")" << std::endl;
+                    }
+                    cursor = page.next_cursor;
+                } while (!cursor.empty());
                 return 0;
                 
             } else {
@@ -0,0 +1,287 @@
+#pragma once
+
+// Minimal stub DNS server used by the resolver tests. It answers A, AAAA
+// and MX questions from a fixed table over UDP on an ephemeral loopback port,
+// and over TCP on the same port when truncate is set; unknown names get
+// NXDOMAIN with an SOA record carrying negative_ttl.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace ssmtp_test {
+
+class FakeDNSServer {
+public:
+    struct Record {
+        std::vector<std::string> a;
+        std::vector<std::string> aaaa;
+        std::vector<std::pair<uint16_t, std::string>> mx;  // Empty exchange for a null MX
+        uint32_t ttl = 300;
+    };
+
+    struct Options {
+        std::map<std::string, Record> records;
+        uint32_t negative_ttl = 120;
+        bool silent = false;    // Swallow every query, to exercise timeouts
+        bool truncate = false;  // Answer UDP with TC and nothing else; serve the answers over TCP
+    };
+
+    FakeDNSServer() : FakeDNSServer(Options()) {}
+
+    explicit FakeDNSServer(Options options)
+        : options_(std::move(options)), fd_(-1), tcp_fd_(-1), port_(0), running_(false), queries_(0),
+          tcp_queries_(0) {}
+
+    ~FakeDNSServer() {
+        stop();
+    }
+
+    bool start() {
+        fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            return false;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+
+        if (options_.truncate) {
+            tcp_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+            if (tcp_fd_ < 0 || bind(tcp_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+                listen(tcp_fd_, 8) < 0) {
+                return false;
+            }
+        }
+
+        running_ = true;
+        thread_ = std::thread([this] { serve(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        close(fd_);
+        if (tcp_fd_ >= 0) {
+            close(tcp_fd_);
+        }
+    }
+
+    int port() const { return port_; }
+
+    std::string address() const { return "127.0.0.1:" + std::to_string(port_); }
+
+    size_t queryCount() const { return queries_; }
+
+    size_t tcpQueryCount() const { return tcp_queries_; }
+
+private:
+    static void put16(std::string& out, uint16_t value) {
+        out += static_cast<char>(value >> 8);
+        out += static_cast<char>(value & 0xff);
+    }
+
+    static void put32(std::string& out, uint32_t value) {
+        put16(out, static_cast<uint16_t>(value >> 16));
+        put16(out, static_cast<uint16_t>(value & 0xffff));
+    }
+
+    static void putName(std::string& out, const std::string& name) {
+        size_t start = 0;
+        while (start < name.size()) {
+            size_t dot = name.find('.', start);
+            size_t end = dot == std::string::npos ? name.size() : dot;
+            out += static_cast<char>(end - start);
+            out.append(name, start, end - start);
+            start = end + 1;
+        }
+        out += '\0';
+    }
+
+    void serve() {
+        unsigned char buffer[512];
+        while (running_) {
+            pollfd pfds[2] = {{fd_, POLLIN, 0}, {tcp_fd_, POLLIN, 0}};
+            if (poll(pfds, tcp_fd_ >= 0 ? 2 : 1, 50) <= 0) {
+                continue;
+            }
+            if (tcp_fd_ >= 0 && (pfds[1].revents & POLLIN)) {
+                serveTCP();
+            }
+            if (!(pfds[0].revents & POLLIN)) {
+                continue;
+            }
+            sockaddr_storage from;
+            socklen_t from_len = sizeof(from);
+            ssize_t n = recvfrom(fd_, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+            if (n < 17) {
+                continue;
+            }
+            queries_++;
+            if (options_.silent) {
+                continue;
+            }
+
+            std::string reply = answer(buffer, static_cast<size_t>(n), options_.truncate);
+            sendto(fd_, reply.data(), reply.size(), 0, reinterpret_cast<sockaddr*>(&from), from_len);
+        }
+    }
+
+    // One connection at a time, each query with its two-byte length in front
+    void serveTCP() {
+        int conn = accept(tcp_fd_, nullptr, nullptr);
+        if (conn < 0) {
+            return;
+        }
+        std::string in;
+        while (running_) {
+            pollfd pfd{conn, POLLIN, 0};
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+            char chunk[512];
+            ssize_t n = recv(conn, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                break;
+            }
+            in.append(chunk, static_cast<size_t>(n));
+            while (in.size() >= 2) {
+                size_t length = (static_cast<unsigned char>(in[0]) << 8) | static_cast<unsigned char>(in[1]);
+                if (in.size() < 2 + length) {
+                    break;
+                }
+                tcp_queries_++;
+                std::string reply = answer(reinterpret_cast<const unsigned char*>(in.data() + 2), length, false);
+                std::string framed;
+                put16(framed, static_cast<uint16_t>(reply.size()));
+                framed += reply;
+                ::send(conn, framed.data(), framed.size(), MSG_NOSIGNAL);
+                in.erase(0, 2 + length);
+            }
+        }
+        close(conn);
+    }
+
+    std::string answer(const unsigned char* buffer, size_t n, bool truncated) const {
+        // Question name
+        std::string name;
+        size_t offset = 12;
+        while (offset < n && buffer[offset] != 0) {
+            size_t label = buffer[offset];
+            if (!name.empty()) {
+                name += '.';
+            }
+            name.append(reinterpret_cast<const char*>(buffer + offset + 1), label);
+            offset += 1 + label;
+        }
+        size_t question_end = offset + 5;
+        uint16_t type = static_cast<uint16_t>((buffer[offset + 1] << 8) | buffer[offset + 2]);
+
+        if (truncated) {
+            std::string reply(reinterpret_cast<const char*>(buffer), 2);
+            put16(reply, 0x8380);
+            put16(reply, 1);
+            put16(reply, 0);
+            put16(reply, 0);
+            put16(reply, 0);
+            reply.append(reinterpret_cast<const char*>(buffer + 12), question_end - 12);
+            return reply;
+        }
+
+        auto record = options_.records.find(name);
+        std::vector<std::string> values;
+        std::vector<std::pair<uint16_t, std::string>> exchanges;
+        uint32_t ttl = 0;
+        if (record != options_.records.end()) {
+            values = type == 1 ? record->second.a : type == 28 ? record->second.aaaa : values;
+            exchanges = type == 15 ? record->second.mx : exchanges;
+            ttl = record->second.ttl;
+        }
+        bool nxdomain = record == options_.records.end();
+
+        std::string reply(reinterpret_cast<const char*>(buffer), 2);
+        put16(reply, static_cast<uint16_t>(0x8180 | (nxdomain ? 3 : 0)));
+        put16(reply, 1);
+        put16(reply, static_cast<uint16_t>(values.size() + exchanges.size()));
+        put16(reply, values.empty() && exchanges.empty() ? 1 : 0);
+        put16(reply, 0);
+        reply.append(reinterpret_cast<const char*>(buffer + 12), question_end - 12);
+
+        for (const auto& value : values) {
+            put16(reply, 0xc00c);
+            put16(reply, type);
+            put16(reply, 1);
+            put32(reply, ttl);
+            unsigned char raw[16];
+            int family = type == 1 ? AF_INET : AF_INET6;
+            inet_pton(family, value.c_str(), raw);
+            put16(reply, type == 1 ? 4 : 16);
+            reply.append(reinterpret_cast<const char*>(raw), type == 1 ? 4 : 16);
+        }
+        for (const auto& exchange : exchanges) {
+            std::string rdata;
+            put16(rdata, exchange.first);
+            if (exchange.second == name) {
+                put16(rdata, 0xc00c);  // Compressed, pointing at the question
+            } else {
+                putName(rdata, exchange.second);
+            }
+            put16(reply, 0xc00c);
+            put16(reply, type);
+            put16(reply, 1);
+            put32(reply, ttl);
+            put16(reply, static_cast<uint16_t>(rdata.size()));
+            reply += rdata;
+        }
+        if (values.empty() && exchanges.empty()) {
+            // SOA with root MNAME/RNAME; MINIMUM is the negative TTL
+            put16(reply, 0xc00c);
+            put16(reply, 6);
+            put16(reply, 1);
+            put32(reply, 3600);
+            put16(reply, 22);
+            reply += '\0';
+            reply += '\0';
+            put32(reply, 1);
+            put32(reply, 3600);
+            put32(reply, 600);
+            put32(reply, 86400);
+            put32(reply, options_.negative_ttl);
+        }
+        return reply;
+    }
+
+    Options options_;
+    int fd_;
+    int tcp_fd_;
+    int port_;
+    std::atomic<bool> running_;
+    std::atomic<size_t> queries_;
+    std::atomic<size_t> tcp_queries_;
+    std::thread thread_;
+};
+
+} // namespace ssmtp_test
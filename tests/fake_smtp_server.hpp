@@ -0,0 +1,414 @@
+#pragma once
+
+// Minimal scripted SMTP server used by the transport tests. It listens on an
+// ephemeral loopback port and serves every connection on its own thread.
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#include "core/smtp/tls_context.hpp"
+
+namespace ssmtp_test {
+
+class FakeSMTPServer {
+public:
+    struct Options {
+        std::vector<std::string> extensions{"8BITMIME", "SIZE 10485760", "AUTH PLAIN LOGIN"};
+        std::set<std::string> reject_recipients;
+        int reply_delay_ms = 0;
+        bool starttls = false;  // Advertise STARTTLS with a throwaway self-signed certificate
+        int hang_up_after = 0;  // Close a session without replying once it has taken this many messages
+        int hang_up_on = 0;     // Take this message of a session, counting from 1, then close without a reply
+    };
+
+    struct Message {
+        std::string from;
+        std::vector<std::string> recipients;
+        std::string data;
+    };
+
+    FakeSMTPServer() : FakeSMTPServer(Options()) {}
+
+    explicit FakeSMTPServer(Options options)
+        : options_(std::move(options)), listen_fd_(-1), port_(0), running_(false), connections_(0),
+      pipelined_(0), tls_handshakes_(0), tls_resumed_(0), ssl_ctx_(nullptr) {
+        if (options_.starttls) {
+            options_.extensions.push_back("STARTTLS");
+        }
+    }
+
+    ~FakeSMTPServer() {
+        stop();
+    }
+
+    bool start() {
+        if (options_.starttls && !ssl_ctx_ && !(ssl_ctx_ = makeServerContext())) {
+            return false;
+        }
+        listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd_ < 0) {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(listen_fd_, 128) < 0) {
+            return false;
+        }
+
+        socklen_t len = sizeof(addr);
+        getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &len);
+        port_ = ntohs(addr.sin_port);
+
+        running_ = true;
+        accept_thread_ = std::thread([this] { acceptLoop(); });
+        return true;
+    }
+
+    void stop() {
+        if (!running_.exchange(false)) {
+            return;
+        }
+        if (accept_thread_.joinable()) {
+            accept_thread_.join();
+        }
+        close(listen_fd_);
+
+        std::vector<std::thread> sessions;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sessions.swap(session_threads_);
+        }
+        for (auto& session : sessions) {
+            if (session.joinable()) {
+                session.join();
+            }
+        }
+        if (ssl_ctx_) {
+            SSL_CTX_free(ssl_ctx_);
+            ssl_ctx_ = nullptr;
+        }
+    }
+
+    int port() const { return port_; }
+
+    size_t connectionCount() const { return connections_; }
+
+    std::vector<Message> messages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return messages_;
+    }
+
+    std::vector<std::string> commands() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return commands_;
+    }
+
+    // Commands that arrived while a further command was already buffered
+    size_t pipelinedCommands() const { return pipelined_; }
+
+    size_t tlsHandshakes() const { return tls_handshakes_; }
+
+    // TLS handshakes that resumed an earlier session
+    size_t tlsResumed() const { return tls_resumed_; }
+
+    size_t countCommands(const std::string& prefix) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return static_cast<size_t>(std::count_if(commands_.begin(), commands_.end(),
+            [&prefix](const std::string& c) { return c.compare(0, prefix.size(), prefix) == 0; }));
+    }
+
+private:
+    struct Connection {
+        int fd;
+        SSL* ssl;
+    };
+
+    static SSL_CTX* makeServerContext() {
+        SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+        EVP_PKEY* key = EVP_EC_gen("P-256");
+        X509* cert = X509_new();
+        if (!ctx || !key || !cert) {
+            SSL_CTX_free(ctx);
+            EVP_PKEY_free(key);
+            X509_free(cert);
+            return nullptr;
+        }
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+        X509_set_pubkey(cert, key);
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                   reinterpret_cast<const unsigned char*>("127.0.0.1"), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+        X509_sign(cert, key, EVP_sha256());
+        SSL_CTX_use_certificate(ctx, cert);
+        SSL_CTX_use_PrivateKey(ctx, key);
+        X509_free(cert);
+        EVP_PKEY_free(key);
+
+        static const unsigned char session_context[] = "fake-smtp";
+        SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+        return ctx;
+    }
+
+    void acceptLoop() {
+        while (running_) {
+            pollfd pfd{listen_fd_, POLLIN, 0};
+            if (poll(&pfd, 1, 50) <= 0) {
+                continue;
+            }
+            int client = accept(listen_fd_, nullptr, nullptr);
+            if (client < 0) {
+                continue;
+            }
+            connections_++;
+            std::lock_guard<std::mutex> lock(mutex_);
+            session_threads_.emplace_back([this, client] { serve(client); });
+        }
+    }
+
+    void reply(Connection& conn, const std::string& text) {
+        if (options_.reply_delay_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(options_.reply_delay_ms));
+        }
+        std::string line = text + "\r\n";
+        if (conn.ssl) {
+            SSL_write(conn.ssl, line.data(), static_cast<int>(line.size()));
+        } else {
+            ::send(conn.fd, line.data(), line.size(), MSG_NOSIGNAL);
+        }
+    }
+
+    // Returns false when the peer disconnected or the server is stopping
+    bool fill(Connection& conn, std::string& buffer) {
+        while (running_) {
+            if (!conn.ssl || SSL_pending(conn.ssl) == 0) {
+                pollfd pfd{conn.fd, POLLIN, 0};
+                int rc = poll(&pfd, 1, 50);
+                if (rc == 0) {
+                    continue;
+                }
+            }
+            char chunk[8192];
+            ssize_t n = conn.ssl ? SSL_read(conn.ssl, chunk, sizeof(chunk))
+                                 : recv(conn.fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+        return false;
+    }
+
+    bool readLine(Connection& conn, std::string& buffer, std::string& line) {
+        size_t eol;
+        while ((eol = buffer.find("\r\n")) == std::string::npos) {
+            if (!fill(conn, buffer)) {
+                return false;
+            }
+        }
+        line = buffer.substr(0, eol);
+        buffer.erase(0, eol + 2);
+        return true;
+    }
+
+    static std::string extractPath(const std::string& command) {
+        size_t open = command.find('<');
+        size_t close_pos = command.find('>', open);
+        if (open == std::string::npos || close_pos == std::string::npos) {
+            return "";
+        }
+        return command.substr(open + 1, close_pos - open - 1);
+    }
+
+    void serve(int fd) {
+        Connection conn{fd, nullptr};
+        std::string buffer;
+        std::string line;
+        Message current;
+        int served = 0;
+
+        reply(conn, "220 fake.smtp.test ESMTP ready");
+
+        while (readLine(conn, buffer, line)) {
+            if (options_.hang_up_after > 0 && served >= options_.hang_up_after) {
+                // As a server's idle timeout firing just as the client writes
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                commands_.push_back(line);
+            }
+            if (buffer.find("\r\n") != std::string::npos) {
+                pipelined_++;
+            }
+
+            std::string upper = line;
+            std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+
+            if (upper.compare(0, 4, "EHLO") == 0) {
+                std::vector<std::string> lines{"250-fake.smtp.test"};
+                for (const auto& ext : options_.extensions) {
+                    lines.push_back("250-" + ext);
+                }
+                lines.back()[3] = ' ';
+                std::string joined;
+                for (size_t i = 0; i < lines.size(); ++i) {
+                    joined += lines[i];
+                    if (i + 1 < lines.size()) {
+                        joined += "\r\n";
+                    }
+                }
+                reply(conn, joined);
+            } else if (upper.compare(0, 4, "HELO") == 0) {
+                reply(conn, "250 fake.smtp.test");
+            } else if (upper.compare(0, 10, "AUTH PLAIN") == 0) {
+                if (upper.size() <= 11) {
+                    // No initial response: ask for the credentials
+                    reply(conn, "334 ");
+                    if (!readLine(conn, buffer, line)) break;
+                }
+                reply(conn, "235 2.7.0 Authentication successful");
+            } else if (upper.compare(0, 10, "AUTH LOGIN") == 0) {
+                reply(conn, "334 VXNlcm5hbWU6");
+                if (!readLine(conn, buffer, line)) break;
+                reply(conn, "334 UGFzc3dvcmQ6");
+                if (!readLine(conn, buffer, line)) break;
+                reply(conn, "235 2.7.0 Authentication successful");
+            } else if (upper.compare(0, 9, "MAIL FROM") == 0) {
+                current = Message();
+                current.from = extractPath(line);
+                reply(conn, "250 2.1.0 Ok");
+            } else if (upper.compare(0, 7, "RCPT TO") == 0) {
+                std::string rcpt = extractPath(line);
+                if (options_.reject_recipients.count(rcpt)) {
+                    reply(conn, "550 5.1.1 <" + rcpt + ">: Recipient address rejected");
+                } else {
+                    current.recipients.push_back(rcpt);
+                    reply(conn, "250 2.1.5 Ok");
+                }
+            } else if (upper == "DATA") {
+                if (current.recipients.empty()) {
+                    reply(conn, "554 5.5.1 No valid recipients");
+                    continue;
+                }
+                reply(conn, "354 End data with <CR><LF>.<CR><LF>");
+                std::string data;
+                bool complete = false;
+                while (readLine(conn, buffer, line)) {
+                    if (line == ".") {
+                        complete = true;
+                        break;
+                    }
+                    if (!line.empty() && line[0] == '.') {
+                        line.erase(0, 1);
+                    }
+                    data += line + "\r\n";
+                }
+                if (!complete) break;
+                current.data = data;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    messages_.push_back(current);
+                }
+                current = Message();
+                served++;
+                if (served == options_.hang_up_on) {
+                    break;
+                }
+                reply(conn, "250 2.0.0 Ok: queued");
+            } else if (upper.compare(0, 4, "BDAT") == 0) {
+                std::string args = line.substr(5);
+                size_t length = std::stoul(args);
+                bool last = upper.find("LAST") != std::string::npos;
+                while (buffer.size() < length) {
+                    if (!fill(conn, buffer)) break;
+                }
+                if (buffer.size() < length) break;
+                current.data += buffer.substr(0, length);
+                buffer.erase(0, length);
+                if (last) {
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        messages_.push_back(current);
+                    }
+                    current = Message();
+                    served++;
+                    if (served == options_.hang_up_on) {
+                        break;
+                    }
+                    reply(conn, "250 2.0.0 Ok: queued");
+                } else {
+                    reply(conn, "250 2.0.0 " + std::to_string(length) + " octets received");
+                }
+            } else if (upper == "STARTTLS" && ssl_ctx_ && !conn.ssl) {
+                reply(conn, "220 2.0.0 Ready to start TLS");
+                buffer.clear();
+                conn.ssl = SSL_new(ssl_ctx_);
+                // A client that hangs up early must not SIGPIPE the test binary
+                ssmtp_mailer::TLSContextManager::getInstance().attachSocket(conn.ssl, fd);
+                if (SSL_accept(conn.ssl) != 1) break;
+                tls_handshakes_++;
+                if (SSL_session_reused(conn.ssl)) {
+                    tls_resumed_++;
+                }
+            } else if (upper == "RSET") {
+                current = Message();
+                reply(conn, "250 2.0.0 Ok");
+            } else if (upper == "NOOP") {
+                reply(conn, "250 2.0.0 Ok");
+            } else if (upper == "QUIT") {
+                reply(conn, "221 2.0.0 Bye");
+                break;
+            } else {
+                reply(conn, "502 5.5.2 Command not recognized");
+            }
+        }
+        if (conn.ssl) {
+            SSL_shutdown(conn.ssl);
+            SSL_free(conn.ssl);
+        }
+        close(fd);
+    }
+
+    Options options_;
+    int listen_fd_;
+    int port_;
+    std::atomic<bool> running_;
+    std::atomic<size_t> connections_;
+    std::atomic<size_t> pipelined_;
+    std::atomic<size_t> tls_handshakes_;
+    std::atomic<size_t> tls_resumed_;
+    SSL_CTX* ssl_ctx_;
+    std::thread accept_thread_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::thread> session_threads_;
+    std::vector<Message> messages_;
+    std::vector<std::string> commands_;
+};
+
+} // namespace ssmtp_test
@@ -0,0 +1,163 @@
+#include <gtest/gtest.h>
+#include "core/smtp/body_canonicalizer.hpp"
+#include "core/smtp/mime_stream.hpp"
+#include <random>
+#include <string>
+#include <vector>
+
+using ssmtp_mailer::BodyCanonicalizer;
+
+namespace {
+
+/**
+ * @brief Run input through a canonicalizer in blocks of block_size bytes
+ */
+std::string canonicalize(BodyCanonicalizer& canonicalizer, const std::string& input, size_t block_size) {
+    std::string output;
+    for (size_t offset = 0; offset < input.size(); offset += block_size) {
+        size_t length = std::min(block_size, input.size() - offset);
+        std::vector<char> buffer(canonicalizer.maxOutput(length));
+        size_t written = canonicalizer.transform(input.data() + offset, length, buffer.data());
+        EXPECT_LE(written, buffer.size());
+        output.append(buffer.data(), written);
+    }
+    return output;
+}
+
+/**
+ * @brief Straightforward per-byte reference of the same transform
+ */
+std::string reference(const std::string& input, bool dot_stuff, size_t max_line_length) {
+    std::string output;
+    bool at_line_start = true;
+    bool after_cr = false;
+    size_t line_length = 0;
+    for (char c : input) {
+        if (c == '\n' || c == '\r') {
+            if (c == '\r' || !after_cr) {
+                output += "\r\n";
+            }
+            after_cr = c == '\r';
+            at_line_start = true;
+            line_length = 0;
+            continue;
+        }
+        after_cr = false;
+        if (max_line_length > 0 && line_length == max_line_length) {
+            output += "\r\n";
+            at_line_start = true;
+            line_length = 0;
+        }
+        if (at_line_start && dot_stuff && c == '.') {
+            output += '.';
+            line_length++;
+        }
+        output += c;
+        line_length++;
+        at_line_start = false;
+    }
+    return output;
+}
+
+} // namespace
+
+// Test 1: Bare LF, bare CR and CRLF all become CRLF, even when split between blocks
+TEST(BodyCanonicalizerTest, NormalizesLineEndingsAcrossBlocks) {
+    std::string input = "one\ntwo\rthree\r\nfour\r\r\nfive";
+    std::string expected = "one\r\ntwo\r\nthree\r\nfour\r\n\r\nfive";
+
+    for (size_t block = 1; block <= input.size(); ++block) {
+        BodyCanonicalizer canonicalizer(false);
+        EXPECT_EQ(canonicalize(canonicalizer, input, block), expected) << "block size " << block;
+        EXPECT_FALSE(canonicalizer.atLineStart());
+    }
+}
+
+// Test 2: Lines starting with '.' are stuffed only for DATA
+TEST(BodyCanonicalizerTest, DotStuffsLineStarts) {
+    std::string input = ".\n..x\na.b\r\n.";
+
+    BodyCanonicalizer stuffed(true);
+    EXPECT_EQ(canonicalize(stuffed, input, input.size()), "..\r\n...x\r\na.b\r\n..");
+
+    BodyCanonicalizer plain(false);
+    EXPECT_EQ(canonicalize(plain, input, input.size()), ".\r\n..x\r\na.b\r\n.");
+}
+
+// Test 3: Lines over 998 octets are broken, counting a stuffed dot
+TEST(BodyCanonicalizerTest, BreaksLongLines) {
+    std::string input = "." + std::string(2500, 'a') + "\nshort";
+
+    BodyCanonicalizer canonicalizer(true);
+    std::string output = canonicalize(canonicalizer, input, 100);
+    EXPECT_EQ(output, reference(input, true, BodyCanonicalizer::kMaxLineLength));
+
+    size_t start = 0;
+    size_t end;
+    while ((end = output.find("\r\n", start)) != std::string::npos) {
+        EXPECT_LE(end - start, BodyCanonicalizer::kMaxLineLength);
+        start = end + 2;
+    }
+    EXPECT_EQ(output.substr(0, 2), "..");
+    EXPECT_EQ(output.substr(998, 2), "\r\n");
+}
+
+// Test 4: The vector scan matches the per-byte reference on random input
+TEST(BodyCanonicalizerTest, MatchesReferenceOnRandomInput) {
+    std::mt19937 rng(1234);
+    const char alphabet[] = {'a', 'b', '.', ' ', '\r', '\n'};
+    std::discrete_distribution<int> pick({40, 40, 5, 10, 2, 3});
+    std::uniform_int_distribution<size_t> block(1, 300);
+
+    for (int round = 0; round < 50; ++round) {
+        std::string input;
+        for (int i = 0; i < 5000; ++i) {
+            input += alphabet[pick(rng)];
+        }
+        bool dot_stuff = round % 2 == 0;
+        size_t max_line_length = round % 3 == 0 ? 0 : 40 + round;
+
+        BodyCanonicalizer canonicalizer(dot_stuff, max_line_length);
+        std::string output;
+        size_t offset = 0;
+        while (offset < input.size()) {
+            size_t length = std::min(block(rng), input.size() - offset);
+            output += canonicalize(canonicalizer, input.substr(offset, length), length);
+            offset += length;
+        }
+        ASSERT_EQ(output, reference(input, dot_stuff, max_line_length)) << "round " << round;
+    }
+}
+
+// Test 5: Long recipient lists are folded rather than written as one line
+TEST(BodyCanonicalizerTest, MessageFoldsAddressHeaders) {
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    for (int i = 0; i < 20; ++i) {
+        email.to.push_back("recipient" + std::to_string(i) + "@example.test");
+    }
+    email.subject = "Folding";
+    email.body = std::string(3000, 'x');
+
+    ssmtp_mailer::MimeMessageStream message(email, "<id@example.test>", "Thu, 1 Jan 2026 00:00:00 +0000", true);
+    std::string output;
+    char buffer[512];
+    size_t length;
+    while ((length = message.read(buffer, sizeof(buffer))) > 0) {
+        output.append(buffer, length);
+    }
+
+    size_t to = output.find("To: ");
+    ASSERT_NE(to, std::string::npos);
+    EXPECT_NE(output.find("\r\n recipient", to), std::string::npos);
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_NE(output.find("recipient" + std::to_string(i) + "@example.test"), std::string::npos);
+    }
+
+    size_t start = 0;
+    size_t end;
+    while ((end = output.find("\r\n", start)) != std::string::npos) {
+        EXPECT_LE(end - start, 998u);
+        start = end + 2;
+    }
+}
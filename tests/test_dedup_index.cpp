@@ -0,0 +1,158 @@
+#include <gtest/gtest.h>
+#include "core/queue/dedup_index.hpp"
+#include "core/queue/email_queue.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+using Clock = std::chrono::system_clock;
+
+Clock::time_point at(int seconds) {
+    return Clock::time_point(std::chrono::hours(24 * 365 * 50) + std::chrono::seconds(seconds));
+}
+
+DedupIndexOptions options(size_t exact_keys) {
+    DedupIndexOptions result;
+    result.window = std::chrono::seconds(400);
+    result.exact_keys = exact_keys;
+    result.filter_keys = 4000;
+    result.false_positive_rate = 0.001;
+    return result;
+}
+
+Email keyed(const std::string& key) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "Notification";
+    email.body = "Hello";
+    email.idempotency_key = key;
+    return email;
+}
+
+} // namespace
+
+// Test 1: Keys held exactly turn away repeats until forgotten or out of the window
+TEST(DedupIndexTest, ExactKeysWithinWindow) {
+    DedupIndex index(options(100));
+    EXPECT_TRUE(index.admit("order-1", at(0)));
+    EXPECT_TRUE(index.admit("order-2", at(10)));
+    EXPECT_FALSE(index.admit("order-1", at(20)));
+    EXPECT_FALSE(index.admit("order-2", at(399)));
+
+    index.forget("order-2");
+    EXPECT_TRUE(index.admit("order-2", at(30)));
+
+    // order-1 leaves the window; order-2 was seen again later and stays
+    EXPECT_TRUE(index.admit("order-1", at(400)));
+    EXPECT_FALSE(index.admit("order-2", at(420)));
+
+    QueueDedupStats stats = index.getStats();
+    EXPECT_EQ(stats.checked, 7u);
+    EXPECT_EQ(stats.exact_hits, 3u);
+    EXPECT_EQ(stats.filter_hits, 0u);
+    EXPECT_EQ(stats.expired, 1u);
+    EXPECT_EQ(stats.spilled, 0u);
+    EXPECT_EQ(stats.remembered, 2u);
+}
+
+// Test 2: Keys beyond the exact set spill into the filters, which remember them for the window
+TEST(DedupIndexTest, FiltersHoldTheLongTail) {
+    DedupIndex index(options(50));
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(index.admit("key-" + std::to_string(i), at(i / 10))) << i;
+    }
+    QueueDedupStats stats = index.getStats();
+    EXPECT_EQ(stats.remembered, 50u);
+    EXPECT_EQ(stats.spilled, 950u);
+
+    // No false negatives within the window
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_FALSE(index.admit("key-" + std::to_string(i), at(200))) << i;
+    }
+    stats = index.getStats();
+    EXPECT_EQ(stats.exact_hits, 50u);
+    EXPECT_EQ(stats.filter_hits, 950u);
+
+    // Few new keys are mistaken for old ones
+    size_t false_hits = 0;
+    for (int i = 0; i < 2000; ++i) {
+        false_hits += !index.admit("new-" + std::to_string(i), at(200));
+    }
+    EXPECT_LT(false_hits, 20u);
+
+    // A window and a quarter later the filters have rotated out
+    EXPECT_TRUE(index.admit("key-0", at(100 + 500)));
+}
+
+// Test 3: The queue drops resubmissions before they take room or reach the sender
+TEST(DedupIndexTest, QueueDropsDuplicates) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setMaxQueueSize(2);
+    std::atomic<int> sent(0);
+    queue.setSendCallback([&](const Email*) {
+        sent++;
+        return SMTPResult::createSuccess("sent");
+    });
+
+    EXPECT_EQ(queue.enqueue(keyed("a")), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(keyed("a")), EnqueueResult::DUPLICATE);
+    Email copy = keyed("a");
+    EXPECT_EQ(queue.enqueue(&copy), EnqueueResult::DUPLICATE);
+    EXPECT_EQ(queue.enqueue(keyed("")), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(keyed("")), EnqueueResult::QUEUE_FULL);
+
+    // Turned away for room, so a retry of it is not a duplicate
+    EXPECT_EQ(queue.enqueue(keyed("b")), EnqueueResult::QUEUE_FULL);
+    std::future<EnqueueResult> b = queue.enqueueAsync(keyed("b"), EmailPriority::NORMAL,
+                                                      std::chrono::seconds(10));
+    std::future<EnqueueResult> again = queue.enqueueAsync(keyed("b"), EmailPriority::NORMAL,
+                                                          std::chrono::seconds(10));
+    ASSERT_EQ(again.wait_for(std::chrono::seconds(0)), std::future_status::ready);
+    EXPECT_EQ(again.get(), EnqueueResult::DUPLICATE);
+
+    queue.start();
+    ASSERT_EQ(b.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    EXPECT_EQ(b.get(), EnqueueResult::ACCEPTED);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (sent < 3 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    queue.stop();
+    EXPECT_EQ(sent, 3);
+
+    // Sent keys are still remembered
+    EXPECT_EQ(queue.enqueue(keyed("a")), EnqueueResult::DUPLICATE);
+    QueueDedupStats stats = queue.getDedupStats();
+    EXPECT_EQ(stats.exact_hits, 4u);
+    EXPECT_EQ(stats.remembered, 2u);
+}
+
+// Test 4: Keys of spooled emails are remembered across a restart
+TEST(DedupIndexTest, KeysSurviveSpoolRecovery) {
+    std::string directory = ::testing::TempDir() + "ssmtp_dedup_" + std::to_string(getpid());
+    std::filesystem::remove_all(directory);
+    QueueSpoolOptions spool_options;
+    spool_options.directory = directory;
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(spool_options));
+        EXPECT_EQ(queue.enqueue(keyed("persisted")), EnqueueResult::ACCEPTED);
+    }
+
+    EmailQueue queue;
+    ASSERT_TRUE(queue.enableSpool(spool_options));
+    std::vector<QueueItem> pending = queue.getPendingEmails();
+    ASSERT_EQ(pending.size(), 1u);
+    EXPECT_EQ(pending[0].idempotency_key, "persisted");
+    EXPECT_EQ(queue.enqueue(keyed("persisted")), EnqueueResult::DUPLICATE);
+    EXPECT_EQ(queue.enqueue(keyed("fresh")), EnqueueResult::ACCEPTED);
+    std::filesystem::remove_all(directory);
+}
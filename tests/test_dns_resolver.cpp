@@ -0,0 +1,669 @@
+#include <gtest/gtest.h>
+#include "core/smtp/dns_resolver.hpp"
+#include "core/smtp/smtp_client.hpp"
+#include "core/smtp/smtp_event_loop.hpp"
+#include "core/config/config_manager.hpp"
+#include "core/queue/email_queue.hpp"
+#include "fake_dns_server.hpp"
+#include "fake_smtp_server.hpp"
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <thread>
+
+class DNSResolverTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ssmtp_test::FakeDNSServer::Record mx;
+        mx.a = {"127.0.0.1", "127.0.0.2"};
+        mx.aaaa = {"::1"};
+        mx.ttl = 300;
+        options_.records["mx.example.test"] = mx;
+
+        ssmtp_test::FakeDNSServer::Record relay;
+        relay.a = {"127.0.0.1"};
+        options_.records["relay.example.test"] = relay;
+
+        ssmtp_test::FakeDNSServer::Record volatile_record;
+        volatile_record.a = {"127.0.0.3"};
+        volatile_record.ttl = 0;
+        options_.records["volatile.example.test"] = volatile_record;
+    }
+
+    void TearDown() override {
+        resolver().setOptions(ssmtp_mailer::DNSResolverOptions());
+    }
+
+    void useServer(const ssmtp_test::FakeDNSServer& server) {
+        ssmtp_mailer::DNSResolverOptions options;
+        options.nameservers = {server.address()};
+        options.hosts_file.clear();
+        options.timeout = std::chrono::milliseconds(200);
+        resolver().setOptions(options);
+    }
+
+    static ssmtp_mailer::DNSResolver& resolver() {
+        return ssmtp_mailer::DNSResolver::getInstance();
+    }
+
+    ssmtp_test::FakeDNSServer::Options options_;
+};
+
+// Test 1: A and AAAA answers are interleaved, IPv6 first, with the port filled in
+TEST_F(DNSResolverTest, ResolvesInHappyEyeballsOrder) {
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(dns.start());
+    useServer(dns);
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("MX.example.test.", 25, addresses, error)) << error;
+
+    ASSERT_EQ(addresses.size(), 3u);
+    EXPECT_EQ(addresses[0].toString(), "::1");
+    EXPECT_EQ(addresses[1].toString(), "127.0.0.1");
+    EXPECT_EQ(addresses[2].toString(), "127.0.0.2");
+    EXPECT_EQ(ntohs(reinterpret_cast<const sockaddr_in*>(&addresses[1].address)->sin_port), 25);
+    EXPECT_EQ(dns.queryCount(), 2u);
+}
+
+// Test 2: Answers are served from the cache until their TTL runs out
+TEST_F(DNSResolverTest, CachesPositiveAnswers) {
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(dns.start());
+    useServer(dns);
+    auto before = resolver().getStats();
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("mx.example.test", 25, addresses, error));
+    ASSERT_TRUE(resolver().resolve("mx.example.test", 587, addresses, error));
+    EXPECT_EQ(dns.queryCount(), 2u);
+    EXPECT_EQ(ntohs(reinterpret_cast<const sockaddr_in6*>(&addresses[0].address)->sin6_port), 587);
+
+    // A zero TTL is never cached
+    ASSERT_TRUE(resolver().resolve("volatile.example.test", 25, addresses, error));
+    ASSERT_TRUE(resolver().resolve("volatile.example.test", 25, addresses, error));
+    EXPECT_EQ(dns.queryCount(), 6u);
+
+    auto after = resolver().getStats();
+    EXPECT_EQ(after.hits - before.hits, 1u);
+    EXPECT_EQ(after.misses - before.misses, 3u);
+    EXPECT_EQ(after.cached_entries, 1u);
+
+    ssmtp_mailer::DNSResolverStats delta;
+    delta.hits = after.hits - before.hits;
+    delta.misses = after.misses - before.misses;
+    EXPECT_DOUBLE_EQ(delta.hitRate(), 0.25);
+}
+
+// Test 3: NXDOMAIN is cached for the SOA minimum
+TEST_F(DNSResolverTest, CachesNegativeAnswers) {
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(dns.start());
+    useServer(dns);
+    size_t negative_hits = resolver().getStats().negative_hits;
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    EXPECT_FALSE(resolver().resolve("missing.example.test", 25, addresses, error));
+    EXPECT_NE(error.find("host not found"), std::string::npos);
+    EXPECT_FALSE(resolver().resolve("missing.example.test", 25, addresses, error));
+
+    EXPECT_EQ(dns.queryCount(), 2u);
+    EXPECT_EQ(resolver().getStats().negative_hits - negative_hits, 1u);
+}
+
+// Test 4: An unresponsive nameserver is skipped after the timeout
+TEST_F(DNSResolverTest, FailsOverToNextNameserver) {
+    ssmtp_test::FakeDNSServer::Options silent_options;
+    silent_options.silent = true;
+    ssmtp_test::FakeDNSServer silent(silent_options);
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(silent.start());
+    ASSERT_TRUE(dns.start());
+
+    ssmtp_mailer::DNSResolverOptions options;
+    options.nameservers = {silent.address(), dns.address()};
+    options.hosts_file.clear();
+    options.timeout = std::chrono::milliseconds(100);
+    resolver().setOptions(options);
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("relay.example.test", 25, addresses, error)) << error;
+    EXPECT_EQ(silent.queryCount(), 2u);
+    EXPECT_EQ(dns.queryCount(), 2u);
+
+    // With no nameserver answering the lookup fails and nothing is cached
+    silent.stop();
+    options.nameservers = {"127.0.0.1:" + std::to_string(silent.port())};
+    options.attempts = 1;
+    resolver().setOptions(options);
+    EXPECT_FALSE(resolver().resolve("relay.example.test", 25, addresses, error));
+    EXPECT_EQ(resolver().getStats().cached_entries, 0u);
+}
+
+// Test 5: The hosts file answers before DNS
+TEST_F(DNSResolverTest, UsesHostsFile) {
+    std::string path = ::testing::TempDir() + "ssmtp_hosts";
+    {
+        std::ofstream hosts(path);
+        hosts << "# comment\n127.0.0.9   relay.local  alias.local # trailing\n::1 relay.local\n";
+    }
+
+    ssmtp_mailer::DNSResolverOptions options;
+    options.nameservers = {"127.0.0.1:9"};
+    options.hosts_file = path;
+    resolver().setOptions(options);
+    size_t queries = resolver().getStats().queries;
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("alias.local", 25, addresses, error)) << error;
+    ASSERT_EQ(addresses.size(), 1u);
+    EXPECT_EQ(addresses[0].toString(), "127.0.0.9");
+
+    ASSERT_TRUE(resolver().resolve("relay.local", 25, addresses, error));
+    ASSERT_EQ(addresses.size(), 2u);
+    EXPECT_EQ(addresses[0].toString(), "::1");
+    EXPECT_EQ(resolver().getStats().queries, queries);
+    std::remove(path.c_str());
+}
+
+// Test 6: SMTPClient and SMTPEventLoop connect through the resolver, falling back from
+// the refused IPv6 address to IPv4
+TEST_F(DNSResolverTest, TransportsUseResolver) {
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp;
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+    useServer(dns);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig domain;
+    domain.name = "example.test";
+    domain.smtp_server = "mx.example.test";
+    domain.smtp_port = smtp.port();
+    domain.auth_method = "NONE";
+    domain.use_ssl = false;
+    domain.use_starttls = false;
+    config.setDomainConfig(domain);
+
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@remote.test"};
+    email.subject = "Resolved";
+    email.body = "Hello";
+
+    ssmtp_mailer::SMTPClient client(config);
+    auto result = client.send(email);
+    ASSERT_TRUE(result.success) << result.error_message;
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+    resolver().clearCache();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    loop.submit(email, [&](const ssmtp_mailer::SMTPResult& r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = r;
+        done = true;
+        cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; }));
+    }
+    EXPECT_TRUE(result.success) << result.error_message;
+
+    EXPECT_EQ(smtp.messages().size(), 2u);
+    EXPECT_EQ(dns.queryCount(), 4u);
+}
+
+// Test 7: MX answers are sorted by preference and cached; domains without MX
+// records are their own exchanger, null MX and NXDOMAIN fail
+TEST_F(DNSResolverTest, LooksUpMailExchangers) {
+    ssmtp_test::FakeDNSServer::Record mail;
+    mail.mx = {{20, "mx2.mail.test"}, {10, "mx1.mail.test"}, {10, "mail.test"}};
+    options_.records["mail.test"] = mail;
+    ssmtp_test::FakeDNSServer::Record bare;
+    bare.a = {"127.0.0.1"};
+    options_.records["bare.test"] = bare;
+    ssmtp_test::FakeDNSServer::Record nomail;
+    nomail.mx = {{0, ""}};
+    options_.records["nomail.test"] = nomail;
+
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(dns.start());
+    useServer(dns);
+
+    std::vector<ssmtp_mailer::MXRecord> exchanges;
+    std::string error;
+    ASSERT_TRUE(resolver().resolveMX("Mail.Test", exchanges, error)) << error;
+    ASSERT_EQ(exchanges.size(), 3u);
+    EXPECT_EQ(exchanges[0].exchange, "mail.test");
+    EXPECT_EQ(exchanges[1].exchange, "mx1.mail.test");
+    EXPECT_EQ(exchanges[2].exchange, "mx2.mail.test");
+    EXPECT_EQ(exchanges[2].preference, 20);
+
+    ASSERT_TRUE(resolver().resolveMX("mail.test", exchanges, error));
+    EXPECT_EQ(exchanges.size(), 3u);
+    EXPECT_EQ(dns.queryCount(), 1u);
+
+    ASSERT_TRUE(resolver().resolveMX("bare.test", exchanges, error)) << error;
+    ASSERT_EQ(exchanges.size(), 1u);
+    EXPECT_EQ(exchanges[0].exchange, "bare.test");
+
+    EXPECT_FALSE(resolver().resolveMX("nomail.test", exchanges, error));
+    EXPECT_NE(error.find("null MX"), std::string::npos);
+    EXPECT_FALSE(resolver().resolveMX("nomail.test", exchanges, error));
+    EXPECT_NE(error.find("null MX"), std::string::npos);
+
+    EXPECT_FALSE(resolver().resolveMX("missing.test", exchanges, error));
+    EXPECT_NE(error.find("domain not found"), std::string::npos);
+
+    ASSERT_TRUE(resolver().resolveMX("[127.0.0.1]", exchanges, error)) << error;
+    ASSERT_EQ(exchanges.size(), 1u);
+    EXPECT_EQ(exchanges[0].exchange, "127.0.0.1");
+    EXPECT_EQ(dns.queryCount(), 4u);
+}
+
+// Test 8: Direct-to-MX delivery folds recipients that share exchangers into one
+// transaction, fails over to a backup MX and reuses sessions per MX host
+TEST_F(DNSResolverTest, DeliversDirectToMX) {
+    ssmtp_test::FakeDNSServer::Record sink;
+    sink.a = {"127.0.0.1"};
+    options_.records["mx.sink.test"] = sink;
+    ssmtp_test::FakeDNSServer::Record dead;
+    dead.a = {"127.0.0.5"};  // Nothing listens there
+    options_.records["dead.sink.test"] = dead;
+    ssmtp_test::FakeDNSServer::Record shared;
+    shared.mx = {{10, "mx.sink.test"}};
+    options_.records["alpha.test"] = shared;
+    options_.records["beta.test"] = shared;
+    ssmtp_test::FakeDNSServer::Record backup;
+    backup.mx = {{10, "dead.sink.test"}, {20, "mx.sink.test"}};
+    options_.records["gamma.test"] = backup;
+
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp;
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+    useServer(dns);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig domain;
+    domain.name = "example.test";
+    domain.delivery_mode = "mx";
+    domain.smtp_port = smtp.port();
+    domain.auth_method = "PLAIN";
+    domain.username = "relay-user";
+    domain.password = "secret";
+    config.setDomainConfig(domain);
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+
+    auto send = [&loop](const ssmtp_mailer::Email& email) {
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool done = false;
+        ssmtp_mailer::SMTPResult result;
+        loop.submit(email, [&](const ssmtp_mailer::SMTPResult& r) {
+            std::lock_guard<std::mutex> lock(mutex);
+            result = r;
+            done = true;
+            cv.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; });
+        return result;
+    };
+
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    email.to = {"a@alpha.test", "c@gamma.test"};
+    email.cc = {"b@Beta.test"};
+    email.subject = "Direct";
+    email.body = "Hello";
+
+    auto result = send(email);
+    ASSERT_TRUE(result.success) << result.error_message;
+
+    auto messages = smtp.messages();
+    ASSERT_EQ(messages.size(), 2u);
+    std::vector<std::string> folded = {"a@alpha.test", "b@Beta.test"};
+    std::vector<std::string> single = {"c@gamma.test"};
+    EXPECT_TRUE((messages[0].recipients == folded && messages[1].recipients == single) ||
+                (messages[0].recipients == single && messages[1].recipients == folded));
+    // Both copies carry the same Message-ID, and no credentials went to the MX
+    EXPECT_NE(messages[0].data.find(result.message_id), std::string::npos);
+    EXPECT_NE(messages[1].data.find(result.message_id), std::string::npos);
+    for (const auto& command : smtp.commands()) {
+        EXPECT_EQ(command.find("AUTH"), std::string::npos);
+    }
+
+    // The next message to the same MX rides on a parked session
+    size_t connections = smtp.connectionCount();
+    email.to = {"d@alpha.test"};
+    email.cc.clear();
+    result = send(email);
+    ASSERT_TRUE(result.success) << result.error_message;
+    EXPECT_EQ(smtp.connectionCount(), connections);
+
+    // Unknown recipient domains fail without touching the others
+    email.to = {"e@alpha.test", "f@missing.test"};
+    result = send(email);
+    EXPECT_FALSE(result.success);
+    EXPECT_NE(result.error_message.find("Delivered to 1 of 2"), std::string::npos) << result.error_message;
+    EXPECT_NE(result.error_message.find("missing.test"), std::string::npos);
+    EXPECT_EQ(smtp.messages().size(), 4u);
+}
+
+// Test 9: MX lookups run on the event loop: submit() returns at once while the
+// first nameserver times out, and mail through a relay goes out meanwhile
+TEST_F(DNSResolverTest, LooksUpMailExchangersWithoutBlocking) {
+    ssmtp_test::FakeDNSServer::Record sink;
+    sink.a = {"127.0.0.1"};
+    options_.records["mx.sink.test"] = sink;
+    ssmtp_test::FakeDNSServer::Record remote;
+    remote.mx = {{10, "mx.sink.test"}};
+    options_.records["remote.test"] = remote;
+
+    ssmtp_test::FakeDNSServer::Options silent_options;
+    silent_options.silent = true;
+    ssmtp_test::FakeDNSServer silent(silent_options);
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp;
+    ASSERT_TRUE(silent.start());
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+
+    ssmtp_mailer::DNSResolverOptions options;
+    options.nameservers = {silent.address(), dns.address()};
+    options.hosts_file.clear();
+    options.timeout = std::chrono::milliseconds(400);
+    resolver().setOptions(options);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig direct;
+    direct.name = "example.test";
+    direct.delivery_mode = "mx";
+    direct.smtp_port = smtp.port();
+    config.setDomainConfig(direct);
+    ssmtp_mailer::DomainConfig relay;
+    relay.name = "relay.test";
+    relay.smtp_server = "127.0.0.1";
+    relay.smtp_port = smtp.port();
+    relay.auth_method = "NONE";
+    relay.use_ssl = false;
+    relay.use_starttls = false;
+    config.setDomainConfig(relay);
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> finished;
+    std::vector<ssmtp_mailer::SMTPResult> results;
+    auto submit = [&](const ssmtp_mailer::Email& email) {
+        return loop.submit(email, [&, email](const ssmtp_mailer::SMTPResult& r) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.push_back(email.subject);
+            results.push_back(r);
+            cv.notify_one();
+        });
+    };
+
+    ssmtp_mailer::Email direct_email;
+    direct_email.from = "sender@example.test";
+    direct_email.to = {"rcpt@remote.test"};
+    direct_email.subject = "Direct";
+    direct_email.body = "Hello";
+    ssmtp_mailer::Email relay_email = direct_email;
+    relay_email.from = "sender@relay.test";
+    relay_email.subject = "Relayed";
+
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_TRUE(submit(direct_email));
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200));
+    ASSERT_TRUE(submit(relay_email));
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return finished.size() == 2; }));
+    }
+    EXPECT_EQ(finished[0], "Relayed");
+    EXPECT_EQ(finished[1], "Direct");
+    EXPECT_TRUE(results[0].success) << results[0].error_message;
+    EXPECT_TRUE(results[1].success) << results[1].error_message;
+    EXPECT_EQ(smtp.messages().size(), 2u);
+    EXPECT_GE(silent.queryCount(), 1u);
+}
+
+// Test 10: STARTTLS to an exchanger is opportunistic: a self-signed certificate
+// does not stop delivery, even with ssl_verify_peer on for the domain
+TEST_F(DNSResolverTest, AcceptsUnverifiedCertificateFromMX) {
+    ssmtp_test::FakeDNSServer::Record sink;
+    sink.a = {"127.0.0.1"};
+    options_.records["mx.sink.test"] = sink;
+    ssmtp_test::FakeDNSServer::Record remote;
+    remote.mx = {{10, "mx.sink.test"}};
+    options_.records["remote.test"] = remote;
+
+    ssmtp_test::FakeSMTPServer::Options smtp_options;
+    smtp_options.starttls = true;
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp(smtp_options);
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+    useServer(dns);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig domain;
+    domain.name = "example.test";
+    domain.delivery_mode = "mx";
+    domain.smtp_port = smtp.port();
+    domain.ssl_verify_peer = true;
+    config.setDomainConfig(domain);
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@remote.test"};
+    email.subject = "Encrypted";
+    email.body = "Hello";
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    ssmtp_mailer::SMTPResult result;
+    loop.submit(email, [&](const ssmtp_mailer::SMTPResult& r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = r;
+        done = true;
+        cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; }));
+    }
+    ASSERT_TRUE(result.success) << result.error_message;
+    ASSERT_EQ(smtp.messages().size(), 1u);
+    EXPECT_EQ(smtp.countCommands("STARTTLS"), 1u);
+}
+
+// Test 11: Short host names are tried under the resolv.conf search list,
+// while a name with a trailing dot is taken as it is
+TEST_F(DNSResolverTest, AppliesSearchListToShortNames) {
+    ssmtp_test::FakeDNSServer::Record relay;
+    relay.a = {"127.0.0.4"};
+    options_.records["mailrelay.corp.test"] = relay;
+    ssmtp_test::FakeDNSServer dns(options_);
+    ASSERT_TRUE(dns.start());
+
+    std::string path = ::testing::TempDir() + "dns_resolver_search.conf";
+    {
+        std::ofstream resolv(path);
+        resolv << "nameserver " << dns.address() << "\n"
+               << "domain ignored.test\n"
+               << "search other.test corp.test\n"
+               << "options ndots:1 timeout:1\n";
+    }
+    ssmtp_mailer::DNSResolverOptions options;
+    options.resolv_conf = path;
+    options.hosts_file.clear();
+    options.timeout = std::chrono::milliseconds(200);
+    resolver().setOptions(options);
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("mailrelay", 25, addresses, error)) << error;
+    ASSERT_EQ(addresses.size(), 1u);
+    EXPECT_EQ(addresses[0].toString(), "127.0.0.4");
+    EXPECT_EQ(dns.queryCount(), 4u);
+
+    EXPECT_FALSE(resolver().resolve("mailrelay.", 25, addresses, error));
+    EXPECT_NE(error.find("host not found"), std::string::npos);
+    EXPECT_EQ(dns.queryCount(), 6u);
+    std::remove(path.c_str());
+}
+
+// Test 12: A truncated UDP answer is asked for again over TCP, both by the
+// blocking resolve() and by a lookup running on the event loop
+TEST_F(DNSResolverTest, RetriesTruncatedAnswersOverTCP) {
+    options_.truncate = true;
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp;
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+    useServer(dns);
+
+    std::vector<ssmtp_mailer::ResolvedAddress> addresses;
+    std::string error;
+    ASSERT_TRUE(resolver().resolve("mx.example.test", 25, addresses, error)) << error;
+    ASSERT_EQ(addresses.size(), 3u);
+    EXPECT_EQ(addresses[0].toString(), "::1");
+    EXPECT_EQ(dns.tcpQueryCount(), 2u);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig domain;
+    domain.name = "example.test";
+    domain.smtp_server = "relay.example.test";
+    domain.smtp_port = smtp.port();
+    domain.auth_method = "NONE";
+    domain.use_ssl = false;
+    domain.use_starttls = false;
+    config.setDomainConfig(domain);
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@remote.test"};
+    email.subject = "Truncated";
+    email.body = "Hello";
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    ssmtp_mailer::SMTPResult result;
+    loop.submit(email, [&](const ssmtp_mailer::SMTPResult& r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = r;
+        done = true;
+        cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; }));
+    }
+    EXPECT_TRUE(result.success) << result.error_message;
+    EXPECT_EQ(smtp.messages().size(), 1u);
+    EXPECT_EQ(dns.tcpQueryCount(), 4u);
+}
+
+// Test 13: A message split over several MX routes is retried only for the
+// recipients that did not get it, and a domain that does not exist fails it
+// for good
+TEST_F(DNSResolverTest, RetriesOnlyUndeliveredRecipients) {
+    ssmtp_test::FakeDNSServer::Record sink;
+    sink.a = {"127.0.0.1"};
+    options_.records["mx.sink.test"] = sink;
+    ssmtp_test::FakeDNSServer::Record dead;
+    dead.a = {"127.0.0.5"};  // Nothing listens there
+    options_.records["dead.sink.test"] = dead;
+    ssmtp_test::FakeDNSServer::Record remote;
+    remote.mx = {{10, "mx.sink.test"}};
+    options_.records["remote.test"] = remote;
+    ssmtp_test::FakeDNSServer::Record down;
+    down.mx = {{10, "dead.sink.test"}};
+    options_.records["down.test"] = down;
+
+    ssmtp_test::FakeDNSServer dns(options_);
+    ssmtp_test::FakeSMTPServer smtp;
+    ASSERT_TRUE(dns.start());
+    ASSERT_TRUE(smtp.start());
+    useServer(dns);
+
+    ssmtp_mailer::ConfigManager config;
+    ssmtp_mailer::DomainConfig domain;
+    domain.name = "example.test";
+    domain.delivery_mode = "mx";
+    domain.smtp_port = smtp.port();
+    config.setDomainConfig(domain);
+
+    ssmtp_mailer::SMTPEventLoop loop(config);
+    ASSERT_TRUE(loop.start());
+    ssmtp_mailer::EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setAsyncSendCallback([&loop](std::shared_ptr<const ssmtp_mailer::Email> email,
+                                       ssmtp_mailer::EmailQueue::CompletionCallback done) {
+        loop.submit(std::move(email), std::move(done));
+    });
+
+    auto waitFor = [](const std::function<bool()>& predicate) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (!predicate() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return predicate();
+    };
+
+    ssmtp_mailer::Email email;
+    email.from = "sender@example.test";
+    email.to = {"a@remote.test", "b@down.test"};
+    email.subject = "Split";
+    email.body = "Hello";
+    queue.enqueue(&email);
+    queue.start();
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalRetries() == 1; }));
+
+    ASSERT_EQ(smtp.messages().size(), 1u);
+    EXPECT_EQ(smtp.messages()[0].recipients, std::vector<std::string>{"a@remote.test"});
+    ssmtp_mailer::QueuePage retrying = queue.getPage(ssmtp_mailer::EmailStatus::RETRY);
+    ASSERT_EQ(retrying.items.size(), 1u);
+    EXPECT_EQ(retrying.items[0].recipient_count, 1u);
+    EXPECT_EQ(retrying.items[0].first_recipient, "b@down.test");
+
+    // Led by another domain, as remote.test is resting after the failure
+    email.to = {"d@missing.test", "c@remote.test"};
+    queue.enqueue(&email);
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalFailed() == 1; }));
+    queue.stop();
+
+    EXPECT_EQ(queue.getTotalRetries(), 1u);
+    EXPECT_EQ(smtp.messages().size(), 2u);
+    ssmtp_mailer::QueuePage failed = queue.getPage(ssmtp_mailer::EmailStatus::FAILED);
+    ASSERT_EQ(failed.items.size(), 1u);
+    EXPECT_NE(failed.items[0].error_message.find("domain not found"), std::string::npos)
+        << failed.items[0].error_message;
+}
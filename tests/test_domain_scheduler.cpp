@@ -0,0 +1,372 @@
+#include <gtest/gtest.h>
+#include "core/queue/domain_scheduler.hpp"
+#include "core/queue/email_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+using namespace ssmtp_mailer;
+using Clock = std::chrono::system_clock;
+
+namespace {
+
+QueueItem makeItem(const std::string& to, EmailPriority priority = EmailPriority::NORMAL,
+                   size_t body_size = 100) {
+    QueueItem item("sender@example.test", {to}, "Subject", std::string(body_size, 'x'));
+    item.priority = priority;
+    return item;
+}
+
+template <typename Predicate>
+bool waitFor(Predicate predicate, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!predicate()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+} // namespace
+
+// Test 1: A small domain queued behind a large one gets every other turn
+TEST(DomainSchedulerTest, TakesTurnsByDomain) {
+    DomainScheduler scheduler;
+    scheduler.setConcurrency(1000);
+    for (int i = 0; i < 100; ++i) {
+        scheduler.push(makeItem("user" + std::to_string(i) + "@Big.Example"));
+    }
+    for (int i = 0; i < 10; ++i) {
+        scheduler.push(makeItem("user" + std::to_string(i) + "@small.example"));
+    }
+    EXPECT_EQ(scheduler.size(), 110u);
+
+    auto now = Clock::now();
+    int small_seen = 0;
+    QueueItem item;
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(scheduler.pop(now, item));
+        if (item.domain == "small.example") {
+            small_seen++;
+        } else {
+            EXPECT_EQ(item.domain, "big.example");
+        }
+    }
+    EXPECT_EQ(small_seen, 10);
+
+    // Higher priority mail goes first whatever its domain
+    scheduler.push(makeItem("boss@other.example", EmailPriority::URGENT));
+    ASSERT_TRUE(scheduler.pop(now, item));
+    EXPECT_EQ(item.domain, "other.example");
+}
+
+// Test 2: Large messages cost their size, so they do not crowd out small ones
+TEST(DomainSchedulerTest, WeighsTurnsBySize) {
+    const size_t quantum = 64 * 1024;
+    DomainScheduler scheduler(quantum);
+    scheduler.setConcurrency(1000);
+    for (int i = 0; i < 20; ++i) {
+        scheduler.push(makeItem("a@bulk.example", EmailPriority::NORMAL, 4 * quantum));
+    }
+    for (int i = 0; i < 100; ++i) {
+        scheduler.push(makeItem("b@light.example", EmailPriority::NORMAL, 1024));
+    }
+
+    auto now = Clock::now();
+    int bulk = 0;
+    int light = 0;
+    QueueItem item;
+    while (bulk < 8) {
+        ASSERT_TRUE(scheduler.pop(now, item));
+        (item.domain == "bulk.example" ? bulk : light)++;
+    }
+    // Each bulk message takes four turns' credit, a small one a single turn
+    EXPECT_GE(light, 28);
+    EXPECT_LE(light, 36);
+}
+
+// Test 3: A domain at its cap or backing off sits out; others keep going
+TEST(DomainSchedulerTest, PacesBusyAndFailingDomains) {
+    DomainScheduler scheduler;
+    scheduler.setConcurrency(10);
+    scheduler.setConcurrency("slow.example", 2);
+    scheduler.setBackoff(std::chrono::milliseconds(100), std::chrono::seconds(1));
+    for (int i = 0; i < 5; ++i) {
+        scheduler.push(makeItem("rcpt@slow.example"));
+        scheduler.push(makeItem("rcpt@fast.example"));
+    }
+
+    auto now = Clock::now();
+    QueueItem item;
+    int slow_taken = 0;
+    while (scheduler.pop(now, item)) {
+        slow_taken += item.domain == "slow.example";
+    }
+    EXPECT_EQ(slow_taken, 2);
+    EXPECT_EQ(scheduler.size(), 3u);
+
+    // A success frees a slot; a temporary failure frees one but backs the domain off
+    scheduler.release("slow.example", DomainOutcome::SENT, now);
+    ASSERT_TRUE(scheduler.pop(now, item));
+    EXPECT_EQ(item.domain, "slow.example");
+    scheduler.release("slow.example", DomainOutcome::DEFERRED, now);
+    EXPECT_FALSE(scheduler.pop(now, item));
+
+    Clock::time_point deadline;
+    ASSERT_TRUE(scheduler.nextDeadline(deadline));
+    EXPECT_EQ(deadline, now + std::chrono::milliseconds(100));
+    auto stats = scheduler.getStats(now);
+    ASSERT_EQ(stats.size(), 2u);
+    EXPECT_EQ(stats[1].domain, "slow.example");
+    EXPECT_EQ(stats[1].queued, 2u);
+    EXPECT_EQ(stats[1].in_flight, 1u);
+    EXPECT_EQ(stats[1].concurrency_limit, 2u);
+    EXPECT_EQ(stats[1].consecutive_failures, 1u);
+    EXPECT_TRUE(stats[1].backing_off);
+
+    // The second failure in a row doubles the backoff
+    ASSERT_TRUE(scheduler.pop(deadline, item));
+    scheduler.release("slow.example", DomainOutcome::DEFERRED, deadline);
+    Clock::time_point next;
+    ASSERT_TRUE(scheduler.nextDeadline(next));
+    EXPECT_EQ(next, deadline + std::chrono::milliseconds(200));
+
+    // Handed back mail goes to the front, and a permanent rejection does not pause
+    ASSERT_TRUE(scheduler.pop(next, item));
+    std::string subject = item.subject = "returned";
+    scheduler.giveBack(item);
+    ASSERT_TRUE(scheduler.pop(next, item));
+    EXPECT_EQ(item.subject, subject);
+    scheduler.release("slow.example", DomainOutcome::REJECTED, next);
+    EXPECT_FALSE(scheduler.nextDeadline(next));
+}
+
+// Test 4: Mail to a domain whose sends hang does not hold up other domains
+TEST(DomainSchedulerTest, QueueKeepsHealthyDomainsFlowing) {
+    EmailQueue queue;
+    queue.setWorkerCount(4);
+    queue.setDomainConcurrency("stuck.example", 1);
+    std::atomic<bool> release(false);
+    std::atomic<int> healthy(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->subject == "stuck") {
+            while (!release) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        } else {
+            healthy++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+
+    // The stuck domain's mail is older and first in line
+    for (int i = 0; i < 20; ++i) {
+        Email email;
+        email.from = "sender@example.test";
+        email.to = {"rcpt" + std::to_string(i) + "@Stuck.Example"};
+        email.subject = "stuck";
+        email.body = "Hello";
+        queue.enqueue(&email);
+    }
+    for (int i = 0; i < 40; ++i) {
+        Email email;
+        email.from = "sender@example.test";
+        email.to = {"rcpt@healthy.example"};
+        email.subject = "healthy";
+        email.body = "Hello";
+        queue.enqueue(&email);
+    }
+    queue.start();
+
+    EXPECT_TRUE(waitFor([&] { return healthy == 40; }));
+    auto stats = queue.getDomainStats();
+    ASSERT_EQ(stats.size(), 1u);
+    EXPECT_EQ(stats[0].domain, "stuck.example");
+    EXPECT_EQ(stats[0].in_flight, 1u);
+    EXPECT_EQ(stats[0].queued, 19u);
+
+    release = true;
+    EXPECT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 60; }));
+    queue.stop();
+    EXPECT_TRUE(queue.getDomainStats().empty());
+}
+
+// Test 5: Waiting lifts lower priorities up to HIGH, never past URGENT
+TEST(DomainSchedulerTest, AgesWaitingPriorities) {
+    DomainScheduler scheduler;
+    scheduler.setConcurrency(1000);
+    scheduler.setAging(std::chrono::seconds(10));
+    auto start = Clock::now();
+    scheduler.push(makeItem("old@low.example", EmailPriority::LOW), start);
+    for (int i = 0; i < 3; ++i) {
+        scheduler.push(makeItem("user@high.example", EmailPriority::HIGH), start + std::chrono::seconds(15));
+    }
+    scheduler.push(makeItem("user@normal.example", EmailPriority::NORMAL), start + std::chrono::seconds(20));
+
+    // Aged one level only, so HIGH still goes first
+    QueueItem item;
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(15), item));
+    EXPECT_EQ(item.domain, "high.example");
+
+    scheduler.push(makeItem("boss@urgent.example", EmailPriority::URGENT), start + std::chrono::seconds(25));
+    EXPECT_EQ(scheduler.urgentQueued(), 1u);
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(25), item, EmailPriority::URGENT));
+    EXPECT_EQ(item.domain, "urgent.example");
+    EXPECT_EQ(scheduler.urgentQueued(), 0u);
+    EXPECT_FALSE(scheduler.pop(start + std::chrono::seconds(25), item, EmailPriority::URGENT));
+
+    // Aged up to HIGH and waiting longer than the HIGH mail
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(25), item));
+    EXPECT_EQ(item.domain, "low.example");
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(25), item));
+    EXPECT_EQ(item.domain, "high.example");
+
+    // Aged up to HIGH, but the HIGH mail has waited longer
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(40), item));
+    EXPECT_EQ(item.domain, "high.example");
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(40), item));
+    EXPECT_EQ(item.domain, "normal.example");
+
+    // Without aging, priority is strict however long mail waits
+    DomainScheduler strict;
+    strict.setConcurrency(1000);
+    strict.push(makeItem("old@low.example", EmailPriority::LOW), start);
+    strict.push(makeItem("user@high.example", EmailPriority::HIGH), start + std::chrono::hours(1));
+    ASSERT_TRUE(strict.pop(start + std::chrono::hours(2), item));
+    EXPECT_EQ(item.domain, "high.example");
+}
+
+// Test 6: A level ages by its oldest email, not by the domain whose turn is next
+TEST(DomainSchedulerTest, AgesByOldestEmailOfLevel) {
+    DomainScheduler scheduler;
+    scheduler.setConcurrency(1000);
+    scheduler.setAging(std::chrono::seconds(10));
+    auto start = Clock::now();
+    // first.example holds the turn at NORMAL; second.example has the older mail
+    scheduler.push(makeItem("user@first.example"), start + std::chrono::seconds(30));
+    scheduler.push(makeItem("old@second.example"), start);
+    scheduler.push(makeItem("user@high.example", EmailPriority::HIGH), start + std::chrono::seconds(20));
+
+    // NORMAL has aged to HIGH and its oldest email waited longer than the HIGH one
+    QueueItem item;
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(30), item));
+    EXPECT_EQ(item.domain, "first.example");
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(30), item));
+    EXPECT_EQ(item.domain, "second.example");
+
+    // Only first.example's newer mail would have kept NORMAL behind HIGH
+    scheduler.push(makeItem("user@first.example"), start + std::chrono::seconds(30));
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(30), item));
+    EXPECT_EQ(item.domain, "high.example");
+}
+
+// Test 7: Within a level, mail with a deadline goes earliest first and is dropped once late
+TEST(DomainSchedulerTest, ServesEarliestDeadlineFirst) {
+    DomainScheduler scheduler;
+    scheduler.setConcurrency(1000);
+    auto start = Clock::now();
+    auto deadlined = [&](const std::string& to, int seconds) {
+        QueueItem item = makeItem(to);
+        item.subject = std::to_string(seconds);
+        item.expires_at = start + std::chrono::seconds(seconds);
+        return item;
+    };
+    scheduler.push(makeItem("user@plain.example"), start);
+    scheduler.push(deadlined("user@a.example", 300), start);
+    scheduler.push(deadlined("user@b.example", 60), start);
+    scheduler.push(deadlined("user@a.example", 120), start);
+    scheduler.push(deadlined("user@c.example", 30), start);
+    scheduler.push(makeItem("boss@high.example", EmailPriority::HIGH), start);
+
+    // A higher level still goes first; a deadline only orders mail within one
+    QueueItem item;
+    ASSERT_TRUE(scheduler.pop(start, item));
+    EXPECT_EQ(item.domain, "high.example");
+    Clock::time_point next;
+    ASSERT_TRUE(scheduler.nextExpiry(next));
+    EXPECT_EQ(next, start + std::chrono::seconds(30));
+
+    // Late mail is dropped in deadline order, whatever its domain
+    std::vector<QueueItem> expired;
+    EXPECT_EQ(scheduler.dropExpired(start + std::chrono::seconds(60), expired), 2u);
+    ASSERT_EQ(expired.size(), 2u);
+    EXPECT_EQ(expired[0].domain, "c.example");
+    EXPECT_EQ(expired[1].domain, "b.example");
+    EXPECT_EQ(scheduler.size(), 3u);
+
+    // The rest by deadline across domains, then mail without one
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(60), item));
+    EXPECT_EQ(item.subject, "120");
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(60), item));
+    EXPECT_EQ(item.subject, "300");
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(60), item));
+    EXPECT_EQ(item.domain, "plain.example");
+    EXPECT_FALSE(scheduler.nextExpiry(next));
+    scheduler.release("a.example", DomainOutcome::SENT, start);
+    scheduler.release("a.example", DomainOutcome::SENT, start);
+
+    // Mail given back keeps its deadline order, and a capped domain's mail
+    // still expires while it waits its turn
+    scheduler.setConcurrency("a.example", 1);
+    scheduler.push(deadlined("user@a.example", 90), start);
+    scheduler.push(deadlined("user@a.example", 100), start);
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(60), item));
+    EXPECT_EQ(item.subject, "90");
+    EXPECT_FALSE(scheduler.pop(start + std::chrono::seconds(60), item));
+    expired.clear();
+    EXPECT_EQ(scheduler.dropExpired(start + std::chrono::seconds(100), expired), 1u);
+    EXPECT_EQ(expired[0].subject, "100");
+    scheduler.giveBack(deadlined("user@a.example", 90));
+    ASSERT_TRUE(scheduler.pop(start + std::chrono::seconds(60), item));
+    EXPECT_EQ(item.subject, "90");
+    scheduler.release("a.example", DomainOutcome::SENT, start);
+    EXPECT_TRUE(scheduler.empty());
+}
+
+// Test 8: The queue drops expired mail unsent and does not retry past a deadline
+TEST(DomainSchedulerTest, QueueExpiresLateMail) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setRetryDelay(std::chrono::seconds(60));
+    std::atomic<int> attempts(0);
+    queue.setSendCallback([&](const Email* email) {
+        attempts++;
+        if (email->subject == "fails") {
+            return SMTPResult::createError("Mailbox busy", 450);
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+
+    auto make = [](const std::string& subject) {
+        Email email;
+        email.from = "sender@example.test";
+        email.to = {"rcpt@example.test"};
+        email.subject = subject;
+        email.body = "Your code is 123456";
+        return email;
+    };
+    Email late = make("late");
+    late.send_by = Clock::now() - std::chrono::seconds(1);
+    EXPECT_EQ(queue.enqueue(std::move(late)), EnqueueResult::ACCEPTED);
+    Email fails = make("fails");
+    fails.ttl = std::chrono::seconds(30);
+    EXPECT_EQ(queue.enqueue(std::move(fails)), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(make("plain")), EnqueueResult::ACCEPTED);
+
+    queue.start();
+    EXPECT_TRUE(waitFor([&] { return queue.getTotalExpired() == 2 && queue.getTotalProcessed() == 1; }));
+    queue.stop();
+
+    // The late one was never tried, and the failing one was tried once:
+    // its retry would have come after its TTL
+    EXPECT_EQ(attempts, 2);
+    EXPECT_EQ(queue.getTotalRetries(), 0u);
+    EXPECT_EQ(queue.getTotalFailed(), 0u);
+    EXPECT_EQ(queue.size(), 0u);
+    EXPECT_EQ(queue.getQueuedBytes(), 0u);
+    QueueStatusCounts counts = queue.getStatusCounts();
+    EXPECT_EQ(counts.failed, 2u);
+    EXPECT_EQ(counts.retry, 0u);
+}
@@ -0,0 +1,172 @@
+#include <gtest/gtest.h>
+#include "core/queue/ingest_ring.hpp"
+#include "core/queue/email_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+template <typename Predicate>
+bool waitFor(Predicate predicate, std::chrono::milliseconds timeout = std::chrono::milliseconds(10000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!predicate()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+} // namespace
+
+// Test 1: FIFO order, and a full ring refuses without taking the value
+TEST(IngestRingTest, FifoAndBounded) {
+    IngestRing<std::string> ring(5);
+    EXPECT_EQ(ring.capacity(), 8u);
+    EXPECT_TRUE(ring.empty());
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 8; ++i) {
+            std::string value = "value " + std::to_string(i);
+            ASSERT_TRUE(ring.tryPush(std::move(value)));
+        }
+        std::string extra = "extra";
+        EXPECT_FALSE(ring.tryPush(std::move(extra)));
+        EXPECT_EQ(extra, "extra");
+
+        std::string value;
+        for (int i = 0; i < 8; ++i) {
+            ASSERT_TRUE(ring.tryPop(value));
+            EXPECT_EQ(value, "value " + std::to_string(i));
+        }
+        EXPECT_FALSE(ring.tryPop(value));
+        EXPECT_TRUE(ring.empty());
+    }
+}
+
+// Test 2: Many producers and consumers at once lose and repeat nothing
+TEST(IngestRingTest, ManyProducersAndConsumers) {
+    const int producers = 8;
+    const int consumers = 4;
+    const int per_producer = 50000;
+    IngestRing<long> ring(64);
+
+    std::vector<std::vector<long>> received(consumers);
+    std::atomic<int> producing(producers);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            for (long i = 0; i < per_producer; ++i) {
+                long value = static_cast<long>(p) * per_producer + i;
+                while (!ring.tryPush(std::move(value))) {
+                    std::this_thread::yield();
+                }
+            }
+            producing--;
+        });
+    }
+    for (int c = 0; c < consumers; ++c) {
+        threads.emplace_back([&, c] {
+            long value;
+            while (true) {
+                if (ring.tryPop(value)) {
+                    received[c].push_back(value);
+                } else if (producing == 0 && ring.empty()) {
+                    break;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<int> seen(producers * per_producer, 0);
+    for (const auto& values : received) {
+        // Each producer's values reach any one consumer in the order pushed
+        std::vector<long> last(producers, -1);
+        for (long value : values) {
+            int producer = static_cast<int>(value / per_producer);
+            ASSERT_GT(value, last[producer]);
+            last[producer] = value;
+            seen[value]++;
+        }
+    }
+    for (size_t i = 0; i < seen.size(); ++i) {
+        ASSERT_EQ(seen[i], 1) << i;
+    }
+}
+
+// Test 3: Concurrent enqueues reach the workers exactly once, and the size limit holds
+TEST(IngestRingTest, QueueTakesConcurrentEnqueues) {
+    EmailQueue queue;
+    queue.setWorkerCount(4);
+    queue.setMaxQueueSize(100000);
+    std::mutex mutex;
+    std::map<std::string, int> deliveries;
+    queue.setSendCallback([&](const Email* email) {
+        std::lock_guard<std::mutex> lock(mutex);
+        deliveries[email->subject]++;
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.start();
+
+    const int producers = 16;
+    const int per_producer = 500;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&, p] {
+            Email email;
+            email.from = "sender@example.test";
+            email.to = {"rcpt" + std::to_string(p % 5) + "@example" + std::to_string(p % 3) + ".test"};
+            email.body = "Hello";
+            for (int i = 0; i < per_producer; ++i) {
+                email.subject = std::to_string(p) + "/" + std::to_string(i);
+                queue.enqueue(&email);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == producers * per_producer; }));
+    EXPECT_TRUE(queue.empty());
+    queue.stop();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(deliveries.size(), static_cast<size_t>(producers * per_producer));
+        for (const auto& delivery : deliveries) {
+            EXPECT_EQ(delivery.second, 1) << delivery.first;
+        }
+    }
+
+    // Stopped, enqueues pile up to the limit, past the ingest ring's capacity
+    queue.setMaxQueueSize(3000);
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "held";
+    threads.clear();
+    for (int p = 0; p < 4; ++p) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; ++i) {
+                queue.enqueue(&email);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(queue.size(), 3000u);
+    EXPECT_EQ(queue.getPendingEmails().size(), 3000u);
+}
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+#include "core/queue/latency_histogram.hpp"
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+
+// Test 1: Percentiles land within a bucket's width of the true value, never above the largest
+TEST(LatencyHistogramTest, ReportsPercentiles) {
+    LatencyHistogram histogram;
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.percentile(0.99), microseconds(0));
+
+    for (int i = 1; i <= 1000; ++i) {
+        histogram.record(milliseconds(i));
+    }
+    EXPECT_EQ(histogram.count(), 1000u);
+    EXPECT_EQ(histogram.max(), milliseconds(1000));
+
+    auto within = [](microseconds reported, milliseconds actual) {
+        return reported >= actual && reported <= actual + actual / 8;
+    };
+    EXPECT_TRUE(within(histogram.percentile(0.50), milliseconds(500))) << histogram.percentile(0.50).count();
+    EXPECT_TRUE(within(histogram.percentile(0.90), milliseconds(900))) << histogram.percentile(0.90).count();
+    EXPECT_EQ(histogram.percentile(0.999), milliseconds(1000));
+    EXPECT_EQ(histogram.percentile(1.0), milliseconds(1000));
+
+    // Small values are exact; negative ones count as zero
+    LatencyHistogram small;
+    small.record(microseconds(3));
+    small.record(microseconds(-5));
+    EXPECT_EQ(small.percentile(0.5), microseconds(0));
+    EXPECT_EQ(small.percentile(1.0), microseconds(3));
+}
+
+// Test 2: Threads record concurrently without losing samples; huge values are clamped into range
+TEST(LatencyHistogramTest, RecordsConcurrently) {
+    LatencyHistogram histogram;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&histogram, t] {
+            for (int i = 0; i < 10000; ++i) {
+                histogram.record(microseconds(t * 10000 + i));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(histogram.count(), 40000u);
+    EXPECT_EQ(histogram.max(), microseconds(39999));
+
+    histogram.record(std::chrono::hours(24 * 365));
+    EXPECT_EQ(histogram.max(), std::chrono::hours(24 * 365));
+    // The top bucket ends about 25 days in
+    EXPECT_GE(histogram.percentile(1.0), std::chrono::hours(24 * 25));
+    EXPECT_LE(histogram.percentile(1.0), histogram.max());
+    EXPECT_LT(histogram.percentile(0.5), microseconds(25000));
+}
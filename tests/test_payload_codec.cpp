@@ -0,0 +1,259 @@
+#include <gtest/gtest.h>
+#include "core/queue/payload_codec.hpp"
+#include "core/queue/email_queue.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <filesystem>
+#include <thread>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+// HTML that compresses the way newsletters do, different for each n
+std::string htmlOf(int n, size_t size) {
+    std::string html = "<html><body><table width=\"100%\">";
+    int row = 0;
+    while (html.size() < size) {
+        html += "<tr><td style=\"padding:16px;color:#333333;\"><a href=\"https://example.test/t/" +
+                std::to_string(n) + "/" + std::to_string(row++) + "\">Read more of issue " +
+                std::to_string(n) + "</a></td></tr>";
+    }
+    return html + "</table></body></html>";
+}
+
+Email newsletter(int n, const std::string& html) {
+    Email email;
+    email.from = "news@example.test";
+    email.to = {"reader" + std::to_string(n) + "@example.test"};
+    email.subject = "Newsletter";
+    email.body = "Plain text edition";
+    email.html_body = html;
+    email.attachments = {"issue.pdf"};
+    return email;
+}
+
+PayloadCompressionOptions zlibOptions() {
+    PayloadCompressionOptions options;
+    options.codec = PayloadCodec::ZLIB;
+    options.threshold = 16 * 1024;
+    return options;
+}
+
+void waitForProcessed(const EmailQueue& queue, size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() < count && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+uintmax_t spoolBytes(const std::string& directory) {
+    uintmax_t bytes = 0;
+    for (const auto& file : std::filesystem::directory_iterator(directory)) {
+        bytes += std::filesystem::file_size(file.path());
+    }
+    return bytes;
+}
+
+} // namespace
+
+// Test 1: Every codec built in round-trips, and names parse back to codecs
+TEST(PayloadCodecTest, RoundTripsEachCodec) {
+    const std::string html = htmlOf(1, 64 * 1024);
+    for (PayloadCodec codec : {PayloadCodec::NONE, PayloadCodec::ZLIB}) {
+        PayloadCodec parsed = PayloadCodec::NONE;
+        EXPECT_TRUE(payload_codec::parse(payload_codec::nameOf(codec), parsed));
+        EXPECT_EQ(parsed, codec);
+
+        std::string packed;
+        std::string unpacked;
+        if (!payload_codec::isAvailable(codec)) {
+            EXPECT_FALSE(payload_codec::compress(codec, 0, html, packed));
+            continue;
+        }
+        ASSERT_TRUE(payload_codec::compress(codec, 0, html, packed)) << payload_codec::nameOf(codec);
+        if (codec != PayloadCodec::NONE) {
+            EXPECT_LT(packed.size(), html.size() / 4) << payload_codec::nameOf(codec);
+        }
+        ASSERT_TRUE(payload_codec::decompress(codec, packed, html.size(), unpacked));
+        EXPECT_EQ(unpacked, html);
+        EXPECT_FALSE(payload_codec::decompress(codec, packed, html.size() + 1, unpacked));
+    }
+    PayloadCodec parsed;
+    EXPECT_FALSE(payload_codec::parse("brotli", parsed));
+    EXPECT_FALSE(payload_codec::parse("zstd", parsed));
+    EXPECT_TRUE(payload_codec::isAvailable(PayloadCodec::ZLIB));
+}
+
+// Test 2: Large payloads wait compressed and are sent whole; small ones are left
+TEST(PayloadCodecTest, QueueHoldsLargePayloadsCompressed) {
+    EmailQueue queue;
+    queue.setPayloadCompression(zlibOptions());
+    std::atomic<int> whole(0);
+    queue.setSendCallback([&](const Email* email) {
+        int n = std::stoi(email->to.front().substr(6));
+        std::string html = n < 20 ? htmlOf(n, 64 * 1024) : "<p>short</p>";
+        if (email->body == "Plain text edition" && email->html_body == html &&
+            email->attachments == std::vector<std::string>{"issue.pdf"}) {
+            whole++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+
+    size_t payload = 0;
+    for (int i = 0; i < 20; ++i) {
+        std::string html = htmlOf(i, 64 * 1024);
+        payload += html.size();
+        ASSERT_EQ(queue.enqueue(newsletter(i, html)), EnqueueResult::ACCEPTED);
+    }
+    Email small = newsletter(20, "<p>short</p>");
+    ASSERT_EQ(queue.enqueue(&small), EnqueueResult::ACCEPTED);
+
+    QueuePayloadStats stats = queue.getPayloadStats();
+    EXPECT_EQ(stats.compressed, 20u);
+    EXPECT_GT(stats.compression_ratio, 5.0);
+    EXPECT_GE(stats.bytes_before, payload);
+    EXPECT_LT(queue.getQueuedBytes(), payload / 5);
+
+    // Inspection sees them decompressed
+    for (const auto& item : queue.getPendingEmails()) {
+        EXPECT_EQ(item.payloadSize(), item.body.size() + item.html_body.size() + 9);
+        EXPECT_EQ(item.body, "Plain text edition");
+    }
+
+    queue.start();
+    waitForProcessed(queue, 21);
+    queue.stop();
+    EXPECT_EQ(whole.load(), 21);
+    EXPECT_EQ(queue.getQueuedBytes(), 0u);
+}
+
+// Test 3: A fan-out is compressed once and shares the result
+TEST(PayloadCodecTest, FanOutSharesCompressedPayload) {
+    const std::string html = htmlOf(7, 128 * 1024);
+    EmailQueue queue;
+    queue.setPayloadCompression(zlibOptions());
+    for (int i = 0; i < 50; ++i) {
+        ASSERT_EQ(queue.enqueue(newsletter(i, html)), EnqueueResult::ACCEPTED);
+    }
+    QueuePayloadStats stats = queue.getPayloadStats();
+    EXPECT_EQ(stats.compressed, 1u);
+    EXPECT_EQ(stats.shared, 49u);
+    EXPECT_EQ(stats.payloads, 1u);
+    EXPECT_EQ(queue.getQueuedBytes(), stats.stored_bytes);
+    EXPECT_EQ(stats.stored_bytes, stats.bytes_after);
+    EXPECT_LT(stats.stored_bytes, html.size() / 5);
+
+    std::atomic<int> whole(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->html_body == html) {
+            whole++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.start();
+    waitForProcessed(queue, 50);
+    queue.stop();
+    EXPECT_EQ(whole.load(), 50);
+}
+
+// Test 4: The spool stores payloads compressed, shared or not, and recovers them
+TEST(PayloadCodecTest, SpoolStoresCompressedPayloads) {
+    for (bool dedup : {true, false}) {
+        std::string directory = ::testing::TempDir() + "ssmtp_codec_" + std::to_string(getpid()) +
+                                (dedup ? "_shared" : "_own");
+        std::filesystem::remove_all(directory);
+        QueueSpoolOptions spool_options;
+        spool_options.directory = directory;
+        const std::string fanout = htmlOf(1, 64 * 1024);
+        size_t payload = 0;
+        {
+            EmailQueue queue;
+            queue.setPayloadDedup(dedup);
+            queue.setPayloadCompression(zlibOptions());
+            ASSERT_TRUE(queue.enableSpool(spool_options));
+            for (int i = 0; i < 20; ++i) {
+                std::string html = i < 10 ? fanout : htmlOf(i, 64 * 1024);
+                payload += html.size();
+                ASSERT_EQ(queue.enqueue(newsletter(i, html)), EnqueueResult::ACCEPTED);
+            }
+        }
+        EXPECT_LT(spoolBytes(directory), payload / 5) << (dedup ? "shared" : "own");
+
+        EmailQueue queue;
+        queue.setPayloadDedup(dedup);
+        queue.setPayloadCompression(zlibOptions());
+        ASSERT_TRUE(queue.enableSpool(spool_options));
+        ASSERT_EQ(queue.size(), 20u);
+        EXPECT_LT(queue.getQueuedBytes(), payload / 5);
+
+        std::atomic<int> whole(0);
+        queue.setSendCallback([&](const Email* email) {
+            int n = std::stoi(email->to.front().substr(6));
+            if (email->html_body == (n < 10 ? fanout : htmlOf(n, 64 * 1024)) &&
+                email->body == "Plain text edition") {
+                whole++;
+            }
+            return SMTPResult::createSuccess("sent");
+        });
+        queue.start();
+        waitForProcessed(queue, 20);
+        queue.stop();
+        EXPECT_EQ(whole.load(), 20) << (dedup ? "shared" : "own");
+        std::filesystem::remove_all(directory);
+    }
+}
+
+// Test 5: A spool written uncompressed is compressed as it is recovered
+TEST(PayloadCodecTest, CompressesRecoveredPayloads) {
+    std::string directory = ::testing::TempDir() + "ssmtp_codec_recover_" + std::to_string(getpid());
+    std::filesystem::remove_all(directory);
+    QueueSpoolOptions spool_options;
+    spool_options.directory = directory;
+    const std::string html = htmlOf(3, 64 * 1024);
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(spool_options));
+        for (int i = 0; i < 10; ++i) {
+            ASSERT_EQ(queue.enqueue(newsletter(i, html)), EnqueueResult::ACCEPTED);
+        }
+    }
+
+    EmailQueue queue;
+    queue.setPayloadCompression(zlibOptions());
+    ASSERT_TRUE(queue.enableSpool(spool_options));
+    ASSERT_EQ(queue.size(), 10u);
+    QueuePayloadStats stats = queue.getPayloadStats();
+    EXPECT_EQ(stats.compressed, 1u);
+    EXPECT_EQ(stats.payloads, 1u);
+    EXPECT_LT(queue.getQueuedBytes(), html.size() / 5);
+
+    std::atomic<int> whole(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->html_body == html) {
+            whole++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.start();
+    waitForProcessed(queue, 10);
+    queue.stop();
+    EXPECT_EQ(whole.load(), 10);
+    std::filesystem::remove_all(directory);
+}
+
+// Test 6: A packed payload that no longer decompresses is reported, not copied out blank
+TEST(PayloadCodecTest, CorruptPayloadIsNotCopiedBlank) {
+    auto corrupt = std::make_shared<PackedPayload>();
+    corrupt->body_codec = PayloadCodec::ZLIB;
+    corrupt->body = "not zlib data";
+    corrupt->body_size = 64 * 1024;
+
+    QueueItem item;
+    item.message = std::make_shared<Email>(newsletter(1, "<p>short</p>"));
+    item.packed = corrupt;
+    item.body = "untouched";
+    EXPECT_FALSE(item.copyMessage());
+    EXPECT_EQ(item.body, "untouched");
+    EXPECT_EQ(item.outgoingMessage(), nullptr);
+}
@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+#include "core/queue/payload_store.hpp"
+#include "core/queue/email_queue.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+Email newsletter(int n, const std::string& body) {
+    Email email;
+    email.from = "news@example.test";
+    email.to = {"reader" + std::to_string(n) + "@example.test"};
+    email.subject = "Newsletter";
+    email.body = body;
+    email.html_body = "<p>" + body + "</p>";
+    email.attachments = {"issue.pdf"};
+    return email;
+}
+
+void waitForProcessed(const EmailQueue& queue, size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() < count && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+} // namespace
+
+// Test 1: The digest is XXH64, and covers every part of the payload
+TEST(PayloadStoreTest, HashesWithXXH64) {
+    EXPECT_EQ(PayloadStore::hash("", 0), 0xEF46DB3751D8E999ull);
+    EXPECT_EQ(PayloadStore::hash("a", 1), 0xD24EC4F1A98C6E5Bull);
+    EXPECT_EQ(PayloadStore::hash("abc", 3), 0x44BC2CF5AD770999ull);
+    std::string longer = "Nobody inspects the spammish repetition";
+    EXPECT_EQ(PayloadStore::hash(longer.data(), longer.size()), 0xFBCEA83C8A378BF1ull);
+
+    uint64_t digest = PayloadStore::digestOf("body", "html", {"a.pdf"});
+    EXPECT_NE(digest, 0u);
+    EXPECT_EQ(digest, PayloadStore::digestOf("body", "html", {"a.pdf"}));
+    EXPECT_NE(digest, PayloadStore::digestOf("bodyhtml", "", {"a.pdf"}));
+    EXPECT_NE(digest, PayloadStore::digestOf("body", "html", {"a.pdf", ""}));
+    EXPECT_NE(digest, PayloadStore::digestOf("body", "html", {}));
+}
+
+// Test 2: A fan-out keeps one copy of its payload, and each send still gets it whole
+TEST(PayloadStoreTest, QueueSharesFanOutPayload) {
+    const std::string body(64 * 1024, 'n');
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    std::mutex mutex;
+    std::set<std::string> recipients;
+    std::atomic<int> whole(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->body == body && email->html_body == "<p>" + body + "</p>" &&
+            email->attachments == std::vector<std::string>{"issue.pdf"}) {
+            whole++;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        recipients.insert(email->to.front());
+        return SMTPResult::createSuccess("sent");
+    });
+
+    for (int i = 0; i < 100; ++i) {
+        Email email = newsletter(i, body);
+        if (i % 2) {
+            ASSERT_EQ(queue.enqueue(&email), EnqueueResult::ACCEPTED);
+        } else {
+            ASSERT_EQ(queue.enqueue(std::move(email)), EnqueueResult::ACCEPTED);
+        }
+    }
+    Email other = newsletter(100, "A different issue");
+    ASSERT_EQ(queue.enqueue(&other), EnqueueResult::ACCEPTED);
+
+    QueuePayloadStats stats = queue.getPayloadStats();
+    size_t payload = 2 * body.size() + 7 + std::string("issue.pdf").size();
+    EXPECT_EQ(stats.checked, 101u);
+    EXPECT_EQ(stats.shared, 99u);
+    EXPECT_EQ(stats.payloads, 2u);
+    EXPECT_EQ(stats.stored_bytes, payload + other.body.size() + other.html_body.size() + 9);
+    EXPECT_GT(stats.dedup_ratio, 90.0);
+    EXPECT_EQ(queue.getQueuedBytes(), stats.stored_bytes);
+
+    // Inspection still sees every payload
+    for (const auto& item : queue.getPendingEmails()) {
+        EXPECT_FALSE(item.body.empty());
+    }
+
+    queue.start();
+    waitForProcessed(queue, 101);
+    queue.stop();
+    EXPECT_EQ(queue.getTotalProcessed(), 101u);
+    EXPECT_EQ(whole.load(), 100);
+    EXPECT_EQ(recipients.size(), 101u);
+    EXPECT_EQ(queue.getQueuedBytes(), 0u);
+    EXPECT_EQ(queue.getPayloadStats().payloads, 0u);
+}
+
+// Test 3: Switched off, every email keeps its own payload
+TEST(PayloadStoreTest, DedupCanBeSwitchedOff) {
+    EmailQueue queue;
+    queue.setPayloadDedup(false);
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_EQ(queue.enqueue(newsletter(i, "Same body")), EnqueueResult::ACCEPTED);
+    }
+    QueuePayloadStats stats = queue.getPayloadStats();
+    EXPECT_EQ(stats.checked, 0u);
+    EXPECT_EQ(stats.payloads, 0u);
+    EXPECT_EQ(stats.dedup_ratio, 1.0);
+    EXPECT_EQ(queue.getQueuedBytes(), 10 * (9 + 16 + 9u));
+}
+
+// Test 4: A spooled fan-out is written and recovered with one copy of its payload
+TEST(PayloadStoreTest, SpoolSharesFanOutPayload) {
+    std::string directory = ::testing::TempDir() + "ssmtp_payload_" + std::to_string(getpid());
+    std::filesystem::remove_all(directory);
+    QueueSpoolOptions spool_options;
+    spool_options.directory = directory;
+    const std::string body(32 * 1024, 's');
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(spool_options));
+        for (int i = 0; i < 50; ++i) {
+            ASSERT_EQ(queue.enqueue(newsletter(i, body)), EnqueueResult::ACCEPTED);
+        }
+        EXPECT_EQ(queue.getSpoolStats().payloads, 1u);
+    }
+    uintmax_t bytes = 0;
+    for (const auto& file : std::filesystem::directory_iterator(directory)) {
+        bytes += std::filesystem::file_size(file.path());
+    }
+    EXPECT_LT(bytes, 4 * body.size());
+
+    EmailQueue queue;
+    ASSERT_TRUE(queue.enableSpool(spool_options));
+    EXPECT_EQ(queue.size(), 50u);
+    QueuePayloadStats stats = queue.getPayloadStats();
+    EXPECT_EQ(stats.payloads, 1u);
+    EXPECT_EQ(stats.shared, 49u);
+    EXPECT_LT(queue.getQueuedBytes(), 3 * body.size());
+
+    std::atomic<int> whole(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->body == body && email->to.size() == 1) {
+            whole++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.start();
+    waitForProcessed(queue, 50);
+    queue.stop();
+    EXPECT_EQ(whole.load(), 50);
+    EXPECT_EQ(queue.getSpoolStats().payloads, 0u);
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+#include "core/queue/email_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+Email makeEmail(const std::string& subject, size_t body_size = 10) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = subject;
+    // Bodies differ by subject, so the queue does not share one payload between them
+    email.body = std::string(body_size, subject.empty() ? 'x' : subject[0]);
+    return email;
+}
+
+} // namespace
+
+// Test 1: Lower priorities are turned away first; urgent mail gets room past the limit
+TEST(QueueAdmissionTest, ShedsByPriorityAtTheCountLimit) {
+    EmailQueue queue;
+    queue.setMaxQueueSize(8);
+    queue.setMaxQueueBytes(0);
+
+    // Low priority may fill three quarters of the queue
+    for (int i = 0; i < 6; ++i) {
+        EXPECT_EQ(queue.enqueue(makeEmail("low"), EmailPriority::LOW), EnqueueResult::ACCEPTED);
+    }
+    EXPECT_EQ(queue.enqueue(makeEmail("low"), EmailPriority::LOW), EnqueueResult::QUEUE_FULL);
+
+    EXPECT_EQ(queue.enqueue(makeEmail("normal")), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("normal")), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("normal")), EnqueueResult::QUEUE_FULL);
+    EXPECT_EQ(queue.enqueue(makeEmail("high"), EmailPriority::HIGH), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("high"), EmailPriority::HIGH), EnqueueResult::QUEUE_FULL);
+    EXPECT_EQ(queue.enqueue(makeEmail("urgent"), EmailPriority::URGENT), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("urgent"), EmailPriority::URGENT), EnqueueResult::QUEUE_FULL);
+    EXPECT_EQ(queue.getStatusCounts().pending, 10u);
+
+    // A larger limit lets the waiting levels in again
+    queue.setMaxQueueSize(16);
+    EXPECT_EQ(queue.enqueue(makeEmail("low"), EmailPriority::LOW), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("low"), EmailPriority::LOW), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("low"), EmailPriority::LOW), EnqueueResult::QUEUE_FULL);
+    EXPECT_EQ(queue.enqueue(makeEmail("normal")), EnqueueResult::ACCEPTED);
+}
+
+// Test 2: Queued bytes are bounded too, but a lone email larger than the limit still goes
+TEST(QueueAdmissionTest, BoundsQueuedBytes) {
+    EmailQueue queue;
+    queue.setMaxQueueSize(1000);
+    queue.setMaxQueueBytes(1000);
+
+    EXPECT_EQ(queue.enqueue(makeEmail("a", 400)), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("b", 400)), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(queue.enqueue(makeEmail("c", 400)), EnqueueResult::QUEUE_FULL);
+    EXPECT_EQ(queue.getQueuedBytes(), 800u);
+    EXPECT_EQ(queue.enqueue(makeEmail("d", 150)), EnqueueResult::ACCEPTED);
+
+    QueueItem taken;
+    ASSERT_TRUE(queue.dequeue(taken));
+    EXPECT_EQ(queue.getQueuedBytes(), 550u);
+
+    EmailQueue empty;
+    empty.setMaxQueueBytes(1000);
+    EXPECT_EQ(empty.enqueue(makeEmail("huge", 5000)), EnqueueResult::ACCEPTED);
+    EXPECT_EQ(empty.enqueue(makeEmail("small", 10)), EnqueueResult::QUEUE_FULL);
+}
+
+// Test 3: enqueueFor() waits for a send to free room, and gives up at its timeout
+TEST(QueueAdmissionTest, BlockingEnqueueWaitsForRoom) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setMaxQueueSize(1);
+    std::atomic<int> sent(0);
+    queue.setSendCallback([&](const Email*) {
+        sent++;
+        return SMTPResult::createSuccess("sent");
+    });
+    ASSERT_EQ(queue.enqueue(makeEmail("first")), EnqueueResult::ACCEPTED);
+
+    auto started = std::chrono::steady_clock::now();
+    EXPECT_EQ(queue.enqueueFor(makeEmail("late"), EmailPriority::NORMAL, std::chrono::milliseconds(50)),
+              EnqueueResult::TIMED_OUT);
+    EXPECT_GE(std::chrono::steady_clock::now() - started, std::chrono::milliseconds(50));
+
+    std::thread starter([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        queue.start();
+    });
+    EXPECT_EQ(queue.enqueueFor(makeEmail("second"), EmailPriority::NORMAL, std::chrono::seconds(10)),
+              EnqueueResult::ACCEPTED);
+    starter.join();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (sent < 2 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    queue.stop();
+    EXPECT_EQ(sent, 2);
+}
+
+// Test 4: Emails offered without blocking are admitted highest priority first, or time out
+TEST(QueueAdmissionTest, AsyncEnqueueAdmitsByPriority) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setMaxQueueSize(1);
+    std::mutex mutex;
+    std::vector<std::string> order;
+    queue.setSendCallback([&](const Email* email) {
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(email->subject);
+        return SMTPResult::createSuccess("sent");
+    });
+
+    // The fast path answers before returning
+    EnqueueResult first = EnqueueResult::UNAVAILABLE;
+    queue.enqueueAsync(makeEmail("first"), EmailPriority::NORMAL, std::chrono::seconds(10),
+                       [&](EnqueueResult result) { first = result; });
+    EXPECT_EQ(first, EnqueueResult::ACCEPTED);
+
+    std::future<EnqueueResult> low = queue.enqueueAsync(makeEmail("low"), EmailPriority::LOW,
+                                                        std::chrono::seconds(10));
+    std::future<EnqueueResult> urgent = queue.enqueueAsync(makeEmail("urgent"), EmailPriority::URGENT,
+                                                           std::chrono::seconds(10));
+    std::future<EnqueueResult> impatient = queue.enqueueAsync(makeEmail("impatient"), EmailPriority::HIGH,
+                                                              std::chrono::milliseconds(20));
+    ASSERT_EQ(impatient.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(impatient.get(), EnqueueResult::TIMED_OUT);
+    EXPECT_EQ(low.wait_for(std::chrono::milliseconds(0)), std::future_status::timeout);
+
+    queue.start();
+    ASSERT_EQ(urgent.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    EXPECT_EQ(urgent.get(), EnqueueResult::ACCEPTED);
+    ASSERT_EQ(low.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    EXPECT_EQ(low.get(), EnqueueResult::ACCEPTED);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() < 3 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    queue.stop();
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_EQ(order, (std::vector<std::string>{"first", "urgent", "low"}));
+}
+
+// Test 5: Whatever still waits when the queue goes away is told so
+TEST(QueueAdmissionTest, AbandonedOffersAreUnavailable) {
+    std::future<EnqueueResult> waiting;
+    {
+        EmailQueue queue;
+        queue.setMaxQueueSize(1);
+        ASSERT_EQ(queue.enqueue(makeEmail("first")), EnqueueResult::ACCEPTED);
+        waiting = queue.enqueueAsync(makeEmail("second"), EmailPriority::NORMAL, std::chrono::seconds(60));
+        EXPECT_EQ(waiting.wait_for(std::chrono::milliseconds(20)), std::future_status::timeout);
+    }
+    ASSERT_EQ(waiting.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    EXPECT_EQ(waiting.get(), EnqueueResult::UNAVAILABLE);
+}
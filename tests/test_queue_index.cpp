@@ -0,0 +1,180 @@
+#include <gtest/gtest.h>
+#include "core/queue/queue_index.hpp"
+#include "core/queue/email_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+QueueItem makeItem(int n) {
+    QueueItem item("sender@example.test", {"rcpt" + std::to_string(n) + "@example.test", "cc@example.test"},
+                   "Subject " + std::to_string(n), std::string(100, 'x'));
+    item.id = "id-" + std::to_string(n);
+    item.attachments = {"a.pdf"};
+    return item;
+}
+
+std::vector<std::string> readAll(const QueueIndex& index, EmailStatus status, size_t limit) {
+    std::vector<std::string> ids;
+    std::string cursor;
+    do {
+        QueuePage page = index.page(status, cursor, limit);
+        EXPECT_LE(page.items.size(), limit);
+        for (const auto& summary : page.items) {
+            ids.push_back(summary.id);
+        }
+        cursor = page.next_cursor;
+    } while (!cursor.empty());
+    return ids;
+}
+
+} // namespace
+
+// Test 1: Counts follow each move; pages cover a status in the order emails reached it
+TEST(QueueIndexTest, CountsAndPages) {
+    QueueIndex index;
+    for (int i = 0; i < 10; ++i) {
+        index.update(makeItem(i), EmailStatus::PENDING);
+    }
+    index.move("id-3", EmailStatus::PROCESSING);
+    index.move("id-7", EmailStatus::PROCESSING);
+    QueueItem retried = makeItem(3);
+    retried.retry_count = 1;
+    retried.error_message = "421 try later";
+    index.update(retried, EmailStatus::RETRY);
+    index.remove("id-7");
+    index.remove("unknown");
+
+    QueueStatusCounts counts = index.counts();
+    EXPECT_EQ(counts.pending, 8u);
+    EXPECT_EQ(counts.processing, 0u);
+    EXPECT_EQ(counts.retry, 1u);
+    EXPECT_EQ(counts.failed, 0u);
+    EXPECT_EQ(index.size(), 9u);
+
+    EXPECT_EQ(readAll(index, EmailStatus::PENDING, 3),
+              (std::vector<std::string>{"id-0", "id-1", "id-2", "id-4", "id-5", "id-6", "id-8", "id-9"}));
+    QueuePage page = index.page(EmailStatus::RETRY, "", 10);
+    ASSERT_EQ(page.items.size(), 1u);
+    EXPECT_TRUE(page.next_cursor.empty());
+    EXPECT_EQ(page.total, 1u);
+    const QueueItemSummary& summary = page.items[0];
+    EXPECT_EQ(summary.id, "id-3");
+    EXPECT_EQ(summary.first_recipient, "rcpt3@example.test");
+    EXPECT_EQ(summary.recipient_count, 2u);
+    EXPECT_EQ(summary.status, EmailStatus::RETRY);
+    EXPECT_EQ(summary.retry_count, 1);
+    EXPECT_EQ(summary.error_message, "421 try later");
+    EXPECT_EQ(summary.size_bytes, 105u);
+
+    // A page exactly filling the status has no next cursor
+    page = index.page(EmailStatus::PENDING, "", 8);
+    EXPECT_EQ(page.items.size(), 8u);
+    EXPECT_TRUE(page.next_cursor.empty());
+    EXPECT_TRUE(index.page(EmailStatus::PENDING, "garbage", 8).items.empty());
+}
+
+// Test 2: A cursor still works after its email moved away, and failures beyond the history are dropped
+TEST(QueueIndexTest, CursorSurvivesMovesAndFailedHistoryIsBounded) {
+    QueueIndex index(3);
+    for (int i = 0; i < 6; ++i) {
+        index.update(makeItem(i), EmailStatus::PENDING);
+    }
+    QueuePage first = index.page(EmailStatus::PENDING, "", 2);
+    ASSERT_EQ(first.items.size(), 2u);
+    EXPECT_EQ(first.items[1].id, "id-1");
+
+    // The cursor's email is taken and another arrives: the next page carries on after it
+    index.move("id-1", EmailStatus::PROCESSING);
+    index.update(makeItem(6), EmailStatus::PENDING);
+    std::vector<std::string> rest;
+    std::string cursor = first.next_cursor;
+    while (!cursor.empty()) {
+        QueuePage page = index.page(EmailStatus::PENDING, cursor, 2);
+        for (const auto& summary : page.items) {
+            rest.push_back(summary.id);
+        }
+        cursor = page.next_cursor;
+    }
+    EXPECT_EQ(rest, (std::vector<std::string>{"id-2", "id-3", "id-4", "id-5", "id-6"}));
+
+    for (int i = 0; i < 5; ++i) {
+        QueueItem failed = makeItem(i);
+        failed.error_message = "550 no such user";
+        index.update(failed, EmailStatus::FAILED);
+    }
+    EXPECT_EQ(readAll(index, EmailStatus::FAILED, 10), (std::vector<std::string>{"id-2", "id-3", "id-4"}));
+    QueueStatusCounts counts = index.counts();
+    EXPECT_EQ(counts.failed, 3u);
+    EXPECT_EQ(counts.pending, 2u);
+    EXPECT_EQ(counts.processing, 0u);
+    EXPECT_EQ(index.size(), 5u);
+}
+
+// Test 3: The queue keeps the index in step as workers take, send and retry emails
+TEST(QueueIndexTest, QueueReportsStatusWhileSending) {
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    queue.setMaxQueueSize(10000);
+    std::atomic<bool> release(false);
+    queue.setSendCallback([&](const Email* email) {
+        while (!release) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (email->subject.find("bad") != std::string::npos) {
+            return SMTPResult::createError("550 rejected");
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.body = "Hello";
+    for (int i = 0; i < 500; ++i) {
+        email.subject = (i % 100 == 0 ? "bad " : "good ") + std::to_string(i);
+        queue.enqueue(&email);
+    }
+    QueueStatusCounts counts = queue.getStatusCounts();
+    EXPECT_EQ(counts.pending, 500u);
+
+    std::set<std::string> ids;
+    std::string cursor;
+    do {
+        QueuePage page = queue.getPage(EmailStatus::PENDING, cursor, 64);
+        for (const auto& summary : page.items) {
+            EXPECT_TRUE(ids.insert(summary.id).second);
+        }
+        cursor = page.next_cursor;
+    } while (!cursor.empty());
+    EXPECT_EQ(ids.size(), 500u);
+
+    queue.start();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getStatusCounts().processing == 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_GT(queue.getStatusCounts().processing, 0u);
+    release = true;
+
+    // The rejected emails wait out their first retry delay
+    while ((queue.getTotalProcessed() < 495 || queue.getStatusCounts().retry < 5) &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    queue.stop();
+
+    counts = queue.getStatusCounts();
+    EXPECT_EQ(counts.pending, 0u);
+    EXPECT_EQ(counts.processing, 0u);
+    EXPECT_EQ(counts.retry, 5u);
+    EXPECT_EQ(counts.failed, 0u);
+    QueuePage retrying = queue.getPage(EmailStatus::RETRY);
+    ASSERT_EQ(retrying.items.size(), 5u);
+    EXPECT_EQ(retrying.items[0].retry_count, 1);
+    EXPECT_EQ(retrying.items[0].subject.substr(0, 3), "bad");
+}
@@ -0,0 +1,398 @@
+#include <gtest/gtest.h>
+#include "core/queue/queue_spool.hpp"
+#include "core/queue/email_queue.hpp"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+class QueueSpoolTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        directory_ = ::testing::TempDir() + "ssmtp_spool_" + std::to_string(getpid()) + "_" +
+                     ::testing::UnitTest::GetInstance()->current_test_info()->name();
+        std::filesystem::remove_all(directory_);
+        options_.directory = directory_;
+        options_.commit_interval = std::chrono::milliseconds(2);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(directory_);
+    }
+
+    QueueItem makeItem(int n) {
+        QueueItem item("sender@example.test", {"rcpt" + std::to_string(n) + "@example.test"},
+                       "Subject " + std::to_string(n), "Body " + std::to_string(n) + "\r\n.\r\n");
+        item.id = "id-" + std::to_string(n);
+        item.priority = n % 2 ? EmailPriority::HIGH : EmailPriority::NORMAL;
+        return item;
+    }
+
+    std::vector<std::filesystem::path> segmentFiles() const {
+        std::vector<std::filesystem::path> files;
+        for (const auto& file : std::filesystem::directory_iterator(directory_)) {
+            files.push_back(file.path());
+        }
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    std::string directory_;
+    QueueSpoolOptions options_;
+};
+
+} // namespace
+
+// Test 1: Enqueued and retried mail comes back after a restart, a retried one only
+// for the recipients still owed it; completed mail does not
+TEST_F(QueueSpoolTest, RecoversLiveMessagesAfterRestart) {
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+        EXPECT_TRUE(recovered.empty());
+
+        for (int i = 0; i < 3; ++i) {
+            ASSERT_TRUE(spool.waitDurable(spool.recordEnqueue(makeItem(i))));
+        }
+        QueueItem retried = makeItem(1);
+        retried.status = EmailStatus::RETRY;
+        retried.retry_count = 1;
+        retried.retry_delay = std::chrono::seconds(120);
+        retried.error_message = "451 try later";
+        retried.to_addresses = {"still-owed@example.test"};
+        spool.recordAttempt(retried);
+
+        QueueItem sent = makeItem(0);
+        sent.status = EmailStatus::SENT;
+        spool.recordComplete(sent);
+    }
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+    ASSERT_EQ(recovered.size(), 2u);
+    EXPECT_EQ(recovered[0].id, "id-1");
+    EXPECT_EQ(recovered[0].status, EmailStatus::RETRY);
+    EXPECT_EQ(recovered[0].retry_count, 1);
+    EXPECT_EQ(recovered[0].retry_delay, std::chrono::seconds(120));
+    EXPECT_EQ(recovered[0].error_message, "451 try later");
+    EXPECT_EQ(recovered[0].to_addresses, std::vector<std::string>{"still-owed@example.test"});
+    EXPECT_EQ(recovered[0].priority, EmailPriority::HIGH);
+    EXPECT_EQ(recovered[1].id, "id-2");
+    EXPECT_EQ(recovered[1].to_addresses, std::vector<std::string>{"rcpt2@example.test"});
+    EXPECT_EQ(recovered[1].body, "Body 2\r\n.\r\n");
+    EXPECT_EQ(spool.getStats().recovered, 2u);
+}
+
+// Test 2: A process killed without closing keeps exactly what waitDurable() confirmed
+TEST_F(QueueSpoolTest, SurvivesCrash) {
+    pid_t child = fork();
+    ASSERT_GE(child, 0);
+    if (child == 0) {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        if (!spool.open(recovered)) {
+            _exit(2);
+        }
+        uint64_t sequence = 0;
+        for (int i = 0; i < 50; ++i) {
+            sequence = spool.recordEnqueue(makeItem(i));
+        }
+        if (!spool.waitDurable(sequence)) {
+            _exit(3);
+        }
+        // No destructors, no final commit
+        _exit(0);
+    }
+    int status = 0;
+    ASSERT_EQ(waitpid(child, &status, 0), child);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+    ASSERT_EQ(recovered.size(), 50u);
+    for (int i = 0; i < 50; ++i) {
+        EXPECT_EQ(recovered[i].id, "id-" + std::to_string(i));
+    }
+}
+
+// Test 3: A record torn by a crash mid-write is cut off and the spool stays usable
+TEST_F(QueueSpoolTest, TruncatesTornRecord) {
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered));
+        for (int i = 0; i < 2; ++i) {
+            spool.recordEnqueue(makeItem(i));
+        }
+        ASSERT_TRUE(spool.flush());
+    }
+
+    auto files = segmentFiles();
+    ASSERT_EQ(files.size(), 1u);
+    auto intact = std::filesystem::file_size(files[0]);
+    {
+        // The first bytes of a record whose payload never made it to disk
+        std::ofstream out(files[0], std::ios::binary | std::ios::app);
+        out.write("\x40\x00\x00\x00\x12\x34\x56\x78\x01" "abc", 12);
+    }
+
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+        EXPECT_EQ(recovered.size(), 2u);
+        EXPECT_EQ(std::filesystem::file_size(files[0]), intact);
+        spool.recordEnqueue(makeItem(2));
+    }
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered));
+    ASSERT_EQ(recovered.size(), 3u);
+    EXPECT_EQ(recovered[2].id, "id-2");
+}
+
+// Test 4: Sealed segments are deleted or compacted once their mail is delivered
+TEST_F(QueueSpoolTest, CompactsSegments) {
+    options_.segment_size = 4096;
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered));
+        for (int i = 0; i < 300; ++i) {
+            spool.recordEnqueue(makeItem(i));
+        }
+        ASSERT_TRUE(spool.flush());
+        size_t before = spool.getStats().segments;
+        EXPECT_GT(before, 5u);
+
+        // Keep every hundredth message live, in a retry state
+        for (int i = 0; i < 300; ++i) {
+            QueueItem item = makeItem(i);
+            if (i % 100 == 7) {
+                item.status = EmailStatus::RETRY;
+                item.retry_count = 2;
+                spool.recordAttempt(item);
+            } else {
+                item.status = EmailStatus::SENT;
+                spool.recordComplete(item);
+            }
+        }
+        ASSERT_TRUE(spool.flush());
+        spool.compact();
+
+        QueueSpoolStats stats = spool.getStats();
+        EXPECT_EQ(stats.live, 3u);
+        EXPECT_GT(stats.compacted, 0u);
+        EXPECT_LT(stats.segments, before);
+        EXPECT_EQ(stats.segments, segmentFiles().size());
+    }
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+    ASSERT_EQ(recovered.size(), 3u);
+    EXPECT_EQ(recovered[0].id, "id-7");
+    EXPECT_EQ(recovered[1].id, "id-107");
+    EXPECT_EQ(recovered[2].id, "id-207");
+    for (const auto& item : recovered) {
+        EXPECT_EQ(item.status, EmailStatus::RETRY);
+        EXPECT_EQ(item.retry_count, 2);
+    }
+}
+
+// Test 5: Concurrent durable enqueues share fsyncs instead of paying one each
+TEST_F(QueueSpoolTest, GroupsCommits) {
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered));
+
+    const int threads = 8;
+    const int per_thread = 40;
+    std::atomic<int> failures(0);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < per_thread; ++i) {
+                if (!spool.waitDurable(spool.recordEnqueue(makeItem(t * per_thread + i)))) {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(failures, 0);
+    QueueSpoolStats stats = spool.getStats();
+    EXPECT_EQ(stats.records, static_cast<size_t>(threads * per_thread));
+    EXPECT_LT(stats.commits * 2, stats.records);
+}
+
+// Test 6: EmailQueue re-queues spooled mail it did not deliver before shutting down
+TEST_F(QueueSpoolTest, EmailQueueRecoversQueuedMail) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "Spooled";
+    email.body = "Hello";
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(options_));
+        queue.enqueue(&email);
+        queue.enqueue(&email, EmailPriority::HIGH);
+        EXPECT_EQ(queue.size(), 2u);
+    }
+
+    std::atomic<int> sent(0);
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(options_));
+        ASSERT_EQ(queue.size(), 2u);
+        queue.setSendCallback([&](const Email* delivered) {
+            EXPECT_EQ(delivered->subject, "Spooled");
+            sent++;
+            return SMTPResult::createSuccess("sent");
+        });
+        queue.start();
+        for (int i = 0; i < 100 && sent < 2; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        queue.stop();
+        EXPECT_EQ(sent, 2);
+    }
+
+    EmailQueue queue;
+    ASSERT_TRUE(queue.enableSpool(options_));
+    EXPECT_EQ(queue.size(), 0u);
+}
+
+// Test 7: A payload shared by many messages is written once and outlives compaction
+TEST_F(QueueSpoolTest, StoresSharedPayloadsOnce) {
+    options_.segment_size = 4096;
+    auto content = std::make_shared<Email>();
+    content->body = std::string(2000, 'x');
+    content->html_body = "<p>" + std::string(1000, 'y') + "</p>";
+    auto shared = [&](int n) {
+        QueueItem item = makeItem(n);
+        item.body.clear();
+        item.payload = content;
+        item.payload_digest = 42;
+        return item;
+    };
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered));
+        for (int i = 0; i < 200; ++i) {
+            spool.recordEnqueue(shared(i));
+        }
+        ASSERT_TRUE(spool.flush());
+        EXPECT_EQ(spool.getStats().payloads, 1u);
+        uintmax_t bytes = 0;
+        for (const auto& file : segmentFiles()) {
+            bytes += std::filesystem::file_size(file);
+        }
+        EXPECT_LT(bytes, 200u * 1000u);
+
+        for (int i = 0; i < 200; ++i) {
+            if (i % 50 != 3) {
+                QueueItem item = shared(i);
+                item.status = EmailStatus::SENT;
+                spool.recordComplete(item);
+            }
+        }
+        ASSERT_TRUE(spool.flush());
+        spool.compact();
+        EXPECT_EQ(spool.getStats().live, 4u);
+        EXPECT_EQ(spool.getStats().payloads, 1u);
+        EXPECT_EQ(spool.getStats().segments, segmentFiles().size());
+    }
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    ASSERT_TRUE(spool.open(recovered)) << spool.getError();
+    ASSERT_EQ(recovered.size(), 4u);
+    for (const auto& item : recovered) {
+        EXPECT_EQ(item.payload_digest, 42u);
+        EXPECT_EQ(item.bodyText(), content->body);
+        EXPECT_EQ(item.htmlBodyText(), content->html_body);
+        EXPECT_EQ(item.payload, recovered[0].payload);
+    }
+    EXPECT_EQ(spool.getStats().payloads, 1u);
+
+    for (auto& item : recovered) {
+        item.status = EmailStatus::SENT;
+        spool.recordComplete(item);
+    }
+    EXPECT_EQ(spool.getStats().payloads, 0u);
+}
+
+// Test 8: Mail taken with dequeue() is the caller's and does not come back after a restart
+TEST_F(QueueSpoolTest, DequeuedMailIsNotRecovered) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = "Spooled";
+    email.body = "Hello";
+    {
+        EmailQueue queue;
+        ASSERT_TRUE(queue.enableSpool(options_));
+        queue.enqueue(&email);
+        queue.enqueue(&email);
+        QueueItem taken;
+        ASSERT_TRUE(queue.dequeue(taken));
+        EXPECT_EQ(taken.subject, "Spooled");
+        EXPECT_EQ(queue.size(), 1u);
+    }
+
+    EmailQueue queue;
+    ASSERT_TRUE(queue.enableSpool(options_));
+    EXPECT_EQ(queue.size(), 1u);
+    QueueItem taken;
+    ASSERT_TRUE(queue.dequeue(taken));
+    EXPECT_FALSE(queue.dequeue(taken));
+}
+
+// Test 9: A spool holding mail compressed with a codec this build lacks is left
+// closed and untouched, rather than replayed without that mail
+TEST_F(QueueSpoolTest, RefusesPayloadsItCannotDecompress) {
+    {
+        QueueSpool spool(options_);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered));
+        spool.recordEnqueue(makeItem(0));
+        QueueItem packed = makeItem(1);
+        auto payload = std::make_shared<PackedPayload>();
+        payload->body_codec = static_cast<PayloadCodec>(9);   // As written by some other build
+        payload->body = "compressed";
+        payload->body_size = 64;
+        packed.packed = payload;
+        spool.recordEnqueue(packed);
+        ASSERT_TRUE(spool.flush());
+    }
+
+    auto files = segmentFiles();
+    ASSERT_EQ(files.size(), 1u);
+    auto size = std::filesystem::file_size(files[0]);
+
+    QueueSpool spool(options_);
+    std::vector<QueueItem> recovered;
+    EXPECT_FALSE(spool.open(recovered));
+    EXPECT_NE(spool.getError().find("id-1"), std::string::npos) << spool.getError();
+    EXPECT_TRUE(recovered.empty());
+    ASSERT_EQ(segmentFiles().size(), 1u);
+    EXPECT_EQ(std::filesystem::file_size(files[0]), size);
+}
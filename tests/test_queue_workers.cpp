@@ -0,0 +1,308 @@
+#include <gtest/gtest.h>
+#include "core/queue/email_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+Email makeEmail(const std::string& subject) {
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.subject = subject;
+    email.body = "Hello";
+    return email;
+}
+
+template <typename Predicate>
+bool waitFor(Predicate predicate, std::chrono::milliseconds timeout = std::chrono::milliseconds(5000)) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!predicate()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    return true;
+}
+
+} // namespace
+
+// Test 1: A send that hangs holds up only itself; the rest of its batch is stolen
+TEST(QueueWorkersTest, SlowSendDoesNotBlockOthers) {
+    EmailQueue queue;
+    queue.setWorkerCount(4);
+    std::atomic<bool> release(false);
+    std::atomic<int> fast(0);
+    queue.setSendCallback([&](const Email* email) {
+        if (email->subject == "slow") {
+            while (!release) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        } else {
+            fast++;
+        }
+        return SMTPResult::createSuccess("sent");
+    });
+
+    Email slow = makeEmail("slow");
+    queue.enqueue(&slow, EmailPriority::HIGH);
+    Email email = makeEmail("fast");
+    for (int i = 0; i < 30; ++i) {
+        queue.enqueue(&email);
+    }
+    queue.start();
+
+    EXPECT_TRUE(waitFor([&] { return fast == 30; }));
+    release = true;
+    EXPECT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 31; }));
+
+    size_t stolen = 0;
+    for (const auto& worker : queue.getWorkerStats()) {
+        stolen += worker.stolen;
+    }
+    EXPECT_GT(stolen, 0u);
+    queue.stop();
+}
+
+// Test 2: Sends run on several workers at once
+TEST(QueueWorkersTest, SendsConcurrently) {
+    EmailQueue queue;
+    queue.setWorkerCount(4);
+    std::atomic<int> active(0);
+    std::atomic<int> peak(0);
+    queue.setSendCallback([&](const Email*) {
+        int now = ++active;
+        int seen = peak;
+        while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        active--;
+        return SMTPResult::createSuccess("sent");
+    });
+
+    Email email = makeEmail("parallel");
+    for (int i = 0; i < 40; ++i) {
+        queue.enqueue(&email);
+    }
+    queue.start();
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 40; }));
+
+    EXPECT_GE(peak, 3);
+    auto stats = queue.getWorkerStats();
+    ASSERT_EQ(stats.size(), 4u);
+    size_t processed = 0;
+    for (const auto& worker : stats) {
+        processed += worker.processed;
+        EXPECT_GE(worker.utilization, 0.0);
+        EXPECT_LE(worker.utilization, 1.0);
+    }
+    EXPECT_EQ(processed, 40u);
+    queue.stop();
+}
+
+// Test 3: The pool grows and shrinks while running without losing or repeating mail
+TEST(QueueWorkersTest, ResizesWhileRunning) {
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    std::mutex mutex;
+    std::map<std::string, int> deliveries;
+    queue.setSendCallback([&](const Email* email) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        std::lock_guard<std::mutex> lock(mutex);
+        deliveries[email->subject]++;
+        return SMTPResult::createSuccess("sent");
+    });
+
+    queue.start();
+    for (int i = 0; i < 200; ++i) {
+        Email email = makeEmail("message " + std::to_string(i));
+        queue.enqueue(&email);
+        if (i == 50) {
+            queue.setWorkerCount(8);
+            EXPECT_EQ(queue.getWorkerStats().size(), 8u);
+        } else if (i == 120) {
+            queue.setWorkerCount(1);
+            EXPECT_EQ(queue.getWorkerStats().size(), 1u);
+        }
+    }
+    EXPECT_EQ(queue.getWorkerCount(), 1u);
+
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 200; }));
+    queue.stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(deliveries.size(), 200u);
+    for (const auto& delivery : deliveries) {
+        EXPECT_EQ(delivery.second, 1) << delivery.first;
+    }
+}
+
+// Test 4: A moved-in email reaches the sender without its body being copied
+TEST(QueueWorkersTest, HandsOverMessageWithoutCopying) {
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    Email email = makeEmail("large");
+    email.body.assign(1 << 20, 'x');
+    email.attachments = {"report.pdf"};
+    const char* buffer = email.body.data();
+
+    std::mutex mutex;
+    std::vector<const char*> seen;
+    queue.setSendCallback([&](const Email* sent) {
+        std::lock_guard<std::mutex> lock(mutex);
+        seen.push_back(sent->body.data());
+        EXPECT_EQ(sent->body.size(), 1u << 20);
+        EXPECT_EQ(sent->attachments, std::vector<std::string>{"report.pdf"});
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.enqueue(std::move(email));
+
+    // Inspection still sees the payload in the copies it returns
+    std::vector<QueueItem> pending = queue.getPendingEmails();
+    ASSERT_EQ(pending.size(), 1u);
+    EXPECT_EQ(pending[0].body.size(), 1u << 20);
+    EXPECT_EQ(pending[0].payloadSize(), (1u << 20) + 10);
+
+    queue.start();
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 1; }));
+    queue.stop();
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(seen.size(), 1u);
+    EXPECT_EQ(seen[0], buffer);
+}
+
+// Test 5: URGENT mail goes ahead of the rest of a worker's batch; latency is reported per priority
+TEST(QueueWorkersTest, UrgentPreemptsBatch) {
+    EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setBatchSize(10);
+    std::atomic<bool> urgent_queued(false);
+    std::mutex mutex;
+    std::vector<std::string> order;
+    queue.setSendCallback([&](const Email* email) {
+        if (email->subject == "bulk 0") {
+            waitFor([&] { return urgent_queued.load(); });
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        order.push_back(email->subject);
+        return SMTPResult::createSuccess("sent");
+    });
+
+    for (int i = 0; i < 10; ++i) {
+        queue.enqueue(makeEmail("bulk " + std::to_string(i)));
+    }
+    queue.start();
+    ASSERT_TRUE(waitFor([&] { return queue.getInFlight() == 0 && queue.getStatusCounts().pending == 0; }));
+    queue.enqueue(makeEmail("urgent"), EmailPriority::URGENT);
+    urgent_queued = true;
+    ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 11; }));
+    queue.stop();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(order.size(), 11u);
+        EXPECT_EQ(order[0], "bulk 0");
+        EXPECT_EQ(order[1], "urgent");
+        EXPECT_EQ(order[2], "bulk 1");
+    }
+
+    std::vector<QueueLatencyStats> latency = queue.getLatencyStats();
+    ASSERT_EQ(latency.size(), 4u);
+    EXPECT_EQ(latency[static_cast<int>(EmailPriority::NORMAL)].samples, 10u);
+    const QueueLatencyStats& urgent = latency[static_cast<int>(EmailPriority::URGENT)];
+    EXPECT_EQ(urgent.priority, EmailPriority::URGENT);
+    EXPECT_EQ(urgent.samples, 1u);
+    EXPECT_EQ(latency[static_cast<int>(EmailPriority::LOW)].samples, 0u);
+    for (const auto& level : latency) {
+        EXPECT_LE(level.p50, level.p90);
+        EXPECT_LE(level.p90, level.p99);
+        EXPECT_LE(level.p99, level.max);
+    }
+}
+
+// Test 6: Reserved workers and in-flight slots stay free for URGENT mail
+TEST(QueueWorkersTest, ReservesCapacityForUrgent) {
+    {
+        EmailQueue queue;
+        queue.setWorkerCount(2);
+        queue.setUrgentReserve(0.5);
+        std::atomic<bool> release(false);
+        std::atomic<int> sending(0);
+        std::atomic<int> most(0);
+        std::atomic<bool> urgent_sent(false);
+        queue.setSendCallback([&](const Email* email) {
+            if (email->subject == "urgent") {
+                urgent_sent = true;
+                return SMTPResult::createSuccess("sent");
+            }
+            int now = ++sending;
+            int seen = most;
+            while (now > seen && !most.compare_exchange_weak(seen, now)) {
+            }
+            waitFor([&] { return release.load(); });
+            sending--;
+            return SMTPResult::createSuccess("sent");
+        });
+
+        for (int i = 0; i < 5; ++i) {
+            queue.enqueue(makeEmail("bulk"));
+        }
+        queue.start();
+        ASSERT_TRUE(waitFor([&] { return sending.load() == 1; }));
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_EQ(most, 1);
+
+        // The bulk worker is stuck; the reserved one sends this at once
+        queue.enqueue(makeEmail("urgent"), EmailPriority::URGENT);
+        EXPECT_TRUE(waitFor([&] { return urgent_sent.load(); }));
+        release = true;
+        ASSERT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 6; }));
+        queue.stop();
+        EXPECT_EQ(most, 1);
+    }
+
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    queue.setMaxInFlight(4);
+    queue.setUrgentReserve(0.25);
+    std::mutex mutex;
+    std::vector<std::pair<std::string, EmailQueue::CompletionCallback>> pending;
+    std::atomic<bool> answer(false);
+    queue.setAsyncSendCallback([&](std::shared_ptr<const Email> email, EmailQueue::CompletionCallback done) {
+        if (answer) {
+            done(SMTPResult::createSuccess("sent"));
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.emplace_back(email->subject, std::move(done));
+    });
+    for (int i = 0; i < 10; ++i) {
+        queue.enqueue(makeEmail("bulk"));
+    }
+    queue.start();
+    ASSERT_TRUE(waitFor([&] { return queue.getInFlight() == 3; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(queue.getInFlight(), 3u);
+
+    queue.enqueue(makeEmail("urgent"), EmailPriority::URGENT);
+    ASSERT_TRUE(waitFor([&] { return queue.getInFlight() == 4; }));
+    std::vector<std::pair<std::string, EmailQueue::CompletionCallback>> sent;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ASSERT_EQ(pending.size(), 4u);
+        EXPECT_EQ(pending.back().first, "urgent");
+        sent.swap(pending);
+    }
+    answer = true;
+    for (auto& entry : sent) {
+        entry.second(SMTPResult::createSuccess("sent"));
+    }
+    EXPECT_TRUE(waitFor([&] { return queue.getTotalProcessed() == 11; }));
+    queue.stop();
+}
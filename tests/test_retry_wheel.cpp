@@ -0,0 +1,137 @@
+#include <gtest/gtest.h>
+#include "core/queue/retry_wheel.hpp"
+#include "core/queue/email_queue.hpp"
+#include "core/queue/queue_spool.hpp"
+#include <unistd.h>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <thread>
+
+using namespace ssmtp_mailer;
+using Clock = std::chrono::system_clock;
+
+namespace {
+
+QueueItem makeItem(const std::string& id) {
+    QueueItem item("sender@example.test", {"rcpt@example.test"}, "Retry", "Body");
+    item.id = id;
+    item.status = EmailStatus::RETRY;
+    return item;
+}
+
+} // namespace
+
+// Test 1: Items come out once each, never before they are due, however far apart the steps
+TEST(RetryWheelTest, ReleasesItemsWhenDue) {
+    Clock::time_point start(std::chrono::milliseconds(1700000000123LL));
+    RetryTimerWheel wheel(start);
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<long long> delay(0, 10LL * 24 * 3600 * 1000);
+    std::map<std::string, Clock::time_point> due;
+    for (int i = 0; i < 5000; ++i) {
+        std::string id = "id-" + std::to_string(i);
+        // Mix short, mid-range and very long delays
+        long long ms = delay(rng) >> (i % 4 * 8);
+        due[id] = start + std::chrono::milliseconds(ms);
+        wheel.schedule(makeItem(id), due[id]);
+    }
+    EXPECT_EQ(wheel.size(), 5000u);
+
+    std::uniform_int_distribution<long long> step(1, 90LL * 60 * 1000);
+    Clock::time_point now = start;
+    std::map<std::string, int> released;
+    std::vector<QueueItem> batch;
+    while (!wheel.empty()) {
+        now += std::chrono::milliseconds(step(rng) >> (rng() % 20));
+        batch.clear();
+        wheel.advance(now, batch);
+        Clock::time_point previous = start;
+        for (const auto& item : batch) {
+            ASSERT_LE(due[item.id], now) << item.id;
+            ASSERT_GE(due[item.id], previous) << "out of order: " << item.id;
+            previous = due[item.id];
+            released[item.id]++;
+        }
+    }
+    ASSERT_EQ(released.size(), 5000u);
+    for (const auto& entry : released) {
+        EXPECT_EQ(entry.second, 1) << entry.first;
+    }
+}
+
+// Test 2: Sleeping until nextDeadline() reaches an item in a few exact steps
+TEST(RetryWheelTest, ReportsNextDeadline) {
+    Clock::time_point start(std::chrono::milliseconds(1700000000000LL));
+    RetryTimerWheel wheel(start);
+    Clock::time_point deadline;
+    EXPECT_FALSE(wheel.nextDeadline(deadline));
+
+    Clock::time_point due = start + std::chrono::hours(5) + std::chrono::milliseconds(417);
+    wheel.schedule(makeItem("late"), due);
+    wheel.schedule(makeItem("now"), start - std::chrono::seconds(1));
+
+    ASSERT_TRUE(wheel.nextDeadline(deadline));
+    EXPECT_EQ(deadline, start);
+    std::vector<QueueItem> batch;
+    ASSERT_EQ(wheel.advance(start, batch), 1u);
+    EXPECT_EQ(batch[0].id, "now");
+
+    int wakeups = 0;
+    batch.clear();
+    while (batch.empty()) {
+        ASSERT_TRUE(wheel.nextDeadline(deadline));
+        ASSERT_LE(deadline, due);
+        ASSERT_LT(++wakeups, 12);
+        wheel.advance(deadline, batch);
+    }
+    EXPECT_EQ(deadline, due);
+    EXPECT_EQ(batch[0].id, "late");
+    EXPECT_FALSE(wheel.nextDeadline(deadline));
+}
+
+// Test 3: The queue sends a deferred retry as soon as it is due, not on a polling tick
+TEST(RetryWheelTest, QueueSendsRetryWhenDue) {
+    std::string directory = ::testing::TempDir() + "ssmtp_retry_" + std::to_string(getpid());
+    std::filesystem::remove_all(directory);
+    QueueSpoolOptions options;
+    options.directory = directory;
+
+    // Seed a spool with an email whose retry falls due in 300ms
+    Clock::time_point due = Clock::now() + std::chrono::milliseconds(300);
+    {
+        QueueSpool spool(options);
+        std::vector<QueueItem> recovered;
+        ASSERT_TRUE(spool.open(recovered));
+        QueueItem item = makeItem("deferred");
+        item.retry_count = 1;
+        item.retry_delay = std::chrono::seconds(60);
+        item.last_attempt = due - item.retry_delay;
+        ASSERT_TRUE(spool.waitDurable(spool.recordEnqueue(item)));
+    }
+
+    EmailQueue queue;
+    std::atomic<long long> sent_at(0);
+    queue.setSendCallback([&](const Email*) {
+        sent_at = std::chrono::duration_cast<std::chrono::milliseconds>(
+            Clock::now().time_since_epoch()).count();
+        return SMTPResult::createSuccess("sent");
+    });
+    ASSERT_TRUE(queue.enableSpool(options));
+    EXPECT_EQ(queue.size(), 1u);
+    EXPECT_EQ(queue.getPendingEmails().size(), 1u);
+    queue.start();
+
+    for (int i = 0; i < 200 && sent_at == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    queue.stop();
+    std::filesystem::remove_all(directory);
+
+    ASSERT_NE(sent_at, 0);
+    long long due_ms = std::chrono::duration_cast<std::chrono::milliseconds>(due.time_since_epoch()).count();
+    EXPECT_GE(sent_at, due_ms);
+    EXPECT_LT(sent_at, due_ms + 50);
+}
@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+#include "core/queue/schedule_store.hpp"
+#include "core/queue/email_queue.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+using namespace ssmtp_mailer;
+
+namespace {
+
+using Clock = std::chrono::system_clock;
+
+class ScheduleStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        directory_ = ::testing::TempDir() + "ssmtp_schedule_" + std::to_string(getpid()) + "_" +
+                     ::testing::UnitTest::GetInstance()->current_test_info()->name();
+        std::filesystem::remove_all(directory_);
+        options_.directory = directory_;
+        options_.bucket_width = std::chrono::seconds(60);
+        options_.window = std::chrono::seconds(60);
+        options_.sync = false;
+        // A bucket boundary, so offsets below land in predictable buckets
+        base_ = Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+            std::chrono::hours(24 * 365 * 60)));
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(directory_);
+    }
+
+    QueueItem makeItem(const std::string& subject, std::chrono::seconds offset) {
+        QueueItem item("sender@example.test", {"rcpt@example.test"}, subject, "Body of " + subject);
+        item.id = subject;
+        item.scheduled_for = base_ + offset;
+        return item;
+    }
+
+    std::vector<std::string> subjects(const std::vector<QueueItem>& items) {
+        std::vector<std::string> result;
+        for (const auto& item : items) {
+            result.push_back(item.subject);
+        }
+        return result;
+    }
+
+    // The bucket part of an email id
+    static std::string bucketOf(const std::string& id) {
+        return id.substr(0, id.find('-'));
+    }
+
+    size_t bucketFiles() const {
+        if (!std::filesystem::exists(directory_)) {
+            return 0;
+        }
+        size_t count = 0;
+        for (const auto& file : std::filesystem::directory_iterator(directory_)) {
+            (void)file;
+            count++;
+        }
+        return count;
+    }
+
+    std::string directory_;
+    ScheduleStoreOptions options_;
+    Clock::time_point base_;
+};
+
+} // namespace
+
+// Test 1: Only the buckets within the window are in memory; due emails come out in order, also after a reopen
+TEST_F(ScheduleStoreTest, HoldsOnlyTheWindowInMemory) {
+    {
+        ScheduleStore store(options_);
+        ASSERT_TRUE(store.open()) << store.getError();
+        for (int minute = 0; minute < 10; ++minute) {
+            for (int i = 0; i < 5; ++i) {
+                std::string id = store.schedule(makeItem(std::to_string(minute) + "." + std::to_string(i),
+                                                         std::chrono::seconds(minute * 60 + 50 - i * 10)));
+                ASSERT_FALSE(id.empty()) << store.getError();
+            }
+        }
+        ScheduleStoreStats stats = store.getStats();
+        EXPECT_EQ(stats.buckets, 10u);
+        EXPECT_EQ(stats.loaded, 0u);
+        EXPECT_EQ(stats.in_memory, 0u);
+        EXPECT_EQ(stats.scheduled, 50u);
+    }
+
+    ScheduleStore store(options_);
+    ASSERT_TRUE(store.open()) << store.getError();
+    Clock::time_point deadline;
+    ASSERT_TRUE(store.nextDeadline(deadline));
+    EXPECT_EQ(deadline, base_ - std::chrono::seconds(60));
+
+    // Two minutes in: buckets 0-2 are within the window, 0 and 1 are due
+    std::vector<QueueItem> due;
+    EXPECT_EQ(store.takeDue(base_ + std::chrono::seconds(120), due), 10u);
+    EXPECT_EQ(subjects(due), (std::vector<std::string>{"0.4", "0.3", "0.2", "0.1", "0.0",
+                                                       "1.4", "1.3", "1.2", "1.1", "1.0"}));
+    ScheduleStoreStats stats = store.getStats();
+    EXPECT_EQ(stats.loaded, 3u);
+    EXPECT_EQ(stats.in_memory, 5u);
+    EXPECT_EQ(stats.taken, 10u);
+    EXPECT_EQ(due[0].body, "Body of 0.4");
+
+    // Buckets 0 and 1 are over and emptied; the next work is bucket 3 coming within the window
+    store.retireTaken();
+    EXPECT_EQ(bucketFiles(), 8u);
+    ASSERT_TRUE(store.nextDeadline(deadline));
+    EXPECT_EQ(deadline, base_ + std::chrono::seconds(120));
+
+    // Partway through bucket 2 only its earlier emails are due
+    due.clear();
+    EXPECT_EQ(store.takeDue(base_ + std::chrono::seconds(145), due), 2u);
+    EXPECT_EQ(subjects(due), (std::vector<std::string>{"2.4", "2.3"}));
+    stats = store.getStats();
+    EXPECT_EQ(stats.buckets, 8u);
+    EXPECT_EQ(stats.in_memory, 3u + 5u);
+}
+
+// Test 2: Cancelling and rescheduling work on loaded and unloaded buckets and survive a reopen
+TEST_F(ScheduleStoreTest, CancelAndRescheduleSurviveReopen) {
+    std::string near_cancelled, near_moved, far_cancelled, far_moved, kept;
+    {
+        ScheduleStore store(options_);
+        ASSERT_TRUE(store.open()) << store.getError();
+        near_cancelled = store.schedule(makeItem("near cancelled", std::chrono::seconds(10)));
+        near_moved = store.schedule(makeItem("near moved", std::chrono::seconds(20)));
+        far_cancelled = store.schedule(makeItem("far cancelled", std::chrono::seconds(3600)));
+        far_moved = store.schedule(makeItem("far moved", std::chrono::seconds(3610)));
+        kept = store.schedule(makeItem("kept", std::chrono::seconds(30)));
+        EXPECT_NE(bucketOf(near_cancelled), bucketOf(far_cancelled));
+
+        // Read the near bucket into memory; the far ones stay on disk
+        std::vector<QueueItem> due;
+        EXPECT_EQ(store.takeDue(base_, due), 0u);
+        EXPECT_EQ(store.getStats().in_memory, 3u);
+
+        EXPECT_TRUE(store.cancel(near_cancelled));
+        EXPECT_FALSE(store.cancel(near_cancelled));
+        EXPECT_TRUE(store.cancel(far_cancelled));
+        EXPECT_FALSE(store.cancel("0-unknown"));
+        EXPECT_FALSE(store.cancel("not an id"));
+
+        // Into the same bucket keeps the id; into another gives a new one
+        EXPECT_EQ(store.reschedule(near_moved, base_ + std::chrono::seconds(5)), near_moved);
+        far_moved = store.reschedule(far_moved, base_ + std::chrono::seconds(40));
+        ASSERT_FALSE(far_moved.empty());
+        EXPECT_EQ(bucketOf(far_moved), bucketOf(kept));
+        EXPECT_TRUE(store.reschedule(far_cancelled, base_).empty());
+
+        ScheduleStoreStats stats = store.getStats();
+        EXPECT_EQ(stats.cancelled, 2u);
+        EXPECT_EQ(stats.rescheduled, 2u);
+    }
+
+    ScheduleStore store(options_);
+    ASSERT_TRUE(store.open()) << store.getError();
+    std::vector<QueueItem> due;
+    EXPECT_EQ(store.takeDue(base_ + std::chrono::hours(2), due), 3u);
+    EXPECT_EQ(subjects(due), (std::vector<std::string>{"near moved", "kept", "far moved"}));
+    EXPECT_EQ(due[0].id, near_moved);
+    EXPECT_EQ(due[2].id, far_moved);
+    EXPECT_EQ(due[2].scheduled_for, base_ + std::chrono::seconds(40));
+
+    // Everything is over and handed out, so every file can go
+    store.retireTaken();
+    EXPECT_EQ(bucketFiles(), 0u);
+    Clock::time_point deadline;
+    EXPECT_FALSE(store.nextDeadline(deadline));
+}
+
+// Test 3: A record torn by a crash is dropped and cut off before the bucket is appended to
+TEST_F(ScheduleStoreTest, TruncatesTornRecord) {
+    std::string first;
+    {
+        ScheduleStore store(options_);
+        ASSERT_TRUE(store.open()) << store.getError();
+        first = store.schedule(makeItem("first", std::chrono::seconds(10)));
+        ASSERT_FALSE(store.schedule(makeItem("second", std::chrono::seconds(20))).empty());
+    }
+    std::filesystem::path file = std::filesystem::directory_iterator(directory_)->path();
+    auto size = std::filesystem::file_size(file);
+    std::filesystem::resize_file(file, size - 7);
+    {
+        std::ofstream torn(file, std::ios::binary | std::ios::app);
+        torn << "\x01\x02" "garbage";
+    }
+
+    ScheduleStore store(options_);
+    ASSERT_TRUE(store.open()) << store.getError();
+    ASSERT_FALSE(store.schedule(makeItem("third", std::chrono::seconds(30))).empty());
+    EXPECT_TRUE(store.cancel(first));
+
+    ScheduleStore reopened(options_);
+    store.close();
+    ASSERT_TRUE(reopened.open()) << reopened.getError();
+    std::vector<QueueItem> due;
+    EXPECT_EQ(reopened.takeDue(base_ + std::chrono::seconds(60), due), 1u);
+    EXPECT_EQ(subjects(due), (std::vector<std::string>{"third"}));
+}
+
+// Test 4: The queue sends scheduled email once due, never a cancelled one
+TEST_F(ScheduleStoreTest, QueueSendsScheduledEmailWhenDue) {
+    options_.bucket_width = std::chrono::seconds(1);
+    options_.window = std::chrono::seconds(1);
+
+    EmailQueue queue;
+    queue.setWorkerCount(2);
+    ASSERT_TRUE(queue.enableScheduleStore(options_));
+    std::mutex mutex;
+    std::vector<std::pair<std::string, Clock::time_point>> sent;
+    queue.setSendCallback([&](const Email* email) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sent.emplace_back(email->subject, Clock::now());
+        return SMTPResult::createSuccess("sent");
+    });
+    queue.start();
+
+    Email email;
+    email.from = "sender@example.test";
+    email.to = {"rcpt@example.test"};
+    email.body = "Later";
+    auto now = Clock::now();
+    email.subject = "later";
+    ASSERT_FALSE(queue.scheduleEmail(&email, now + std::chrono::milliseconds(1500)).empty());
+    email.subject = "sooner";
+    ASSERT_FALSE(queue.scheduleEmail(&email, now + std::chrono::milliseconds(300)).empty());
+    email.subject = "cancelled";
+    std::string cancelled = queue.scheduleEmail(&email, now + std::chrono::milliseconds(600));
+    ASSERT_FALSE(cancelled.empty());
+    EXPECT_TRUE(queue.cancelScheduled(cancelled));
+
+    auto deadline = Clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() < 2 && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    queue.stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_EQ(sent.size(), 2u);
+    EXPECT_EQ(sent[0].first, "sooner");
+    EXPECT_EQ(sent[1].first, "later");
+    // Send times are kept to the millisecond
+    EXPECT_GE(sent[0].second, now + std::chrono::milliseconds(299));
+    EXPECT_GE(sent[1].second, now + std::chrono::milliseconds(1499));
+    EXPECT_LT(sent[1].second, now + std::chrono::milliseconds(3000));
+    EXPECT_EQ(queue.getScheduleStats().taken, 2u);
+}
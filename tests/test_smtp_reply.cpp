@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+#include "core/smtp/smtp_reply.hpp"
+#include <cstring>
+
+using ssmtp_mailer::SMTPReply;
+using ssmtp_mailer::SMTPReplyReader;
+
+namespace {
+
+void feed(SMTPReplyReader& reader, const std::string& data) {
+    size_t available = 0;
+    char* space = reader.prepare(available);
+    ASSERT_GE(available, data.size());
+    std::memcpy(space, data.data(), data.size());
+    reader.commit(data.size());
+}
+
+} // namespace
+
+// Test 1: A multi-line EHLO reply that arrives a byte at a time comes out whole
+TEST(SMTPReplyTest, AssemblesSplitMultiLineReply) {
+    SMTPReplyReader reader;
+    SMTPReply reply;
+    std::string data = "250-mail.example.test Hello\r\n250-PIPELINING\r\n250-SIZE 1024\r\n250 CHUNKING\r\n";
+
+    for (size_t i = 0; i + 1 < data.size(); ++i) {
+        feed(reader, data.substr(i, 1));
+        ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::INCOMPLETE);
+        EXPECT_TRUE(reader.hasBufferedData());
+    }
+    feed(reader, data.substr(data.size() - 1));
+    ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+
+    EXPECT_EQ(reply.code(), 250);
+    ASSERT_EQ(reply.lineCount(), 4u);
+    EXPECT_EQ(reply.line(0), "mail.example.test Hello");
+    EXPECT_EQ(reply.line(2), "SIZE 1024");
+    EXPECT_EQ(reply.line(3), "CHUNKING");
+    EXPECT_EQ(reply.text(), "250-mail.example.test Hello\n250-PIPELINING\n250-SIZE 1024\n250 CHUNKING");
+    EXPECT_TRUE(reply.enhancedStatus().empty());
+    EXPECT_FALSE(reader.hasBufferedData());
+}
+
+// Test 2: Pipelined replies in one read come out one at a time, with enhanced status codes
+TEST(SMTPReplyTest, SplitsPipelinedReplies) {
+    SMTPReplyReader reader;
+    SMTPReply reply;
+    feed(reader, "250 2.1.0 Sender ok\r\n550 5.1.1 <nobody@example.test>: no such user\r\n354 Go ahead\n");
+
+    ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+    EXPECT_EQ(reply.code(), 250);
+    EXPECT_EQ(reply.enhancedStatus(), "2.1.0");
+
+    ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+    EXPECT_EQ(reply.code(), 550);
+    EXPECT_EQ(reply.enhancedStatus(), "5.1.1");
+    EXPECT_EQ(reply.line(0), "5.1.1 <nobody@example.test>: no such user");
+
+    ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+    EXPECT_EQ(reply.code(), 354);
+    EXPECT_TRUE(reply.enhancedStatus().empty());
+
+    EXPECT_EQ(reader.next(reply), SMTPReplyReader::Status::INCOMPLETE);
+    EXPECT_FALSE(reader.hasBufferedData());
+}
+
+// Test 3: Garbage and oversized replies are reported instead of buffered forever
+TEST(SMTPReplyTest, RejectsMalformedReplies) {
+    SMTPReply reply;
+    {
+        SMTPReplyReader reader;
+        feed(reader, "HTTP/1.1 400 Bad Request\r\n");
+        EXPECT_EQ(reader.next(reply), SMTPReplyReader::Status::MALFORMED);
+        EXPECT_NE(reader.getError().find("Malformed SMTP reply"), std::string::npos);
+    }
+    {
+        SMTPReplyReader reader(64);
+        feed(reader, "250-" + std::string(80, 'x'));
+        EXPECT_EQ(reader.next(reply), SMTPReplyReader::Status::MALFORMED);
+        EXPECT_EQ(reader.getError(), "SMTP reply line too long");
+    }
+    {
+        SMTPReplyReader reader(64);
+        feed(reader, "250-" + std::string(40, 'x') + "\r\n250-" + std::string(40, 'y') + "\r\n");
+        EXPECT_EQ(reader.next(reply), SMTPReplyReader::Status::MALFORMED);
+        EXPECT_EQ(reader.getError(), "SMTP reply too long");
+    }
+}
+
+// Test 4: A reply reused for every response stops allocating
+TEST(SMTPReplyTest, ReusesReplyStorage) {
+    SMTPReplyReader reader;
+    SMTPReply reply;
+    std::string line = "250 2.0.0 Ok: queued as ABCDEF0123\r\n";
+
+    for (int i = 0; i < 4; ++i) {
+        feed(reader, line);
+        ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+    }
+    const char* storage = reply.text().data();
+    for (int i = 0; i < 100; ++i) {
+        feed(reader, line);
+        ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+        // Two buffers circulate between the reader and the caller
+        feed(reader, line);
+        ASSERT_EQ(reader.next(reply), SMTPReplyReader::Status::COMPLETE);
+        EXPECT_EQ(reply.text().data(), storage);
+    }
+    EXPECT_EQ(reply.code(), 250);
+}
@@ -0,0 +1,640 @@
+#include <gtest/gtest.h>
+#include "core/smtp/smtp_client.hpp"
+#include "core/smtp/smtp_connection_pool.hpp"
+#include "core/smtp/smtp_event_loop.hpp"
+#include "core/smtp/tls_context.hpp"
+#include "core/queue/email_queue.hpp"
+#include "core/config/config_manager.hpp"
+#include "fake_smtp_server.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+
+class SMTPTransportTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_TRUE(server_.start());
+
+        domain_.name = "example.test";
+        domain_.smtp_server = "127.0.0.1";
+        domain_.smtp_port = server_.port();
+        domain_.auth_method = "NONE";
+        domain_.use_ssl = false;
+        domain_.use_starttls = false;
+        config_.setDomainConfig(domain_);
+
+        email_.from = "sender@example.test";
+        email_.to = {"rcpt@remote.test"};
+        email_.subject = "Native transport";
+        email_.body = "Hello from the native transport";
+    }
+
+    void TearDown() override {
+        server_.stop();
+    }
+
+    ssmtp_test::FakeSMTPServer server_;
+    ssmtp_mailer::ConfigManager config_;
+    ssmtp_mailer::DomainConfig domain_;
+    ssmtp_mailer::Email email_;
+};
+
+// Test 1: Message is delivered in-process without spawning curl
+TEST_F(SMTPTransportTest, SendsMessageNatively) {
+    ssmtp_mailer::SMTPClient client(config_);
+    auto result = client.send(email_);
+
+    ASSERT_TRUE(result.success) << result.error_message;
+    EXPECT_FALSE(result.message_id.empty());
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages[0].from, "sender@example.test");
+    ASSERT_EQ(messages[0].recipients.size(), 1u);
+    EXPECT_EQ(messages[0].recipients[0], "rcpt@remote.test");
+    EXPECT_NE(messages[0].data.find("Subject: Native transport\r\n"), std::string::npos);
+    EXPECT_NE(messages[0].data.find("Message-ID: " + result.message_id), std::string::npos);
+    EXPECT_EQ(server_.countCommands("QUIT"), 1u);
+    EXPECT_FALSE(client.isConnected());
+}
+
+// Test 2: Cc and Bcc recipients are part of the envelope, Bcc is not a header
+TEST_F(SMTPTransportTest, EnvelopeIncludesCcAndBcc) {
+    email_.cc = {"cc@remote.test"};
+    email_.bcc = {"hidden@remote.test"};
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages[0].recipients.size(), 3u);
+    EXPECT_NE(messages[0].data.find("Cc: cc@remote.test\r\n"), std::string::npos);
+    EXPECT_EQ(messages[0].data.find("hidden@remote.test"), std::string::npos);
+}
+
+// Test 3: Bare LF is normalized and leading dots are stuffed
+TEST_F(SMTPTransportTest, CanonicalizesBody) {
+    email_.body = "first line\n.starts with a dot\n.\nlast line";
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_NE(messages[0].data.find("first line\r\n.starts with a dot\r\n.\r\nlast line\r\n"),
+              std::string::npos);
+}
+
+// Test 4: AUTH PLAIN sends authzid NUL authcid NUL password
+TEST_F(SMTPTransportTest, AuthenticatesWithPlain) {
+    domain_.auth_method = "PLAIN";
+    domain_.username = "user";
+    domain_.password = "secret";
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+
+    // base64("\0user\0secret")
+    auto commands = server_.commands();
+    EXPECT_NE(std::find(commands.begin(), commands.end(), "AUTH PLAIN AHVzZXIAc2VjcmV0"), commands.end());
+}
+
+// Test 5: AUTH LOGIN walks through both challenges
+TEST_F(SMTPTransportTest, AuthenticatesWithLogin) {
+    domain_.auth_method = "LOGIN";
+    domain_.username = "user";
+    domain_.password = "secret";
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+    EXPECT_EQ(server_.countCommands("AUTH LOGIN"), 1u);
+    EXPECT_EQ(server_.messages().size(), 1u);
+}
+
+// Test 6: Rejected recipient surfaces the SMTP reply code
+TEST_F(SMTPTransportTest, ReportsRejectedRecipient) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.reject_recipients = {"rcpt@remote.test"};
+    ssmtp_test::FakeSMTPServer rejecting(options);
+    ASSERT_TRUE(rejecting.start());
+    domain_.smtp_port = rejecting.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPClient client(config_);
+    auto result = client.send(email_);
+
+    EXPECT_FALSE(result.success);
+    EXPECT_EQ(result.error_code, 550);
+    EXPECT_TRUE(rejecting.messages().empty());
+}
+
+// Test 7: STARTTLS requested but not offered never falls back to plaintext
+TEST_F(SMTPTransportTest, RefusesMissingStartTLS) {
+    domain_.use_starttls = true;
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPClient client(config_);
+    auto result = client.send(email_);
+
+    EXPECT_FALSE(result.success);
+    EXPECT_NE(result.error_message.find("STARTTLS"), std::string::npos);
+    EXPECT_EQ(server_.countCommands("MAIL FROM"), 0u);
+}
+
+// Test 8: Pooled sessions are reused across messages without reconnecting
+TEST_F(SMTPTransportTest, PoolReusesSessions) {
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+
+    for (int i = 0; i < 3; ++i) {
+        auto result = pool.send(email_);
+        ASSERT_TRUE(result.success) << result.error_message;
+    }
+
+    auto stats = pool.getStats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.open_connections, 1u);
+    EXPECT_EQ(stats.idle_connections, 1u);
+    EXPECT_EQ(server_.connectionCount(), 1u);
+    EXPECT_EQ(server_.countCommands("EHLO"), 1u);
+    EXPECT_EQ(server_.messages().size(), 3u);
+    EXPECT_EQ(server_.countCommands("QUIT"), 0u);
+}
+
+// Test 9: A rejected transaction is reset and the session stays usable
+TEST_F(SMTPTransportTest, PoolResetsAfterRejection) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.reject_recipients = {"bounce@remote.test"};
+    ssmtp_test::FakeSMTPServer rejecting(options);
+    ASSERT_TRUE(rejecting.start());
+    domain_.smtp_port = rejecting.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    ssmtp_mailer::Email bounced = email_;
+    bounced.to = {"bounce@remote.test"};
+
+    EXPECT_FALSE(pool.send(bounced).success);
+    EXPECT_TRUE(pool.send(email_).success);
+
+    EXPECT_EQ(rejecting.connectionCount(), 1u);
+    EXPECT_EQ(rejecting.countCommands("RSET"), 1u);
+    EXPECT_EQ(pool.getStats().hits, 1u);
+}
+
+// Test 10: The pool never exceeds max_connections, evicting idle sessions instead
+TEST_F(SMTPTransportTest, PoolHonorsMaxConnections) {
+    ssmtp_test::FakeSMTPServer second;
+    ASSERT_TRUE(second.start());
+
+    ssmtp_mailer::DomainConfig other = domain_;
+    other.name = "other.test";
+    other.smtp_port = second.port();
+    config_.setDomainConfig(other);
+
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    pool.setMaxConnections(1);
+
+    ssmtp_mailer::Email other_email = email_;
+    other_email.from = "sender@other.test";
+
+    ASSERT_TRUE(pool.send(email_).success);
+    ASSERT_TRUE(pool.send(other_email).success);
+
+    auto stats = pool.getStats();
+    EXPECT_EQ(stats.open_connections, 1u);
+    EXPECT_EQ(stats.evictions, 1u);
+    EXPECT_EQ(server_.countCommands("QUIT"), 1u);
+}
+
+// Test 11: Idle sessions past the timeout are closed
+TEST_F(SMTPTransportTest, PoolEvictsIdleSessions) {
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    ASSERT_TRUE(pool.send(email_).success);
+
+    pool.setIdleTimeout(std::chrono::seconds(0));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    EXPECT_EQ(pool.evictIdle(), 1u);
+
+    auto stats = pool.getStats();
+    EXPECT_EQ(stats.open_connections, 0u);
+    EXPECT_EQ(stats.idle_connections, 0u);
+}
+
+// Test 12: With PIPELINING the envelope is sent in a single write
+TEST_F(SMTPTransportTest, PipelinesEnvelope) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.extensions.push_back("PIPELINING");
+    ssmtp_test::FakeSMTPServer pipelining(options);
+    ASSERT_TRUE(pipelining.start());
+    domain_.smtp_port = pipelining.port();
+    config_.setDomainConfig(domain_);
+
+    email_.to = {"a@remote.test", "b@remote.test", "c@remote.test"};
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+
+    auto messages = pipelining.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_EQ(messages[0].recipients.size(), 3u);
+    // MAIL FROM and all three RCPT TO were followed by buffered commands
+    EXPECT_EQ(pipelining.pipelinedCommands(), 4u);
+}
+
+// Test 13: Pipelined rejections are reported per recipient
+TEST_F(SMTPTransportTest, PipeliningMapsRejectedRecipients) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.extensions.push_back("PIPELINING");
+    options.reject_recipients = {"b@remote.test", "d@remote.test"};
+    ssmtp_test::FakeSMTPServer pipelining(options);
+    ASSERT_TRUE(pipelining.start());
+    domain_.smtp_port = pipelining.port();
+    config_.setDomainConfig(domain_);
+
+    email_.to = {"a@remote.test", "b@remote.test", "c@remote.test", "d@remote.test"};
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    auto result = pool.send(email_);
+
+    EXPECT_FALSE(result.success);
+    EXPECT_EQ(result.error_code, 550);
+    EXPECT_NE(result.error_message.find("b@remote.test"), std::string::npos);
+    EXPECT_EQ(result.rejected_recipients,
+              (std::vector<std::string>{"b@remote.test", "d@remote.test"}));
+    EXPECT_TRUE(pipelining.messages().empty());
+
+    // The aborted session is not reused for the next message
+    email_.to = {"a@remote.test"};
+    EXPECT_TRUE(pool.send(email_).success);
+    EXPECT_EQ(pipelining.messages().size(), 1u);
+    EXPECT_EQ(pipelining.connectionCount(), 2u);
+}
+
+// Test 14: With CHUNKING large messages are streamed as BDAT chunks without dot-stuffing
+TEST_F(SMTPTransportTest, StreamsLargeMessageWithBdat) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.extensions.push_back("CHUNKING");
+    ssmtp_test::FakeSMTPServer chunking(options);
+    ASSERT_TRUE(chunking.start());
+    domain_.smtp_port = chunking.port();
+    config_.setDomainConfig(domain_);
+
+    std::string line(99, 'x');
+    email_.body.clear();
+    for (int i = 0; i < 3000; ++i) {
+        email_.body += line + "\n";
+    }
+    email_.body += ".leading dot";
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+
+    EXPECT_EQ(chunking.countCommands("DATA"), 0u);
+    EXPECT_GE(chunking.countCommands("BDAT"), 5u);
+    auto commands = chunking.commands();
+    EXPECT_EQ(std::count_if(commands.begin(), commands.end(),
+                            [](const std::string& c) { return c.find(" LAST") != std::string::npos; }), 1);
+
+    auto messages = chunking.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_NE(messages[0].data.find(line + "\r\n" + line + "\r\n"), std::string::npos);
+    EXPECT_NE(messages[0].data.find("\r\n.leading dot\r\n"), std::string::npos);
+    EXPECT_EQ(messages[0].data.find("\r\n..leading dot"), std::string::npos);
+}
+
+// Test 15: Attachments are base64-encoded into a multipart/mixed message
+TEST_F(SMTPTransportTest, StreamsAttachments) {
+    std::string path = ::testing::TempDir() + "ssmtp_attachment.bin";
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << std::string("Hello\0World", 11);
+    }
+    email_.attachments = {path};
+
+    ssmtp_mailer::SMTPClient client(config_);
+    ASSERT_TRUE(client.send(email_).success);
+    std::remove(path.c_str());
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    EXPECT_NE(messages[0].data.find("Content-Type: multipart/mixed"), std::string::npos);
+    EXPECT_NE(messages[0].data.find("filename=\"ssmtp_attachment.bin\""), std::string::npos);
+    EXPECT_NE(messages[0].data.find("\r\nSGVsbG8AV29ybGQ=\r\n"), std::string::npos);
+}
+
+// Test 16: A missing attachment fails before the transaction starts
+TEST_F(SMTPTransportTest, RejectsMissingAttachment) {
+    email_.attachments = {"/nonexistent/ssmtp_attachment.bin"};
+
+    ssmtp_mailer::SMTPClient client(config_);
+    auto result = client.send(email_);
+
+    EXPECT_FALSE(result.success);
+    EXPECT_NE(result.error_message.find("attachment"), std::string::npos);
+    EXPECT_EQ(server_.countCommands("MAIL FROM"), 0u);
+}
+
+// Test 17: The event loop keeps many slow transactions in flight on one thread
+TEST_F(SMTPTransportTest, EventLoopRunsSessionsConcurrently) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.extensions.push_back("PIPELINING");
+    options.reply_delay_ms = 50;
+    ssmtp_test::FakeSMTPServer slow(options);
+    ASSERT_TRUE(slow.start());
+    domain_.smtp_port = slow.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPEventLoop loop(config_);
+    loop.setMaxSessions(20);
+    ASSERT_TRUE(loop.start());
+
+    const size_t count = 20;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t done = 0;
+    size_t sent = 0;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_TRUE(loop.submit(email_, [&](const ssmtp_mailer::SMTPResult& result) {
+            std::lock_guard<std::mutex> lock(mutex);
+            done++;
+            sent += result.success ? 1 : 0;
+            cv.notify_one();
+        }));
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done == count; }));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - begin;
+
+    EXPECT_EQ(sent, count);
+    EXPECT_EQ(slow.messages().size(), count);
+    EXPECT_EQ(slow.connectionCount(), count);
+    // Serially each message costs several delayed replies; in parallel the total stays near one
+    EXPECT_LT(elapsed, std::chrono::milliseconds(50 * 4 * count / 2));
+    EXPECT_EQ(loop.getStats().sent, count);
+}
+
+// Test 18: The queue feeds the event loop and sessions are reused between messages
+TEST_F(SMTPTransportTest, QueueFeedsEventLoop) {
+    ssmtp_mailer::SMTPEventLoop loop(config_);
+    loop.setMaxSessions(1);
+    ASSERT_TRUE(loop.start());
+
+    ssmtp_mailer::EmailQueue queue;
+    queue.setAsyncSendCallback([&loop](std::shared_ptr<const ssmtp_mailer::Email> email,
+                                       ssmtp_mailer::EmailQueue::CompletionCallback done) {
+        loop.submit(std::move(email), std::move(done));
+    });
+    for (int i = 0; i < 5; ++i) {
+        queue.enqueue(&email_);
+    }
+    queue.start();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() < 5 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    queue.stop();
+
+    EXPECT_EQ(queue.getTotalProcessed(), 5u);
+    EXPECT_EQ(queue.getTotalFailed(), 0u);
+    EXPECT_EQ(queue.getInFlight(), 0u);
+    EXPECT_EQ(server_.messages().size(), 5u);
+    EXPECT_EQ(server_.connectionCount(), 1u);
+    EXPECT_EQ(server_.countCommands("EHLO"), 1u);
+}
+
+// Test 19: Stopping the loop fails messages that have not completed
+TEST_F(SMTPTransportTest, EventLoopRejectsWhenStopped) {
+    ssmtp_mailer::SMTPEventLoop loop(config_);
+
+    bool called = false;
+    ssmtp_mailer::SMTPResult outcome;
+    ASSERT_TRUE(loop.submit(email_, [&](const ssmtp_mailer::SMTPResult& result) {
+        called = true;
+        outcome = result;
+    }));
+
+    EXPECT_TRUE(called);
+    EXPECT_FALSE(outcome.success);
+    EXPECT_EQ(server_.connectionCount(), 0u);
+}
+
+// Test 20: Reconnecting to the same relay resumes the TLS session on a shared context
+TEST_F(SMTPTransportTest, ResumesTLSSessions) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.starttls = true;
+    ssmtp_test::FakeSMTPServer tls(options);
+    ASSERT_TRUE(tls.start());
+    domain_.smtp_port = tls.port();
+    domain_.use_starttls = true;
+    domain_.ssl_verify_peer = false;
+    config_.setDomainConfig(domain_);
+
+    auto& manager = ssmtp_mailer::TLSContextManager::getInstance();
+    auto before = manager.getStats();
+
+    for (int i = 0; i < 2; ++i) {
+        ssmtp_mailer::SMTPClient client(config_);
+        auto result = client.send(email_);
+        ASSERT_TRUE(result.success) << result.error_message;
+    }
+
+    ssmtp_mailer::SMTPEventLoop loop(config_);
+    ASSERT_TRUE(loop.start());
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    bool sent = false;
+    loop.submit(email_, [&](const ssmtp_mailer::SMTPResult& result) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        sent = result.success;
+        cv.notify_one();
+    });
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; }));
+    }
+    EXPECT_TRUE(sent);
+
+    auto after = manager.getStats();
+    EXPECT_EQ(tls.tlsHandshakes(), 3u);
+    EXPECT_EQ(tls.tlsResumed(), 2u);
+    EXPECT_EQ(after.full_handshakes - before.full_handshakes, 1u);
+    EXPECT_EQ(after.resumed_handshakes - before.resumed_handshakes, 2u);
+    EXPECT_LE(after.contexts - before.contexts, 1u);
+    EXPECT_EQ(tls.messages().size(), 3u);
+}
+
+// Test 21: A dequeued batch goes out over one pooled session, with per-email results
+TEST_F(SMTPTransportTest, QueueSendsBatchesOverOneSession) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.reject_recipients = {"bounce@remote.test"};
+    ssmtp_test::FakeSMTPServer rejecting(options);
+    ASSERT_TRUE(rejecting.start());
+    domain_.smtp_port = rejecting.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    std::mutex mutex;
+    std::vector<size_t> batches;
+    ssmtp_mailer::EmailQueue queue;
+    queue.setWorkerCount(1);
+    queue.setDomainConcurrency(10);
+    queue.setBatchSendCallback([&](const std::vector<const ssmtp_mailer::Email*>& emails) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batches.push_back(emails.size());
+        }
+        return pool.sendBatch(emails);
+    });
+
+    ssmtp_mailer::Email bounced = email_;
+    bounced.to = {"bounce@remote.test"};
+    for (int i = 0; i < 4; ++i) {
+        queue.enqueue(&email_);
+    }
+    queue.enqueue(&bounced);
+    queue.start();
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (queue.getTotalProcessed() + queue.getTotalRetries() < 5 &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    queue.stop();
+
+    // The bounce comes back to the queue for its retry on its own
+    EXPECT_EQ(queue.getTotalProcessed(), 4u);
+    EXPECT_EQ(queue.getTotalRetries(), 1u);
+    EXPECT_EQ(queue.getInFlight(), 0u);
+    EXPECT_EQ(rejecting.messages().size(), 4u);
+    EXPECT_EQ(rejecting.countCommands("RSET"), 1u);
+    EXPECT_EQ(rejecting.connectionCount(), 1u);
+    EXPECT_EQ(rejecting.countCommands("EHLO"), 1u);
+    std::lock_guard<std::mutex> lock(mutex);
+    ASSERT_FALSE(batches.empty());
+    EXPECT_GT(*std::max_element(batches.begin(), batches.end()), 1u);
+}
+
+// Test 22: A pooled session the server dropped is replaced and the message sent once more
+TEST_F(SMTPTransportTest, PoolRetriesDroppedSessionOnce) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.hang_up_after = 1;
+    ssmtp_test::FakeSMTPServer dropping(options);
+    ASSERT_TRUE(dropping.start());
+    domain_.smtp_port = dropping.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    ASSERT_TRUE(pool.send(email_).success);
+    ssmtp_mailer::SMTPResult result = pool.send(email_);
+    EXPECT_TRUE(result.success) << result.error_message;
+    std::vector<ssmtp_mailer::SMTPResult> batch = pool.sendBatch({&email_});
+    ASSERT_EQ(batch.size(), 1u);
+    EXPECT_TRUE(batch[0].success) << batch[0].error_message;
+
+    EXPECT_EQ(dropping.messages().size(), 3u);
+    EXPECT_EQ(dropping.connectionCount(), 3u);
+    EXPECT_EQ(pool.getStats().hits, 2u);
+}
+
+// Test 23: A pooled session lost after the server took the message is not retried,
+// as the message may already be on its way
+TEST_F(SMTPTransportTest, PoolDoesNotResendAfterReply) {
+    server_.stop();
+    ssmtp_test::FakeSMTPServer::Options options;
+    options.hang_up_on = 2;
+    ssmtp_test::FakeSMTPServer dropping(options);
+    ASSERT_TRUE(dropping.start());
+    domain_.smtp_port = dropping.port();
+    config_.setDomainConfig(domain_);
+
+    ssmtp_mailer::SMTPConnectionPool pool(config_);
+    ASSERT_TRUE(pool.send(email_).success);
+    ssmtp_mailer::SMTPResult result = pool.send(email_);
+    EXPECT_FALSE(result.success);
+    EXPECT_EQ(dropping.messages().size(), 2u);
+    EXPECT_EQ(dropping.connectionCount(), 1u);
+}
+
+// Test 24: The curl fallback goes through libcurl, with addresses passed as they are
+// and the credentials never leaving the process
+TEST_F(SMTPTransportTest, CurlFallbackUsesLibcurl) {
+    domain_.smtp_transport = "curl";
+    domain_.auth_method = "PLAIN";
+    domain_.username = "relay-user";
+    domain_.password = "secret";
+    config_.setDomainConfig(domain_);
+    email_.to = {"rcpt$(touch x)@remote.test"};
+    email_.cc = {"cc@remote.test"};
+
+    ssmtp_mailer::SMTPClient client(config_);
+    auto result = client.send(email_);
+    ASSERT_TRUE(result.success) << result.error_message;
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    std::vector<std::string> recipients = {"rcpt$(touch x)@remote.test", "cc@remote.test"};
+    EXPECT_EQ(messages[0].recipients, recipients);
+    EXPECT_NE(messages[0].data.find("Message-ID: " + result.message_id), std::string::npos);
+    EXPECT_EQ(server_.countCommands("AUTH PLAIN"), 1u);
+}
+
+// Test 25: The event loop gets SIZE= from the submitting thread, which also
+// rejects a message whose attachment cannot be read before submit() returns
+TEST_F(SMTPTransportTest, EventLoopMeasuresOnSubmittingThread) {
+    ssmtp_mailer::SMTPEventLoop loop(config_);
+    ASSERT_TRUE(loop.start());
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    ssmtp_mailer::SMTPResult result;
+    ASSERT_TRUE(loop.submit(email_, [&](const ssmtp_mailer::SMTPResult& r) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = r;
+        done = true;
+        cv.notify_one();
+    }));
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10), [&] { return done; }));
+    }
+    ASSERT_TRUE(result.success) << result.error_message;
+
+    auto messages = server_.messages();
+    ASSERT_EQ(messages.size(), 1u);
+    std::string mail_from;
+    for (const auto& command : server_.commands()) {
+        if (command.compare(0, 10, "MAIL FROM:") == 0) {
+            mail_from = command;
+        }
+    }
+    EXPECT_NE(mail_from.find(" SIZE=" + std::to_string(messages[0].data.size())), std::string::npos)
+        << mail_from;
+
+    email_.attachments = {"/nonexistent/attachment.pdf"};
+    bool rejected = false;
+    ASSERT_TRUE(loop.submit(email_, [&](const ssmtp_mailer::SMTPResult& r) {
+        rejected = !r.success && r.error_message.find("attachment") != std::string::npos;
+    }));
+    EXPECT_TRUE(rejected);
+    EXPECT_EQ(server_.messages().size(), 1u);
+}